@@ -0,0 +1,324 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * In-process benchmark of the fuse operations.  Builds a synthetic library
+ * of DVD images in a temporary directory, sets up a context as main() does
+ * and calls dvdwrap_oper directly, so the figures are dvdwrap's own cost
+ * without the kernel and libfuse round trips.  fuse_get_context() comes
+ * from bench_lib, so libfuse isn't linked at all.
+ *
+ * The VOBs are sparse, so reads come from the page cache and measure the
+ * read path rather than the disk.  Each operation runs from one thread and
+ * then from several, and reports throughput and latency percentiles.
+ *
+ * Usage: bench_fuse [-t titles] [-s MiB per title] [-j threads]
+ *                   [-c cache_size MiB] [-l log_level]
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "dvdwrap_fuse.h"
+#include "bench_lib.h"
+
+#define BENCH_TITLES	16
+#define BENCH_SIZE		64			/* MiB per title */
+#define BENCH_VOBS		3
+#define BENCH_THREADS	4
+#define BENCH_OPS		20000		/* Per thread, except sequential reads */
+#define BENCH_READ		131072		/* Sequential read size, as the kernel sends */
+#define BENCH_SEEK		65536		/* Random read size */
+
+typedef enum {
+	BENCH_GETATTR,
+	BENCH_READDIR,
+	BENCH_OPEN,
+	BENCH_SEQUENTIAL,
+	BENCH_RANDOM,
+} bench_op_t;
+
+static const char *bench_names[] = {
+	"getattr", "readdir", "open+release", "read seq", "read random",
+};
+
+typedef struct {
+	bench_op_t		op;
+	unsigned int	index;		/*!< Thread number */
+	unsigned int	threads;
+	unsigned int	seed;
+	bench_samples_t	samples;
+	uint64_t		bytes;
+	unsigned int	errors;
+} bench_thread_t;
+
+static char bench_root[] = "/tmp/dvdwrap-bench-XXXXXX";
+static bench_lib_conf_t bench_lib = {
+	BENCH_TITLES, 0, BENCH_VOBS, (uint64_t)BENCH_SIZE << 20, 0
+};
+
+static void bench_title(char *path, unsigned int n)
+{
+	bench_lib_path(&bench_lib, n, path, PATH_MAX - 4);
+	strcat(path, ".mpg");
+}
+
+/*! Adds one timed operation to a thread's results */
+static void bench_record(bench_thread_t *bt, uint64_t start, int rc)
+{
+	bench_sample(&bt->samples, start);
+	if (rc < 0) {
+		bt->errors++;
+	}
+}
+
+/*! Reads one title through, or reads at random for a fixed count */
+static void bench_read(bench_thread_t *bt, unsigned int title, char *buf)
+{
+	struct fuse_file_info fi;
+	char path[PATH_MAX];
+	uint64_t offset, start;
+	unsigned int n;
+	int rc;
+
+	bench_title(path, title);
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDONLY;
+	if (dvdwrap_oper.open(path, &fi) < 0) {
+		bt->errors++;
+		return;
+	}
+	if (bt->op == BENCH_SEQUENTIAL) {
+		for (offset = 0; offset < bench_lib.size; offset += BENCH_READ) {
+			start = bench_now_ns();
+			rc = dvdwrap_oper.read(path, buf, BENCH_READ, (off_t)offset, &fi);
+			bench_record(bt, start, rc);
+			if (rc > 0) {
+				bt->bytes += rc;
+			}
+		}
+	} else {
+		for (n = 0; n < BENCH_OPS; n++) {
+			offset = (bench_rand(&bt->seed) % (bench_lib.size / BENCH_SEEK)) * BENCH_SEEK;
+			start = bench_now_ns();
+			rc = dvdwrap_oper.read(path, buf, BENCH_SEEK, (off_t)offset, &fi);
+			bench_record(bt, start, rc);
+			if (rc > 0) {
+				bt->bytes += rc;
+			}
+		}
+	}
+	dvdwrap_oper.release(path, &fi);
+}
+
+static void* bench_thread(void *arg)
+{
+	bench_thread_t *bt = (bench_thread_t*)arg;
+	struct fuse_file_info fi;
+	struct stat st;
+	char path[PATH_MAX];
+	char *buf;
+	uint64_t start;
+	unsigned int n, entries;
+	int rc;
+
+	buf = (char*)malloc(BENCH_READ);
+	if (buf == NULL) {
+		bt->errors++;
+		return NULL;
+	}
+	switch (bt->op) {
+	case BENCH_GETATTR:
+		for (n = 0; n < BENCH_OPS; n++) {
+			bench_title(path, bench_rand(&bt->seed) % bench_lib.titles);
+			start = bench_now_ns();
+			rc = dvdwrap_oper.getattr(path, &st);
+			bench_record(bt, start, rc);
+		}
+		break;
+	case BENCH_READDIR:
+		for (n = 0; n < BENCH_OPS / 10; n++) {
+			memset(&fi, 0, sizeof(fi));
+			entries = 0;
+			start = bench_now_ns();
+			rc = dvdwrap_oper.opendir("/", &fi);
+			if (rc == 0) {
+				rc = dvdwrap_oper.readdir("/", &entries, bench_filler, 0, &fi);
+				dvdwrap_oper.releasedir("/", &fi);
+			}
+			bench_record(bt, start, rc < 0 || entries < bench_lib.titles ? -1 : 0);
+		}
+		break;
+	case BENCH_OPEN:
+		for (n = 0; n < BENCH_OPS; n++) {
+			bench_title(path, bench_rand(&bt->seed) % bench_lib.titles);
+			memset(&fi, 0, sizeof(fi));
+			fi.flags = O_RDONLY;
+			start = bench_now_ns();
+			rc = dvdwrap_oper.open(path, &fi);
+			if (rc == 0) {
+				dvdwrap_oper.release(path, &fi);
+			}
+			bench_record(bt, start, rc);
+		}
+		break;
+	case BENCH_SEQUENTIAL:
+		/* Each thread streams its own share of the titles */
+		for (n = bt->index; n < bench_lib.titles; n += bt->threads) {
+			bench_read(bt, n, buf);
+		}
+		break;
+	case BENCH_RANDOM:
+		bench_read(bt, bt->index % bench_lib.titles, buf);
+		break;
+	}
+	free(buf);
+	return NULL;
+}
+
+/*! Runs one operation from a number of threads and prints a line of results */
+static int bench_run(bench_op_t op, unsigned int threads)
+{
+	bench_thread_t bt[threads];
+	pthread_t tid[threads];
+	bench_samples_t all = { NULL, 0, 0 };
+	unsigned int n, errors = 0;
+	uint64_t start, elapsed, bytes = 0;
+
+	memset(bt, 0, sizeof(bt));
+	start = bench_now_ns();
+	for (n = 0; n < threads; n++) {
+		bt[n].op = op;
+		bt[n].index = n;
+		bt[n].threads = threads;
+		bt[n].seed = 2463534242u + n * 7919;
+		pthread_create(&tid[n], NULL, bench_thread, &bt[n]);
+	}
+	for (n = 0; n < threads; n++) {
+		pthread_join(tid[n], NULL);
+	}
+	elapsed = bench_now_ns() - start;
+
+	/* Gather every thread's samples together */
+	for (n = 0; n < threads; n++) {
+		if (bench_samples_add(&all, &bt[n].samples) < 0) {
+			errors++;
+		}
+		bench_samples_free(&bt[n].samples);
+		bytes += bt[n].bytes;
+		errors += bt[n].errors;
+	}
+	bench_samples_sort(&all);
+	if (all.count) {
+		printf("%-13s %7u %12.0f %9.1f %9.2f %9.2f %9.2f %9.2f\n",
+			bench_names[op], threads,
+			all.count * 1e9 / elapsed,
+			bytes * 1e9 / elapsed / (1 << 20),
+			bench_samples_mean(&all),
+			bench_samples_pct(&all, 50),
+			bench_samples_pct(&all, 99),
+			bench_samples_pct(&all, 100));
+	}
+	bench_samples_free(&all);
+	if (errors) {
+		fprintf(stderr, "%s: %u operations failed\n", bench_names[op], errors);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	dvdwrap_ctx_t *ctx;
+	struct fuse_conn_info conn;
+	unsigned int threads = BENCH_THREADS, cache = 0, level = DEFAULT_LOG_LEVEL;
+	int op, n, rc = 0;
+
+	while ((n = getopt(argc, argv, "t:s:j:c:l:")) != -1) {
+		switch (n) {
+		case 't': bench_lib.titles = (unsigned int)strtoul(optarg, NULL, 0); break;
+		case 's': bench_lib.size = (uint64_t)strtoul(optarg, NULL, 0) << 20; break;
+		case 'j': threads = (unsigned int)strtoul(optarg, NULL, 0); break;
+		case 'c': cache = (unsigned int)strtoul(optarg, NULL, 0); break;
+		case 'l': level = (unsigned int)strtoul(optarg, NULL, 0); break;
+		default:
+			fprintf(stderr, "Usage: %s [-t titles] [-s MiB per title] [-j threads] "
+				"[-c cache_size MiB] [-l log_level]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (bench_lib.titles == 0 || bench_lib.size < BENCH_SEEK * BENCH_VOBS || threads == 0) {
+		fprintf(stderr, "Need at least one title, thread and MiB per title\n");
+		return 1;
+	}
+	if (mkdtemp(bench_root) == NULL || bench_lib_create(bench_root, &bench_lib) < 0) {
+		fprintf(stderr, "Failed to create library in %s\n", bench_root);
+		bench_lib_remove(bench_root, &bench_lib);
+		rmdir(bench_root);
+		return 1;
+	}
+
+	/* Set up as main() would, then start up as fuse_main() would */
+	ctx = dvdwrap_ctx_new();
+	if (ctx == NULL) {
+		bench_lib_remove(bench_root, &bench_lib);
+		rmdir(bench_root);
+		return 1;
+	}
+	ctx->sourcepath = bench_root;
+	ctx->cache_conf.size = cache;
+	ctx->log_level = level;
+	if (dvdwrap_ctx_setup(ctx) < 0) {
+		bench_lib_remove(bench_root, &bench_lib);
+		rmdir(bench_root);
+		return 1;
+	}
+	bench_context_set(ctx);
+	dvdwrap_trace_init();
+	memset(&conn, 0, sizeof(conn));
+	dvdwrap_oper.init(&conn);
+
+	printf("%u titles of %llu MiB, cache_size %u, log_level %u\n\n", bench_lib.titles,
+		(unsigned long long)(bench_lib.size >> 20), cache, level);
+	printf("%-13s %7s %12s %9s %9s %9s %9s %9s\n", "operation", "threads",
+		"ops/s", "MiB/s", "mean us", "p50 us", "p99 us", "max us");
+	for (op = BENCH_GETATTR; op <= BENCH_RANDOM && rc == 0; op++) {
+		rc = bench_run((bench_op_t)op, 1);
+		if (rc == 0 && threads > 1) {
+			rc = bench_run((bench_op_t)op, threads);
+		}
+	}
+
+	dvdwrap_oper.destroy(ctx);
+	bench_lib_remove(bench_root, &bench_lib);
+	rmdir(bench_root);
+	return rc ? 1 : 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Library index benchmark.  Fills an index with synthetic entries and
+ * measures insertion, lookups from one thread and from several, and the
+ * memory held, at 10k, 100k and 1M entries or the sizes given.
+ *
+ * The paths don't exist, so each insertion includes one failed lstat of
+ * VIDEO_TS, as when readdir first meets a directory.  Lookups are all
+ * hits and never touch the disk.
+ *
+ * Usage: bench_index [entries...]
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "dvdwrap_fuse.h"
+#include "dvdwrap_index.h"
+#include "bench_lib.h"
+
+#define BENCH_ROOT		"/nonexistent/dvdwrap-bench"
+#define BENCH_LOOKUPS	1000000
+#define BENCH_THREADS	4
+
+typedef struct {
+	dvdwrap_index_t	*index;
+	unsigned int	entries;
+	unsigned int	seed;
+} bench_thread_t;
+
+static void bench_path(char *path, unsigned int n)
+{
+	snprintf(path, PATH_MAX, BENCH_ROOT "/Genre %03u/Some Film Title %07u",
+		n % 100, n);
+}
+
+static void* bench_lookups(void *arg)
+{
+	bench_thread_t *bt = (bench_thread_t*)arg;
+	dvdwrap_index_info_t info;
+	char path[PATH_MAX];
+	unsigned int n;
+
+	for (n = 0; n < BENCH_LOOKUPS; n++) {
+		bench_path(path, bench_rand(&bt->seed) % bt->entries);
+		dvdwrap_index_lookup(bt->index, path, &info);
+	}
+	return NULL;
+}
+
+/*! Resident set size in bytes */
+static uint64_t bench_rss(void)
+{
+	unsigned long size, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (f) {
+		if (fscanf(f, "%lu %lu", &size, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(f);
+	}
+	return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+static int bench_run(unsigned int entries)
+{
+	dvdwrap_index_conf_t conf;
+	dvdwrap_index_t index;
+	dvdwrap_index_batch_t batch;
+	bench_thread_t bt[BENCH_THREADS];
+	pthread_t threads[BENCH_THREADS];
+	char path[PATH_MAX];
+	uint64_t start, build, single, multi, rss, misses;
+	unsigned int n;
+
+	memset(&conf, 0, sizeof(conf));
+	conf.ttl = 86400;
+	memset(&batch, 0, sizeof(batch));
+	rss = bench_rss();
+	if (dvdwrap_index_init(&index, &conf, BENCH_ROOT) < 0) {
+		return -1;
+	}
+
+	/* Insert, as readdir does for each directory it lists */
+	start = dvdwrap_now_us();
+	for (n = 0; n < entries; n++) {
+		bench_path(path, n);
+		dvdwrap_index_is_image(&index, path, &batch);
+	}
+	build = dvdwrap_now_us() - start;
+	rss = bench_rss() - rss;
+	misses = index.misses;
+
+	/* Look up at random from one thread, then from several */
+	bt[0].index = &index;
+	bt[0].entries = entries;
+	bt[0].seed = 2463534242u;
+	start = dvdwrap_now_us();
+	bench_lookups(&bt[0]);
+	single = dvdwrap_now_us() - start;
+
+	start = dvdwrap_now_us();
+	for (n = 0; n < BENCH_THREADS; n++) {
+		bt[n].index = &index;
+		bt[n].entries = entries;
+		bt[n].seed = 2463534242u + n * 7919;
+		pthread_create(&threads[n], NULL, bench_lookups, &bt[n]);
+	}
+	for (n = 0; n < BENCH_THREADS; n++) {
+		pthread_join(threads[n], NULL);
+	}
+	multi = dvdwrap_now_us() - start;
+
+	printf("%10u %10.0f %10.0f %10.0f %12llu %10.1f %12llu\n", entries,
+		build * 1000.0 / entries,
+		single * 1000.0 / BENCH_LOOKUPS,
+		multi * 1000.0 / ((uint64_t)BENCH_LOOKUPS * BENCH_THREADS),
+		(unsigned long long)index.bytes, (double)index.bytes / entries,
+		(unsigned long long)rss);
+	if (index.count != entries || index.misses != misses) {
+		fprintf(stderr, "Index holds %u entries and missed %llu lookups\n",
+			index.count, (unsigned long long)(index.misses - misses));
+		dvdwrap_index_destroy(&index);
+		return -1;
+	}
+	dvdwrap_index_destroy(&index);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned int sizes[] = { 10000, 100000, 1000000 };
+	int n, rc = 0;
+
+	dvdwrap_log_level = 0;
+	printf("%10s %10s %10s %10s %12s %10s %12s\n", "entries", "insert ns",
+		"lookup ns", "x4 ns", "memory", "B/entry", "rss");
+	if (argc > 1) {
+		for (n = 1; n < argc && rc == 0; n++) {
+			rc = bench_run((unsigned int)strtoul(argv[n], NULL, 0));
+		}
+	} else {
+		for (n = 0; n < (int)(sizeof(sizes) / sizeof(sizes[0])) && rc == 0; n++) {
+			rc = bench_run(sizes[n]);
+		}
+	}
+	return rc ? 1 : 0;
+}
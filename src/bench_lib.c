@@ -0,0 +1,360 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Synthetic libraries of DVD images for the benchmarks.  Each title is a
+ * directory holding an empty VIDEO_TS.IFO, a main titleset of sparse VOBs
+ * and a 1 MiB second titleset, so the scan has to pick the longest.  The
+ * VOBs take no space, and read back as zeros from the page cache.
+ *
+ * Libraries made with pattern set hold real data in the main titleset
+ * instead, in which every byte depends on the title and its offset in it,
+ * so reads can be checked byte for byte.
+ *
+ * Also here is what every benchmark needs to drive the operations and
+ * time them: a fuse_get_context() standing in for libfuse, so none of them
+ * link it, and latency samples with the percentiles they report.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "bench_lib.h"
+
+#define BENCH_LIB_EXTRA		(1 << 20)	/* Size of the second titleset */
+#define BENCH_LIB_CHUNK		(1 << 20)	/* Pattern written this much at a time */
+
+/*!
+ * Gives the contents of a pattern library's title.  Each 8-byte word of a
+ * title holds the title number in its top 24 bits and the word's index
+ * in the rest, least significant byte first.
+ *
+ * \param title		Title number
+ * \param offset	Offset in the title's output file
+ * \param buf		Returns the data
+ * \param len		Bytes wanted
+ */
+void bench_lib_fill(unsigned int title, uint64_t offset, char *buf, size_t len)
+{
+	uint64_t word;
+	size_t n;
+
+	for (n = 0; n < len; n++, offset++) {
+		word = ((uint64_t)title << 40) | (offset >> 3);
+		buf[n] = (char)(word >> ((offset & 7) * 8));
+	}
+}
+
+/*!
+ * Gives the path of a title's directory relative to the library root,
+ * which is also the path of its output file without the extension.
+ *
+ * \param conf		Library shape
+ * \param n			Title number
+ * \param path		Returns the path, starting with '/'
+ * \param len		Size of path
+ */
+void bench_lib_path(const bench_lib_conf_t *conf, unsigned int n, char *path, size_t len)
+{
+	if (conf->per_dir) {
+		snprintf(path, len, "/Genre %04u/Film %07u", n / conf->per_dir, n);
+	} else {
+		snprintf(path, len, "/Film %07u", n);
+	}
+}
+
+/*! Number of genre directories, or 0 if the titles are all in the root */
+unsigned int bench_lib_dirs(const bench_lib_conf_t *conf)
+{
+	if (conf->per_dir == 0) {
+		return 0;
+	}
+	return (conf->titles + conf->per_dir - 1) / conf->per_dir;
+}
+
+/*!
+ * Creates a file of a title, sparse unless it holds part of a pattern.
+ *
+ * \param title		Title number
+ * \param offset	Offset of the file within the title, when pattern is set
+ */
+static int bench_lib_file(const char *path, uint64_t size, int pattern,
+	unsigned int title, uint64_t offset)
+{
+	char *buf = NULL;
+	uint64_t done;
+	size_t len;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+	if (!pattern) {
+		if (ftruncate(fd, (off_t)size) < 0) {
+			close(fd);
+			return -1;
+		}
+		close(fd);
+		return 0;
+	}
+
+	buf = (char*)malloc(BENCH_LIB_CHUNK);
+	if (buf == NULL) {
+		close(fd);
+		return -1;
+	}
+	for (done = 0; done < size; done += len) {
+		len = size - done < BENCH_LIB_CHUNK ? (size_t)(size - done) : BENCH_LIB_CHUNK;
+		bench_lib_fill(title, offset + done, buf, len);
+		if (write(fd, buf, len) != (ssize_t)len) {
+			break;
+		}
+	}
+	free(buf);
+	close(fd);
+	return done < size ? -1 : 0;
+}
+
+/*!
+ * Creates a library under a directory, which must exist.
+ *
+ * \param root		Library root
+ * \param conf		Library shape
+ * \return			0, or -1 if a file couldn't be created
+ */
+int bench_lib_create(const char *root, const bench_lib_conf_t *conf)
+{
+	char name[64], title[PATH_MAX - 32], path[PATH_MAX];
+	uint64_t vob = (conf->size / conf->vobs) & ~(uint64_t)2047;
+	unsigned int n, min;
+
+	for (n = 0; n < conf->titles; n++) {
+		if (conf->per_dir && n % conf->per_dir == 0) {
+			snprintf(path, PATH_MAX, "%s/Genre %04u", root, n / conf->per_dir);
+			mkdir(path, 0755);
+		}
+		bench_lib_path(conf, n, name, sizeof(name));
+		snprintf(title, sizeof(title), "%s%s", root, name);
+		mkdir(title, 0755);
+		snprintf(path, PATH_MAX, "%s/VIDEO_TS", title);
+		if (mkdir(path, 0755) < 0) {
+			return -1;
+		}
+		snprintf(path, PATH_MAX, "%s/VIDEO_TS/VIDEO_TS.IFO", title);
+		if (bench_lib_file(path, 0, 0, n, 0) < 0) {
+			return -1;
+		}
+		for (min = 1; min <= conf->vobs; min++) {
+			snprintf(path, PATH_MAX, "%s/VIDEO_TS/VTS_01_%u.VOB", title, min);
+			if (bench_lib_file(path, min < conf->vobs ? vob :
+					conf->size - vob * (conf->vobs - 1), conf->pattern, n, vob * (min - 1)) < 0) {
+				return -1;
+			}
+		}
+		snprintf(path, PATH_MAX, "%s/VIDEO_TS/VTS_02_1.VOB", title);
+		if (bench_lib_file(path, BENCH_LIB_EXTRA, 0, n, 0) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*!
+ * Removes what bench_lib_create() made, which may be only part of it.
+ * The root itself is left.
+ */
+void bench_lib_remove(const char *root, const bench_lib_conf_t *conf)
+{
+	char name[64], title[PATH_MAX - 32], path[PATH_MAX];
+	unsigned int n, min;
+
+	for (n = 0; n < conf->titles; n++) {
+		bench_lib_path(conf, n, name, sizeof(name));
+		snprintf(title, sizeof(title), "%s%s", root, name);
+		for (min = 1; min <= conf->vobs; min++) {
+			snprintf(path, PATH_MAX, "%s/VIDEO_TS/VTS_01_%u.VOB", title, min);
+			unlink(path);
+		}
+		snprintf(path, PATH_MAX, "%s/VIDEO_TS/VTS_02_1.VOB", title);
+		unlink(path);
+		snprintf(path, PATH_MAX, "%s/VIDEO_TS/VIDEO_TS.IFO", title);
+		unlink(path);
+		snprintf(path, PATH_MAX, "%s/VIDEO_TS", title);
+		rmdir(path);
+		rmdir(title);
+	}
+	for (n = 0; n < bench_lib_dirs(conf); n++) {
+		snprintf(path, PATH_MAX, "%s/Genre %04u", root, n);
+		rmdir(path);
+	}
+}
+
+/* Shared by the benchmarks */
+
+static void *bench_private;
+static __thread struct fuse_context bench_context;
+static __thread pid_t bench_pid;
+
+/*! Stands in for libfuse, giving each thread its own id as the caller
+ * unless bench_context_pid() has chosen another */
+struct fuse_context* fuse_get_context(void)
+{
+	if (bench_context.private_data != bench_private) {
+		bench_context.private_data = bench_private;
+		bench_context.uid = getuid();
+		bench_context.gid = getgid();
+	}
+	bench_context.pid = bench_pid ? bench_pid : (pid_t)syscall(SYS_gettid);
+	return &bench_context;
+}
+
+/*! Makes the calling thread's operations look as if they came from pid,
+ * or from the thread itself again if it is 0 */
+void bench_context_pid(pid_t pid)
+{
+	bench_pid = pid;
+}
+
+/*! Sets what fuse_get_context() hands the operations, as fuse_main()
+ * would.  Call before starting any threads. */
+void bench_context_set(void *private_data)
+{
+	bench_private = private_data;
+}
+
+uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+unsigned int bench_rand(unsigned int *seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
+
+/*! Counts directory entries into an unsigned int */
+int bench_filler(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	(void)name; (void)st; (void)off;
+	(*(unsigned int*)buf)++;
+	return 0;
+}
+
+/*! Records the time since start, dropping it if there is no memory */
+void bench_sample(bench_samples_t *s, uint64_t start)
+{
+	uint64_t ns = bench_now_ns() - start;
+
+	if (s->count == s->size) {
+		size_t size = s->size ? s->size * 2 : 65536;
+		uint32_t *p = (uint32_t*)realloc(s->ns, size * sizeof(uint32_t));
+
+		if (p == NULL) {
+			return;
+		}
+		s->ns = p;
+		s->size = size;
+	}
+	s->ns[s->count++] = ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+}
+
+/*! Appends one set of samples to another */
+int bench_samples_add(bench_samples_t *all, const bench_samples_t *s)
+{
+	if (all->count + s->count > all->size) {
+		uint32_t *p = (uint32_t*)realloc(all->ns, (all->count + s->count) * sizeof(uint32_t));
+
+		if (p == NULL) {
+			return -1;
+		}
+		all->ns = p;
+		all->size = all->count + s->count;
+	}
+	if (s->count) {
+		memcpy(all->ns + all->count, s->ns, s->count * sizeof(uint32_t));
+		all->count += s->count;
+	}
+	return 0;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+/*! Sorts samples, as bench_samples_pct() needs */
+void bench_samples_sort(bench_samples_t *s)
+{
+	qsort(s->ns, s->count, sizeof(uint32_t), bench_cmp);
+}
+
+/*! Returns the mean in microseconds */
+double bench_samples_mean(const bench_samples_t *s)
+{
+	uint64_t total = 0;
+	size_t n;
+
+	for (n = 0; n < s->count; n++) {
+		total += s->ns[n];
+	}
+	return s->count ? total / 1000.0 / s->count : 0;
+}
+
+/*!
+ * Returns a percentile of sorted samples in microseconds.
+ *
+ * \param s			Samples, sorted
+ * \param pct		Percentile, where 100 gives the largest
+ */
+double bench_samples_pct(const bench_samples_t *s, double pct)
+{
+	size_t n = (size_t)(s->count * pct / 100);
+
+	if (s->count == 0) {
+		return 0;
+	}
+	return s->ns[n < s->count ? n : s->count - 1] / 1000.0;
+}
+
+void bench_samples_free(bench_samples_t *s)
+{
+	free(s->ns);
+	s->ns = NULL;
+	s->count = s->size = 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _BENCH_LIB_H
+#define _BENCH_LIB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*! Shape of a synthetic library of DVD images */
+typedef struct {
+	unsigned int	titles;
+	unsigned int	per_dir;	/*!< Titles per genre directory, 0 = all in the root */
+	unsigned int	vobs;		/*!< VOBs the main titleset is split across */
+	uint64_t		size;		/*!< Bytes in the main titleset of each title */
+	int				pattern;	/*!< Write bench_lib_fill() data rather than sparse VOBs */
+} bench_lib_conf_t;
+
+void bench_lib_fill(unsigned int title, uint64_t offset, char *buf, size_t len);
+void bench_lib_path(const bench_lib_conf_t *conf, unsigned int n, char *path, size_t len);
+unsigned int bench_lib_dirs(const bench_lib_conf_t *conf);
+int bench_lib_create(const char *root, const bench_lib_conf_t *conf);
+void bench_lib_remove(const char *root, const bench_lib_conf_t *conf);
+
+/*! Latencies of one kind of operation */
+typedef struct {
+	uint32_t		*ns;
+	size_t			count;
+	size_t			size;
+} bench_samples_t;
+
+void bench_context_set(void *private_data);
+void bench_context_pid(pid_t pid);
+uint64_t bench_now_ns(void);
+unsigned int bench_rand(unsigned int *seed);
+int bench_filler(void *buf, const char *name, const struct stat *st, off_t off);
+void bench_sample(bench_samples_t *s, uint64_t start);
+int bench_samples_add(bench_samples_t *all, const bench_samples_t *s);
+void bench_samples_sort(bench_samples_t *s);
+double bench_samples_mean(const bench_samples_t *s);
+double bench_samples_pct(const bench_samples_t *s, double pct);
+void bench_samples_free(bench_samples_t *s);
+
+#endif
@@ -0,0 +1,274 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Metadata scaling report.  Generates libraries of 1k, 10k and 100k titles
+ * or the sizes given, and for each measures, per entry, what browsing
+ * costs: listing every directory and stat'ing every title with the index
+ * cold, then both again with it warm.  The fuse operations are called
+ * directly, as in bench_fuse.
+ *
+ * Each library is measured without index threads, so the first listing
+ * and stats do the scanning, and then with them, after waiting for the
+ * background walk to finish.  Per-entry figures that stay flat as the
+ * library grows mean browsing scales linearly; the summary gives how much
+ * each grew from the smallest library to the largest.
+ *
+ * The files were just created, so the kernel's own caches are warm and
+ * "cold" refers to dvdwrap's index only.
+ *
+ * Usage: bench_meta [-g titles per genre] [-i index_threads] [-l log_level]
+ *                   [titles...]
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "dvdwrap_fuse.h"
+#include "bench_lib.h"
+
+#define BENCH_PER_DIR	100
+#define BENCH_THREADS	4
+#define BENCH_SIZE		4096		/* MiB per title, sparse */
+#define BENCH_SIZES		8
+#define BENCH_WALK_WAIT	600000		/* ms to wait for the background walk */
+
+/*! Nanoseconds per entry for each step, and what the index holds */
+typedef struct {
+	unsigned int	titles;
+	unsigned int	threads;
+	uint64_t		walk;		/*!< Background walk, ms */
+	double			list_cold;
+	double			stat_cold;
+	double			stat_warm;
+	double			list_warm;
+	double			bytes;		/*!< Index memory per title */
+} bench_result_t;
+
+static char bench_root[] = "/tmp/dvdwrap-meta-XXXXXX";
+
+static unsigned int bench_list_one(const char *path)
+{
+	struct fuse_file_info fi;
+	unsigned int entries = 0;
+
+	memset(&fi, 0, sizeof(fi));
+	if (dvdwrap_oper.opendir(path, &fi) == 0) {
+		dvdwrap_oper.readdir(path, &entries, bench_filler, 0, &fi);
+		dvdwrap_oper.releasedir(path, &fi);
+	}
+	return entries;
+}
+
+/*! Lists the root and every genre, returning ns per entry listed */
+static double bench_list(const bench_lib_conf_t *lib)
+{
+	char path[PATH_MAX];
+	unsigned int n, entries;
+	uint64_t start;
+
+	start = bench_now_ns();
+	entries = bench_list_one("/");
+	for (n = 0; n < bench_lib_dirs(lib); n++) {
+		snprintf(path, PATH_MAX, "/Genre %04u", n);
+		entries += bench_list_one(path);
+	}
+	return entries ? (double)(bench_now_ns() - start) / entries : 0;
+}
+
+/*! Stats every title, returning ns per title, or -1 if any are missing */
+static double bench_stat(const bench_lib_conf_t *lib)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	unsigned int n;
+	uint64_t start;
+	int missing = 0;
+
+	start = bench_now_ns();
+	for (n = 0; n < lib->titles; n++) {
+		bench_lib_path(lib, n, path, PATH_MAX - 4);
+		strcat(path, ".mpg");
+		if (dvdwrap_oper.getattr(path, &st) < 0 || (uint64_t)st.st_size != lib->size) {
+			missing++;
+		}
+	}
+	if (missing) {
+		fprintf(stderr, "%u of %u titles missing or the wrong size\n", missing, lib->titles);
+		return -1;
+	}
+	return (double)(bench_now_ns() - start) / lib->titles;
+}
+
+/*! Waits for the first background walk, returning how long it took in ms */
+static uint64_t bench_walk(dvdwrap_index_t *index)
+{
+	uint64_t start = dvdwrap_now_ms(), ms = 0;
+	unsigned int walks = 0;
+
+	while (walks == 0 && dvdwrap_now_ms() - start < BENCH_WALK_WAIT) {
+		usleep(10000);
+		pthread_mutex_lock(&index->lock);
+		walks = index->walks;
+		ms = index->last_walk;
+		pthread_mutex_unlock(&index->lock);
+	}
+	return ms;
+}
+
+/*! Mounts the library in-process with a number of index threads and measures it */
+static int bench_run(const bench_lib_conf_t *lib, unsigned int threads,
+	unsigned int level, bench_result_t *result)
+{
+	struct fuse_conn_info conn;
+	dvdwrap_ctx_t *ctx;
+	int rc = 0;
+
+	ctx = dvdwrap_ctx_new();
+	if (ctx == NULL) {
+		return -1;
+	}
+	ctx->sourcepath = bench_root;
+	ctx->index_conf.threads = threads;
+	ctx->log_level = level;
+	if (dvdwrap_ctx_setup(ctx) < 0) {
+		free(ctx);
+		return -1;
+	}
+	bench_context_set(ctx);
+	memset(&conn, 0, sizeof(conn));
+	dvdwrap_oper.init(&conn);
+
+	memset(result, 0, sizeof(*result));
+	result->titles = lib->titles;
+	result->threads = threads;
+	if (threads) {
+		result->walk = bench_walk(&ctx->index);
+	}
+	result->list_cold = bench_list(lib);
+	result->stat_cold = bench_stat(lib);
+	result->stat_warm = bench_stat(lib);
+	result->list_warm = bench_list(lib);
+	result->bytes = (double)ctx->index.bytes / lib->titles;
+	if (result->stat_cold < 0 || result->stat_warm < 0) {
+		rc = -1;
+	}
+
+	printf("%9u %7u ", result->titles, threads);
+	if (threads) {
+		printf("%9llu", (unsigned long long)result->walk);
+	} else {
+		printf("%9s", "-");
+	}
+	printf(" %10.0f %10.0f %10.0f %10.0f %9.1f\n", result->list_cold,
+		result->stat_cold, result->stat_warm, result->list_warm, result->bytes);
+
+	dvdwrap_oper.destroy(ctx);
+	free(ctx);
+	return rc;
+}
+
+/*! Prints how much each per-entry cost grew between two results */
+static void bench_growth(const bench_result_t *a, const bench_result_t *b)
+{
+	printf("%u to %u titles, index_threads %u: list x%.2f/x%.2f, stat x%.2f/x%.2f "
+		"(cold/warm), index memory x%.2f per title\n",
+		a->titles, b->titles, a->threads,
+		b->list_cold / a->list_cold, b->list_warm / a->list_warm,
+		b->stat_cold / a->stat_cold, b->stat_warm / a->stat_warm,
+		b->bytes / a->bytes);
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned int defaults[] = { 1000, 10000, 100000 };
+	unsigned int sizes[BENCH_SIZES];
+	bench_result_t results[BENCH_SIZES][2];
+	bench_lib_conf_t lib = { 0, BENCH_PER_DIR, 1, (uint64_t)BENCH_SIZE << 20, 0 };
+	unsigned int nsizes = 0, threads = BENCH_THREADS, level = DEFAULT_LOG_LEVEL;
+	unsigned int n, mode;
+	int opt, rc = 0;
+
+	while ((opt = getopt(argc, argv, "g:i:l:")) != -1) {
+		switch (opt) {
+		case 'g': lib.per_dir = (unsigned int)strtoul(optarg, NULL, 0); break;
+		case 'i': threads = (unsigned int)strtoul(optarg, NULL, 0); break;
+		case 'l': level = (unsigned int)strtoul(optarg, NULL, 0); break;
+		default:
+			fprintf(stderr, "Usage: %s [-g titles per genre] [-i index_threads] "
+				"[-l log_level] [titles...]\n", argv[0]);
+			return 1;
+		}
+	}
+	for (n = optind; n < (unsigned int)argc && nsizes < BENCH_SIZES; n++) {
+		sizes[nsizes] = (unsigned int)strtoul(argv[n], NULL, 0);
+		if (sizes[nsizes]) {
+			nsizes++;
+		}
+	}
+	if (nsizes == 0) {
+		for (n = 0; n < sizeof(defaults) / sizeof(defaults[0]); n++) {
+			sizes[nsizes++] = defaults[n];
+		}
+	}
+	if (mkdtemp(bench_root) == NULL) {
+		fprintf(stderr, "Failed to create %s\n", bench_root);
+		return 1;
+	}
+	dvdwrap_trace_init();
+
+	printf("%u titles per genre, log_level %u, ns per entry\n\n", lib.per_dir, level);
+	printf("%9s %7s %9s %10s %10s %10s %10s %9s\n", "titles", "threads", "walk ms",
+		"list cold", "stat cold", "stat warm", "list warm", "B/title");
+	for (n = 0; n < nsizes && rc == 0; n++) {
+		lib.titles = sizes[n];
+		if (bench_lib_create(bench_root, &lib) < 0) {
+			fprintf(stderr, "Failed to create %u titles in %s\n", lib.titles, bench_root);
+			rc = -1;
+		}
+		for (mode = 0; mode < 2 && rc == 0; mode++) {
+			if (mode && threads == 0) {
+				results[n][mode] = results[n][0];
+				break;
+			}
+			rc = bench_run(&lib, mode ? threads : 0, level, &results[n][mode]);
+		}
+		bench_lib_remove(bench_root, &lib);
+	}
+	rmdir(bench_root);
+
+	if (rc == 0 && nsizes > 1) {
+		printf("\n");
+		for (mode = 0; mode < (threads ? 2u : 1u); mode++) {
+			bench_growth(&results[0][mode], &results[nsizes - 1][mode]);
+		}
+	}
+	return rc ? 1 : 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Creates, or with -r removes, a synthetic library of DVD images for
+ * trying dvdwrap or bench_mount against.  The VOBs are sparse, so even a
+ * large library takes little space, unless -p fills them with the pattern
+ * bench_stress checks reads against.
+ *
+ * Usage: bench_mklib [-r] [-p] [-n titles] [-g titles per genre, 0 = none]
+ *                    [-v VOBs per title] [-s MiB per title] dir
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bench_lib.h"
+
+#define BENCH_TITLES	1000
+#define BENCH_PER_DIR	100
+#define BENCH_VOBS		5
+#define BENCH_SIZE		4096		/* MiB per title */
+
+int main(int argc, char **argv)
+{
+	bench_lib_conf_t conf = {
+		BENCH_TITLES, BENCH_PER_DIR, BENCH_VOBS, (uint64_t)BENCH_SIZE << 20, 0
+	};
+	int opt, remove = 0;
+
+	while ((opt = getopt(argc, argv, "rpn:g:v:s:")) != -1) {
+		switch (opt) {
+		case 'r': remove = 1; break;
+		case 'p': conf.pattern = 1; break;
+		case 'n': conf.titles = (unsigned int)strtoul(optarg, NULL, 0); break;
+		case 'g': conf.per_dir = (unsigned int)strtoul(optarg, NULL, 0); break;
+		case 'v': conf.vobs = (unsigned int)strtoul(optarg, NULL, 0); break;
+		case 's': conf.size = (uint64_t)strtoul(optarg, NULL, 0) << 20; break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+	if (argc - optind != 1 || conf.vobs == 0 || conf.vobs >= 10 ||
+			conf.size < (uint64_t)conf.vobs * 2048) {
+		fprintf(stderr, "Usage: %s [-r] [-p] [-n titles] [-g titles per genre, 0 = none]\n"
+			"       [-v VOBs per title, 1-9] [-s MiB per title] dir\n", argv[0]);
+		return 1;
+	}
+
+	if (remove) {
+		bench_lib_remove(argv[optind], &conf);
+		rmdir(argv[optind]);
+		return 0;
+	}
+	mkdir(argv[optind], 0755);
+	if (bench_lib_create(argv[optind], &conf) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	printf("%u titles of %llu MiB in %u genres under %s\n", conf.titles,
+		(unsigned long long)(conf.size >> 20), bench_lib_dirs(&conf), argv[optind]);
+	return 0;
+}
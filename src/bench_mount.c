@@ -0,0 +1,472 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * End-to-end benchmark through a mounted dvdwrap.  Mounts the source with
+ * the dvdwrap binary unless the mount point is already mounted, then uses
+ * ordinary system calls, so the figures include the kernel and libfuse:
+ *
+ *   walk       list and stat the whole tree, on a fresh mount and again
+ *   read seq   stream titles one at a time, then several at once
+ *   read seek  random 64 KiB reads within a title, as when scrubbing
+ *   direct     stream the VOBs behind the first title straight from the
+ *              source, as the baseline the read seq figures compare to
+ *
+ * Page cache held for the files read is dropped before each pass, so reads
+ * go to dvdwrap.  Its own caches are left alone.
+ *
+ * Usage: bench_mount [-d dvdwrap] [-o options] [-n titles] [-j streams]
+ *                    [-b KiB per read] [-l MiB per title] source mountpoint
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "bench_lib.h"
+
+#define FILE_EXTENSION	".mpg"
+#define MAX_VTS_MIN		10
+#define MAX_VTS_MAJ		100
+
+#define BENCH_TITLES	4
+#define BENCH_STREAMS	4
+#define BENCH_BLOCK		128			/* KiB per read */
+#define BENCH_LIMIT		256			/* MiB read from each title, 0 = all */
+#define BENCH_SEEKS		2000
+#define BENCH_SEEK		65536
+#define BENCH_MAX		4096		/* Titles remembered from the walk */
+
+typedef struct {
+	char		path[PATH_MAX];		/*!< Relative to the mount point */
+	uint64_t	size;
+} bench_title_t;
+
+typedef struct {
+	const char		*path[MAX_VTS_MIN];	/*!< Files read back to back */
+	unsigned int	files;
+	int				seek;
+	uint64_t		bytes;
+	uint64_t		first;		/*!< Open to first byte, ns */
+	bench_samples_t	samples;	/*!< Latency of each read */
+	unsigned int	errors;
+	unsigned int	seed;
+} bench_stream_t;
+
+static const char *bench_source;
+static const char *bench_mnt;
+static bench_title_t bench_titles[BENCH_MAX];
+static unsigned int bench_ntitles;
+static size_t bench_block = BENCH_BLOCK * 1024;
+static uint64_t bench_limit = (uint64_t)BENCH_LIMIT << 20;
+
+/*! Runs a program and waits for it, returning its exit status */
+static int bench_exec(char *const argv[])
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid < 0) {
+		return -1;
+	}
+	if (pid == 0) {
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) {
+		return -1;
+	}
+	return WEXITSTATUS(status);
+}
+
+/*! A directory is a mount point if it is on a different device to its parent */
+static int bench_mounted(const char *path)
+{
+	char parent[PATH_MAX];
+	struct stat st, pst;
+
+	snprintf(parent, PATH_MAX, "%s/..", path);
+	if (stat(path, &st) < 0 || stat(parent, &pst) < 0) {
+		return 0;
+	}
+	return st.st_dev != pst.st_dev;
+}
+
+/*!
+ * Lists and stats everything below a directory of the mount, remembering
+ * the titles found.
+ *
+ * \param rel		Path relative to the mount point, "" for the root
+ * \return			Number of entries stat'd
+ */
+static unsigned int bench_walk(const char *rel)
+{
+	char path[PATH_MAX], child[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
+	unsigned int entries = 0;
+	size_t len;
+	DIR *dir;
+
+	snprintf(path, PATH_MAX, "%s%s", bench_mnt, rel);
+	dir = opendir(path);
+	if (dir == NULL) {
+		return 0;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.') {
+			/* Also skips .dvdwrap */
+			continue;
+		}
+		snprintf(child, PATH_MAX, "%s/%s", rel, de->d_name);
+		snprintf(path, PATH_MAX, "%s%s", bench_mnt, child);
+		if (lstat(path, &st) < 0) {
+			continue;
+		}
+		entries++;
+		len = strlen(child);
+		if (S_ISDIR(st.st_mode)) {
+			entries += bench_walk(child);
+		} else if (S_ISREG(st.st_mode) && len > strlen(FILE_EXTENSION) &&
+				strcmp(&child[len - strlen(FILE_EXTENSION)], FILE_EXTENSION) == 0 &&
+				bench_ntitles < BENCH_MAX) {
+			strcpy(bench_titles[bench_ntitles].path, child);
+			bench_titles[bench_ntitles].size = (uint64_t)st.st_size;
+			bench_ntitles++;
+		}
+	}
+	closedir(dir);
+	return entries;
+}
+
+/*!
+ * Finds the VOBs of the source that make up a title, as the titleset whose
+ * VOBs add up to the size of the title.
+ *
+ * \return			Number of VOBs, or 0 if none match
+ */
+static unsigned int bench_vobs(const char *source, const bench_title_t *title,
+	char paths[][PATH_MAX])
+{
+	char dir[PATH_MAX];
+	struct stat st;
+	uint64_t total;
+	unsigned int maj, min;
+
+	snprintf(dir, PATH_MAX, "%s%.*s/VIDEO_TS", source,
+		(int)(strlen(title->path) - strlen(FILE_EXTENSION)), title->path);
+	for (maj = 1; maj < MAX_VTS_MAJ; maj++) {
+		total = 0;
+		for (min = 1; min < MAX_VTS_MIN; min++) {
+			if (snprintf(paths[min - 1], PATH_MAX, "%s/VTS_%02u_%u.VOB", dir, maj, min) >= PATH_MAX ||
+					stat(paths[min - 1], &st) < 0) {
+				break;
+			}
+			total += st.st_size;
+		}
+		if (min == 1) {
+			break;
+		}
+		if (total == title->size) {
+			return min - 1;
+		}
+	}
+	return 0;
+}
+
+/*! Adds one timed read to a stream's results */
+static void bench_record(bench_stream_t *bs, uint64_t start, ssize_t rc)
+{
+	bench_sample(&bs->samples, start);
+	if (rc < 0) {
+		bs->errors++;
+	}
+}
+
+/*! Reads a stream's files back to back, or seeks about the first of them */
+static void* bench_stream(void *arg)
+{
+	bench_stream_t *bs = (bench_stream_t*)arg;
+	uint64_t start, opened, offset, left = bench_limit ? bench_limit : UINT64_MAX;
+	unsigned int n, seek;
+	struct stat st;
+	ssize_t rc;
+	char *buf;
+	int fd;
+
+	buf = (char*)malloc(bench_block > BENCH_SEEK ? bench_block : BENCH_SEEK);
+	if (buf == NULL) {
+		bs->errors++;
+		return NULL;
+	}
+	for (n = 0; n < bs->files && left; n++) {
+		opened = bench_now_ns();
+		fd = open(bs->path[n], O_RDONLY);
+		if (fd < 0 || fstat(fd, &st) < 0) {
+			bs->errors++;
+			if (fd >= 0) {
+				close(fd);
+			}
+			break;
+		}
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		if (bs->seek) {
+			for (seek = 0; seek < BENCH_SEEKS && st.st_size >= BENCH_SEEK; seek++) {
+				offset = (bench_rand(&bs->seed) % (st.st_size / BENCH_SEEK)) * BENCH_SEEK;
+				start = bench_now_ns();
+				rc = pread(fd, buf, BENCH_SEEK, (off_t)offset);
+				bench_record(bs, start, rc);
+				if (rc > 0) {
+					bs->bytes += rc;
+				}
+			}
+			close(fd);
+			break;
+		}
+		for (offset = 0; left; offset += rc) {
+			start = bench_now_ns();
+			rc = pread(fd, buf, bench_block < left ? bench_block : left, (off_t)offset);
+			bench_record(bs, start, rc);
+			if (rc <= 0) {
+				break;
+			}
+			if (n == 0 && offset == 0) {
+				bs->first = bench_now_ns() - opened;
+			}
+			bs->bytes += rc;
+			left -= rc;
+		}
+		close(fd);
+	}
+	free(buf);
+	return NULL;
+}
+
+/*!
+ * Runs streams side by side and prints a line of results.
+ *
+ * \return			Throughput in MiB/s, or -1 on failure
+ */
+static double bench_run(const char *name, bench_stream_t *bs, unsigned int streams)
+{
+	pthread_t tid[streams];
+	bench_samples_t all = { NULL, 0, 0 };
+	unsigned int n, errors = 0;
+	uint64_t start, elapsed, bytes = 0, first = 0;
+	double rate;
+
+	start = bench_now_ns();
+	for (n = 0; n < streams; n++) {
+		bs[n].seed = 2463534242u + n * 7919;
+		pthread_create(&tid[n], NULL, bench_stream, &bs[n]);
+	}
+	for (n = 0; n < streams; n++) {
+		pthread_join(tid[n], NULL);
+	}
+	elapsed = bench_now_ns() - start;
+
+	for (n = 0; n < streams; n++) {
+		if (bench_samples_add(&all, &bs[n].samples) < 0) {
+			errors++;
+		}
+		bench_samples_free(&bs[n].samples);
+		bytes += bs[n].bytes;
+		first += bs[n].first;
+		errors += bs[n].errors;
+	}
+	bench_samples_sort(&all);
+	rate = bytes * 1e9 / elapsed / (1 << 20);
+	if (all.count) {
+		char firstms[16] = "-";
+
+		if (!bs[0].seek) {
+			snprintf(firstms, sizeof(firstms), "%.2f", first / 1e6 / streams);
+		}
+		printf("%-10s %7u %9.1f %9s %9.1f %9.1f %9.1f\n", name, streams, rate, firstms,
+			bench_samples_pct(&all, 50),
+			bench_samples_pct(&all, 99),
+			bench_samples_pct(&all, 100));
+	}
+	bench_samples_free(&all);
+	if (errors) {
+		fprintf(stderr, "%s: %u reads failed\n", name, errors);
+		return -1;
+	}
+	return rate;
+}
+
+/*! Drops any page cache held for the VOBs behind a title */
+static void bench_drop(const bench_title_t *title)
+{
+	char vobs[MAX_VTS_MIN][PATH_MAX];
+	unsigned int n, files;
+	int fd;
+
+	files = bench_vobs(bench_source, title, vobs);
+	for (n = 0; n < files; n++) {
+		fd = open(vobs[n], O_RDONLY);
+		if (fd >= 0) {
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+			close(fd);
+		}
+	}
+}
+
+/*! Streams or seeks in titles of the mount, stream n reading title first + n */
+static double bench_titles_run(const char *name, unsigned int first,
+	unsigned int streams, int seek)
+{
+	char paths[streams][PATH_MAX];
+	bench_stream_t bs[streams];
+	bench_title_t *title;
+	unsigned int n;
+
+	memset(bs, 0, sizeof(bs));
+	for (n = 0; n < streams; n++) {
+		title = &bench_titles[(first + n) % bench_ntitles];
+		bench_drop(title);
+		snprintf(paths[n], PATH_MAX, "%s%s", bench_mnt, title->path);
+		bs[n].path[0] = paths[n];
+		bs[n].files = 1;
+		bs[n].seek = seek;
+	}
+	return bench_run(name, bs, streams);
+}
+
+static void bench_usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-d dvdwrap] [-o options] [-n titles] [-j streams]\n"
+		"       [-b KiB per read] [-l MiB per title, 0 = all] source mountpoint\n",
+		progname);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dvdwrap = "./dvdwrap", *options = NULL, *source;
+	unsigned int titles = BENCH_TITLES, streams = BENCH_STREAMS, entries, n;
+	char vobs[MAX_VTS_MIN][PATH_MAX];
+	bench_stream_t direct;
+	uint64_t start, elapsed;
+	double seq = 0, rate, base;
+	int opt, mounted, rc = 0;
+
+	while ((opt = getopt(argc, argv, "d:o:n:j:b:l:")) != -1) {
+		switch (opt) {
+		case 'd': dvdwrap = optarg; break;
+		case 'o': options = optarg; break;
+		case 'n': titles = (unsigned int)strtoul(optarg, NULL, 0); break;
+		case 'j': streams = (unsigned int)strtoul(optarg, NULL, 0); break;
+		case 'b': bench_block = (size_t)strtoul(optarg, NULL, 0) * 1024; break;
+		case 'l': bench_limit = (uint64_t)strtoul(optarg, NULL, 0) << 20; break;
+		default:
+			bench_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - optind != 2 || titles == 0 || streams == 0 || bench_block == 0) {
+		bench_usage(argv[0]);
+		return 1;
+	}
+	source = bench_source = argv[optind];
+	bench_mnt = argv[optind + 1];
+
+	/* Mount unless already mounted, in which case the walk isn't cold */
+	mounted = bench_mounted(bench_mnt);
+	if (!mounted) {
+		char *args[] = { (char*)dvdwrap, (char*)source, (char*)bench_mnt,
+			options ? "-o" : NULL, (char*)options, NULL };
+
+		if (bench_exec(args) != 0 || !bench_mounted(bench_mnt)) {
+			fprintf(stderr, "Failed to mount %s on %s with %s\n", source, bench_mnt, dvdwrap);
+			return 1;
+		}
+	}
+
+	start = bench_now_ns();
+	entries = bench_walk("");
+	elapsed = bench_now_ns() - start;
+	printf("walk %-5s %7u entries %9.1f ms %9.0f entries/s\n", mounted ? "first" : "cold",
+		entries, elapsed / 1e6, entries * 1e9 / elapsed);
+	bench_ntitles = 0;
+	start = bench_now_ns();
+	entries = bench_walk("");
+	elapsed = bench_now_ns() - start;
+	printf("walk %-5s %7u entries %9.1f ms %9.0f entries/s\n\n", "warm",
+		entries, elapsed / 1e6, entries * 1e9 / elapsed);
+	if (bench_ntitles == 0) {
+		fprintf(stderr, "No titles found under %s\n", bench_mnt);
+		rc = 1;
+		goto unmount;
+	}
+	if (titles > bench_ntitles) {
+		titles = bench_ntitles;
+	}
+
+	printf("%-10s %7s %9s %9s %9s %9s %9s\n", "test", "streams", "MiB/s",
+		"first ms", "p50 us", "p99 us", "max us");
+	for (n = 0; n < titles && seq >= 0; n++) {
+		rate = bench_titles_run("read seq", n, 1, 0);
+		if (n == 0 || rate < 0) {
+			seq = rate;
+		}
+	}
+	if (seq < 0 || bench_titles_run("read seq", 0, streams, 0) < 0 ||
+			bench_titles_run("read seek", 0, 1, 1) < 0) {
+		rc = 1;
+		goto unmount;
+	}
+
+	/* Baseline: the first title's VOBs read directly from the source */
+	memset(&direct, 0, sizeof(direct));
+	direct.files = bench_vobs(source, &bench_titles[0], vobs);
+	for (n = 0; n < direct.files; n++) {
+		direct.path[n] = vobs[n];
+	}
+	if (direct.files) {
+		base = bench_run("direct", &direct, 1);
+		if (base < 0) {
+			rc = 1;
+		} else if (base > 0) {
+			printf("\ndvdwrap streams at %.0f%% of the source's rate\n", seq * 100 / base);
+		}
+	}
+
+unmount:
+	if (!mounted) {
+		char *args[] = { "fusermount", "-u", (char*)bench_mnt, NULL };
+
+		if (bench_exec(args) != 0) {
+			fprintf(stderr, "Failed to unmount %s\n", bench_mnt);
+			rc = 1;
+		}
+	}
+	return rc;
+}
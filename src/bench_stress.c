@@ -0,0 +1,481 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Concurrency stress test.  Generates a library whose every byte can be
+ * predicted, starts dvdwrap in-process with the caches, chunked reads,
+ * spin-down buffers, pinning and index threads all on, and has many
+ * threads call the fuse operations at random for a while:
+ *
+ *   - open a title and read it sequentially or at random, with odd sizes
+ *     and offsets, across VOB boundaries and past the end, checking every
+ *     byte returned
+ *   - stat titles and list the root
+ *   - read the .dvdwrap files, and change settings through its control
+ *     file while the reads go on
+ *
+ * Each thread picks the caller's pid for every operation from a range of
+ * its own, well above any real pid so that the Tgid lookup fails and each
+ * counts as a process.  With the default thread count there are more of
+ * them than .dvdwrap/clients tracks, so once enough have been seen,
+ * processes are dropped to make room for new ones.  At the end, latency
+ * percentiles out to p99.9 are printed for each kind of operation.  Any
+ * wrong byte, short read or failed operation makes it exit 1.  If the
+ * threads don't finish soon after being told to stop, the trace ring is
+ * written to a file and it exits 2.
+ *
+ * Usage: bench_stress [-j threads] [-d seconds] [-t titles] [-s MiB per title]
+ *                     [-p, for plain default settings]
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "dvdwrap_fuse.h"
+#include "bench_lib.h"
+
+#define BENCH_TITLES	8
+#define BENCH_SIZE		16			/* MiB per title */
+#define BENCH_VOBS		3
+#define BENCH_THREADS	16
+#define BENCH_SECONDS	10
+#define BENCH_GRACE		30			/* Seconds to wait for threads after stopping */
+#define BENCH_MAX_READ	262144
+#define BENCH_SESSION	64			/* Most reads per open */
+#define BENCH_PID_BASE	0x40000000	/* Above the largest pid_max */
+#define BENCH_PIDS		256			/* Callers per thread */
+#define BENCH_REPORTED	8			/* Failures described in full */
+#define BENCH_HANG_FILE	"bench_stress.trace"
+
+typedef enum {
+	BENCH_READ,
+	BENCH_OPEN,
+	BENCH_GETATTR,
+	BENCH_READDIR,
+	BENCH_VFILE,
+	BENCH_CONTROL,
+	BENCH_OPS
+} bench_op_t;
+
+static const char *bench_names[] = {
+	"read", "open", "getattr", "readdir", "vfile", "control",
+};
+
+/*! Files under .dvdwrap read at random */
+static const char *bench_vfiles[] = {
+	"stats", "devices", "stalls", "cache", "spindown", "pinned", "memory",
+	"index", "clients", "heat", "control", "trace",
+};
+
+/*! Settings changed at random while reads go on, including the limits of
+ * their ranges: chunk_depth=64 is CHUNK_MAX_DEPTH, ioq_stall=1 reports
+ * nearly every read as stalled and index_ttl=0 turns the index off under
+ * the walkers.  The cache can't be resized unless it was on at mount, so
+ * those come last and are left out with -p. */
+static const char *bench_settings[] = {
+	"chunk_depth=2\n", "chunk_depth=8\n", "chunk_depth=64\n",
+	"spin_buffer=0\n", "spin_buffer=8\n", "pin_head=256\n", "pin_head=1024\n",
+	"ioq_depth=4\n", "ioq_depth=16\n", "ioq_stall=0\n", "ioq_stall=1\n", "ioq_stall=5000\n",
+	"sched_share=50\n", "sched_share=90\n", "mem_min=25\n", "mem_min=100\n",
+	"index_ttl=0\n", "index_ttl=1\n", "index_ttl=86400\n",
+	"log_level=0\n", "log_level=1\n", "cache_size=32\n", "cache_size=64\n",
+};
+
+#define BENCH_COUNT(a)	(sizeof(a) / sizeof((a)[0]))
+
+typedef struct {
+	pthread_t		thread;
+	unsigned int	id;
+	unsigned int	seed;
+	bench_samples_t	samples[BENCH_OPS];
+	uint64_t		bytes;		/*!< Checked and found correct */
+	unsigned int	errors;
+	unsigned int	mismatches;
+	char			*buf;
+	char			*expect;
+} bench_thread_t;
+
+static char bench_root[] = "/tmp/dvdwrap-stress-XXXXXX";
+static bench_lib_conf_t bench_lib = {
+	BENCH_TITLES, 0, BENCH_VOBS, (uint64_t)BENCH_SIZE << 20, 1
+};
+static dvdwrap_ctx_t *bench_ctx;
+static unsigned int bench_nsettings = BENCH_COUNT(bench_settings);
+static volatile int bench_stop;
+
+static pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bench_finished = PTHREAD_COND_INITIALIZER;
+static unsigned int bench_done;
+static unsigned int bench_reported;
+
+/*! Records one timed operation, counting it as an error if rc < 0 */
+static void bench_record(bench_thread_t *bt, bench_op_t op, uint64_t start, int rc)
+{
+	bench_sample(&bt->samples[op], start);
+	if (rc < 0) {
+		bt->errors++;
+		pthread_mutex_lock(&bench_lock);
+		if (bench_reported++ < BENCH_REPORTED) {
+			fprintf(stderr, "%s failed: %s\n", bench_names[op], strerror(-rc));
+		}
+		pthread_mutex_unlock(&bench_lock);
+	}
+}
+
+/*! Checks what a read returned against what the title holds */
+static void bench_check(bench_thread_t *bt, unsigned int title, uint64_t offset,
+	size_t size, int rc)
+{
+	uint64_t want = 0;
+	size_t n = 0;
+
+	if (offset < bench_lib.size) {
+		want = bench_lib.size - offset < size ? bench_lib.size - offset : size;
+	}
+	if (rc == (int)want) {
+		bench_lib_fill(title, offset, bt->expect, want);
+		if (memcmp(bt->buf, bt->expect, want) == 0) {
+			bt->bytes += want;
+			return;
+		}
+		while (bt->buf[n] == bt->expect[n]) {
+			n++;
+		}
+	}
+
+	bt->mismatches++;
+	pthread_mutex_lock(&bench_lock);
+	if (bench_reported++ < BENCH_REPORTED) {
+		if (rc != (int)want) {
+			fprintf(stderr, "Title %u: read of %zu at %llu returned %d, not %llu\n",
+				title, size, (unsigned long long)offset, rc, (unsigned long long)want);
+		} else {
+			fprintf(stderr, "Title %u: read of %zu at %llu wrong from %llu, "
+				"0x%02x not 0x%02x\n", title, size, (unsigned long long)offset,
+				(unsigned long long)(offset + n),
+				(unsigned char)bt->buf[n], (unsigned char)bt->expect[n]);
+		}
+	}
+	pthread_mutex_unlock(&bench_lock);
+}
+
+/*! Opens a title and reads it sequentially or at random */
+static void bench_session(bench_thread_t *bt)
+{
+	struct fuse_file_info fi;
+	char path[PATH_MAX];
+	unsigned int title, reads, n;
+	uint64_t offset, start;
+	size_t size;
+	int sequential, rc;
+
+	title = bench_rand(&bt->seed) % bench_lib.titles;
+	bench_lib_path(&bench_lib, title, path, PATH_MAX - 4);
+	strcat(path, ".mpg");
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDONLY;
+	start = bench_now_ns();
+	rc = dvdwrap_oper.open(path, &fi);
+	bench_record(bt, BENCH_OPEN, start, rc);
+	if (rc < 0) {
+		return;
+	}
+
+	/* Half the sessions play from somewhere, the rest jump about */
+	sequential = bench_rand(&bt->seed) & 1;
+	reads = 1 + bench_rand(&bt->seed) % BENCH_SESSION;
+	offset = bench_rand(&bt->seed) % bench_lib.size;
+	for (n = 0; n < reads && !bench_stop; n++) {
+		if (bench_rand(&bt->seed) & 1) {
+			size = 4096 * (1 + bench_rand(&bt->seed) % (BENCH_MAX_READ / 4096));
+		} else {
+			size = 1 + bench_rand(&bt->seed) % BENCH_MAX_READ;
+		}
+		if (!sequential) {
+			/* Sometimes past the end */
+			offset = bench_rand(&bt->seed) % (bench_lib.size + BENCH_MAX_READ);
+		}
+		start = bench_now_ns();
+		rc = dvdwrap_oper.read(path, bt->buf, size, (off_t)offset, &fi);
+		bench_record(bt, BENCH_READ, start, rc);
+		bench_check(bt, title, offset, size, rc);
+		offset += size;
+	}
+	dvdwrap_oper.release(path, &fi);
+}
+
+/*! Reads the whole of a .dvdwrap file, or writes a setting to control */
+static int bench_vfile(bench_thread_t *bt, const char *name, const char *setting)
+{
+	struct fuse_file_info fi;
+	char path[PATH_MAX];
+	off_t offset = 0;
+	int rc;
+
+	snprintf(path, PATH_MAX, "/.dvdwrap/%s", name);
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = setting ? O_WRONLY : O_RDONLY;
+	rc = dvdwrap_oper.open(path, &fi);
+	if (rc < 0) {
+		return rc;
+	}
+	if (setting) {
+		rc = dvdwrap_oper.write(path, setting, strlen(setting), 0, &fi);
+		if (rc >= 0) {
+			rc = dvdwrap_oper.flush(path, &fi);
+		}
+	} else {
+		while ((rc = dvdwrap_oper.read(path, bt->buf, BENCH_MAX_READ, offset, &fi)) > 0) {
+			offset += rc;
+		}
+	}
+	dvdwrap_oper.release(path, &fi);
+	return rc < 0 ? rc : 0;
+}
+
+static void* bench_thread(void *arg)
+{
+	bench_thread_t *bt = (bench_thread_t*)arg;
+	struct fuse_file_info fi;
+	struct stat st;
+	char path[PATH_MAX];
+	unsigned int r, entries;
+	uint64_t start;
+	int rc;
+
+	while (!bench_stop) {
+		bench_context_pid(BENCH_PID_BASE + bt->id * BENCH_PIDS +
+			bench_rand(&bt->seed) % BENCH_PIDS);
+		r = bench_rand(&bt->seed) % 100;
+		if (r < 70) {
+			bench_session(bt);
+		} else if (r < 82) {
+			bench_lib_path(&bench_lib, bench_rand(&bt->seed) % bench_lib.titles,
+				path, PATH_MAX - 4);
+			strcat(path, ".mpg");
+			start = bench_now_ns();
+			rc = dvdwrap_oper.getattr(path, &st);
+			if (rc == 0 && (uint64_t)st.st_size != bench_lib.size) {
+				rc = -EIO;
+			}
+			bench_record(bt, BENCH_GETATTR, start, rc);
+		} else if (r < 88) {
+			memset(&fi, 0, sizeof(fi));
+			entries = 0;
+			start = bench_now_ns();
+			rc = dvdwrap_oper.opendir("/", &fi);
+			if (rc == 0) {
+				rc = dvdwrap_oper.readdir("/", &entries, bench_filler, 0, &fi);
+				dvdwrap_oper.releasedir("/", &fi);
+			}
+			if (rc == 0 && entries < bench_lib.titles) {
+				rc = -EIO;
+			}
+			bench_record(bt, BENCH_READDIR, start, rc);
+		} else if (r < 99) {
+			start = bench_now_ns();
+			rc = bench_vfile(bt, bench_vfiles[bench_rand(&bt->seed) % BENCH_COUNT(bench_vfiles)], NULL);
+			bench_record(bt, BENCH_VFILE, start, rc);
+		} else {
+			start = bench_now_ns();
+			rc = bench_vfile(bt, "control",
+				bench_settings[bench_rand(&bt->seed) % bench_nsettings]);
+			bench_record(bt, BENCH_CONTROL, start, rc);
+		}
+	}
+
+	pthread_mutex_lock(&bench_lock);
+	bench_done++;
+	pthread_cond_signal(&bench_finished);
+	pthread_mutex_unlock(&bench_lock);
+	return NULL;
+}
+
+/*! Prints percentiles of one kind of operation across all threads */
+static void bench_report(bench_thread_t *bt, unsigned int threads, bench_op_t op,
+	uint64_t elapsed)
+{
+	bench_samples_t all = { NULL, 0, 0 };
+	unsigned int n;
+
+	for (n = 0; n < threads; n++) {
+		if (bench_samples_add(&all, &bt[n].samples[op]) < 0) {
+			bench_samples_free(&all);
+			return;
+		}
+	}
+	if (all.count == 0) {
+		return;
+	}
+	bench_samples_sort(&all);
+	printf("%-8s %10zu %10.0f %9.1f %9.1f %9.1f %9.1f %9.1f\n", bench_names[op], all.count,
+		all.count * 1e9 / elapsed,
+		bench_samples_pct(&all, 50),
+		bench_samples_pct(&all, 90),
+		bench_samples_pct(&all, 99),
+		bench_samples_pct(&all, 99.9),
+		bench_samples_pct(&all, 100));
+	bench_samples_free(&all);
+}
+
+static void bench_cleanup(void)
+{
+	bench_lib_remove(bench_root, &bench_lib);
+	rmdir(bench_root);
+}
+
+int main(int argc, char **argv)
+{
+	struct fuse_conn_info conn;
+	struct timespec deadline;
+	bench_thread_t *bt;
+	unsigned int threads = BENCH_THREADS, seconds = BENCH_SECONDS, n, started;
+	unsigned int errors = 0, mismatches = 0;
+	uint64_t start, elapsed, bytes = 0;
+	int opt, plain = 0, op;
+
+	while ((opt = getopt(argc, argv, "j:d:t:s:p")) != -1) {
+		switch (opt) {
+		case 'j': threads = (unsigned int)strtoul(optarg, NULL, 0); break;
+		case 'd': seconds = (unsigned int)strtoul(optarg, NULL, 0); break;
+		case 't': bench_lib.titles = (unsigned int)strtoul(optarg, NULL, 0); break;
+		case 's': bench_lib.size = (uint64_t)strtoul(optarg, NULL, 0) << 20; break;
+		case 'p': plain = 1; break;
+		default:
+			threads = 0;
+			break;
+		}
+	}
+	if (threads == 0 || bench_lib.titles == 0 || bench_lib.size == 0) {
+		fprintf(stderr, "Usage: %s [-j threads] [-d seconds] [-t titles] "
+			"[-s MiB per title] [-p]\n", argv[0]);
+		return 1;
+	}
+	bt = (bench_thread_t*)calloc(threads, sizeof(bench_thread_t));
+	if (bt == NULL) {
+		return 1;
+	}
+	if (mkdtemp(bench_root) == NULL || bench_lib_create(bench_root, &bench_lib) < 0) {
+		fprintf(stderr, "Failed to create library in %s\n", bench_root);
+		bench_cleanup();
+		return 1;
+	}
+
+	/* Set up as main() would with every layer on, then start as fuse would */
+	bench_ctx = dvdwrap_ctx_new();
+	if (bench_ctx == NULL) {
+		bench_cleanup();
+		return 1;
+	}
+	bench_ctx->sourcepath = bench_root;
+	if (plain) {
+		bench_nsettings -= 2;
+	} else {
+		bench_ctx->cache_conf.size = 64;
+		bench_ctx->chunk_conf.size = 256;
+		bench_ctx->spin_conf.size = 8;
+		bench_ctx->pin_conf.size = 16;
+		bench_ctx->index_conf.threads = 2;
+	}
+	if (dvdwrap_ctx_setup(bench_ctx) < 0) {
+		bench_cleanup();
+		return 1;
+	}
+	bench_context_set(bench_ctx);
+	dvdwrap_trace_init();
+	memset(&conn, 0, sizeof(conn));
+	dvdwrap_oper.init(&conn);
+
+	start = bench_now_ns();
+	for (started = 0; started < threads; started++) {
+		bt[started].id = started;
+		bt[started].seed = 2463534242u + started * 7919;
+		bt[started].buf = (char*)malloc(BENCH_MAX_READ);
+		bt[started].expect = (char*)malloc(BENCH_MAX_READ);
+		if (bt[started].buf == NULL || bt[started].expect == NULL ||
+				pthread_create(&bt[started].thread, NULL, bench_thread, &bt[started]) != 0) {
+			break;
+		}
+	}
+	if (started == threads) {
+		sleep(seconds);
+	}
+	bench_stop = 1;
+
+	/* A thread still going long after this is stuck */
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += BENCH_GRACE;
+	pthread_mutex_lock(&bench_lock);
+	while (bench_done < started) {
+		if (pthread_cond_timedwait(&bench_finished, &bench_lock, &deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+	n = bench_done;
+	pthread_mutex_unlock(&bench_lock);
+	if (n < started) {
+		fprintf(stderr, "%u of %u threads stuck, trace written to %s\n", started - n,
+			started, dvdwrap_trace_write(BENCH_HANG_FILE) < 0 ? "nowhere" : BENCH_HANG_FILE);
+		return 2;
+	}
+	elapsed = bench_now_ns() - start;
+	for (n = 0; n < started; n++) {
+		pthread_join(bt[n].thread, NULL);
+		bytes += bt[n].bytes;
+		errors += bt[n].errors;
+		mismatches += bt[n].mismatches;
+	}
+
+	printf("%u threads for %u s on %u titles of %llu MiB, %s\n\n", started,
+		seconds, bench_lib.titles, (unsigned long long)(bench_lib.size >> 20),
+		plain ? "default settings" : "every layer on");
+	printf("%-8s %10s %10s %9s %9s %9s %9s %9s\n", "op", "count", "ops/s",
+		"p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+	for (op = 0; op < BENCH_OPS; op++) {
+		bench_report(bt, started, (bench_op_t)op, elapsed);
+	}
+	printf("\n%.1f MiB checked at %.1f MiB/s, %u failed operations, %u wrong reads\n",
+		bytes / 1048576.0, bytes * 1e9 / elapsed / 1048576.0, errors, mismatches);
+
+	dvdwrap_oper.destroy(bench_ctx);
+	bench_cleanup();
+	for (n = 0; n < threads; n++) {
+		for (op = 0; op < BENCH_OPS; op++) {
+			bench_samples_free(&bt[n].samples[op]);
+		}
+		free(bt[n].buf);
+		free(bt[n].expect);
+	}
+	free(bt);
+	free(bench_ctx);
+	return errors || mismatches || started < threads ? 1 : 0;
+}
@@ -0,0 +1,359 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Decodes a trace ring dump, from .dvdwrap/trace or SIGUSR1, into text
+ * ordered by time, or into Chrome trace JSON for chrome://tracing or
+ * Perfetto with one track per thread.
+ *
+ * Usage: dvdtrace [-j] [dump]
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "dvdwrap_buf.h"
+#include "dvdwrap_trace.h"
+
+typedef struct {
+	uint32_t		tid;
+	uint32_t		fmt;
+	uint64_t		time;
+	uint16_t		len;
+	const uint8_t	*args;
+	size_t			order;		/*!< Position in the dump, to keep sorting stable */
+} dvdtrace_event_t;
+
+typedef struct {
+	char				**fmts;
+	uint32_t			nfmts;
+	dvdtrace_event_t	*events;
+	size_t				count;
+	size_t				alloc;
+} dvdtrace_t;
+
+/*! Reads a whole file, or stdin if path is NULL */
+static int dvdtrace_load(const char *path, dvdwrap_buf_t *buf)
+{
+	FILE *f = path ? fopen(path, "rb") : stdin;
+	char chunk[65536];
+	size_t n;
+
+	if (f == NULL) {
+		return -1;
+	}
+	while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+		dvdwrap_buf_append(buf, chunk, n);
+	}
+	if (path) {
+		fclose(f);
+	}
+	return 0;
+}
+
+/*! Takes len bytes from the dump, or returns NULL if it ends first */
+static const uint8_t* dvdtrace_take(const uint8_t **p, const uint8_t *end, size_t len)
+{
+	const uint8_t *q = *p;
+
+	if ((size_t)(end - q) < len) {
+		return NULL;
+	}
+	*p += len;
+	return q;
+}
+
+static int dvdtrace_parse(dvdtrace_t *trace, const uint8_t *p, const uint8_t *end)
+{
+	const uint8_t *q;
+	char **fmts;
+	uint32_t id;
+	uint16_t len;
+
+	q = dvdtrace_take(&p, end, strlen(TRACE_MAGIC));
+	if (q == NULL || memcmp(q, TRACE_MAGIC, strlen(TRACE_MAGIC)) != 0) {
+		return -1;
+	}
+	while (p < end) {
+		switch (*p++) {
+		case 'F':
+			if ((q = dvdtrace_take(&p, end, 6)) == NULL) {
+				return -1;
+			}
+			memcpy(&id, q, 4);
+			memcpy(&len, q + 4, 2);
+			if (id != trace->nfmts || (q = dvdtrace_take(&p, end, len)) == NULL) {
+				return -1;
+			}
+			fmts = (char**)realloc(trace->fmts, (id + 1) * sizeof(char*));
+			if (fmts == NULL) {
+				return -1;
+			}
+			trace->fmts = fmts;
+			if ((trace->fmts[id] = strndup((const char*)q, len)) == NULL) {
+				return -1;
+			}
+			trace->nfmts++;
+			break;
+		case 'E': {
+			dvdtrace_event_t *ev;
+
+			if (trace->count == trace->alloc) {
+				size_t alloc = trace->alloc ? trace->alloc * 2 : 4096;
+				dvdtrace_event_t *events = (dvdtrace_event_t*)realloc(trace->events,
+					alloc * sizeof(dvdtrace_event_t));
+
+				if (events == NULL) {
+					return -1;
+				}
+				trace->events = events;
+				trace->alloc = alloc;
+			}
+			ev = &trace->events[trace->count];
+			if ((q = dvdtrace_take(&p, end, 18)) == NULL) {
+				return -1;
+			}
+			memcpy(&ev->tid, q, 4);
+			memcpy(&ev->fmt, q + 4, 4);
+			memcpy(&ev->time, q + 8, 8);
+			memcpy(&ev->len, q + 16, 2);
+			if (ev->fmt >= trace->nfmts ||
+					(ev->args = dvdtrace_take(&p, end, ev->len)) == NULL) {
+				return -1;
+			}
+			ev->order = trace->count++;
+			break;
+		}
+		default:
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int dvdtrace_compare(const void *a, const void *b)
+{
+	const dvdtrace_event_t *x = (const dvdtrace_event_t*)a;
+	const dvdtrace_event_t *y = (const dvdtrace_event_t*)b;
+
+	if (x->time != y->time) {
+		return x->time < y->time ? -1 : 1;
+	}
+	return x->order < y->order ? -1 : 1;
+}
+
+/*! Takes the next 8 byte argument, or returns 0 if there isn't one */
+static int dvdtrace_arg(const dvdtrace_event_t *ev, size_t *pos, void *value)
+{
+	if (*pos + 8 > ev->len) {
+		return 0;
+	}
+	memcpy(value, ev->args + *pos, 8);
+	*pos += 8;
+	return 1;
+}
+
+/*! Formats a message as printf would have */
+static void dvdtrace_format(const char *fmt, const dvdtrace_event_t *ev, dvdwrap_buf_t *out)
+{
+	dvdwrap_trace_spec_t spec;
+	const char *next;
+	size_t pos = 0;
+	int64_t stars[2] = { 0, 0 };
+	char conv[64];
+	unsigned int n;
+
+	out->len = 0;
+	while ((next = dvdwrap_trace_next(fmt, &spec)) != NULL) {
+		int64_t i;
+		double d;
+
+		dvdwrap_buf_printf(out, "%.*s", (int)(spec.start - fmt), fmt);
+		fmt = next;
+		for (n = 0; n < spec.stars; n++) {
+			if (!dvdtrace_arg(ev, &pos, &i)) {
+				goto missing;
+			}
+			if (n < 2) {
+				stars[n] = i;
+			}
+		}
+
+		/* Rebuild the conversion with a length to suit the stored value */
+		snprintf(conv, sizeof(conv), "%.*s%s%c", (int)(spec.length - spec.start),
+			spec.start,
+			(spec.type == TRACE_ARG_INT || spec.type == TRACE_ARG_UINT) &&
+			spec.end[-1] != 'c' ? "ll" : "",
+			spec.end > spec.start + 1 ? spec.end[-1] : '%');
+
+#define DVDTRACE_PRINT(v) \
+		switch (spec.stars) { \
+		case 0: dvdwrap_buf_printf(out, conv, v); break; \
+		case 1: dvdwrap_buf_printf(out, conv, (int)stars[0], v); break; \
+		default: dvdwrap_buf_printf(out, conv, (int)stars[0], (int)stars[1], v); break; \
+		}
+
+		switch (spec.type) {
+		case TRACE_ARG_NONE:
+			if (spec.end[-1] == '%') {
+				dvdwrap_buf_printf(out, "%%");
+			}
+			break;
+		case TRACE_ARG_INT:
+		case TRACE_ARG_UINT:
+			if (!dvdtrace_arg(ev, &pos, &i)) {
+				goto missing;
+			}
+			if (spec.end[-1] == 'c') {
+				DVDTRACE_PRINT((int)i);
+			} else {
+				DVDTRACE_PRINT((long long)i);
+			}
+			break;
+		case TRACE_ARG_PTR:
+			if (!dvdtrace_arg(ev, &pos, &i)) {
+				goto missing;
+			}
+			DVDTRACE_PRINT((void*)(uintptr_t)i);
+			break;
+		case TRACE_ARG_DOUBLE:
+			if (!dvdtrace_arg(ev, &pos, &d)) {
+				goto missing;
+			}
+			DVDTRACE_PRINT(d);
+			break;
+		case TRACE_ARG_STR: {
+			const char *s = (const char*)ev->args + pos;
+			size_t len;
+
+			if (pos >= ev->len) {
+				goto missing;
+			}
+			len = strnlen(s, ev->len - pos);
+			if (len == ev->len - pos) {
+				goto missing; /* Not terminated */
+			}
+			pos += len + 1;
+			DVDTRACE_PRINT(s);
+			break;
+		}
+		}
+	}
+	dvdwrap_buf_printf(out, "%s", fmt);
+	return;
+
+missing:
+	/* The record ran out of room */
+	dvdwrap_buf_printf(out, "...\n");
+}
+
+/*! Writes a message as a JSON string */
+static void dvdtrace_json_string(const char *s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') {
+			printf("\\%c", *s);
+		} else if ((unsigned char)*s < 0x20) {
+			/* Drop the trailing newline, escape anything else */
+			if (!(*s == '\n' && s[1] == '\0')) {
+				printf("\\u%04x", *s);
+			}
+		} else {
+			putchar(*s);
+		}
+	}
+	putchar('"');
+}
+
+static void dvdtrace_usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-j] [dump]\n\n"
+		"Prints a dvdwrap trace dump, read from the file given or stdin, as text.\n"
+		"    -j    write Chrome trace JSON instead\n", progname);
+}
+
+int main(int argc, char **argv)
+{
+	dvdwrap_buf_t dump = { NULL, 0, 0 };
+	dvdwrap_buf_t line = { NULL, 0, 0 };
+	dvdtrace_t trace;
+	uint64_t base;
+	size_t n;
+	int json = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "jh")) != -1) {
+		switch (opt) {
+		case 'j':
+			json = 1;
+			break;
+		default:
+			dvdtrace_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - optind > 1) {
+		dvdtrace_usage(argv[0]);
+		return 1;
+	}
+	if (dvdtrace_load(optind < argc ? argv[optind] : NULL, &dump) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	memset(&trace, 0, sizeof(trace));
+	if (dump.data == NULL || dvdtrace_parse(&trace, (const uint8_t*)dump.data,
+			(const uint8_t*)dump.data + dump.len) < 0) {
+		fprintf(stderr, "Not a dvdwrap trace, or truncated\n");
+		return 1;
+	}
+	qsort(trace.events, trace.count, sizeof(dvdtrace_event_t), dvdtrace_compare);
+	base = trace.count ? trace.events[0].time : 0;
+
+	if (json) {
+		printf("{\"traceEvents\":[\n");
+	}
+	for (n = 0; n < trace.count; n++) {
+		dvdtrace_event_t *ev = &trace.events[n];
+
+		dvdtrace_format(trace.fmts[ev->fmt], ev, &line);
+		if (json) {
+			printf("%s{\"name\":", n ? ",\n" : "");
+			dvdtrace_json_string(line.data);
+			printf(",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":1,\"tid\":%u}",
+				(unsigned long long)ev->time, ev->tid);
+		} else {
+			printf("%10.6f %6u %s", (double)(ev->time - base) / 1000000.0, ev->tid,
+				line.data);
+			if (line.len == 0 || line.data[line.len - 1] != '\n') {
+				putchar('\n');
+			}
+		}
+	}
+	if (json) {
+		printf("\n],\"displayTimeUnit\":\"ms\"}\n");
+	}
+	return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "dvdwrap_buf.h"
+
+/*! Makes room for len more bytes and a NUL, returning 0 on success */
+static int dvdwrap_buf_reserve(dvdwrap_buf_t *buf, size_t len)
+{
+	if (buf->len + len + 1 > buf->alloc) {
+		size_t alloc = buf->alloc ? buf->alloc : 1024;
+		char *data;
+
+		while (buf->len + len + 1 > alloc) {
+			alloc *= 2;
+		}
+		data = (char*)realloc(buf->data, alloc);
+		if (data == NULL) {
+			return -1;
+		}
+		buf->data = data;
+		buf->alloc = alloc;
+	}
+	return 0;
+}
+
+/*!
+ * Appends formatted text to a buffer, growing it as required.  Output is
+ * silently dropped if memory runs out.
+ */
+void dvdwrap_buf_printf(dvdwrap_buf_t *buf, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (len < 0 || dvdwrap_buf_reserve(buf, len) < 0) {
+		return;
+	}
+
+	va_start(ap, fmt);
+	vsnprintf(buf->data + buf->len, buf->alloc - buf->len, fmt, ap);
+	va_end(ap);
+	buf->len += len;
+}
+
+/*! Appends binary data to a buffer, in the same way */
+void dvdwrap_buf_append(dvdwrap_buf_t *buf, const void *data, size_t len)
+{
+	if (dvdwrap_buf_reserve(buf, len) < 0) {
+		return;
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	buf->data[buf->len] = '\0';
+}
+
+void dvdwrap_buf_free(dvdwrap_buf_t *buf)
+{
+	free(buf->data);
+	buf->data = NULL;
+	buf->len = buf->alloc = 0;
+}
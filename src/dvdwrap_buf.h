@@ -0,0 +1,40 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DVDWRAP_BUF_H
+#define _DVDWRAP_BUF_H
+
+#include <stddef.h>
+
+/*! Growable buffer, used to build virtual file contents */
+typedef struct {
+	char	*data;
+	size_t	len;
+	size_t	alloc;
+} dvdwrap_buf_t;
+
+void dvdwrap_buf_printf(dvdwrap_buf_t *buf, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+void dvdwrap_buf_append(dvdwrap_buf_t *buf, const void *data, size_t len);
+void dvdwrap_buf_free(dvdwrap_buf_t *buf);
+
+#endif
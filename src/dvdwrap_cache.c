@@ -0,0 +1,451 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Shared block cache.  Blocks are keyed by (title id, block index) so
+ * every handle on a title shares them, which helps several viewers
+ * watching the same title a little apart, and mounts using direct_io
+ * where the kernel page cache is bypassed.
+ *
+ * Replacement is 2Q: blocks seen once sit in a FIFO (a1in), blocks
+ * referenced again after falling out of it go to an LRU (am).  A single
+ * sequential pass, such as a copy, therefore only churns a1in and can't
+ * flush the blocks that viewers keep coming back to.  Concurrent misses
+ * on the same block wait for the first reader's fill rather than going to
+ * the disk again.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "dvdwrap_fuse.h"
+#include "dvdwrap_cache.h"
+
+enum {
+	CACHE_LIST_NONE = 0,
+	CACHE_LIST_A1IN,
+	CACHE_LIST_AM,
+	CACHE_LIST_A1OUT,
+};
+
+struct dvdwrap_cache_block {
+	dvdwrap_cache_block_t	*hnext;		/*!< Hash chain */
+	dvdwrap_cache_block_t	*prev;
+	dvdwrap_cache_block_t	*next;
+	uint32_t				title;
+	uint64_t				index;
+	int						list;		/*!< List it is on, or will go on once loaded */
+	int						loading;
+	unsigned int			refs;
+	size_t					len;
+	char					*data;		/*!< NULL for ghosts */
+};
+
+static unsigned int dvdwrap_cache_bucket(dvdwrap_cache_t *cache, uint32_t title,
+	uint64_t index)
+{
+	uint64_t h = (index * 0x9e3779b97f4a7c15ull) ^ ((uint64_t)title * 0xc2b2ae3d27d4eb4full);
+
+	return (unsigned int)(h ^ (h >> 32)) & (cache->nbuckets - 1);
+}
+
+static dvdwrap_cache_block_t* dvdwrap_cache_lookup(dvdwrap_cache_t *cache,
+	uint32_t title, uint64_t index)
+{
+	dvdwrap_cache_block_t *b;
+
+	for (b = cache->hash[dvdwrap_cache_bucket(cache, title, index)]; b; b = b->hnext) {
+		if (b->title == title && b->index == index) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static void dvdwrap_cache_unhash(dvdwrap_cache_t *cache, dvdwrap_cache_block_t *block)
+{
+	dvdwrap_cache_block_t **b;
+
+	for (b = &cache->hash[dvdwrap_cache_bucket(cache, block->title, block->index)];
+			*b; b = &(*b)->hnext) {
+		if (*b == block) {
+			*b = block->hnext;
+			return;
+		}
+	}
+}
+
+static dvdwrap_cache_list_t* dvdwrap_cache_list(dvdwrap_cache_t *cache, int list)
+{
+	switch (list) {
+	case CACHE_LIST_A1IN:	return &cache->a1in;
+	case CACHE_LIST_AM:		return &cache->am;
+	case CACHE_LIST_A1OUT:	return &cache->a1out;
+	}
+	return NULL;
+}
+
+static void dvdwrap_cache_push(dvdwrap_cache_t *cache, dvdwrap_cache_block_t *b, int list)
+{
+	dvdwrap_cache_list_t *l = dvdwrap_cache_list(cache, list);
+
+	b->list = list;
+	b->prev = NULL;
+	b->next = l->head;
+	if (l->head) {
+		l->head->prev = b;
+	} else {
+		l->tail = b;
+	}
+	l->head = b;
+	l->count++;
+}
+
+static void dvdwrap_cache_remove(dvdwrap_cache_t *cache, dvdwrap_cache_block_t *b)
+{
+	dvdwrap_cache_list_t *l = dvdwrap_cache_list(cache, b->list);
+
+	if (b->prev) {
+		b->prev->next = b->next;
+	} else {
+		l->head = b->next;
+	}
+	if (b->next) {
+		b->next->prev = b->prev;
+	} else {
+		l->tail = b->prev;
+	}
+	l->count--;
+	b->prev = b->next = NULL;
+}
+
+/*! Least recently used block on a list that nobody is copying from */
+static dvdwrap_cache_block_t* dvdwrap_cache_victim(dvdwrap_cache_list_t *l)
+{
+	dvdwrap_cache_block_t *b;
+
+	for (b = l->tail; b; b = b->prev) {
+		if (b->refs == 0) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static void dvdwrap_cache_free(dvdwrap_cache_t *cache, dvdwrap_cache_block_t *b)
+{
+	dvdwrap_cache_unhash(cache, b);
+	if (b->data) {
+		cache->used -= b->len;
+		free(b->data);
+	}
+	free(b);
+}
+
+/*! Evicts until within capacity.  Called with the lock held. */
+static void dvdwrap_cache_shrink(dvdwrap_cache_t *cache)
+{
+	unsigned int maxblocks = cache->capacity / CACHE_BLOCK_SIZE;
+	unsigned int kin = maxblocks / 4 ? maxblocks / 4 : 1;
+	unsigned int kout = maxblocks / 2 ? maxblocks / 2 : 1;
+
+	while (cache->used > cache->capacity) {
+		dvdwrap_cache_block_t *victim = NULL;
+
+		if (cache->a1in.count > kin) {
+			victim = dvdwrap_cache_victim(&cache->a1in);
+		}
+		if (victim == NULL) {
+			victim = dvdwrap_cache_victim(&cache->am);
+		}
+		if (victim == NULL) {
+			victim = dvdwrap_cache_victim(&cache->a1in);
+		}
+		if (victim == NULL) {
+			break; /* Everything is in use */
+		}
+		cache->evictions++;
+
+		dvdwrap_cache_remove(cache, victim);
+		if (victim->list == CACHE_LIST_A1IN) {
+			/* Remember it was seen, in case it comes back */
+			cache->used -= victim->len;
+			free(victim->data);
+			victim->data = NULL;
+			dvdwrap_cache_push(cache, victim, CACHE_LIST_A1OUT);
+			while (cache->a1out.count > kout) {
+				dvdwrap_cache_block_t *ghost = cache->a1out.tail;
+
+				dvdwrap_cache_remove(cache, ghost);
+				dvdwrap_cache_free(cache, ghost);
+			}
+		} else {
+			dvdwrap_cache_free(cache, victim);
+		}
+	}
+}
+
+int dvdwrap_cache_init(dvdwrap_cache_t *cache, const dvdwrap_cache_conf_t *conf)
+{
+	uint64_t maxblocks;
+
+	memset(cache, 0, sizeof(dvdwrap_cache_t));
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->loaded, NULL);
+	cache->capacity = (uint64_t)conf->size * 1024 * 1024;
+
+	/* Room for resident blocks plus ghosts at a low load factor */
+	maxblocks = cache->capacity / CACHE_BLOCK_SIZE;
+	for (cache->nbuckets = 1024; cache->nbuckets < maxblocks * 2; cache->nbuckets <<= 1);
+	cache->hash = (dvdwrap_cache_block_t**)calloc(cache->nbuckets, sizeof(dvdwrap_cache_block_t*));
+	return cache->hash ? 0 : -ENOMEM;
+}
+
+/*! Frees every block, resident or ghost.  No reads may be in progress. */
+void dvdwrap_cache_destroy(dvdwrap_cache_t *cache)
+{
+	dvdwrap_cache_block_t *b, *next;
+	unsigned int n;
+
+	for (n = 0; n < cache->nbuckets; n++) {
+		for (b = cache->hash[n]; b; b = next) {
+			next = b->hnext;
+			free(b->data);
+			free(b);
+		}
+	}
+	free(cache->hash);
+	cache->hash = NULL;
+	cache->used = 0;
+	pthread_cond_destroy(&cache->loaded);
+	pthread_mutex_destroy(&cache->lock);
+}
+
+/*!
+ * Returns a referenced, loaded block, filling it from the backend on a
+ * miss.  Release with dvdwrap_cache_put.
+ *
+ * \param len		Length of the block (shorter at the end of a title)
+ * \param err		Returns -errno on failure
+ * \return			Block, or NULL on failure
+ */
+static dvdwrap_cache_block_t* dvdwrap_cache_get(dvdwrap_cache_t *cache, uint32_t title,
+	uint64_t index, size_t len, dvdwrap_cache_fill_t fill, void *arg, ssize_t *err)
+{
+	dvdwrap_cache_block_t *b;
+	ssize_t rc;
+
+	pthread_mutex_lock(&cache->lock);
+	for (;;) {
+		b = dvdwrap_cache_lookup(cache, title, index);
+		if (b == NULL || !b->loading) {
+			break;
+		}
+		/* Someone else is already reading this block */
+		cache->coalesced++;
+		pthread_cond_wait(&cache->loaded, &cache->lock);
+	}
+
+	if (b && b->data) {
+		cache->hits++;
+		if (b->list == CACHE_LIST_AM) {
+			dvdwrap_cache_remove(cache, b);
+			dvdwrap_cache_push(cache, b, CACHE_LIST_AM);
+		}
+		b->refs++;
+		pthread_mutex_unlock(&cache->lock);
+		return b;
+	}
+
+	cache->misses++;
+	if (b) {
+		/* Ghost hit - seen recently, so this one goes to the hot list */
+		dvdwrap_cache_remove(cache, b);
+		b->list = CACHE_LIST_AM;
+	} else {
+		b = (dvdwrap_cache_block_t*)calloc(1, sizeof(dvdwrap_cache_block_t));
+		if (b == NULL) {
+			pthread_mutex_unlock(&cache->lock);
+			*err = -ENOMEM;
+			return NULL;
+		}
+		b->title = title;
+		b->index = index;
+		b->list = CACHE_LIST_A1IN;
+		b->hnext = cache->hash[dvdwrap_cache_bucket(cache, title, index)];
+		cache->hash[dvdwrap_cache_bucket(cache, title, index)] = b;
+	}
+	b->data = (char*)malloc(len);
+	if (b->data == NULL) {
+		dvdwrap_cache_free(cache, b);
+		pthread_mutex_unlock(&cache->lock);
+		*err = -ENOMEM;
+		return NULL;
+	}
+	b->len = len;
+	b->loading = 1;
+	b->refs = 1;
+	cache->used += len;
+	dvdwrap_cache_shrink(cache);
+	pthread_mutex_unlock(&cache->lock);
+
+	rc = fill(arg, b->data, len, index * CACHE_BLOCK_SIZE);
+
+	pthread_mutex_lock(&cache->lock);
+	b->loading = 0;
+	if (rc < 0) {
+		/* Don't cache failures - waiters will retry for themselves */
+		cache->errors++;
+		dvdwrap_cache_free(cache, b);
+		b = NULL;
+		*err = rc;
+	} else {
+		cache->used -= len - rc;
+		b->len = rc;
+		dvdwrap_cache_push(cache, b, b->list);
+	}
+	pthread_cond_broadcast(&cache->loaded);
+	pthread_mutex_unlock(&cache->lock);
+	return b;
+}
+
+/*! Changes the capacity, evicting at once if it has shrunk */
+void dvdwrap_cache_set_capacity(dvdwrap_cache_t *cache, uint64_t capacity)
+{
+	pthread_mutex_lock(&cache->lock);
+	cache->capacity = capacity;
+	dvdwrap_cache_shrink(cache);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*!
+ * Lists the blocks held, those most recently reused first.
+ *
+ * \param fn		Called for each block with the cache locked
+ * \param arg		Passed to fn
+ */
+void dvdwrap_cache_foreach(dvdwrap_cache_t *cache, dvdwrap_cache_visit_t fn, void *arg)
+{
+	dvdwrap_cache_block_t *b;
+
+	pthread_mutex_lock(&cache->lock);
+	for (b = cache->am.head; b; b = b->next) {
+		fn(arg, b->title, b->index);
+	}
+	for (b = cache->a1in.head; b; b = b->next) {
+		fn(arg, b->title, b->index);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static void dvdwrap_cache_put(dvdwrap_cache_t *cache, dvdwrap_cache_block_t *b)
+{
+	pthread_mutex_lock(&cache->lock);
+	b->refs--;
+	if (cache->used > cache->capacity) {
+		dvdwrap_cache_shrink(cache);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*!
+ * Reads part of a title through the cache.
+ *
+ * \param cache			Block cache
+ * \param title			Title id
+ * \param total_size	Size of the title
+ * \param buf			Destination
+ * \param size			Bytes requested
+ * \param offset		Offset within the title
+ * \param fill			Backend read for misses
+ * \param arg			Passed to fill
+ * \return				Bytes read or -errno
+ */
+ssize_t dvdwrap_cache_read(dvdwrap_cache_t *cache, uint32_t title, uint64_t total_size,
+	char *buf, size_t size, uint64_t offset, dvdwrap_cache_fill_t fill, void *arg)
+{
+	size_t total = 0;
+
+	while (total < size && offset < total_size) {
+		uint64_t index = offset / CACHE_BLOCK_SIZE;
+		size_t boff = offset % CACHE_BLOCK_SIZE;
+		size_t len = CACHE_BLOCK_SIZE, n;
+		dvdwrap_cache_block_t *b;
+		ssize_t err = 0;
+
+		if (len > total_size - index * CACHE_BLOCK_SIZE) {
+			len = total_size - index * CACHE_BLOCK_SIZE;
+		}
+		b = dvdwrap_cache_get(cache, title, index, len, fill, arg, &err);
+		if (b == NULL) {
+			return total ? (ssize_t)total : err;
+		}
+
+		n = size - total;
+		if (n > len - boff) {
+			n = len - boff;
+		}
+		if (boff + n > b->len) {
+			/* Short block - VOB shorter than when it was opened */
+			n = b->len > boff ? b->len - boff : 0;
+			memcpy(buf + total, b->data + boff, n);
+			dvdwrap_cache_put(cache, b);
+			total += n;
+			break;
+		}
+		memcpy(buf + total, b->data + boff, n);
+		dvdwrap_cache_put(cache, b);
+		total += n;
+		offset += n;
+	}
+	return total;
+}
+
+/*! Writes cache statistics */
+void dvdwrap_cache_report(dvdwrap_cache_t *cache, dvdwrap_buf_t *buf)
+{
+	uint64_t lookups;
+
+	pthread_mutex_lock(&cache->lock);
+	lookups = cache->hits + cache->misses;
+	dvdwrap_buf_printf(buf,
+		"capacity %llu\n"
+		"used %llu\n"
+		"block_size %u\n"
+		"blocks_a1in %u\n"
+		"blocks_am %u\n"
+		"ghosts_a1out %u\n"
+		"hits %llu\n"
+		"misses %llu\n"
+		"hit_ratio %.3f\n"
+		"coalesced %llu\n"
+		"evictions %llu\n"
+		"errors %llu\n",
+		(unsigned long long)cache->capacity, (unsigned long long)cache->used,
+		CACHE_BLOCK_SIZE, cache->a1in.count, cache->am.count, cache->a1out.count,
+		(unsigned long long)cache->hits, (unsigned long long)cache->misses,
+		lookups ? (double)cache->hits / lookups : 0.0,
+		(unsigned long long)cache->coalesced, (unsigned long long)cache->evictions,
+		(unsigned long long)cache->errors);
+	pthread_mutex_unlock(&cache->lock);
+}
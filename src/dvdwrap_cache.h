@@ -0,0 +1,93 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DVDWRAP_CACHE_H
+#define _DVDWRAP_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "dvdwrap_buf.h"
+
+/*! Size of a cached block */
+#define CACHE_BLOCK_SIZE	(64 * 1024)
+
+/*! Block cache tunables */
+typedef struct {
+	unsigned int	size;			/*!< Capacity (MiB), 0 to disable */
+} dvdwrap_cache_conf_t;
+
+typedef struct dvdwrap_cache_block dvdwrap_cache_block_t;
+
+/*! Doubly linked list of blocks, most recent at the head */
+typedef struct {
+	dvdwrap_cache_block_t	*head;
+	dvdwrap_cache_block_t	*tail;
+	unsigned int			count;
+} dvdwrap_cache_list_t;
+
+/*! Shared block cache with 2Q replacement */
+typedef struct {
+	pthread_mutex_t			lock;
+	pthread_cond_t			loaded;		/*!< Broadcast when a fill finishes */
+	dvdwrap_cache_block_t	**hash;
+	unsigned int			nbuckets;
+	uint64_t				capacity;	/*!< Bytes */
+	uint64_t				used;		/*!< Bytes held in block data */
+
+	dvdwrap_cache_list_t	a1in;		/*!< Seen once, FIFO */
+	dvdwrap_cache_list_t	am;			/*!< Seen again, LRU */
+	dvdwrap_cache_list_t	a1out;		/*!< Ghosts of blocks evicted from a1in */
+
+	/* Statistics */
+	uint64_t				hits;
+	uint64_t				misses;
+	uint64_t				coalesced;	/*!< Misses that waited for another fill */
+	uint64_t				evictions;
+	uint64_t				errors;
+} dvdwrap_cache_t;
+
+/*!
+ * Reads a block from the backend on a cache miss.
+ *
+ * \param arg		Caller context
+ * \param buf		Destination
+ * \param size		Bytes to read
+ * \param offset	Offset within the title
+ * \return			Bytes read or -errno
+ */
+typedef ssize_t (*dvdwrap_cache_fill_t)(void *arg, char *buf, size_t size, uint64_t offset);
+
+/*! Called for each block by dvdwrap_cache_foreach */
+typedef void (*dvdwrap_cache_visit_t)(void *arg, uint32_t title, uint64_t index);
+
+int dvdwrap_cache_init(dvdwrap_cache_t *cache, const dvdwrap_cache_conf_t *conf);
+void dvdwrap_cache_destroy(dvdwrap_cache_t *cache);
+ssize_t dvdwrap_cache_read(dvdwrap_cache_t *cache, uint32_t title, uint64_t total_size,
+	char *buf, size_t size, uint64_t offset, dvdwrap_cache_fill_t fill, void *arg);
+void dvdwrap_cache_set_capacity(dvdwrap_cache_t *cache, uint64_t capacity);
+void dvdwrap_cache_foreach(dvdwrap_cache_t *cache, dvdwrap_cache_visit_t fn, void *arg);
+void dvdwrap_cache_report(dvdwrap_cache_t *cache, dvdwrap_buf_t *buf);
+
+#endif
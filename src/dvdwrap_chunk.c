@@ -0,0 +1,325 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Chunked reads for high-latency backends (NFS, SMB).  A read is split
+ * into fixed-size, chunk-aligned pieces which are all queued at once, and
+ * sequential streams keep a window of further chunks in flight ahead of
+ * the reader.  Completed chunks are copied out in order, so a single
+ * stream sees the throughput of several outstanding round trips.  Chunks
+ * never span VOBs.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "dvdwrap_fuse.h"
+#include "dvdwrap_chunk.h"
+
+/*! Pieces handled per pass through dvdwrap_chunk_read */
+#define CHUNK_BATCH		32
+
+/*! Part of a read request falling within a single chunk */
+typedef struct {
+	int					min;
+	uint64_t			offset;		/*!< Offset within the VOB */
+	size_t				len;
+	char				*dst;
+	dvdwrap_chunk_t		*slot;		/*!< Chunk holding the data, or NULL */
+	dvdwrap_ioq_job_t	job;		/*!< Direct read if no slot was free */
+} dvdwrap_chunk_piece_t;
+
+/*!
+ * Allocates slots for a file handle.  One slot more than the readahead
+ * depth is kept so the chunk being consumed is not evicted by readahead.
+ *
+ * \param cs		Per-handle state
+ * \param conf		Chunk tunables
+ * \return			0 or -ENOMEM
+ */
+int dvdwrap_chunk_init(dvdwrap_chunk_state_t *cs, const dvdwrap_chunk_conf_t *conf)
+{
+	dvdwrap_chunk_t *slots;
+	unsigned int n, nslots;
+
+	memset(cs, 0, sizeof(dvdwrap_chunk_state_t));
+	cs->size = (size_t)conf->size * 1024;
+	cs->depth = conf->depth < CHUNK_MAX_DEPTH ? conf->depth : CHUNK_MAX_DEPTH;
+	nslots = cs->depth + 1;
+	slots = (dvdwrap_chunk_t*)calloc(nslots, sizeof(dvdwrap_chunk_t));
+	if (slots == NULL) {
+		return -ENOMEM;
+	}
+	for (n = 0; n < nslots; n++) {
+		slots[n].buf = (char*)malloc(cs->size);
+		if (slots[n].buf == NULL) {
+			while (n-- > 0) {
+				free(slots[n].buf);
+			}
+			free(slots);
+			return -ENOMEM;
+		}
+	}
+	cs->slots = slots;
+	cs->nslots = nslots;
+	return 0;
+}
+
+/*! Waits for outstanding chunk reads and frees the slots */
+void dvdwrap_chunk_release(dvdwrap_fh_t *fh)
+{
+	dvdwrap_chunk_state_t *cs = &fh->chunks;
+	unsigned int n;
+
+	for (n = 0; n < cs->nslots; n++) {
+		dvdwrap_chunk_t *slot = &cs->slots[n];
+
+		if (slot->min) {
+			dvdwrap_ioq_wait(fh->vts[slot->min].ioq, &slot->job);
+		}
+		free(slot->buf);
+	}
+	free(cs->slots);
+	cs->slots = NULL;
+	cs->nslots = 0;
+}
+
+/*! Finds a chunk already read or in flight.  Called with the handle locked. */
+static dvdwrap_chunk_t* dvdwrap_chunk_find(dvdwrap_chunk_state_t *cs, int min,
+	uint64_t offset)
+{
+	unsigned int n;
+
+	for (n = 0; n < cs->nslots; n++) {
+		if (cs->slots[n].min == min && cs->slots[n].offset == offset) {
+			return &cs->slots[n];
+		}
+	}
+	return NULL;
+}
+
+/*!
+ * Claims a slot for a new chunk, evicting the least recently used idle
+ * chunk.  The read is set up but not submitted.  Called with the handle
+ * locked.
+ *
+ * \return			Slot, or NULL if every slot is busy
+ */
+static dvdwrap_chunk_t* dvdwrap_chunk_alloc(dvdwrap_fh_t *fh, int min,
+	uint64_t offset, dvdwrap_sched_class_t class)
+{
+	dvdwrap_chunk_state_t *cs = &fh->chunks;
+	dvdwrap_chunk_t *slot = NULL;
+	uint64_t len;
+	unsigned int n;
+
+	for (n = 0; n < cs->nslots; n++) {
+		dvdwrap_chunk_t *s = &cs->slots[n];
+
+		if (s->min == 0) {
+			slot = s;
+			break;
+		}
+		if (s->refs || !dvdwrap_ioq_done(fh->vts[s->min].ioq, &s->job)) {
+			continue;
+		}
+		if (slot == NULL || s->used < slot->used) {
+			slot = s;
+		}
+	}
+	if (slot == NULL) {
+		return NULL;
+	}
+
+	len = fh->vts[min].size - offset;
+	if (len > cs->size) {
+		len = cs->size;
+	}
+	slot->min = min;
+	slot->offset = offset;
+	slot->used = ++cs->clock;
+	slot->job.entry.class = class;
+	slot->job.fd = fh->vts[min].fd;
+	slot->job.buf = slot->buf;
+	slot->job.size = len;
+	slot->job.offset = offset;
+	slot->job.done = 0;
+	return slot;
+}
+
+/*!
+ * Reads from an output file in chunks.
+ *
+ * \param fh			Open output file, with chunks initialised
+ * \param buf			Destination
+ * \param size			Bytes requested
+ * \param offset		Offset within the output file
+ * \param class			Scheduling class for the reads
+ * \param sequential	Non-zero to keep the readahead window filled
+ * \return				Bytes read or -errno
+ */
+ssize_t dvdwrap_chunk_read(dvdwrap_fh_t *fh, char *buf, size_t size,
+	uint64_t offset, dvdwrap_sched_class_t class, int sequential)
+{
+	dvdwrap_chunk_state_t *cs = &fh->chunks;
+	dvdwrap_chunk_piece_t piece[CHUNK_BATCH];
+	dvdwrap_chunk_t *submit[CHUNK_BATCH + CHUNK_MAX_DEPTH];
+	size_t total = 0;
+
+	while (total < size && offset < fh->total_size) {
+		int npieces = 0, nsubmit = 0, n, min;
+		uint64_t voff, next, pos = offset;
+		ssize_t err = 0;
+		int stop = 0;
+
+		/* Split into chunk-aligned pieces */
+		pthread_mutex_lock(&fh->lock);
+		while (npieces < CHUNK_BATCH && pos < offset + (size - total) &&
+				pos < fh->total_size) {
+			dvdwrap_chunk_piece_t *p = &piece[npieces++];
+			uint64_t cstart;
+
+			p->min = dvdwrap_fh_locate(fh, pos, &p->offset);
+			cstart = p->offset - p->offset % cs->size;
+			p->len = cstart + cs->size - p->offset;
+			if (p->len > fh->vts[p->min].size - p->offset) {
+				p->len = fh->vts[p->min].size - p->offset;
+			}
+			if (p->len > offset + (size - total) - pos) {
+				p->len = offset + (size - total) - pos;
+			}
+			p->dst = buf + total + (pos - offset);
+
+			p->slot = dvdwrap_chunk_find(cs, p->min, cstart);
+			if (p->slot == NULL) {
+				p->slot = dvdwrap_chunk_alloc(fh, p->min, cstart, class);
+				if (p->slot) {
+					submit[nsubmit++] = p->slot;
+				}
+			}
+			if (p->slot) {
+				p->slot->refs++;
+				p->slot->used = ++cs->clock;
+			} else {
+				/* No free slot - read straight into the caller's buffer */
+				p->job.entry.class = class;
+				p->job.fd = fh->vts[p->min].fd;
+				p->job.buf = p->dst;
+				p->job.size = p->len;
+				p->job.offset = p->offset;
+			}
+			pos += p->len;
+		}
+
+		/* Keep the window ahead of a sequential reader full */
+		if (sequential && pos >= offset + (size - total)) {
+			min = dvdwrap_fh_locate(fh, pos, &voff);
+			next = voff - voff % cs->size;
+			for (n = 0; n < cs->depth && min < MAX_VTS_MIN && fh->vts[min].size; n++) {
+				if (dvdwrap_chunk_find(cs, min, next) == NULL) {
+					dvdwrap_chunk_t *slot = dvdwrap_chunk_alloc(fh, min, next, class);
+
+					if (slot == NULL) {
+						break;
+					}
+					submit[nsubmit++] = slot;
+				}
+				next += cs->size;
+				if (next >= fh->vts[min].size) {
+					min++;
+					next = 0;
+				}
+			}
+		}
+		pthread_mutex_unlock(&fh->lock);
+
+		/* Issue everything before waiting for anything */
+		for (n = 0; n < nsubmit; n++) {
+			dvdwrap_ioq_submit(fh->vts[submit[n]->min].ioq, &submit[n]->job);
+		}
+		for (n = 0; n < npieces; n++) {
+			if (piece[n].slot == NULL) {
+				dvdwrap_ioq_submit(fh->vts[piece[n].min].ioq, &piece[n].job);
+			}
+		}
+
+		/* Collect in order, stopping at the first error or short read.
+		 * Every piece must still be waited for before returning. */
+		for (n = 0; n < npieces; n++) {
+			dvdwrap_chunk_piece_t *p = &piece[n];
+			ssize_t rc;
+
+			if (p->slot) {
+				rc = dvdwrap_ioq_wait(fh->vts[p->min].ioq, &p->slot->job);
+				if (rc >= 0) {
+					/* Bytes of this piece present in the chunk */
+					rc -= p->offset - p->slot->offset;
+					if (rc < 0) {
+						rc = 0;
+					}
+					if (rc > p->len) {
+						rc = p->len;
+					}
+					if (!stop) {
+						memcpy(p->dst, p->slot->buf + (p->offset - p->slot->offset), rc);
+					}
+				}
+			} else {
+				rc = dvdwrap_ioq_wait(fh->vts[p->min].ioq, &p->job);
+			}
+			if (stop) {
+				continue;
+			}
+			if (rc < 0) {
+				err = rc;
+				stop = 1;
+			} else {
+				total += rc;
+				if (rc < p->len) {
+					/* VOB shorter than when it was opened */
+					stop = 1;
+				}
+			}
+		}
+		offset = pos;
+
+		/* Drop references, forgetting chunks that failed */
+		pthread_mutex_lock(&fh->lock);
+		for (n = 0; n < npieces; n++) {
+			dvdwrap_chunk_t *slot = piece[n].slot;
+
+			if (slot && --slot->refs == 0 && slot->job.result < 0) {
+				slot->min = 0;
+			}
+		}
+		pthread_mutex_unlock(&fh->lock);
+
+		if (err) {
+			return err;
+		}
+		if (stop) {
+			break;
+		}
+	}
+	return total;
+}
@@ -0,0 +1,67 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DVDWRAP_CHUNK_H
+#define _DVDWRAP_CHUNK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dvdwrap_sched.h"
+#include "dvdwrap_ioq.h"
+
+struct dvdwrap_fh;
+
+/*! Deepest readahead window, which bounds the reads issued in one pass */
+#define CHUNK_MAX_DEPTH		64
+
+/*! Chunked read tunables */
+typedef struct {
+	unsigned int	size;			/*!< Chunk size (KiB), 0 to disable */
+	unsigned int	depth;			/*!< Chunks kept in flight ahead of a stream */
+} dvdwrap_chunk_conf_t;
+
+/*! One chunk-aligned piece of a VOB */
+typedef struct {
+	int					min;		/*!< VOB index, 0 if unused */
+	uint64_t			offset;		/*!< Chunk start within the VOB */
+	char				*buf;
+	unsigned int		refs;		/*!< Readers waiting on or copying from this */
+	uint64_t			used;		/*!< LRU stamp */
+	dvdwrap_ioq_job_t	job;
+} dvdwrap_chunk_t;
+
+/*! Chunk cache and readahead window for one file handle */
+typedef struct {
+	dvdwrap_chunk_t		*slots;
+	unsigned int		nslots;
+	size_t				size;		/*!< Chunk size in bytes */
+	unsigned int		depth;
+	uint64_t			clock;
+} dvdwrap_chunk_state_t;
+
+int dvdwrap_chunk_init(dvdwrap_chunk_state_t *cs, const dvdwrap_chunk_conf_t *conf);
+void dvdwrap_chunk_release(struct dvdwrap_fh *fh);
+ssize_t dvdwrap_chunk_read(struct dvdwrap_fh *fh, char *buf, size_t size,
+	uint64_t offset, dvdwrap_sched_class_t class, int sequential);
+
+#endif
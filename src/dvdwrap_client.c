@@ -0,0 +1,412 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Per-process accounting.  Each FUSE operation is charged to the process
+ * that made it, so .dvdwrap/clients can show which players and scanners
+ * are using the mount, how much they read and how fast.
+ *
+ * FUSE reports the thread that made a request, so each thread id is
+ * mapped to its process through the Tgid line of /proc/<tid>/status the
+ * first time it is seen, and remembered until it has been idle as long as
+ * a process would be.  Processes are kept in shards chosen by pid, each
+ * with its own lock, so concurrent callers rarely meet.  A process's name
+ * is read from /proc the first time it is seen.  Processes idle for longer
+ * than the expiry time are dropped, as their pids may be reused, and if
+ * too many are tracked the longest idle in a shard makes way for a new
+ * one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "dvdwrap_fuse.h"
+#include "dvdwrap_client.h"
+
+void dvdwrap_client_init(dvdwrap_clients_t *clients, const dvdwrap_client_conf_t *conf)
+{
+	unsigned int n;
+
+	memset(clients, 0, sizeof(dvdwrap_clients_t));
+	clients->conf = conf;
+	for (n = 0; n < CLIENT_SHARDS; n++) {
+		pthread_mutex_init(&clients->shards[n].lock, NULL);
+	}
+}
+
+void dvdwrap_client_destroy(dvdwrap_clients_t *clients)
+{
+	dvdwrap_client_t *client, *next;
+	dvdwrap_client_thread_t *thread, *tnext;
+	unsigned int n;
+
+	for (n = 0; n < CLIENT_SHARDS; n++) {
+		for (client = clients->shards[n].clients; client; client = next) {
+			next = client->next;
+			free(client);
+		}
+		for (thread = clients->shards[n].threads; thread; thread = tnext) {
+			tnext = thread->next;
+			free(thread);
+		}
+		clients->shards[n].clients = NULL;
+		clients->shards[n].count = 0;
+		clients->shards[n].threads = NULL;
+		clients->shards[n].nthreads = 0;
+		pthread_mutex_destroy(&clients->shards[n].lock);
+	}
+}
+
+/*! Reads a process's name, which is "?" if it has already gone */
+static void dvdwrap_client_comm(pid_t pid, char *comm, size_t size)
+{
+	char path[32];
+	ssize_t len = -1;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/comm", (int)pid);
+	fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		len = read(fd, comm, size - 1);
+		close(fd);
+	}
+	if (len <= 0) {
+		snprintf(comm, size, "?");
+		return;
+	}
+	if (comm[len - 1] == '\n') {
+		len--;
+	}
+	comm[len] = '\0';
+}
+
+/*! Reads the process a thread belongs to, which is the thread itself if
+ * it has already gone */
+static pid_t dvdwrap_client_tgid(pid_t tid)
+{
+	char path[32], status[1024], *line;
+	ssize_t len = -1;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)tid);
+	fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		len = read(fd, status, sizeof(status) - 1);
+		close(fd);
+	}
+	if (len <= 0) {
+		return tid;
+	}
+	status[len] = '\0';
+	line = strstr(status, "\nTgid:");
+	if (line == NULL || atoi(line + 6) <= 0) {
+		return tid;
+	}
+	return (pid_t)atoi(line + 6);
+}
+
+/*! Drops processes idle for longer than the expiry time.  Called with
+ * the shard locked. */
+static void dvdwrap_client_expire(dvdwrap_clients_t *clients, dvdwrap_client_shard_t *shard,
+	uint64_t now)
+{
+	uint64_t expire = (uint64_t)clients->conf->expire * 1000;
+	dvdwrap_client_t **p = &shard->clients;
+	dvdwrap_client_t *client;
+
+	while ((client = *p) != NULL) {
+		if (now - client->last_seen > expire) {
+			*p = client->next;
+			free(client);
+			shard->count--;
+			__sync_fetch_and_add(&clients->dropped, 1);
+		} else {
+			p = &client->next;
+		}
+	}
+}
+
+/*! Makes room for a new process in a full shard.  Called with the shard
+ * locked. */
+static void dvdwrap_client_evict(dvdwrap_clients_t *clients, dvdwrap_client_shard_t *shard)
+{
+	dvdwrap_client_t **p, **oldest = NULL;
+
+	for (p = &shard->clients; *p; p = &(*p)->next) {
+		if (oldest == NULL || (*p)->last_seen < (*oldest)->last_seen) {
+			oldest = p;
+		}
+	}
+	if (oldest) {
+		dvdwrap_client_t *client = *oldest;
+
+		*oldest = client->next;
+		free(client);
+		shard->count--;
+		__sync_fetch_and_add(&clients->dropped, 1);
+	}
+}
+
+/*! Forgets threads idle for longer than the expiry time, or the longest
+ * idle if the shard is full.  Called with the shard locked. */
+static void dvdwrap_client_expire_threads(dvdwrap_clients_t *clients,
+	dvdwrap_client_shard_t *shard, uint64_t now)
+{
+	uint64_t expire = (uint64_t)clients->conf->expire * 1000;
+	dvdwrap_client_thread_t **p = &shard->threads, **oldest = NULL;
+	dvdwrap_client_thread_t *thread;
+
+	while ((thread = *p) != NULL) {
+		if (now - thread->last_seen > expire) {
+			*p = thread->next;
+			free(thread);
+			shard->nthreads--;
+		} else {
+			if (oldest == NULL || thread->last_seen < (*oldest)->last_seen) {
+				oldest = p;
+			}
+			p = &thread->next;
+		}
+	}
+	if (oldest && shard->nthreads >= CLIENT_THREADS_MAX / CLIENT_SHARDS) {
+		thread = *oldest;
+		*oldest = thread->next;
+		free(thread);
+		shard->nthreads--;
+	}
+}
+
+static dvdwrap_client_thread_t* dvdwrap_client_find_thread(dvdwrap_client_shard_t *shard,
+	pid_t tid)
+{
+	dvdwrap_client_thread_t *thread;
+
+	for (thread = shard->threads; thread; thread = thread->next) {
+		if (thread->tid == tid) {
+			return thread;
+		}
+	}
+	return NULL;
+}
+
+/*! Returns the process a thread belongs to, looking it up in /proc the
+ * first time the thread is seen */
+static pid_t dvdwrap_client_pid(dvdwrap_clients_t *clients, pid_t tid, uint64_t now)
+{
+	dvdwrap_client_shard_t *shard = &clients->shards[(unsigned int)tid % CLIENT_SHARDS];
+	dvdwrap_client_thread_t *thread, *added;
+	pid_t pid;
+
+	pthread_mutex_lock(&shard->lock);
+	thread = dvdwrap_client_find_thread(shard, tid);
+	if (thread) {
+		thread->last_seen = now;
+		pid = thread->pid;
+		pthread_mutex_unlock(&shard->lock);
+		return pid;
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	/* Look the process up without holding the lock */
+	pid = dvdwrap_client_tgid(tid);
+	added = (dvdwrap_client_thread_t*)malloc(sizeof(dvdwrap_client_thread_t));
+	if (added == NULL) {
+		return pid;
+	}
+	added->tid = tid;
+	added->pid = pid;
+	added->last_seen = now;
+
+	pthread_mutex_lock(&shard->lock);
+	if (dvdwrap_client_find_thread(shard, tid)) {
+		free(added); /* Another thread got there first */
+	} else {
+		dvdwrap_client_expire_threads(clients, shard, now);
+		added->next = shard->threads;
+		shard->threads = added;
+		shard->nthreads++;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return pid;
+}
+
+static dvdwrap_client_t* dvdwrap_client_find(dvdwrap_client_shard_t *shard, pid_t pid)
+{
+	dvdwrap_client_t *client;
+
+	for (client = shard->clients; client; client = client->next) {
+		if (client->pid == pid) {
+			return client;
+		}
+	}
+	return NULL;
+}
+
+/*!
+ * Charges an operation to the process that made it.
+ *
+ * \param clients	Client table
+ * \param tid		Calling thread, from fuse_get_context().  0 (the kernel
+ *					itself) is not counted.
+ * \param op		Operation
+ * \param rc		Its result - bytes read, or -errno
+ * \param us		How long it took
+ */
+void dvdwrap_client_record(dvdwrap_clients_t *clients, pid_t tid, dvdwrap_stats_op_t op,
+	int rc, uint64_t us)
+{
+	dvdwrap_client_shard_t *shard;
+	dvdwrap_client_t *client;
+	uint64_t now;
+	pid_t pid;
+
+	if (tid <= 0) {
+		return;
+	}
+	now = dvdwrap_now_ms();
+	pid = dvdwrap_client_pid(clients, tid, now);
+	shard = &clients->shards[(unsigned int)pid % CLIENT_SHARDS];
+	pthread_mutex_lock(&shard->lock);
+	client = dvdwrap_client_find(shard, pid);
+	if (client == NULL) {
+		dvdwrap_client_t *added;
+
+		/* Look the name up without holding the lock */
+		pthread_mutex_unlock(&shard->lock);
+		added = (dvdwrap_client_t*)calloc(1, sizeof(dvdwrap_client_t));
+		if (added == NULL) {
+			return;
+		}
+		added->pid = pid;
+		dvdwrap_client_comm(pid, added->comm, sizeof(added->comm));
+		added->first_seen = added->window_start = now;
+
+		pthread_mutex_lock(&shard->lock);
+		client = dvdwrap_client_find(shard, pid);
+		if (client) {
+			free(added); /* Another thread got there first */
+		} else {
+			dvdwrap_client_expire(clients, shard, now);
+			if (shard->count >= CLIENT_MAX / CLIENT_SHARDS) {
+				dvdwrap_client_evict(clients, shard);
+			}
+			client = added;
+			client->next = shard->clients;
+			shard->clients = client;
+			shard->count++;
+			__sync_fetch_and_add(&clients->seen, 1);
+		}
+	}
+
+	client->last_seen = now;
+	client->ops++;
+	if (rc < 0) {
+		client->errors++;
+	} else if (op == STATS_OPEN) {
+		client->opens++;
+	} else if (op == STATS_READ) {
+		client->reads++;
+		client->bytes += rc;
+		client->read_us += us;
+		if (now - client->window_start >= CLIENT_WINDOW_MS) {
+			client->rate = client->window_bytes * 1000 / (now - client->window_start);
+			client->window_start = now;
+			client->window_bytes = 0;
+		}
+		client->window_bytes += rc;
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/*! Biggest readers first */
+static int dvdwrap_client_compare(const void *a, const void *b)
+{
+	const dvdwrap_client_t *x = (const dvdwrap_client_t*)a;
+	const dvdwrap_client_t *y = (const dvdwrap_client_t*)b;
+
+	if (x->bytes != y->bytes) {
+		return x->bytes > y->bytes ? -1 : 1;
+	}
+	if (x->ops != y->ops) {
+		return x->ops > y->ops ? -1 : 1;
+	}
+	return x->pid < y->pid ? -1 : 1;
+}
+
+void dvdwrap_client_report(dvdwrap_clients_t *clients, dvdwrap_buf_t *buf)
+{
+	dvdwrap_client_t *list = NULL, *client;
+	uint64_t now = dvdwrap_now_ms();
+	unsigned int count = 0, alloc = 0, n;
+
+	/* Copy every shard out, so the locks aren't held while sorting */
+	for (n = 0; n < CLIENT_SHARDS; n++) {
+		dvdwrap_client_shard_t *shard = &clients->shards[n];
+
+		pthread_mutex_lock(&shard->lock);
+		dvdwrap_client_expire(clients, shard, now);
+		if (count + shard->count > alloc) {
+			dvdwrap_client_t *p;
+
+			alloc = count + shard->count + 64;
+			p = (dvdwrap_client_t*)realloc(list, alloc * sizeof(dvdwrap_client_t));
+			if (p == NULL) {
+				pthread_mutex_unlock(&shard->lock);
+				break;
+			}
+			list = p;
+		}
+		for (client = shard->clients; client; client = client->next) {
+			list[count++] = *client;
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+	qsort(list, count, sizeof(dvdwrap_client_t), dvdwrap_client_compare);
+
+	dvdwrap_buf_printf(buf, "clients %u\nseen %llu\ndropped %llu\n\n", count,
+		(unsigned long long)clients->seen, (unsigned long long)clients->dropped);
+	dvdwrap_buf_printf(buf, "%7s %-16s %9s %7s %7s %9s %14s %10s %9s %7s\n",
+		"pid", "comm", "ops", "errors", "opens", "reads", "bytes", "rate_kib",
+		"read_us", "idle_s");
+	for (n = 0; n < count; n++) {
+		uint64_t rate;
+
+		client = &list[n];
+		/* A period that has run on without reads shows them tailing off */
+		if (now - client->window_start >= CLIENT_WINDOW_MS) {
+			rate = client->window_bytes * 1000 / (now - client->window_start);
+		} else {
+			rate = client->rate;
+		}
+		dvdwrap_buf_printf(buf, "%7d %-16s %9llu %7llu %7llu %9llu %14llu %10llu %9llu %7llu\n",
+			(int)client->pid, client->comm, (unsigned long long)client->ops,
+			(unsigned long long)client->errors, (unsigned long long)client->opens,
+			(unsigned long long)client->reads, (unsigned long long)client->bytes,
+			(unsigned long long)(rate / 1024),
+			(unsigned long long)(client->reads ? client->read_us / client->reads : 0),
+			(unsigned long long)((now - client->last_seen) / 1000));
+	}
+	free(list);
+}
@@ -0,0 +1,96 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DVDWRAP_CLIENT_H
+#define _DVDWRAP_CLIENT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "dvdwrap_buf.h"
+#include "dvdwrap_stats.h"
+
+#define CLIENT_SHARDS		16			/*!< Separately locked, by pid */
+#define CLIENT_MAX			1024		/*!< Most processes tracked */
+#define CLIENT_THREADS_MAX	4096		/*!< Most thread ids remembered */
+#define CLIENT_WINDOW_MS	10000		/*!< Period bandwidth is averaged over */
+
+/*! Client accounting tunables */
+typedef struct {
+	unsigned int	expire;			/*!< Seconds idle before a process is
+									 *   forgotten */
+} dvdwrap_client_conf_t;
+
+/*! What one process has asked of the filesystem */
+typedef struct dvdwrap_client {
+	struct dvdwrap_client	*next;
+	pid_t			pid;
+	char			comm[16];		/*!< Name when first seen */
+	uint64_t		first_seen;		/*!< dvdwrap_now_ms() */
+	uint64_t		last_seen;
+
+	uint64_t		ops;			/*!< All operations */
+	uint64_t		errors;
+	uint64_t		opens;
+	uint64_t		reads;
+	uint64_t		bytes;			/*!< Read */
+	uint64_t		read_us;		/*!< Total time in read */
+
+	uint64_t		window_start;	/*!< Start of current bandwidth period */
+	uint64_t		window_bytes;	/*!< Read in it */
+	uint64_t		rate;			/*!< Bytes/s over the last whole period */
+} dvdwrap_client_t;
+
+/*! The process a thread belongs to */
+typedef struct dvdwrap_client_thread {
+	struct dvdwrap_client_thread	*next;
+	pid_t			tid;
+	pid_t			pid;			/*!< Tgid of tid */
+	uint64_t		last_seen;
+} dvdwrap_client_thread_t;
+
+typedef struct {
+	pthread_mutex_t		lock;
+	dvdwrap_client_t	*clients;	/*!< Most recently added first */
+	unsigned int		count;
+	dvdwrap_client_thread_t	*threads;	/*!< Chosen by tid rather than pid */
+	unsigned int		nthreads;
+} dvdwrap_client_shard_t;
+
+/*! Operations and bandwidth by calling process */
+typedef struct {
+	const dvdwrap_client_conf_t	*conf;
+	dvdwrap_client_shard_t	shards[CLIENT_SHARDS];
+
+	/* Statistics */
+	uint64_t			seen;		/*!< Processes ever seen */
+	uint64_t			dropped;	/*!< Expired or evicted */
+} dvdwrap_clients_t;
+
+void dvdwrap_client_init(dvdwrap_clients_t *clients, const dvdwrap_client_conf_t *conf);
+void dvdwrap_client_destroy(dvdwrap_clients_t *clients);
+void dvdwrap_client_record(dvdwrap_clients_t *clients, pid_t tid, dvdwrap_stats_op_t op,
+	int rc, uint64_t us);
+void dvdwrap_client_report(dvdwrap_clients_t *clients, dvdwrap_buf_t *buf);
+
+#endif
@@ -0,0 +1,223 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Run-time control.  Reading /.dvdwrap/control lists the tunables that
+ * can be changed without remounting as key=value lines, and writing
+ * lines in the same form changes them, e.g.
+ *
+ *   echo sched_share=50 > /mnt/.dvdwrap/control
+ *
+ * Everything written before the file is closed is checked in full before
+ * anything is changed, so a bad line leaves every setting as it was and
+ * close() fails.  Only the user dvdwrap runs as, or root, may write.
+ * Some settings only affect files opened after the change; see the usage
+ * text for what each one does.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "dvdwrap_fuse.h"
+#include "dvdwrap_control.h"
+
+/*! Most settings applied at once */
+#define CONTROL_MAX_LINES	64
+
+/*! A setting which can be changed at run time */
+typedef struct {
+	const char		*name;
+	size_t			offset;		/*!< Of an unsigned int within dvdwrap_ctx_t */
+	unsigned int	min;
+	unsigned int	max;
+	int				(*allowed)(dvdwrap_ctx_t *ctx);	/*!< Or NULL if always */
+	void			(*apply)(dvdwrap_ctx_t *ctx);	/*!< After a change, or NULL */
+} dvdwrap_control_key_t;
+
+#define CONTROL_KEY(n, f, lo, hi, al, ap)	{ n, offsetof(dvdwrap_ctx_t, f), lo, hi, al, ap }
+
+/*! Serialises writers */
+static pthread_mutex_t dvdwrap_control_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int dvdwrap_control_cache_enabled(dvdwrap_ctx_t *ctx)
+{
+	/* The cache can be resized but not created after mount */
+	return ctx->cache_conf.size != 0;
+}
+
+static void dvdwrap_control_cache_size(dvdwrap_ctx_t *ctx)
+{
+	dvdwrap_mem_set_max(&ctx->mem, "cache", (uint64_t)ctx->cache_conf.size * 1024 * 1024);
+}
+
+static int dvdwrap_control_speculate_enabled(dvdwrap_ctx_t *ctx)
+{
+	/* Needs the scanning thread, which is only started at mount */
+	return ctx->index.spec_running;
+}
+
+static void dvdwrap_control_spin(dvdwrap_ctx_t *ctx)
+{
+	dvdwrap_spin_tune(&ctx->spin, ctx->sched_conf.playback_rate);
+	dvdwrap_mem_set_max(&ctx->mem, "spindown", (uint64_t)ctx->spin_conf.total * 1024 * 1024);
+}
+
+static void dvdwrap_control_log_level(dvdwrap_ctx_t *ctx)
+{
+	dvdwrap_log_level = ctx->log_level;
+}
+
+static const dvdwrap_control_key_t dvdwrap_control_keys[] = {
+	CONTROL_KEY("sched_share",		sched_conf.share,		0, 100,			NULL, NULL),
+	CONTROL_KEY("sched_deadline",	sched_conf.deadline,	1, 60000,		NULL, NULL),
+	CONTROL_KEY("probe_deadline",	sched_conf.probe_deadline, 1, 60000,	NULL, NULL),
+	CONTROL_KEY("playback_rate",	sched_conf.playback_rate, 1, 1048576,	NULL, dvdwrap_control_spin),
+	CONTROL_KEY("ioq_depth",		ioq_conf.depth,			1, 4096,		NULL, NULL),
+	CONTROL_KEY("ioq_stall",		ioq_conf.stall,			0, 600000,		NULL, NULL),
+	CONTROL_KEY("chunk_depth",		chunk_conf.depth,		1, CHUNK_MAX_DEPTH,	NULL, NULL),
+	CONTROL_KEY("cache_size",		cache_conf.size,		1, 1048576,
+		dvdwrap_control_cache_enabled, dvdwrap_control_cache_size),
+	CONTROL_KEY("ssd_admit",		ssd_conf.admit,			0, 1000000,		NULL, NULL),
+	CONTROL_KEY("spin_buffer",		spin_conf.size,			0, 65536,		NULL, NULL),
+	CONTROL_KEY("spin_total",		spin_conf.total,		0, 1048576,		NULL, dvdwrap_control_spin),
+	CONTROL_KEY("spin_up",			spin_conf.spinup,		0, 600,			NULL, dvdwrap_control_spin),
+	CONTROL_KEY("pin_head",			pin_conf.head,			0, 65536,		NULL, NULL),
+	CONTROL_KEY("pin_tail",			pin_conf.tail,			0, 65536,		NULL, NULL),
+	CONTROL_KEY("mem_min",			mem_conf.min,			0, 100,			NULL, NULL),
+	CONTROL_KEY("mem_pressure",		mem_conf.pressure,		0, 100,			NULL, NULL),
+	CONTROL_KEY("index_ttl",		index_conf.ttl,			0, 86400,		NULL, NULL),
+	CONTROL_KEY("index_recheck",	index_conf.recheck,		0, 86400,		NULL, NULL),
+	CONTROL_KEY("index_speculate",	index_conf.speculate,	1, 1000000,
+		dvdwrap_control_speculate_enabled, NULL),
+	CONTROL_KEY("client_expire",	client_conf.expire,		1, 86400,		NULL, NULL),
+	CONTROL_KEY("log_level",		log_level,				0, 1,			NULL, dvdwrap_control_log_level),
+	{ NULL, 0, 0, 0, NULL, NULL }
+};
+
+static unsigned int* dvdwrap_control_value(dvdwrap_ctx_t *ctx, const dvdwrap_control_key_t *key)
+{
+	return (unsigned int*)((char*)ctx + key->offset);
+}
+
+void dvdwrap_control_report(dvdwrap_ctx_t *ctx, dvdwrap_buf_t *buf)
+{
+	const dvdwrap_control_key_t *key;
+
+	pthread_mutex_lock(&dvdwrap_control_lock);
+	for (key = dvdwrap_control_keys; key->name; key++) {
+		dvdwrap_buf_printf(buf, "%s=%u\n", key->name, *dvdwrap_control_value(ctx, key));
+	}
+	pthread_mutex_unlock(&dvdwrap_control_lock);
+}
+
+/*! Parses one line.  Returns 1 for a setting, 0 for a blank line or
+ * comment, or -EINVAL. */
+static int dvdwrap_control_parse(dvdwrap_ctx_t *ctx, char *line,
+	const dvdwrap_control_key_t **keyp, unsigned int *valuep)
+{
+	const dvdwrap_control_key_t *key;
+	char *value, *end;
+	unsigned long v;
+
+	line += strspn(line, " \t");
+	if (*line == '\0' || *line == '#') {
+		return 0;
+	}
+	value = strchr(line, '=');
+	if (value == NULL) {
+		return -EINVAL;
+	}
+	*value++ = '\0';
+	line[strcspn(line, " \t")] = '\0';
+	for (key = dvdwrap_control_keys; key->name; key++) {
+		if (strcmp(line, key->name) == 0) {
+			break;
+		}
+	}
+	if (key->name == NULL || (key->allowed && !key->allowed(ctx))) {
+		return -EINVAL;
+	}
+	v = strtoul(value, &end, 10);
+	end += strspn(end, " \t\r");
+	if (end == value || *end != '\0' || v < key->min || v > key->max) {
+		return -EINVAL;
+	}
+	*keyp = key;
+	*valuep = (unsigned int)v;
+	return 1;
+}
+
+/*!
+ * Applies settings written to the control file.
+ *
+ * \param ctx		Mount context
+ * \param data		key=value lines
+ * \param len		Length of data
+ * \return			0, or -EINVAL if any line is bad, in which case
+ *					nothing is changed
+ */
+int dvdwrap_control_write(dvdwrap_ctx_t *ctx, const char *data, size_t len)
+{
+	const dvdwrap_control_key_t *keys[CONTROL_MAX_LINES];
+	unsigned int values[CONTROL_MAX_LINES];
+	unsigned int count = 0, n;
+	char *text, *line, *save;
+	int rc = 0;
+
+	text = (char*)malloc(len + 1);
+	if (text == NULL) {
+		return -ENOMEM;
+	}
+	memcpy(text, data, len);
+	text[len] = '\0';
+	for (line = strtok_r(text, "\n", &save); line && rc == 0; line = strtok_r(NULL, "\n", &save)) {
+		const dvdwrap_control_key_t *key;
+		unsigned int value;
+
+		rc = dvdwrap_control_parse(ctx, line, &key, &value);
+		if (rc > 0) {
+			if (count == CONTROL_MAX_LINES) {
+				rc = -E2BIG;
+			} else {
+				keys[count] = key;
+				values[count++] = value;
+				rc = 0;
+			}
+		}
+	}
+	free(text);
+	if (rc < 0) {
+		return rc;
+	}
+
+	pthread_mutex_lock(&dvdwrap_control_lock);
+	for (n = 0; n < count; n++) {
+		LOG("Set %s=%u\n", keys[n]->name, values[n]);
+		*dvdwrap_control_value(ctx, keys[n]) = values[n];
+		if (keys[n]->apply) {
+			keys[n]->apply(ctx);
+		}
+	}
+	pthread_mutex_unlock(&dvdwrap_control_lock);
+	return 0;
+}
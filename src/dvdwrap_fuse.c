@@ -33,31 +33,15 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
 
 #include "dvdwrap_fuse.h"
+#include "dvdwrap_vfile.h"
+#include "dvdwrap_probes.h"
 
-#define MAX_VTS_MIN		10
-#define MAX_VTS_MAJ		100
 #define FILE_EXTENSION	".mpg"
 
-#ifdef DEBUG
-#define LOG(a,...)		fprintf(stderr, __FILE__ "(%d): " a, __LINE__, ##__VA_ARGS__)
-#else
-#define LOG(a,...)
-#endif
-
-/*! Private data held per input file */
-typedef struct {
-	int			fd;
-	uint64_t	size;
-} dvdwrap_vts_t;
-
-/*! Private data held per output file */
-typedef struct {
-	dvdwrap_vts_t	vts[MAX_VTS_MIN];
-	uint64_t		total_size;
-} dvdwrap_fh_t;
-
 static int dvdwrap_getattr(const char *path, struct stat *stbuf);
 
 static int dvdwrap_opendir(const char* path, struct fuse_file_info* fi);
@@ -68,70 +52,122 @@ static int dvdwrap_releasedir(const char* path, struct fuse_file_info *fi);
 static int dvdwrap_open(const char *path, struct fuse_file_info *fi);
 static int dvdwrap_read(const char *path, char *buf, size_t size, off_t offset,
 	struct fuse_file_info *fi);
+static int dvdwrap_write(const char *path, const char *buf, size_t size, off_t offset,
+	struct fuse_file_info *fi);
+static int dvdwrap_truncate(const char *path, off_t size);
+static int dvdwrap_flush(const char *path, struct fuse_file_info *fi);
 static int dvdwrap_release(const char* path, struct fuse_file_info *fi);
+static ssize_t dvdwrap_spin_fill(void *arg, char *buf, size_t size, uint64_t offset);
+static void dvdwrap_close_title(dvdwrap_fh_t *private);
 
-static struct fuse_operations dvdwrap_oper = {
-	.getattr	= dvdwrap_getattr,
-	.opendir	= dvdwrap_opendir,
-	.readdir	= dvdwrap_readdir,
-	.releasedir	= dvdwrap_releasedir,
-	.open		= dvdwrap_open,
-	.read		= dvdwrap_read,
-	.release	= dvdwrap_release,
+static void* dvdwrap_init(struct fuse_conn_info *conn);
 
-	.flag_nullpath_ok	= 1,
-};
+static void dvdwrap_destroy(void *private_data);
 
-/*!
- * Scans DVD image.  Looks for the titleset containing the largest title
- * and assumes that this is the main feature.
- *
- * \param path		Path to top level of DVD image (containing VIDEO_TS)
- */
-static int dvdwrap_scan_videots(const char *path, int *vts_maj, uint64_t *total_size)
+/* Timed entry points, which count each operation in .dvdwrap/stats and
+ * .dvdwrap/clients and fire the op_start and op_done probes */
+
+static uint64_t dvdwrap_op_start(dvdwrap_stats_op_t op, const char *path)
 {
-	int maj, min, longest_maj = 0;
-	uint64_t titlesize[MAX_VTS_MAJ];
-	uint64_t longest_size = 0;
-	struct stat st;
+	DVDWRAP_PROBE2(op_start, (int)op, path);
+	return dvdwrap_now_us();
+}
 
-	LOG("%s(%s)\n", __FUNCTION__, path);
+static int dvdwrap_op_done(dvdwrap_stats_op_t op, const char *path, uint64_t start, int rc)
+{
+	uint64_t us = dvdwrap_stats_record(op, start, rc);
 
-	memset(titlesize, 0, sizeof(titlesize));
+	dvdwrap_client_record(&PRIVATE->clients, fuse_get_context()->pid, op, rc, us);
+	DVDWRAP_PROBE4(op_done, (int)op, path, rc, us);
+	return rc;
+}
 
-	for (maj = 1; maj < MAX_VTS_MAJ; maj++) {
-		/* Skip VTS_nn_0 because this is always the menu content */
-		for (min = 1; min < MAX_VTS_MIN; min++) {
-			char vtspath[PATH_MAX];
-			snprintf(vtspath, PATH_MAX, "%s/VIDEO_TS/VTS_%02d_%01d.VOB", path, maj, min);
-			LOG("%s\n", vtspath);
-			if (lstat(vtspath, &st) < 0) {
-				/* No more VOBs in this titleset */
-				LOG("No more VOBs at minor %d\n", min);
-				break;
-			}
-			titlesize[maj] += st.st_size;
-		}
-		if (min == 1) {
-			LOG("No more titlesets at major %d\n", maj);
-			break;
-		}
-		if (titlesize[maj] > longest_size) {
-			longest_size = titlesize[maj];
-			longest_maj = maj;
-		}
-	}
+static int dvdwrap_timed_getattr(const char *path, struct stat *stbuf)
+{
+	uint64_t start = dvdwrap_op_start(STATS_GETATTR, path);
 
-	if (longest_maj) {
-		LOG("Found longest titleset %d with length %llu\n", longest_maj, (unsigned long long)longest_size);
-		*vts_maj = longest_maj;
-		*total_size = longest_size;
-		return 0;
-	}
+	return dvdwrap_op_done(STATS_GETATTR, path, start, dvdwrap_getattr(path, stbuf));
+}
+
+static int dvdwrap_timed_opendir(const char* path, struct fuse_file_info* fi)
+{
+	uint64_t start = dvdwrap_op_start(STATS_OPENDIR, path);
+
+	return dvdwrap_op_done(STATS_OPENDIR, path, start, dvdwrap_opendir(path, fi));
+}
 
-	return -1; /* Not found */
+static int dvdwrap_timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+	off_t offset, struct fuse_file_info *fi)
+{
+	uint64_t start = dvdwrap_op_start(STATS_READDIR, path);
+
+	return dvdwrap_op_done(STATS_READDIR, path, start,
+		dvdwrap_readdir(path, buf, filler, offset, fi));
+}
+
+static int dvdwrap_timed_releasedir(const char* path, struct fuse_file_info *fi)
+{
+	uint64_t start = dvdwrap_op_start(STATS_RELEASEDIR, path);
+
+	return dvdwrap_op_done(STATS_RELEASEDIR, path, start, dvdwrap_releasedir(path, fi));
 }
 
+static int dvdwrap_timed_open(const char *path, struct fuse_file_info *fi)
+{
+	uint64_t start = dvdwrap_op_start(STATS_OPEN, path);
+
+	return dvdwrap_op_done(STATS_OPEN, path, start, dvdwrap_open(path, fi));
+}
+
+static int dvdwrap_timed_read(const char *path, char *buf, size_t size, off_t offset,
+	struct fuse_file_info *fi)
+{
+	uint64_t start = dvdwrap_op_start(STATS_READ, path);
+
+	return dvdwrap_op_done(STATS_READ, path, start,
+		dvdwrap_read(path, buf, size, offset, fi));
+}
+
+static int dvdwrap_timed_write(const char *path, const char *buf, size_t size, off_t offset,
+	struct fuse_file_info *fi)
+{
+	uint64_t start = dvdwrap_op_start(STATS_WRITE, path);
+
+	return dvdwrap_op_done(STATS_WRITE, path, start,
+		dvdwrap_write(path, buf, size, offset, fi));
+}
+
+static int dvdwrap_timed_truncate(const char *path, off_t size)
+{
+	uint64_t start = dvdwrap_op_start(STATS_TRUNCATE, path);
+
+	return dvdwrap_op_done(STATS_TRUNCATE, path, start, dvdwrap_truncate(path, size));
+}
+
+static int dvdwrap_timed_release(const char* path, struct fuse_file_info *fi)
+{
+	uint64_t start = dvdwrap_op_start(STATS_RELEASE, path);
+
+	return dvdwrap_op_done(STATS_RELEASE, path, start, dvdwrap_release(path, fi));
+}
+
+const struct fuse_operations dvdwrap_oper = {
+	.getattr	= dvdwrap_timed_getattr,
+	.opendir	= dvdwrap_timed_opendir,
+	.readdir	= dvdwrap_timed_readdir,
+	.releasedir	= dvdwrap_timed_releasedir,
+	.open		= dvdwrap_timed_open,
+	.read		= dvdwrap_timed_read,
+	.write		= dvdwrap_timed_write,
+	.truncate	= dvdwrap_timed_truncate,
+	.flush		= dvdwrap_flush,
+	.release	= dvdwrap_timed_release,
+	.init		= dvdwrap_init,
+	.destroy	= dvdwrap_destroy,
+
+	.flag_nullpath_ok	= 1,
+};
+
 static int dvdwrap_getattr(const char *path, struct stat *stbuf)
 {
 	dvdwrap_ctx_t *ctx = PRIVATE;
@@ -139,36 +175,29 @@ static int dvdwrap_getattr(const char *path, struct stat *stbuf)
 
 	LOG("%s(%s, %p)\n", __FUNCTION__, path, stbuf);
 
+	if (dvdwrap_vfile_match(path)) {
+		return dvdwrap_vfile_getattr(path, stbuf);
+	}
+
 	snprintf(targetpath, PATH_MAX, "%s/%s", ctx->sourcepath, path);
 
 	memset(stbuf, 0, sizeof(struct stat));
 	if (strcmp(&targetpath[strlen(targetpath) - strlen(FILE_EXTENSION)], FILE_EXTENSION) == 0) {
 		/* File ends in FILE_EXTENSION so is probably a DVD. Remove
 		 * the suffix to get back to the original DVD image path. */
-		char vtspath[PATH_MAX];
+		dvdwrap_index_info_t info;
 		targetpath[strlen(targetpath) - strlen(FILE_EXTENSION)] = '\0';
 
-		/* Stat the VIDEO_TS.IFO file to obtain ownership, etc. and as a
-		 * pre-flight sanity check */
-		snprintf(vtspath, PATH_MAX, "%s/VIDEO_TS/VIDEO_TS.IFO", targetpath);
-		if (lstat(vtspath, stbuf) == 0) {
-			int maj;
-			uint64_t total_size;
-
-			/* Scan titlesets for main feature and return aggregate file size */
-			if (dvdwrap_scan_videots(targetpath, &maj, &total_size) == 0) {
-				stbuf->st_size = (off_t)total_size;
-			} else {
-				LOG("VTS scan failed\n");
-				return -ENOENT;
-			}
-		} else {
-			LOG("VIDEO_TS.IFO not found\n");
+		/* Ownership, etc. come from VIDEO_TS.IFO and the size from the
+		 * titleset of the main feature */
+		if (!(dvdwrap_index_lookup(&ctx->index, targetpath, &info) & INDEX_TITLE)) {
 			return -ENOENT;
 		}
+		*stbuf = info.st;
+		stbuf->st_size = (off_t)info.total_size;
 	} else {
 		/* For all other files just pass straight through */
-		if (lstat(targetpath, stbuf) < 0) {
+		if (dvdwrap_stats_lstat(targetpath, stbuf) < 0) {
 			return -ENOENT;
 		}
 		stbuf->st_mode &= ~0222; /* Everything is read-only */
@@ -178,14 +207,24 @@ static int dvdwrap_getattr(const char *path, struct stat *stbuf)
 
 /* Directory operations */
 
+/*! Private data held per open directory */
+typedef struct {
+	char					*path;	/*!< As readdir is passed a NULL path */
+	dvdwrap_index_batch_t	*batch;	/*!< Images being scanned ahead, or NULL */
+} dvdwrap_dh_t;
+
 static int dvdwrap_opendir(const char* path, struct fuse_file_info* fi)
 {
-	LOG("%s(%s, %p)\n", __FUNCTION__, path, fi);
+	dvdwrap_dh_t *dh;
 
-	/* FIXME: We need to implement separate opendir/releasedir because we
-	 * declare flag_nullpath_ok, but there is no optimisation here yet */
+	LOG("%s(%s, %p)\n", __FUNCTION__, path, fi);
 
-	fi->fh = (uint64_t)strdup(path);
+	dh = (dvdwrap_dh_t*)calloc(1, sizeof(dvdwrap_dh_t));
+	if (dh == NULL || (dh->path = strdup(path)) == NULL) {
+		free(dh);
+		return -ENOMEM;
+	}
+	fi->fh = (uint64_t)dh;
 	return 0;
 }
 
@@ -195,18 +234,27 @@ static int dvdwrap_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	DIR *d;
 	struct dirent *dir;
 	dvdwrap_ctx_t *ctx = PRIVATE;
+	dvdwrap_dh_t *dh = (dvdwrap_dh_t*)fi->fh;
 	char targetpath[PATH_MAX];
 
 	LOG("%s(%s, %p, %p, %zd, %p)\n", __FUNCTION__, path, buf, filler, offset, fi);
 
 	if (!path)
-		path = (const char*)fi->fh;
+		path = dh->path;
+	if (dvdwrap_vfile_match(path)) {
+		return dvdwrap_vfile_readdir(path, buf, filler);
+	}
 	snprintf(targetpath, PATH_MAX, "%s/%s", ctx->sourcepath, path);
 
 	/* Always return current and parent directories */
 	filler(buf, ".", NULL, 0);
 	filler(buf, "..", NULL, 0);
 
+	/* Images found are scanned in the background, ready for the stats
+	 * which usually follow a listing */
+	dvdwrap_index_cancel(&ctx->index, dh->batch);
+	dh->batch = dvdwrap_index_batch_new(&ctx->index);
+
 	/* Scan the equivalent location in the source path and proxy
 	 * through all subdirectories except VIDEO_TS.  Files are ignored. */
 	d = opendir(targetpath);
@@ -228,15 +276,14 @@ static int dvdwrap_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 					continue; /* not a dir */
 
 				/* Otherwise call lstat to determine the entity type */
-				if (lstat(thispath, &st) < 0)
+				if (dvdwrap_stats_lstat(thispath, &st) < 0)
 					continue; /* stat failed */
 				if (!S_ISDIR(st.st_mode))
 					continue; /* not a dir */
 			}
 
 			/* If directory contains VIDEO_TS then squash to a file */
-			snprintf(thatpath, PATH_MAX, "%s/VIDEO_TS", thispath);
-			if (lstat(thatpath, &st) < 0) {
+			if (!dvdwrap_index_is_image(&ctx->index, thispath, dh->batch)) {
 				/* Pass through directory name to output */
 				filler(buf, dir->d_name, NULL, 0);
 			} else {
@@ -247,31 +294,48 @@ static int dvdwrap_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		}
 		closedir(d);
 	}
+	dvdwrap_index_speculate(&ctx->index, dh->batch);
 	return 0;
 }
 
 static int dvdwrap_releasedir(const char* path, struct fuse_file_info *fi)
 {
+	dvdwrap_ctx_t *ctx = PRIVATE;
+	dvdwrap_dh_t *dh = (dvdwrap_dh_t*)fi->fh;
+
 	LOG("%s(%s, %p)\n", __FUNCTION__, path, fi);
 
-	free((void*)fi->fh);
+	/* The client has finished with the listing, so stop scanning ahead */
+	dvdwrap_index_cancel(&ctx->index, dh->batch);
+	free(dh->path);
+	free(dh);
 	return 0;
 }
 
 /* File operations */
 
-static int dvdwrap_open(const char *path, struct fuse_file_info *fi)
+/*!
+ * Opens the VOBs behind an output file.
+ *
+ * \param ctx		Mount context
+ * \param path		Path of the output file within the mount
+ * \param quiet		Non-zero for opens made by dvdwrap itself, which
+ *					bypass the caches and don't count towards a title's
+ *					popularity
+ * \param fhp		Returns the new handle
+ * \return			0 or -errno
+ */
+static int dvdwrap_open_title(dvdwrap_ctx_t *ctx, const char *path, int quiet,
+	dvdwrap_fh_t **fhp)
 {
-	dvdwrap_ctx_t *ctx = PRIVATE;
 	dvdwrap_fh_t *private;
-	int maj, min;
-	uint64_t total_size;
+	dvdwrap_index_info_t info;
+	int min;
+	time_t mtime = 0;
 	char targetpath[PATH_MAX];
 	char vtspath[PATH_MAX];
 	struct stat st;
 
-	LOG("%s(%s, %p)\n", __FUNCTION__, path, fi);
-
 	/* Process path for filename and remove extension */
 	snprintf(targetpath, PATH_MAX, "%s/%s", ctx->sourcepath, path);
 	if (strcmp(&targetpath[strlen(targetpath) - strlen(FILE_EXTENSION)], FILE_EXTENSION) != 0) {
@@ -282,8 +346,7 @@ static int dvdwrap_open(const char *path, struct fuse_file_info *fi)
 	targetpath[strlen(targetpath) - strlen(FILE_EXTENSION)] = '\0';
 
 	/* Scan for titleset major number and total size */
-	if (dvdwrap_scan_videots(targetpath, &maj, &total_size) < 0) {
-		LOG("VTS scan failed\n");
+	if (!(dvdwrap_index_lookup(&ctx->index, targetpath, &info) & INDEX_TITLE)) {
 		return -ENOENT;
 	}
 
@@ -292,13 +355,20 @@ static int dvdwrap_open(const char *path, struct fuse_file_info *fi)
 	if (private == NULL) {
 		return -ENOMEM;
 	}
-	fi->fh = (uint64_t)private;
+	private->type = DVDWRAP_FH_TITLE;
+	private->ctx = ctx;
+	pthread_mutex_init(&private->lock, NULL);
+	private->stream.class = SCHED_PROBE;
+	private->stream.window_start = dvdwrap_now_ms();
+	if (ctx->chunk_conf.size && dvdwrap_chunk_init(&private->chunks, &ctx->chunk_conf) < 0) {
+		goto fail;
+	}
 
 	/* Open all VOBs in this titleset, skipping the menu (index 0) */
 	private->total_size = 0;
 	for (min = 1; min < MAX_VTS_MIN; min++) {
-			snprintf(vtspath, PATH_MAX, "%s/VIDEO_TS/VTS_%02d_%01d.VOB", targetpath, maj, min);
-			if (lstat(vtspath, &st) < 0) {
+			snprintf(vtspath, PATH_MAX, "%s/VIDEO_TS/VTS_%02d_%01d.VOB", targetpath, info.maj, min);
+			if (dvdwrap_stats_lstat(vtspath, &st) < 0) {
 				break; /* No more files in the titleset */
 			}
 			LOG("Open %s (size = %zu)\n", vtspath, st.st_size);
@@ -307,43 +377,137 @@ static int dvdwrap_open(const char *path, struct fuse_file_info *fi)
 				goto fail;
 			}
 			private->vts[min].size = (uint64_t)st.st_size;
+			private->vts[min].ioq = dvdwrap_ioq_get(&ctx->ioqs, st.st_dev);
+			if (private->vts[min].ioq == NULL) {
+				goto fail;
+			}
 			private->total_size += (uint64_t)st.st_size;
+			if (st.st_mtime > mtime) {
+				mtime = st.st_mtime;
+			}
+	}
+
+	private->mtime = mtime;
+	*fhp = private;
+	if (quiet) {
+		return 0;
+	}
+
+	/* Register the title so caches can share blocks between handles */
+	private->title = dvdwrap_title_get(&ctx->titles, path, private->total_size, mtime, 1);
+	if (private->title == NULL) {
+		goto fail;
+	}
+	private->title_id = private->title->id;
+	private->heat = dvdwrap_heat_open(&ctx->heat, path, private->total_size, mtime);
+	if (ctx->ssd_conf.dir) {
+		private->ssd = dvdwrap_ssd_open(&ctx->ssd, path, private->total_size, mtime);
+	}
+	if (ctx->spin_conf.size) {
+		dvdwrap_spin_open(&ctx->spin, &private->spin, private->total_size,
+			dvdwrap_spin_fill, private);
+	}
+	if (ctx->pin_conf.size) {
+		private->pin = dvdwrap_pin_open(&ctx->pin, path, private->total_size, mtime);
 	}
 
 	return 0;
 fail:
 	/* Clean up */
-	dvdwrap_release(NULL, fi);
+	dvdwrap_close_title(private);
 	return -ENOENT;
 }
 
-static int dvdwrap_read(const char *path, char *buf, size_t size, off_t offset,
-	struct fuse_file_info *fi)
+/*! Closes a handle from dvdwrap_open_title */
+static void dvdwrap_close_title(dvdwrap_fh_t *private)
 {
-	dvdwrap_fh_t *private = (dvdwrap_fh_t*)fi->fh;
-	int min, rc;
-	size_t total = 0;
+	dvdwrap_ctx_t *ctx = private->ctx;
+	int min;
 
-	LOG("%s(%s, %p, %zd, %zd, %p)\n", __FUNCTION__, path, buf, size, offset, fi);
+	/* The spin-down buffer goes first as its refill thread may still be
+	 * reading */
+	dvdwrap_spin_release(&private->spin);
+	if (private->pin) {
+		dvdwrap_pin_close(&ctx->pin, private->pin);
+	}
+	if (private->ssd) {
+		dvdwrap_ssd_close(&ctx->ssd, private->ssd);
+	}
+	if (private->chunks.nslots) {
+		dvdwrap_chunk_release(private);
+	}
+	for (min = 1; min < MAX_VTS_MIN; min++) {
+		if (private->vts[min].size) {
+			LOG("Closing VTS %d (fd = %d)\n", min, private->vts[min].fd);
+			close(private->vts[min].fd);
+		}
+	}
+	pthread_mutex_destroy(&private->lock);
+	free(private);
+}
 
-	/* Initial sanity check */
-	if (offset >= private->total_size) {
-		/* EOF */
-		return 0;
+static int dvdwrap_open(const char *path, struct fuse_file_info *fi)
+{
+	dvdwrap_ctx_t *ctx = PRIVATE;
+	dvdwrap_fh_t *private;
+	int rc;
+
+	LOG("%s(%s, %p)\n", __FUNCTION__, path, fi);
+
+	if (dvdwrap_vfile_match(path)) {
+		return dvdwrap_vfile_open(ctx, path, fi);
+	}
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		/* Titles are read-only, only the control file takes writes */
+		return -EROFS;
+	}
+
+	rc = dvdwrap_open_title(ctx, path, 0, &private);
+	if (rc == 0) {
+		fi->fh = (uint64_t)private;
+	}
+	return rc;
+}
+
+/*! A backend read on behalf of one FUSE read */
+typedef struct {
+	dvdwrap_ctx_t			*ctx;
+	dvdwrap_fh_t			*fh;
+	dvdwrap_sched_class_t	class;
+	int						sequential;
+} dvdwrap_backend_t;
+
+/*!
+ * Reads part of an output file from its VOBs.  Used directly, or as the
+ * fill function for the block cache.
+ *
+ * \param arg		dvdwrap_backend_t for the read
+ * \param buf		Destination
+ * \param size		Bytes to read
+ * \param offset	Offset within the output file
+ * \return			Bytes read or -errno
+ */
+static ssize_t dvdwrap_backend_read(void *arg, char *buf, size_t size, uint64_t offset)
+{
+	dvdwrap_backend_t *backend = (dvdwrap_backend_t*)arg;
+	dvdwrap_fh_t *private = backend->fh;
+	int min;
+	ssize_t rc;
+	size_t total = 0;
+
+	if (private->chunks.nslots) {
+		/* High-latency backend - split into parallel chunk reads */
+		return dvdwrap_chunk_read(private, buf, size, offset,
+			backend->class, backend->sequential);
 	}
 
 	while (total < size) {
-		off_t thisoffset = offset;
+		uint64_t thisoffset;
 		off_t thissize = size - total;
 
 		/* Determine the source file for this read and convert overall
 		 * offset into offset for that specific VOB */
-		for (min = 1; min < MAX_VTS_MIN; min++) {
-			if (thisoffset < private->vts[min].size) {
-				break;
-			}
-			thisoffset -= private->vts[min].size;
-		}
+		min = dvdwrap_fh_locate(private, offset, &thisoffset);
 		if (min == MAX_VTS_MIN) {
 			LOG("Read beyond end of titleset\n");
 			break;
@@ -351,15 +515,20 @@ static int dvdwrap_read(const char *path, char *buf, size_t size, off_t offset,
 		if (thissize > private->vts[min].size - thisoffset) {
 			thissize = private->vts[min].size - thisoffset;
 		}
-		LOG("File %d offset %zd size %zd\n", min, thisoffset, thissize);
+		LOG("File %d offset %llu size %zd\n", min, (unsigned long long)thisoffset, thissize);
 
-		/* Read next block - we may span into next VOB if we read over the end */
-		lseek(private->vts[min].fd, thisoffset, SEEK_SET);
-		rc = read(private->vts[min].fd, buf, thissize);
+		/* Read next block via the queue for its device - we may span into
+		 * next VOB if we read over the end */
+		rc = dvdwrap_ioq_read(private->vts[min].ioq, private->vts[min].fd,
+			buf, thissize, thisoffset, backend->class);
 		if (rc < 0) {
 			/* Read error */
 			return rc;
 		}
+		if (rc == 0) {
+			/* VOB shorter than when it was opened */
+			break;
+		}
 
 		/* Adjust pointers and repeat read if we need more data */
 		buf += rc;
@@ -370,51 +539,459 @@ static int dvdwrap_read(const char *path, char *buf, size_t size, off_t offset,
 	return total;
 }
 
+/*!
+ * Reads part of an output file through the SSD tier if the title is
+ * cached there, otherwise from its VOBs.  Arguments as for
+ * dvdwrap_backend_read.
+ */
+static ssize_t dvdwrap_tier_read(void *arg, char *buf, size_t size, uint64_t offset)
+{
+	dvdwrap_backend_t *backend = (dvdwrap_backend_t*)arg;
+
+	if (backend->fh->ssd) {
+		return dvdwrap_ssd_read(&backend->ctx->ssd, backend->fh->ssd, buf, size, offset,
+			dvdwrap_backend_read, arg);
+	}
+	return dvdwrap_backend_read(arg, buf, size, offset);
+}
+
+/*!
+ * Reads part of an output file through the block cache, if enabled.
+ * Arguments as for dvdwrap_backend_read.
+ */
+static ssize_t dvdwrap_cached_read(void *arg, char *buf, size_t size, uint64_t offset)
+{
+	dvdwrap_backend_t *backend = (dvdwrap_backend_t*)arg;
+	dvdwrap_ctx_t *ctx = backend->ctx;
+
+	if (ctx->cache_conf.size) {
+		return dvdwrap_cache_read(&ctx->cache, backend->fh->title_id, backend->fh->total_size,
+			buf, size, offset, dvdwrap_tier_read, arg);
+	}
+	return dvdwrap_tier_read(arg, buf, size, offset);
+}
+
+/*!
+ * Refills a playback stream's spin-down buffer.  Runs on the buffer's
+ * own thread, and bypasses the block cache so one long read doesn't
+ * flush it.
+ *
+ * \param arg		Handle being played
+ */
+static ssize_t dvdwrap_spin_fill(void *arg, char *buf, size_t size, uint64_t offset)
+{
+	dvdwrap_fh_t *private = (dvdwrap_fh_t*)arg;
+	dvdwrap_backend_t backend;
+
+	backend.ctx = private->ctx;
+	backend.fh = private;
+	backend.class = SCHED_PLAYBACK;
+	backend.sequential = 1;
+	return dvdwrap_tier_read(&backend, buf, size, offset);
+}
+
+/*!
+ * Reads the head and tail of a title to be pinned.  Runs on the pin
+ * loader thread.
+ *
+ * \param arg		Mount context
+ * \param entry		Title to load
+ * \return			0 or -errno
+ */
+static int dvdwrap_pin_fetch(void *arg, dvdwrap_pin_entry_t *entry)
+{
+	dvdwrap_ctx_t *ctx = (dvdwrap_ctx_t*)arg;
+	dvdwrap_fh_t *private;
+	dvdwrap_backend_t backend;
+	int rc;
+
+	rc = dvdwrap_open_title(ctx, entry->path, 1, &private);
+	if (rc < 0) {
+		return rc;
+	}
+	if (private->total_size != entry->total_size || private->mtime != entry->mtime) {
+		/* Changed since it was queued */
+		rc = -ESTALE;
+	} else {
+		rc = dvdwrap_pin_alloc(&ctx->pin, entry);
+	}
+	if (rc == 0) {
+		/* Background work - keep out of the way of playback */
+		backend.ctx = ctx;
+		backend.fh = private;
+		backend.class = SCHED_BULK;
+		backend.sequential = 1;
+		if (dvdwrap_tier_read(&backend, entry->head, entry->head_len, 0) !=
+					(ssize_t)entry->head_len ||
+				dvdwrap_tier_read(&backend, entry->tail, entry->tail_len, entry->tail_offset) !=
+					(ssize_t)entry->tail_len) {
+			rc = -EIO;
+		}
+	}
+	dvdwrap_close_title(private);
+	return rc;
+}
+
+/*! Asks the kernel to start reading part of an output file ahead */
+static void dvdwrap_fh_advise(dvdwrap_fh_t *private, uint64_t offset, uint64_t size)
+{
+	while (size) {
+		uint64_t thisoffset, thissize;
+		int min;
+
+		min = dvdwrap_fh_locate(private, offset, &thisoffset);
+		if (min == MAX_VTS_MIN) {
+			break;
+		}
+		thissize = private->vts[min].size - thisoffset;
+		if (thissize > size) {
+			thissize = size;
+		}
+		posix_fadvise(private->vts[min].fd, thisoffset, thissize, POSIX_FADV_WILLNEED);
+		offset += thissize;
+		size -= thissize;
+	}
+}
+
+/*!
+ * Loads blocks of a title from the last hot set back into the block
+ * cache.  Runs on the warm thread.
+ *
+ * \param arg		Mount context
+ * \return			Number of blocks loaded
+ */
+static unsigned int dvdwrap_warm_title(void *arg, dvdwrap_warm_t *warm, const char *path,
+	uint64_t total_size, time_t mtime, const dvdwrap_warm_run_t *runs, unsigned int nruns)
+{
+	dvdwrap_ctx_t *ctx = (dvdwrap_ctx_t*)arg;
+	dvdwrap_fh_t *private;
+	dvdwrap_title_t *title;
+	dvdwrap_backend_t backend;
+	unsigned int n, loaded = 0;
+	uint64_t index;
+	char *buf;
+
+	if (dvdwrap_open_title(ctx, path, 1, &private) < 0) {
+		return 0;
+	}
+	if (private->total_size != total_size || private->mtime != mtime) {
+		/* Changed while unmounted */
+		dvdwrap_close_title(private);
+		return 0;
+	}
+	title = dvdwrap_title_get(&ctx->titles, path, total_size, mtime, 0);
+	buf = (char*)malloc(CACHE_BLOCK_SIZE);
+	if (title && buf) {
+		/* Let the kernel fetch everything at once, then copy it in */
+		for (n = 0; n < nruns; n++) {
+			dvdwrap_fh_advise(private, runs[n].start * CACHE_BLOCK_SIZE,
+				(uint64_t)runs[n].count * CACHE_BLOCK_SIZE);
+		}
+		backend.ctx = ctx;
+		backend.fh = private;
+		backend.class = SCHED_BULK;
+		backend.sequential = 1;
+		for (n = 0; n < nruns && !warm->abort; n++) {
+			for (index = runs[n].start; index < runs[n].start + runs[n].count &&
+					index * CACHE_BLOCK_SIZE < total_size && !warm->abort; index++) {
+				if (dvdwrap_cache_read(&ctx->cache, title->id, total_size, buf,
+						CACHE_BLOCK_SIZE, index * CACHE_BLOCK_SIZE,
+						dvdwrap_tier_read, &backend) <= 0) {
+					break;
+				}
+				loaded++;
+			}
+		}
+	}
+	free(buf);
+	dvdwrap_close_title(private);
+	return loaded;
+}
+
+static int dvdwrap_read(const char *path, char *buf, size_t size, off_t offset,
+	struct fuse_file_info *fi)
+{
+	dvdwrap_ctx_t *ctx = PRIVATE;
+	dvdwrap_fh_t *private = (dvdwrap_fh_t*)fi->fh;
+	dvdwrap_backend_t backend;
+	uint64_t expected;
+	ssize_t rc = 0;
+
+	LOG("%s(%s, %p, %zd, %zd, %p)\n", __FUNCTION__, path, buf, size, offset, fi);
+
+	if (FH_TYPE(fi) == DVDWRAP_FH_VFILE) {
+		return dvdwrap_vfile_read(fi, buf, size, offset);
+	}
+	dvdwrap_warm_foreground(&ctx->warm);
+
+	/* Initial sanity check */
+	if (offset >= private->total_size) {
+		/* EOF */
+		return 0;
+	}
+
+	/* Classify this handle so the device queues can prioritise it */
+	backend.ctx = ctx;
+	backend.fh = private;
+	pthread_mutex_lock(&private->lock);
+	expected = private->stream.next_offset;
+	dvdwrap_sched_classify(&ctx->sched_conf, &private->stream, offset, size);
+	backend.class = private->stream.class;
+	backend.sequential = private->stream.seq_run > 0;
+	pthread_mutex_unlock(&private->lock);
+
+	if (private->pin) {
+		/* Start of playback and probes for headers or duration */
+		rc = dvdwrap_pin_read(&ctx->pin, private->pin, private->total_size,
+			buf, size, offset);
+	}
+	if (rc <= 0) {
+		if (private->spin.spin && backend.class == SCHED_PLAYBACK) {
+			rc = dvdwrap_spin_read(&private->spin, buf, size, offset,
+				dvdwrap_cached_read, &backend);
+		} else {
+			rc = dvdwrap_cached_read(&backend, buf, size, offset);
+		}
+	}
+	if (rc > 0 && private->heat) {
+		dvdwrap_heat_record(private->heat, offset, rc, expected);
+	}
+	return rc;
+}
+
+/*! Only the writable virtual files accept writes */
+static int dvdwrap_write(const char *path, const char *buf, size_t size, off_t offset,
+	struct fuse_file_info *fi)
+{
+	LOG("%s(%s, %p, %zd, %zd, %p)\n", __FUNCTION__, path, buf, size, offset, fi);
+
+	if (FH_TYPE(fi) == DVDWRAP_FH_VFILE) {
+		return dvdwrap_vfile_write(PRIVATE, fi, buf, size, offset);
+	}
+	return -EBADF;
+}
+
+static int dvdwrap_truncate(const char *path, off_t size)
+{
+	LOG("%s(%s, %zd)\n", __FUNCTION__, path, size);
+
+	if (dvdwrap_vfile_match(path)) {
+		return dvdwrap_vfile_truncate(path);
+	}
+	return -EROFS;
+}
+
+/*! Settings written to a virtual file are applied when it is closed */
+static int dvdwrap_flush(const char *path, struct fuse_file_info *fi)
+{
+	LOG("%s(%s, %p)\n", __FUNCTION__, path, fi);
+
+	if (FH_TYPE(fi) == DVDWRAP_FH_VFILE) {
+		return dvdwrap_vfile_flush(PRIVATE, fi);
+	}
+	return 0;
+}
+
 static int dvdwrap_release(const char* path, struct fuse_file_info *fi)
 {
 	dvdwrap_fh_t *private = (dvdwrap_fh_t*)fi->fh;
-	int min;
 
 	LOG("%s(%s, %p)\n", __FUNCTION__, path, fi);
 
-	/* Close files and release private data */
-	for (min = 1; min < MAX_VTS_MIN; min++) {
-		if (private->vts[min].size) {
-			LOG("Closing VTS %d (fd = %d)\n", min, private->vts[min].fd);
-			close(private->vts[min].fd);
-		}
+	if (FH_TYPE(fi) == DVDWRAP_FH_VFILE) {
+		dvdwrap_vfile_release(fi);
+		return 0;
 	}
-	free(private);
+
+	/* Close files and release private data */
+	dvdwrap_close_title(private);
 	fi->fh = 0;
 
-	return -ENOENT;
+	return 0;
 }
 
-/* Main */
+static void* dvdwrap_init(struct fuse_conn_info *conn)
+{
+	dvdwrap_ctx_t *ctx = PRIVATE;
+
+	LOG("%s(%p)\n", __FUNCTION__, conn);
 
-int main(int argc, char **argv)
+	/* Background threads are started here rather than in main, as fuse
+	 * forks when it daemonises */
+	if (ctx->pin_conf.size && dvdwrap_pin_start(&ctx->pin, dvdwrap_pin_fetch, ctx) < 0) {
+		fprintf(stderr, "Failed to start pin loader\n");
+	}
+	if (dvdwrap_mem_start(&ctx->mem) < 0) {
+		fprintf(stderr, "Failed to start memory monitor\n");
+	}
+	if (dvdwrap_ioq_watch_start(&ctx->ioqs) < 0) {
+		fprintf(stderr, "Failed to start I/O watchdog\n");
+	}
+	if (dvdwrap_index_start(&ctx->index) < 0) {
+		fprintf(stderr, "Failed to start library indexer\n");
+	}
+	if (dvdwrap_trace_start(ctx->trace_file, ctx->warm_conf.dir) < 0) {
+		fprintf(stderr, "Failed to start trace dumps\n");
+	}
+	if (ctx->warm_conf.dir && ctx->cache_conf.size &&
+			dvdwrap_warm_start(&ctx->warm, dvdwrap_warm_title, ctx) < 0) {
+		fprintf(stderr, "Failed to start cache warming\n");
+	}
+	return ctx;
+}
+
+static void dvdwrap_destroy(void *private_data)
 {
-	dvdwrap_ctx_t *ctx;
-	int n;
+	dvdwrap_ctx_t *ctx = (dvdwrap_ctx_t*)private_data;
+
+	LOG("%s(%p)\n", __FUNCTION__, private_data);
 
-	if (argc < 3) {
-		fprintf(stderr,"Usage: %s <source> <mount point> [options]\n\n", argv[0]);
-		return 1;
+	dvdwrap_trace_stop();
+	dvdwrap_mem_destroy(&ctx->mem);
+	dvdwrap_index_destroy(&ctx->index);
+	dvdwrap_warm_stop(&ctx->warm);
+	if (ctx->warm_conf.dir && ctx->cache_conf.size) {
+		dvdwrap_warm_save(&ctx->warm, &ctx->cache, &ctx->titles);
+	}
+	dvdwrap_heat_save(&ctx->heat);
+	dvdwrap_heat_destroy(&ctx->heat);
+	if (ctx->pin_conf.size) {
+		dvdwrap_pin_destroy(&ctx->pin);
+	}
+	dvdwrap_ioq_watch_stop(&ctx->ioqs);
+	dvdwrap_ioq_set_destroy(&ctx->ioqs);
+	dvdwrap_client_destroy(&ctx->clients);
+	if (ctx->ssd_conf.dir) {
+		dvdwrap_ssd_destroy(&ctx->ssd);
 	}
+	if (ctx->cache_conf.size) {
+		dvdwrap_cache_destroy(&ctx->cache);
+	}
+	dvdwrap_spin_destroy(&ctx->spin);
+	dvdwrap_title_set_destroy(&ctx->titles);
+}
+
+/* Memory budget callbacks */
+
+static void dvdwrap_mem_cache_limit(void *arg, uint64_t limit)
+{
+	dvdwrap_cache_set_capacity((dvdwrap_cache_t*)arg, limit);
+}
+
+static void dvdwrap_mem_spin_limit(void *arg, uint64_t limit)
+{
+	dvdwrap_spin_set_capacity((dvdwrap_spin_t*)arg, limit);
+}
+
+static void dvdwrap_mem_pin_limit(void *arg, uint64_t limit)
+{
+	dvdwrap_pin_set_capacity((dvdwrap_pin_t*)arg, limit);
+}
+
+/* Setup */
+
+/*!
+ * Allocates a context with every setting at its default.
+ *
+ * \return			New context, or NULL if out of memory
+ */
+dvdwrap_ctx_t* dvdwrap_ctx_new(void)
+{
+	dvdwrap_ctx_t *ctx;
 
-	/* Allocate context */
-	ctx = (dvdwrap_ctx_t*)malloc(sizeof(dvdwrap_ctx_t));
+	ctx = (dvdwrap_ctx_t*)calloc(1, sizeof(dvdwrap_ctx_t));
 	if (ctx == NULL) {
-		fprintf(stderr, "Failed to allocate private data\n");
-		return 1;
+		return NULL;
 	}
-	ctx->sourcepath = realpath(argv[1], NULL);
-	LOG("sourcepath = %s\n", ctx->sourcepath);
-	for (n = 1; n < argc - 1; n++)
-		argv[n] = argv[n + 1];
-	argc--;
-
-	return fuse_main(argc, argv, &dvdwrap_oper, ctx);
+	ctx->sched_conf.slots = DEFAULT_SCHED_SLOTS;
+	ctx->sched_conf.share = DEFAULT_SCHED_SHARE;
+	ctx->sched_conf.deadline = DEFAULT_SCHED_DEADLINE;
+	ctx->sched_conf.probe_deadline = DEFAULT_PROBE_DEADLINE;
+	ctx->sched_conf.playback_rate = DEFAULT_PLAYBACK_RATE;
+	ctx->ioq_conf.depth = DEFAULT_IOQ_DEPTH;
+	ctx->ioq_conf.stall = DEFAULT_IOQ_STALL;
+	ctx->chunk_conf.depth = DEFAULT_CHUNK_DEPTH;
+	ctx->cache_conf.size = DEFAULT_CACHE_SIZE;
+	ctx->ssd_conf.size = DEFAULT_SSD_SIZE;
+	ctx->ssd_conf.admit = DEFAULT_SSD_ADMIT;
+	ctx->spin_conf.size = DEFAULT_SPIN_SIZE;
+	ctx->spin_conf.total = DEFAULT_SPIN_TOTAL;
+	ctx->spin_conf.spinup = DEFAULT_SPIN_UP;
+	ctx->pin_conf.size = DEFAULT_PIN_SIZE;
+	ctx->pin_conf.head = DEFAULT_PIN_HEAD;
+	ctx->pin_conf.tail = DEFAULT_PIN_TAIL;
+	ctx->mem_conf.interval = DEFAULT_MEM_INTERVAL;
+	ctx->mem_conf.min = DEFAULT_MEM_MIN;
+	ctx->mem_conf.pressure = DEFAULT_MEM_PRESSURE;
+	ctx->index_conf.threads = DEFAULT_INDEX_THREADS;
+	ctx->index_conf.ttl = DEFAULT_INDEX_TTL;
+	ctx->index_conf.recheck = DEFAULT_INDEX_RECHECK;
+	ctx->index_conf.speculate = DEFAULT_INDEX_SPECULATE;
+	ctx->client_conf.expire = DEFAULT_CLIENT_EXPIRE;
+	ctx->log_level = DEFAULT_LOG_LEVEL;
+	return ctx;
 }
 
+/*!
+ * Checks the settings of a context and sets up everything the fuse
+ * operations need.  Directories named by options must already be absolute.
+ *
+ * \param ctx		Context with sourcepath and options filled in
+ * \return			0, or -1 with a message on stderr
+ */
+int dvdwrap_ctx_setup(dvdwrap_ctx_t *ctx)
+{
+	dvdwrap_log_level = ctx->log_level;
+	LOG("sourcepath = %s\n", ctx->sourcepath);
+	if (ctx->sched_conf.slots == 0) {
+		ctx->sched_conf.slots = 1;
+	}
+	if (ctx->sched_conf.share > 100) {
+		ctx->sched_conf.share = 100;
+	}
+	if (ctx->ioq_conf.depth == 0) {
+		ctx->ioq_conf.depth = 1;
+	}
+	if (ctx->chunk_conf.depth > CHUNK_MAX_DEPTH) {
+		ctx->chunk_conf.depth = CHUNK_MAX_DEPTH;
+	}
+	dvdwrap_ioq_set_init(&ctx->ioqs, &ctx->ioq_conf, &ctx->sched_conf);
+	dvdwrap_spin_init(&ctx->spin, &ctx->spin_conf, ctx->sched_conf.playback_rate);
+	dvdwrap_client_init(&ctx->clients, &ctx->client_conf);
+	if (dvdwrap_title_set_init(&ctx->titles) < 0 ||
+			dvdwrap_index_init(&ctx->index, &ctx->index_conf, ctx->sourcepath) < 0 ||
+			(ctx->cache_conf.size && dvdwrap_cache_init(&ctx->cache, &ctx->cache_conf) < 0)) {
+		fprintf(stderr, "Failed to allocate caches\n");
+		return -1;
+	}
+	if (ctx->ssd_conf.dir && dvdwrap_ssd_init(&ctx->ssd, &ctx->ssd_conf) < 0) {
+		fprintf(stderr, "Bad SSD cache directory %s\n", ctx->ssd_conf.dir);
+		return -1;
+	}
+	dvdwrap_warm_init(&ctx->warm, &ctx->warm_conf);
+	dvdwrap_heat_init(&ctx->heat, ctx->warm_conf.dir);
+	ctx->pin_conf.dir = ctx->ssd_conf.dir;
+	if (ctx->pin_conf.size && dvdwrap_pin_init(&ctx->pin, &ctx->pin_conf) < 0) {
+		fprintf(stderr, "Failed to allocate caches\n");
+		return -1;
+	}
 
+	/* Let the in-memory caches shrink when memory is short */
+	if (ctx->mem_conf.min > 100) {
+		ctx->mem_conf.min = 100;
+	}
+	dvdwrap_mem_init(&ctx->mem, &ctx->mem_conf);
+	if (ctx->cache_conf.size) {
+		dvdwrap_mem_register(&ctx->mem, "cache", ctx->cache.capacity,
+			dvdwrap_mem_cache_limit, &ctx->cache);
+	}
+	if (ctx->spin_conf.size) {
+		dvdwrap_mem_register(&ctx->mem, "spindown", ctx->spin.capacity,
+			dvdwrap_mem_spin_limit, &ctx->spin);
+	}
+	if (ctx->pin_conf.size) {
+		dvdwrap_mem_register(&ctx->mem, "pinned", ctx->pin.capacity,
+			dvdwrap_mem_pin_limit, &ctx->pin);
+	}
+	return 0;
+}
@@ -24,13 +24,183 @@
 #define _DVDWRAP_FUSE_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 #include <fuse.h>
 
+#include "dvdwrap_sched.h"
+#include "dvdwrap_ioq.h"
+#include "dvdwrap_buf.h"
+#include "dvdwrap_chunk.h"
+#include "dvdwrap_title.h"
+#include "dvdwrap_cache.h"
+#include "dvdwrap_ssd.h"
+#include "dvdwrap_spin.h"
+#include "dvdwrap_pin.h"
+#include "dvdwrap_mem.h"
+#include "dvdwrap_warm.h"
+#include "dvdwrap_index.h"
+#include "dvdwrap_stats.h"
+#include "dvdwrap_trace.h"
+#include "dvdwrap_client.h"
+#include "dvdwrap_heat.h"
+
+/* Option defaults */
+#define DEFAULT_SCHED_SLOTS		4
+#define DEFAULT_SCHED_SHARE		75
+#define DEFAULT_SCHED_DEADLINE	100
+#define DEFAULT_PROBE_DEADLINE	500
+#define DEFAULT_PLAYBACK_RATE	4096
+#define DEFAULT_IOQ_DEPTH		16
+#define DEFAULT_IOQ_STALL		5000
+#define DEFAULT_CHUNK_DEPTH		4
+#define DEFAULT_CACHE_SIZE		0
+#define DEFAULT_SSD_SIZE		4096
+#define DEFAULT_SSD_ADMIT		1
+#define DEFAULT_SPIN_SIZE		0
+#define DEFAULT_SPIN_TOTAL		256
+#define DEFAULT_SPIN_UP			10
+#define DEFAULT_PIN_SIZE		0
+#define DEFAULT_PIN_HEAD		1024
+#define DEFAULT_PIN_TAIL		256
+#define DEFAULT_MEM_INTERVAL	5
+#define DEFAULT_MEM_MIN			25
+#define DEFAULT_MEM_PRESSURE	10
+#define DEFAULT_INDEX_THREADS	0
+#define DEFAULT_INDEX_TTL		600
+#define DEFAULT_INDEX_RECHECK	5
+#define DEFAULT_INDEX_SPECULATE	256
+#define DEFAULT_CLIENT_EXPIRE	300
+#define DEFAULT_LOG_LEVEL		1
+
 #define PRIVATE		((dvdwrap_ctx_t*)fuse_get_context()->private_data)
 
+#define MAX_VTS_MIN		10
+#define MAX_VTS_MAJ		100
+
+/* Messages go to the trace ring, and in DEBUG builds to stderr as well */
+#ifdef DEBUG
+#define LOG(a,...)		do { if (dvdwrap_log_level) { \
+	dvdwrap_trace(__FILE__ "(%d): " a, __LINE__, ##__VA_ARGS__); \
+	fprintf(stderr, __FILE__ "(%d): " a, __LINE__, ##__VA_ARGS__); } } while (0)
+#else
+#define LOG(a,...)		do { if (dvdwrap_log_level) \
+	dvdwrap_trace(__FILE__ "(%d): " a, __LINE__, ##__VA_ARGS__); } while (0)
+#endif
+
+/*! Debug logging on or off */
+extern unsigned int dvdwrap_log_level;
+
+/*! Distinguishes the structures hung off fuse_file_info::fh */
+typedef enum {
+	DVDWRAP_FH_TITLE = 1,
+	DVDWRAP_FH_VFILE,
+} dvdwrap_fh_type_t;
+
+#define FH_TYPE(fi)		(*(dvdwrap_fh_type_t*)(uintptr_t)(fi)->fh)
+
+/*! Private data held per input file */
 typedef struct {
+	int				fd;
+	uint64_t		size;
+	dvdwrap_ioq_t	*ioq;	/*!< Queue for the device holding this VOB */
+} dvdwrap_vts_t;
+
+struct dvdwrap_ctx;
+
+/*! Private data held per output file */
+typedef struct dvdwrap_fh {
+	dvdwrap_fh_type_t	type;	/*!< Must be first */
+	struct dvdwrap_ctx	*ctx;	/*!< For threads outside a fuse call */
+	dvdwrap_vts_t	vts[MAX_VTS_MIN];
+	uint64_t		total_size;
+	time_t			mtime;		/*!< Newest VOB modification time */
+	dvdwrap_title_t	*title;
+	uint32_t		title_id;	/*!< Title id when opened */
+	dvdwrap_ssd_entry_t	*ssd;	/*!< SSD tier entry, or NULL */
+	dvdwrap_pin_entry_t	*pin;	/*!< Pinned head and tail, or NULL */
+	dvdwrap_heat_profile_t	*heat;	/*!< Read profile, or NULL */
+
+	pthread_mutex_t			lock;
+	dvdwrap_sched_stream_t	stream;
+	dvdwrap_chunk_state_t	chunks;
+	dvdwrap_spin_state_t	spin;
+} dvdwrap_fh_t;
+
+typedef struct dvdwrap_ctx {
 	const char *sourcepath;
+
+	dvdwrap_sched_conf_t	sched_conf;
+	dvdwrap_ioq_conf_t		ioq_conf;
+	dvdwrap_ioq_set_t		ioqs;
+	dvdwrap_chunk_conf_t	chunk_conf;
+	dvdwrap_cache_conf_t	cache_conf;
+	dvdwrap_cache_t			cache;
+	dvdwrap_title_set_t		titles;
+	dvdwrap_ssd_conf_t		ssd_conf;
+	dvdwrap_ssd_t			ssd;
+	dvdwrap_spin_conf_t		spin_conf;
+	dvdwrap_spin_t			spin;
+	dvdwrap_pin_conf_t		pin_conf;
+	dvdwrap_pin_t			pin;
+	dvdwrap_mem_conf_t		mem_conf;
+	dvdwrap_mem_t			mem;
+	dvdwrap_warm_conf_t		warm_conf;
+	dvdwrap_warm_t			warm;
+	dvdwrap_index_conf_t	index_conf;
+	dvdwrap_index_t			index;
+	dvdwrap_client_conf_t	client_conf;
+	dvdwrap_clients_t		clients;
+	dvdwrap_heat_t			heat;
+	unsigned int			log_level;
+	char					*trace_file;	/*!< Dump written on SIGUSR1 */
 } dvdwrap_ctx_t;
 
+/*! Monotonic clock in milliseconds */
+static inline uint64_t dvdwrap_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*! Monotonic clock in microseconds */
+static inline uint64_t dvdwrap_now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*!
+ * Maps an offset in an output file to the VOB holding it.
+ *
+ * \param fh			Open output file
+ * \param offset		Offset within the output file
+ * \param vob_offset	Returns the offset within the VOB
+ * \return				VOB index, or MAX_VTS_MIN if beyond the end
+ */
+static inline int dvdwrap_fh_locate(const dvdwrap_fh_t *fh, uint64_t offset,
+	uint64_t *vob_offset)
+{
+	int min;
+
+	for (min = 1; min < MAX_VTS_MIN; min++) {
+		if (offset < fh->vts[min].size) {
+			break;
+		}
+		offset -= fh->vts[min].size;
+	}
+	*vob_offset = offset;
+	return min;
+}
+
+/*! The fuse operations, driven by fuse_main or directly by a benchmark */
+extern const struct fuse_operations dvdwrap_oper;
+
+dvdwrap_ctx_t* dvdwrap_ctx_new(void);
+int dvdwrap_ctx_setup(dvdwrap_ctx_t *ctx);
+
 #endif
 
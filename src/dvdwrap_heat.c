@@ -0,0 +1,454 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Read heatmaps.  Each title read keeps a profile of which parts of it
+ * are read - bytes per 1/64th slice - and how: reads that carry on from
+ * the last one on the same handle, small jumps such as readahead arriving
+ * out of order, and real seeks with their distances.  Profiles build up
+ * over every mount, being saved in the state directory at unmount, and
+ * .dvdwrap/heat shows the busiest titles.
+ *
+ * The file is text, with the most recently read titles first:
+ *   DVDWHEAT1
+ *   T <size> <mtime> <last read> <path>
+ *   B <HEAT_BUCKETS bytes counts>
+ *   S <reads> <sequential> <near> <random> <forward>
+ *   D <HEAT_SEEKS seek counts>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "dvdwrap_fuse.h"
+#include "dvdwrap_heat.h"
+
+#define HEAT_MAGIC		"DVDWHEAT1"
+#define HEAT_FILE		"heat"
+
+/*! Finds the profile for a path.  Called with the lock held. */
+static dvdwrap_heat_profile_t** dvdwrap_heat_find(dvdwrap_heat_t *heat, const char *path)
+{
+	dvdwrap_heat_profile_t **p = &heat->hash[dvdwrap_hash_string(path) & (HEAT_HASH - 1)];
+
+	while (*p && strcmp((*p)->path, path) != 0) {
+		p = &(*p)->next;
+	}
+	return p;
+}
+
+/*! Adds a profile, replacing any for an older version of the title.
+ * Called with the lock held. */
+static dvdwrap_heat_profile_t* dvdwrap_heat_add(dvdwrap_heat_t *heat, const char *path,
+	uint64_t total_size, time_t mtime)
+{
+	dvdwrap_heat_profile_t **p = dvdwrap_heat_find(heat, path);
+	dvdwrap_heat_profile_t *profile = *p;
+
+	if (profile) {
+		if (profile->total_size == total_size && profile->mtime == mtime) {
+			return profile;
+		}
+
+		/* The content has changed, so start again.  Open handles may
+		 * still point at the old profile, so it is cleared rather than
+		 * freed. */
+		memset(profile->bytes, 0, sizeof(profile->bytes));
+		memset(profile->seeks, 0, sizeof(profile->seeks));
+		profile->reads = profile->sequential = profile->near = 0;
+		profile->random = profile->forward = 0;
+		profile->total_size = total_size;
+		profile->mtime = mtime;
+		return profile;
+	}
+
+	profile = (dvdwrap_heat_profile_t*)calloc(1, sizeof(dvdwrap_heat_profile_t));
+	if (profile == NULL) {
+		return NULL;
+	}
+	profile->path = strdup(path);
+	if (profile->path == NULL) {
+		free(profile);
+		return NULL;
+	}
+	profile->total_size = total_size;
+	profile->mtime = mtime;
+	*p = profile;
+	heat->count++;
+	return profile;
+}
+
+/*! Loads the profiles saved at the last unmount */
+static void dvdwrap_heat_load(dvdwrap_heat_t *heat)
+{
+	dvdwrap_heat_profile_t *profile = NULL;
+	char name[PATH_MAX], line[PATH_MAX + 64];
+	FILE *f;
+
+	snprintf(name, PATH_MAX, "%s/" HEAT_FILE, heat->dir);
+	f = fopen(name, "r");
+	if (f == NULL) {
+		return;
+	}
+	if (fgets(line, sizeof(line), f) == NULL || strcmp(line, HEAT_MAGIC "\n") != 0) {
+		fclose(f);
+		return;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		unsigned long long total_size, v;
+		long long mtime, last_read;
+		char *p, *end;
+		int pos, n;
+
+		if (sscanf(line, "T %llu %lld %lld %n", &total_size, &mtime, &last_read, &pos) == 3) {
+			line[strcspn(line, "\n")] = '\0';
+			profile = dvdwrap_heat_add(heat, line + pos, total_size, (time_t)mtime);
+			if (profile) {
+				profile->last_read = (time_t)last_read;
+				heat->loaded++;
+			}
+		} else if (profile && line[0] == 'B') {
+			for (p = line + 1, n = 0; n < HEAT_BUCKETS; n++, p = end) {
+				v = strtoull(p, &end, 10);
+				if (end == p) {
+					break;
+				}
+				profile->bytes[n] = v;
+			}
+		} else if (profile && line[0] == 'D') {
+			for (p = line + 1, n = 0; n < HEAT_SEEKS; n++, p = end) {
+				v = strtoull(p, &end, 10);
+				if (end == p) {
+					break;
+				}
+				profile->seeks[n] = v;
+			}
+		} else if (profile) {
+			unsigned long long reads, sequential, near, random, forward;
+
+			if (sscanf(line, "S %llu %llu %llu %llu %llu", &reads, &sequential, &near,
+					&random, &forward) == 5) {
+				profile->reads = reads;
+				profile->sequential = sequential;
+				profile->near = near;
+				profile->random = random;
+				profile->forward = forward;
+			}
+		}
+	}
+	fclose(f);
+	LOG("Loaded %u read profiles\n", heat->loaded);
+}
+
+/*!
+ * Sets up the profile table, loading saved profiles.
+ *
+ * \param heat		Table
+ * \param dir		State directory to save profiles in, or NULL
+ */
+void dvdwrap_heat_init(dvdwrap_heat_t *heat, const char *dir)
+{
+	memset(heat, 0, sizeof(dvdwrap_heat_t));
+	heat->dir = dir;
+	pthread_mutex_init(&heat->lock, NULL);
+	if (dir) {
+		dvdwrap_heat_load(heat);
+	}
+}
+
+void dvdwrap_heat_destroy(dvdwrap_heat_t *heat)
+{
+	dvdwrap_heat_profile_t *profile, *next;
+	unsigned int n;
+
+	for (n = 0; n < HEAT_HASH; n++) {
+		for (profile = heat->hash[n]; profile; profile = next) {
+			next = profile->next;
+			free(profile->path);
+			free(profile);
+		}
+		heat->hash[n] = NULL;
+	}
+	heat->count = 0;
+	pthread_mutex_destroy(&heat->lock);
+}
+
+/*!
+ * Finds or creates the profile of a title being opened.
+ *
+ * \return			Profile, valid until the table is destroyed, or NULL
+ *					if out of memory
+ */
+dvdwrap_heat_profile_t* dvdwrap_heat_open(dvdwrap_heat_t *heat, const char *path,
+	uint64_t total_size, time_t mtime)
+{
+	dvdwrap_heat_profile_t *profile;
+
+	pthread_mutex_lock(&heat->lock);
+	profile = dvdwrap_heat_add(heat, path, total_size, mtime);
+	pthread_mutex_unlock(&heat->lock);
+	return profile;
+}
+
+/*!
+ * Records a read.
+ *
+ * \param profile	Title's profile
+ * \param offset	Where the read started
+ * \param size		Bytes read
+ * \param expected	Where the last read on the same handle ended
+ */
+void dvdwrap_heat_record(dvdwrap_heat_profile_t *profile, uint64_t offset, size_t size,
+	uint64_t expected)
+{
+	uint64_t total = profile->total_size;
+	uint64_t end = offset + size;
+	uint64_t distance;
+
+	/* Share the bytes between the slices the read covers */
+	while (offset < end && offset < total) {
+		unsigned int bucket = (unsigned int)(offset * HEAT_BUCKETS / total);
+		uint64_t limit = ((uint64_t)(bucket + 1) * total + HEAT_BUCKETS - 1) / HEAT_BUCKETS;
+		uint64_t n = (end < limit ? end : limit) - offset;
+
+		if (n == 0) {
+			n = 1;	/* Rounding at a slice boundary */
+		}
+		__sync_fetch_and_add(&profile->bytes[bucket], n);
+		offset += n;
+	}
+	offset = end - size;
+
+	__sync_fetch_and_add(&profile->reads, 1);
+	profile->last_read = time(NULL);
+	if (offset == expected) {
+		__sync_fetch_and_add(&profile->sequential, 1);
+		return;
+	}
+	distance = offset > expected ? offset - expected : expected - offset;
+	if (distance <= HEAT_NEAR) {
+		__sync_fetch_and_add(&profile->near, 1);
+		return;
+	}
+	__sync_fetch_and_add(&profile->random, 1);
+	if (offset > expected) {
+		__sync_fetch_and_add(&profile->forward, 1);
+	}
+	distance >>= 20;
+	distance = distance ? 63 - __builtin_clzll(distance) : 0;
+	__sync_fetch_and_add(&profile->seeks[distance < HEAT_SEEKS ? distance : HEAT_SEEKS - 1], 1);
+}
+
+/*! Lists every profile, copied so counters don't change while in use.
+ * Returns the number listed. */
+static unsigned int dvdwrap_heat_list(dvdwrap_heat_t *heat, dvdwrap_heat_profile_t **list)
+{
+	dvdwrap_heat_profile_t *profile;
+	unsigned int count = 0, n;
+
+	pthread_mutex_lock(&heat->lock);
+	*list = (dvdwrap_heat_profile_t*)malloc((heat->count + 1) * sizeof(dvdwrap_heat_profile_t));
+	if (*list) {
+		for (n = 0; n < HEAT_HASH; n++) {
+			for (profile = heat->hash[n]; profile; profile = profile->next) {
+				(*list)[count] = *profile;
+				(*list)[count].path = strdup(profile->path);
+				if ((*list)[count].path) {
+					count++;
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&heat->lock);
+	return count;
+}
+
+static void dvdwrap_heat_free_list(dvdwrap_heat_profile_t *list, unsigned int count)
+{
+	unsigned int n;
+
+	for (n = 0; n < count; n++) {
+		free(list[n].path);
+	}
+	free(list);
+}
+
+static int dvdwrap_heat_cmp_recent(const void *a, const void *b)
+{
+	const dvdwrap_heat_profile_t *x = (const dvdwrap_heat_profile_t*)a;
+	const dvdwrap_heat_profile_t *y = (const dvdwrap_heat_profile_t*)b;
+
+	if (x->last_read != y->last_read) {
+		return x->last_read > y->last_read ? -1 : 1;
+	}
+	return strcmp(x->path, y->path);
+}
+
+static uint64_t dvdwrap_heat_total(const dvdwrap_heat_profile_t *profile)
+{
+	uint64_t total = 0;
+	unsigned int n;
+
+	for (n = 0; n < HEAT_BUCKETS; n++) {
+		total += profile->bytes[n];
+	}
+	return total;
+}
+
+static int dvdwrap_heat_cmp_bytes(const void *a, const void *b)
+{
+	uint64_t x = dvdwrap_heat_total((const dvdwrap_heat_profile_t*)a);
+	uint64_t y = dvdwrap_heat_total((const dvdwrap_heat_profile_t*)b);
+
+	if (x != y) {
+		return x > y ? -1 : 1;
+	}
+	return dvdwrap_heat_cmp_recent(a, b);
+}
+
+/*!
+ * Saves the profiles of titles read, most recent first, keeping up to
+ * HEAT_MAX.
+ *
+ * \return			0, or -errno
+ */
+int dvdwrap_heat_save(dvdwrap_heat_t *heat)
+{
+	dvdwrap_heat_profile_t *list;
+	char name[PATH_MAX], tmp[PATH_MAX];
+	unsigned int count, n, i;
+	FILE *f;
+	int ok;
+
+	if (heat->dir == NULL) {
+		return 0;
+	}
+	count = dvdwrap_heat_list(heat, &list);
+	if (list == NULL) {
+		return -ENOMEM;
+	}
+	qsort(list, count, sizeof(dvdwrap_heat_profile_t), dvdwrap_heat_cmp_recent);
+
+	snprintf(name, PATH_MAX, "%s/" HEAT_FILE, heat->dir);
+	snprintf(tmp, PATH_MAX, "%s/" HEAT_FILE ".tmp", heat->dir);
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		dvdwrap_heat_free_list(list, count);
+		return -errno;
+	}
+	fprintf(f, HEAT_MAGIC "\n");
+	heat->saved = 0;
+	for (n = 0; n < count && heat->saved < HEAT_MAX; n++) {
+		const dvdwrap_heat_profile_t *profile = &list[n];
+
+		if (profile->reads == 0) {
+			continue; /* Opened but never read */
+		}
+		fprintf(f, "T %llu %lld %lld %s\nB", (unsigned long long)profile->total_size,
+			(long long)profile->mtime, (long long)profile->last_read, profile->path);
+		for (i = 0; i < HEAT_BUCKETS; i++) {
+			fprintf(f, " %llu", (unsigned long long)profile->bytes[i]);
+		}
+		fprintf(f, "\nS %llu %llu %llu %llu %llu\nD", (unsigned long long)profile->reads,
+			(unsigned long long)profile->sequential, (unsigned long long)profile->near,
+			(unsigned long long)profile->random, (unsigned long long)profile->forward);
+		for (i = 0; i < HEAT_SEEKS; i++) {
+			fprintf(f, " %llu", (unsigned long long)profile->seeks[i]);
+		}
+		fprintf(f, "\n");
+		heat->saved++;
+	}
+	ok = fflush(f) == 0 && fdatasync(fileno(f)) == 0;
+	ok = fclose(f) == 0 && ok;
+	if (!ok || rename(tmp, name) < 0) {
+		unlink(tmp);
+		ok = 0;
+	}
+	LOG("Saved %u read profiles\n", heat->saved);
+	dvdwrap_heat_free_list(list, count);
+	return ok ? 0 : -EIO;
+}
+
+/*! Percentage, rounded */
+static unsigned int dvdwrap_heat_pct(uint64_t n, uint64_t total)
+{
+	return total ? (unsigned int)((n * 100 + total / 2) / total) : 0;
+}
+
+void dvdwrap_heat_report(dvdwrap_heat_t *heat, dvdwrap_buf_t *buf)
+{
+	static const char shades[] = " .:-=+*#%@";
+	dvdwrap_heat_profile_t *list;
+	unsigned int count, n, i;
+
+	count = dvdwrap_heat_list(heat, &list);
+	if (list == NULL) {
+		return;
+	}
+	qsort(list, count, sizeof(dvdwrap_heat_profile_t), dvdwrap_heat_cmp_bytes);
+
+	dvdwrap_buf_printf(buf, "dir %s\nprofiles %u\nloaded %u\n",
+		heat->dir ? heat->dir : "none", count, heat->loaded);
+	for (n = 0; n < count && n < HEAT_REPORT; n++) {
+		const dvdwrap_heat_profile_t *profile = &list[n];
+		uint64_t max = 1;
+		char map[HEAT_BUCKETS + 1];
+
+		if (profile->reads == 0) {
+			break;
+		}
+		for (i = 0; i < HEAT_BUCKETS; i++) {
+			if (profile->bytes[i] > max) {
+				max = profile->bytes[i];
+			}
+		}
+		for (i = 0; i < HEAT_BUCKETS; i++) {
+			/* Anything read at all shows */
+			map[i] = shades[profile->bytes[i] ?
+				1 + profile->bytes[i] * (sizeof(shades) - 3) / max : 0];
+		}
+		map[HEAT_BUCKETS] = '\0';
+
+		dvdwrap_buf_printf(buf, "\n%s\n"
+			"  bytes %llu reads %llu sequential %u%% near %u%% random %u%% (forward %u%%)\n"
+			"  heat |%s|\n"
+			"  seek_mib",
+			profile->path, (unsigned long long)dvdwrap_heat_total(profile),
+			(unsigned long long)profile->reads,
+			dvdwrap_heat_pct(profile->sequential, profile->reads),
+			dvdwrap_heat_pct(profile->near, profile->reads),
+			dvdwrap_heat_pct(profile->random, profile->reads),
+			dvdwrap_heat_pct(profile->forward, profile->random), map);
+		for (i = 0; i < HEAT_SEEKS; i++) {
+			if (profile->seeks[i]) {
+				dvdwrap_buf_printf(buf, " <%u:%llu", 2u << i,
+					(unsigned long long)profile->seeks[i]);
+			}
+		}
+		dvdwrap_buf_printf(buf, "\n");
+	}
+	dvdwrap_heat_free_list(list, count);
+}
@@ -0,0 +1,80 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DVDWRAP_HEAT_H
+#define _DVDWRAP_HEAT_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "dvdwrap_buf.h"
+
+#define HEAT_BUCKETS		64			/*!< Equal slices of a title */
+#define HEAT_SEEKS			16			/*!< Log2 seek distance classes, in MiB */
+#define HEAT_NEAR			(1024 * 1024)	/*!< Largest jump still counted as
+											 *   near sequential (bytes) */
+#define HEAT_HASH			1024
+#define HEAT_MAX			4096		/*!< Most profiles kept across mounts */
+#define HEAT_REPORT			50			/*!< Titles listed in .dvdwrap/heat */
+
+/*! How one title has been read, over all mounts.  Counters are updated
+ * atomically without a lock. */
+typedef struct dvdwrap_heat_profile {
+	struct dvdwrap_heat_profile	*next;	/*!< Hash chain */
+	char				*path;
+	uint64_t			total_size;
+	time_t				mtime;			/*!< Newest VOB modification time */
+	time_t				last_read;		/*!< Wall clock, for pruning */
+
+	uint64_t			bytes[HEAT_BUCKETS];	/*!< Read from each slice */
+	uint64_t			reads;
+	uint64_t			sequential;		/*!< Continuing where the last read ended */
+	uint64_t			near;			/*!< Within HEAT_NEAR of it */
+	uint64_t			random;			/*!< Seeks further than that */
+	uint64_t			forward;		/*!< Random seeks forwards */
+	uint64_t			seeks[HEAT_SEEKS];	/*!< Random seeks of < 2^(n+1) MiB */
+} dvdwrap_heat_profile_t;
+
+/*! Read heatmaps and access patterns per title, saved in the state
+ * directory */
+typedef struct {
+	const char			*dir;			/*!< State directory, or NULL */
+	pthread_mutex_t		lock;
+	dvdwrap_heat_profile_t	*hash[HEAT_HASH];
+	unsigned int		count;
+
+	/* Statistics */
+	unsigned int		loaded;
+	unsigned int		saved;
+} dvdwrap_heat_t;
+
+void dvdwrap_heat_init(dvdwrap_heat_t *heat, const char *dir);
+void dvdwrap_heat_destroy(dvdwrap_heat_t *heat);
+dvdwrap_heat_profile_t* dvdwrap_heat_open(dvdwrap_heat_t *heat, const char *path,
+	uint64_t total_size, time_t mtime);
+void dvdwrap_heat_record(dvdwrap_heat_profile_t *profile, uint64_t offset, size_t size,
+	uint64_t expected);
+int dvdwrap_heat_save(dvdwrap_heat_t *heat);
+void dvdwrap_heat_report(dvdwrap_heat_t *heat, dvdwrap_buf_t *buf);
+
+#endif
@@ -0,0 +1,991 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Library index.  Scanning a DVD image for its main feature takes a stat
+ * of every VOB, and browsing clients stat every entry of a listing, often
+ * more than once, so what each source directory holds is remembered for
+ * index_ttl seconds.  Network filesystems don't report changes made by
+ * other machines, so an entry older than index_recheck seconds is checked
+ * before use: VIDEO_TS changes mtime as VOBs are added, removed or
+ * renamed, and rewriting a VOB of the main feature changes its size or
+ * mtime.  That is a handful of stats rather than one for every VOB of
+ * every titleset, and the image is only scanned again if it changed.
+ *
+ * With index_threads set, a pool of threads also walks the whole source
+ * tree at mount and again every index_ttl seconds, so browsing is answered
+ * from memory.  Each worker keeps its own deque of directories still to
+ * read and steals from the others when it runs dry, which keeps every
+ * thread busy however unevenly the library is laid out.
+ *
+ * Without a walk, readdir only checks each entry for VIDEO_TS and queues
+ * the images it finds to be scanned in full by another thread, newest
+ * listing first, as the client will usually stat them next.  When the
+ * directory is released whatever hasn't been scanned yet is dropped, as
+ * the client has moved on.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+
+#include "dvdwrap_fuse.h"
+#include "dvdwrap_index.h"
+#include "dvdwrap_probes.h"
+
+#define INDEX_BUCKETS		1024
+/*! Entries allocated at a time */
+#define INDEX_SLAB			4096
+/*! Bytes of path storage allocated at a time */
+#define INDEX_ARENA			65536
+/*! Longest an idle worker can miss work queued by another */
+#define INDEX_POLL_MS		100
+/*! How often to look again while index_ttl is 0 */
+#define INDEX_IDLE_MS		1000
+
+/*!
+ * Scans DVD image.  Looks for the titleset containing the largest title
+ * and assumes that this is the main feature.
+ *
+ * \param path		Path to top level of DVD image (containing VIDEO_TS)
+ */
+static int dvdwrap_index_scan(const char *path, int *vts_maj, uint64_t *total_size,
+	time_t *vob_mtime)
+{
+	int maj, min, longest_maj = 0;
+	uint64_t titlesize[MAX_VTS_MAJ];
+	time_t titlemtime[MAX_VTS_MAJ];
+	uint64_t longest_size = 0;
+	struct stat st;
+
+	LOG("%s(%s)\n", __FUNCTION__, path);
+
+	memset(titlesize, 0, sizeof(titlesize));
+	memset(titlemtime, 0, sizeof(titlemtime));
+
+	for (maj = 1; maj < MAX_VTS_MAJ; maj++) {
+		/* Skip VTS_nn_0 because this is always the menu content */
+		for (min = 1; min < MAX_VTS_MIN; min++) {
+			char vtspath[PATH_MAX];
+			snprintf(vtspath, PATH_MAX, "%s/VIDEO_TS/VTS_%02d_%01d.VOB", path, maj, min);
+			LOG("%s\n", vtspath);
+			if (dvdwrap_stats_lstat(vtspath, &st) < 0) {
+				/* No more VOBs in this titleset */
+				LOG("No more VOBs at minor %d\n", min);
+				break;
+			}
+			titlesize[maj] += st.st_size;
+			if (st.st_mtime > titlemtime[maj]) {
+				titlemtime[maj] = st.st_mtime;
+			}
+		}
+		if (min == 1) {
+			LOG("No more titlesets at major %d\n", maj);
+			break;
+		}
+		if (titlesize[maj] > longest_size) {
+			longest_size = titlesize[maj];
+			longest_maj = maj;
+		}
+	}
+
+	if (longest_maj) {
+		LOG("Found longest titleset %d with length %llu\n", longest_maj, (unsigned long long)longest_size);
+		*vts_maj = longest_maj;
+		*total_size = longest_size;
+		*vob_mtime = titlemtime[longest_maj];
+		return 0;
+	}
+
+	return -1; /* Not found */
+}
+
+/*! Looks at what a source directory holds on disk */
+static void dvdwrap_index_probe(const char *path, dvdwrap_index_info_t *info)
+{
+	char vtspath[PATH_MAX];
+
+	memset(info, 0, sizeof(dvdwrap_index_info_t));
+	snprintf(vtspath, PATH_MAX, "%s/VIDEO_TS", path);
+	if (dvdwrap_stats_lstat(vtspath, &info->st) < 0) {
+		return; /* Not a DVD image */
+	}
+	info->flags |= INDEX_VIDEOTS;
+	info->vts_mtime = info->st.st_mtime;
+
+	/* Stat the VIDEO_TS.IFO file to obtain ownership, etc. and as a
+	 * pre-flight sanity check */
+	snprintf(vtspath, PATH_MAX, "%s/VIDEO_TS/VIDEO_TS.IFO", path);
+	if (dvdwrap_stats_lstat(vtspath, &info->st) < 0) {
+		LOG("VIDEO_TS.IFO not found\n");
+		return;
+	}
+
+	/* Scan titlesets for main feature and aggregate file size */
+	if (dvdwrap_index_scan(path, &info->maj, &info->total_size, &info->vob_mtime) < 0) {
+		LOG("VTS scan failed\n");
+		return;
+	}
+	info->flags |= INDEX_TITLE;
+	DVDWRAP_PROBE2(index_probe, path, info->flags);
+}
+
+/*! Returns non-zero if a DVD image still matches what was found when it
+ * was scanned */
+static int dvdwrap_index_unchanged(const char *path, const dvdwrap_index_info_t *info)
+{
+	char vtspath[PATH_MAX + 32];
+	uint64_t total_size = 0;
+	time_t vob_mtime = 0;
+	struct stat st;
+	int min;
+
+	if (!(info->flags & INDEX_TITLE)) {
+		return 0; /* As cheap to look again in full */
+	}
+	snprintf(vtspath, sizeof(vtspath), "%s/VIDEO_TS", path);
+	if (dvdwrap_stats_lstat(vtspath, &st) < 0 || st.st_mtime != info->vts_mtime) {
+		return 0;
+	}
+	snprintf(vtspath, sizeof(vtspath), "%s/VIDEO_TS/VIDEO_TS.IFO", path);
+	if (dvdwrap_stats_lstat(vtspath, &st) < 0 || st.st_mtime != info->st.st_mtime ||
+			st.st_size != info->st.st_size) {
+		return 0;
+	}
+	for (min = 1; min < MAX_VTS_MIN; min++) {
+		snprintf(vtspath, sizeof(vtspath), "%s/VIDEO_TS/VTS_%02d_%01d.VOB", path, info->maj, min);
+		if (dvdwrap_stats_lstat(vtspath, &st) < 0) {
+			break;
+		}
+		total_size += st.st_size;
+		if (st.st_mtime > vob_mtime) {
+			vob_mtime = st.st_mtime;
+		}
+	}
+	return total_size == info->total_size && vob_mtime == info->vob_mtime;
+}
+
+/*! Seconds since the index was created, which is all the resolution
+ * index_ttl and index_recheck need */
+static uint32_t dvdwrap_index_now(dvdwrap_index_t *index)
+{
+	return (uint32_t)((dvdwrap_now_ms() - index->base) / 1000);
+}
+
+static dvdwrap_index_entry_t* dvdwrap_index_entry(dvdwrap_index_t *index, uint32_t id)
+{
+	return &index->slabs[id / INDEX_SLAB][id % INDEX_SLAB];
+}
+
+/*! Returns path relative to the root, as the root is the same for every
+ * entry */
+static const char* dvdwrap_index_rel(dvdwrap_index_t *index, const char *path)
+{
+	if (strncmp(path, index->root, index->rootlen) == 0 && path[index->rootlen] == '/') {
+		return path + index->rootlen + 1;
+	}
+	return path;
+}
+
+/*! Finds the entry for a relative path.  Must be called with the lock
+ * held. */
+static dvdwrap_index_entry_t* dvdwrap_index_find(dvdwrap_index_t *index,
+	const char *rel, uint32_t hash)
+{
+	uint32_t id = index->hash[hash % index->nbuckets];
+	dvdwrap_index_entry_t *entry;
+
+	while (id) {
+		entry = dvdwrap_index_entry(index, id);
+		if (entry->hash == hash && strcmp(entry->path, rel) == 0) {
+			return entry;
+		}
+		id = entry->next;
+	}
+	return NULL;
+}
+
+static int dvdwrap_index_fresh(dvdwrap_index_t *index, const dvdwrap_index_entry_t *entry,
+	uint32_t now)
+{
+	return entry && now - entry->checked < index->conf->ttl;
+}
+
+static void dvdwrap_index_unpack(const dvdwrap_index_entry_t *entry, dvdwrap_index_info_t *info)
+{
+	memset(info, 0, sizeof(dvdwrap_index_info_t));
+	info->flags = entry->flags;
+	info->maj = entry->maj;
+	info->total_size = entry->total_size;
+	info->st.st_mode = entry->mode;
+	info->st.st_nlink = 1;
+	info->st.st_uid = entry->uid;
+	info->st.st_gid = entry->gid;
+	info->st.st_size = entry->ifo_size;
+	info->st.st_atime = (time_t)entry->atime;
+	info->st.st_mtime = (time_t)entry->mtime;
+	info->st.st_ctime = (time_t)entry->ctime;
+	info->vts_mtime = (time_t)entry->vts_mtime;
+	info->vob_mtime = (time_t)entry->vob_mtime;
+}
+
+static void dvdwrap_index_pack(dvdwrap_index_entry_t *entry, const dvdwrap_index_info_t *info)
+{
+	entry->flags = (uint8_t)info->flags;
+	entry->maj = (uint8_t)info->maj;
+	entry->total_size = info->total_size;
+	entry->mode = (uint16_t)info->st.st_mode;
+	entry->uid = (uint32_t)info->st.st_uid;
+	entry->gid = (uint32_t)info->st.st_gid;
+	entry->ifo_size = (uint32_t)info->st.st_size;
+	entry->atime = info->st.st_atime;
+	entry->mtime = info->st.st_mtime;
+	entry->ctime = info->st.st_ctime;
+	entry->vts_mtime = info->vts_mtime;
+	entry->vob_mtime = info->vob_mtime;
+}
+
+/*! Copies a path into the arena.  Must be called with the lock held. */
+static const char* dvdwrap_index_intern(dvdwrap_index_t *index, const char *path)
+{
+	size_t len = strlen(path) + 1;
+	char *copy;
+
+	if (index->arena == NULL || index->arena_used + len > INDEX_ARENA) {
+		char *block = (char*)malloc(INDEX_ARENA);
+
+		if (block == NULL) {
+			return NULL;
+		}
+		/* Blocks are chained through their first bytes for freeing */
+		*(char**)block = index->arena;
+		index->arena = block;
+		index->arena_used = sizeof(char*);
+		index->bytes += INDEX_ARENA;
+	}
+	copy = index->arena + index->arena_used;
+	memcpy(copy, path, len);
+	index->arena_used += len;
+	return copy;
+}
+
+/*! Allocates an entry id.  Must be called with the lock held. */
+static uint32_t dvdwrap_index_alloc(dvdwrap_index_t *index)
+{
+	uint32_t id = index->count + 1;
+
+	if (id % INDEX_SLAB == 0 || index->nslabs == 0) {
+		unsigned int slab = id / INDEX_SLAB;
+		dvdwrap_index_entry_t **slabs;
+
+		if (slab >= index->nslabs) {
+			slabs = (dvdwrap_index_entry_t**)realloc(index->slabs,
+				(slab + 1) * sizeof(dvdwrap_index_entry_t*));
+			if (slabs == NULL) {
+				return 0;
+			}
+			index->slabs = slabs;
+			slabs[slab] = (dvdwrap_index_entry_t*)malloc(INDEX_SLAB * sizeof(dvdwrap_index_entry_t));
+			if (slabs[slab] == NULL) {
+				return 0;
+			}
+			index->nslabs = slab + 1;
+			index->bytes += INDEX_SLAB * sizeof(dvdwrap_index_entry_t);
+		}
+	}
+	return id;
+}
+
+/*! Doubles the number of buckets.  Must be called with the lock held. */
+static void dvdwrap_index_grow(dvdwrap_index_t *index)
+{
+	unsigned int nbuckets = index->nbuckets * 2;
+	dvdwrap_index_entry_t *entry;
+	uint32_t *hash, id;
+
+	hash = (uint32_t*)calloc(nbuckets, sizeof(uint32_t));
+	if (hash == NULL) {
+		return; /* Carry on with longer chains */
+	}
+	for (id = 1; id <= index->count; id++) {
+		entry = dvdwrap_index_entry(index, id);
+		entry->next = hash[entry->hash % nbuckets];
+		hash[entry->hash % nbuckets] = id;
+	}
+	free(index->hash);
+	index->bytes += (uint64_t)(nbuckets - index->nbuckets) * sizeof(uint32_t);
+	index->hash = hash;
+	index->nbuckets = nbuckets;
+}
+
+/*! Records what a directory holds.  path must already be a key. */
+static void dvdwrap_index_store(dvdwrap_index_t *index, const char *path,
+	const dvdwrap_index_info_t *info, uint32_t checked)
+{
+	const char *rel = dvdwrap_index_rel(index, path);
+	uint32_t hash = dvdwrap_hash_string(rel), id;
+	dvdwrap_index_entry_t *entry;
+
+	pthread_mutex_lock(&index->lock);
+	entry = dvdwrap_index_find(index, rel, hash);
+	if (entry == NULL) {
+		id = dvdwrap_index_alloc(index);
+		if (id == 0 || (rel = dvdwrap_index_intern(index, rel)) == NULL) {
+			pthread_mutex_unlock(&index->lock);
+			return;
+		}
+		entry = dvdwrap_index_entry(index, id);
+		entry->path = rel;
+		entry->hash = hash;
+		entry->next = index->hash[hash % index->nbuckets];
+		index->hash[hash % index->nbuckets] = id;
+		if (++index->count > index->nbuckets * 2) {
+			dvdwrap_index_grow(index);
+		}
+	}
+	entry->checked = checked;
+	entry->validated = checked;
+	dvdwrap_index_pack(entry, info);
+	pthread_mutex_unlock(&index->lock);
+}
+
+/*! Copies path without repeated or trailing slashes, so the same
+ * directory reached from getattr, readdir and the walker has one entry */
+static void dvdwrap_index_key(const char *path, char *key)
+{
+	char *out = key;
+
+	for (; *path && out < key + PATH_MAX - 1; path++) {
+		if (*path == '/' && (path[1] == '/' || path[1] == '\0') && out != key) {
+			continue;
+		}
+		*out++ = *path;
+	}
+	*out = '\0';
+}
+
+/*! Notes that an entry due a recheck was found unchanged */
+static void dvdwrap_index_validated(dvdwrap_index_t *index, dvdwrap_index_entry_t *entry,
+	uint32_t now)
+{
+	pthread_mutex_lock(&index->lock);
+	entry->validated = now;
+	index->revalidated++;
+	pthread_mutex_unlock(&index->lock);
+}
+
+/*!
+ * Finds out what a source directory holds, from the index if it was
+ * looked at recently enough.
+ *
+ * \param index		Library index
+ * \param path		Absolute path of the directory
+ * \param info		Returns what it holds
+ * \return			info->flags
+ */
+int dvdwrap_index_lookup(dvdwrap_index_t *index, const char *path,
+	dvdwrap_index_info_t *info)
+{
+	uint32_t now = dvdwrap_index_now(index);
+	unsigned int recheck = index->conf->recheck;
+	dvdwrap_index_entry_t *entry;
+	char key[PATH_MAX];
+	const char *rel;
+	uint32_t hash;
+
+	if (index->conf->ttl == 0) {
+		dvdwrap_index_probe(path, info);
+		return info->flags;
+	}
+
+	dvdwrap_index_key(path, key);
+	rel = dvdwrap_index_rel(index, key);
+	hash = dvdwrap_hash_string(rel);
+	pthread_mutex_lock(&index->lock);
+	entry = dvdwrap_index_find(index, rel, hash);
+	if (dvdwrap_index_fresh(index, entry, now)) {
+		dvdwrap_index_unpack(entry, info);
+		if (recheck == 0 || now - entry->validated < recheck) {
+			index->hits++;
+			pthread_mutex_unlock(&index->lock);
+			return info->flags;
+		}
+		pthread_mutex_unlock(&index->lock);
+
+		/* Due a check that it hasn't changed */
+		if (dvdwrap_index_unchanged(key, info)) {
+			dvdwrap_index_validated(index, entry, now);
+			return info->flags;
+		}
+		pthread_mutex_lock(&index->lock);
+		index->changed++;
+	}
+	index->misses++;
+	pthread_mutex_unlock(&index->lock);
+
+	dvdwrap_index_probe(key, info);
+	dvdwrap_index_store(index, key, info, now);
+	return info->flags;
+}
+
+/*!
+ * Returns non-zero if a source directory is a DVD image, for readdir.  An
+ * entry due a recheck costs one stat of VIDEO_TS, whose mtime changes as
+ * VOBs come and go; anything more is left to the scan or the next lookup.
+ *
+ * \param index		Library index
+ * \param path		Absolute path of the directory
+ * \param batch		Collects images to be scanned ahead, or NULL to scan
+ *					them now
+ */
+int dvdwrap_index_is_image(dvdwrap_index_t *index, const char *path,
+	dvdwrap_index_batch_t *batch)
+{
+	uint32_t now = dvdwrap_index_now(index);
+	unsigned int recheck = index->conf->recheck;
+	dvdwrap_index_entry_t *entry;
+	dvdwrap_index_info_t info;
+	char vtspath[PATH_MAX + 16], key[PATH_MAX];
+	const char *rel;
+	struct stat st;
+	int64_t vts_mtime = 0;
+	int found = -1, due = 0;
+
+	if (index->conf->ttl == 0) {
+		/* Nowhere to keep a scan, so just look for VIDEO_TS */
+		snprintf(vtspath, sizeof(vtspath), "%s/VIDEO_TS", path);
+		return dvdwrap_stats_lstat(vtspath, &st) == 0;
+	}
+	if (batch == NULL) {
+		/* Scan in full, as whoever listed the directory usually stats
+		 * each entry next */
+		return (dvdwrap_index_lookup(index, path, &info) & INDEX_VIDEOTS) != 0;
+	}
+
+	dvdwrap_index_key(path, key);
+	rel = dvdwrap_index_rel(index, key);
+	pthread_mutex_lock(&index->lock);
+	entry = dvdwrap_index_find(index, rel, dvdwrap_hash_string(rel));
+	if (dvdwrap_index_fresh(index, entry, now)) {
+		found = (entry->flags & INDEX_VIDEOTS) != 0;
+		if (recheck && now - entry->validated >= recheck) {
+			due = 1;
+			vts_mtime = entry->vts_mtime;
+		} else {
+			index->hits++;
+		}
+	} else {
+		index->misses++;
+	}
+	pthread_mutex_unlock(&index->lock);
+	if (found >= 0 && !due) {
+		return found;
+	}
+
+	snprintf(vtspath, sizeof(vtspath), "%s/VIDEO_TS", key);
+	if (dvdwrap_stats_lstat(vtspath, &st) < 0) {
+		if (due && !found) {
+			dvdwrap_index_validated(index, entry, now);
+			return 0;
+		}
+		/* That is all there is to know about a plain directory */
+		memset(&info, 0, sizeof(dvdwrap_index_info_t));
+		dvdwrap_index_store(index, key, &info, now);
+		return 0;
+	}
+	if (due) {
+		if (found && (int64_t)st.st_mtime == vts_mtime) {
+			dvdwrap_index_validated(index, entry, now);
+			return 1;
+		}
+		/* The entry stays due, so the next lookup probes it again */
+		pthread_mutex_lock(&index->lock);
+		index->changed++;
+		index->misses++;
+		pthread_mutex_unlock(&index->lock);
+	}
+	if (batch->count < index->conf->speculate) {
+		if (batch->count == batch->alloc) {
+			unsigned int alloc = batch->alloc ? batch->alloc * 2 : 16;
+			char **paths = (char**)realloc(batch->paths, alloc * sizeof(char*));
+
+			if (paths == NULL) {
+				return 1;
+			}
+			batch->paths = paths;
+			batch->alloc = alloc;
+		}
+		if ((batch->paths[batch->count] = strdup(key)) != NULL) {
+			batch->count++;
+		}
+	}
+	return 1;
+}
+
+/* Speculative scanning */
+
+/*! Returns a batch for one readdir, or NULL if not scanning ahead */
+dvdwrap_index_batch_t* dvdwrap_index_batch_new(dvdwrap_index_t *index)
+{
+	dvdwrap_index_batch_t *batch;
+
+	if (index->conf->ttl == 0 || index->conf->speculate == 0 || !index->spec_running) {
+		return NULL;
+	}
+	batch = (dvdwrap_index_batch_t*)calloc(1, sizeof(dvdwrap_index_batch_t));
+	if (batch) {
+		batch->refs = 1;
+	}
+	return batch;
+}
+
+/*! Drops a reference.  Must be called with the lock held. */
+static void dvdwrap_index_batch_put(dvdwrap_index_batch_t *batch)
+{
+	unsigned int n;
+
+	if (--batch->refs) {
+		return;
+	}
+	for (n = 0; n < batch->count; n++) {
+		free(batch->paths[n]);
+	}
+	free(batch->paths);
+	free(batch);
+}
+
+/*! Queues the images found by a readdir for scanning */
+void dvdwrap_index_speculate(dvdwrap_index_t *index, dvdwrap_index_batch_t *batch)
+{
+	if (batch == NULL || batch->count == 0) {
+		return;
+	}
+	pthread_mutex_lock(&index->lock);
+	if (!batch->queued && !batch->cancelled) {
+		batch->refs++;
+		batch->queued = 1;
+		batch->next = index->batches;
+		index->batches = batch;
+		pthread_cond_signal(&index->spec_wake);
+	}
+	pthread_mutex_unlock(&index->lock);
+}
+
+/*! Drops a batch when its directory is released */
+void dvdwrap_index_cancel(dvdwrap_index_t *index, dvdwrap_index_batch_t *batch)
+{
+	if (batch == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&index->lock);
+	batch->cancelled = 1;
+	dvdwrap_index_batch_put(batch);
+	pthread_mutex_unlock(&index->lock);
+}
+
+static void* dvdwrap_index_spec_thread(void *arg)
+{
+	dvdwrap_index_t *index = (dvdwrap_index_t*)arg;
+	dvdwrap_index_batch_t *batch;
+	dvdwrap_index_info_t info;
+	const char *rel;
+	uint32_t now;
+	char *path;
+
+	pthread_mutex_lock(&index->lock);
+	while (!index->stop) {
+		batch = index->batches;
+		if (batch == NULL) {
+			pthread_cond_wait(&index->spec_wake, &index->lock);
+			continue;
+		}
+		if (batch->cancelled || batch->done == batch->count) {
+			/* Finished, or the client has moved on */
+			index->abandoned += batch->count - batch->done;
+			index->batches = batch->next;
+			batch->queued = 0;
+			dvdwrap_index_batch_put(batch);
+			continue;
+		}
+
+		/* Skip anything a stat got to first.  The batch can't go away
+		 * while it is queued. */
+		path = batch->paths[batch->done++];
+		rel = dvdwrap_index_rel(index, path);
+		now = dvdwrap_index_now(index);
+		if (dvdwrap_index_fresh(index, dvdwrap_index_find(index, rel, dvdwrap_hash_string(rel)), now)) {
+			continue;
+		}
+		pthread_mutex_unlock(&index->lock);
+		dvdwrap_index_probe(path, &info);
+		dvdwrap_index_store(index, path, &info, now);
+		pthread_mutex_lock(&index->lock);
+		index->speculated++;
+	}
+	pthread_mutex_unlock(&index->lock);
+	return NULL;
+}
+
+/* Work-stealing walker */
+
+static int dvdwrap_index_push(dvdwrap_index_deque_t *dq, char *dir)
+{
+	pthread_mutex_lock(&dq->lock);
+	if (dq->count == dq->alloc) {
+		unsigned int alloc = dq->alloc ? dq->alloc * 2 : 64, n;
+		char **items = (char**)malloc(alloc * sizeof(char*));
+
+		if (items == NULL) {
+			pthread_mutex_unlock(&dq->lock);
+			return -ENOMEM;
+		}
+		for (n = 0; n < dq->count; n++) {
+			items[n] = dq->items[(dq->head + n) % dq->alloc];
+		}
+		free(dq->items);
+		dq->items = items;
+		dq->alloc = alloc;
+		dq->head = 0;
+	}
+	dq->items[(dq->head + dq->count) % dq->alloc] = dir;
+	dq->count++;
+	pthread_mutex_unlock(&dq->lock);
+	return 0;
+}
+
+/*! Takes the newest directory, for the owner */
+static char* dvdwrap_index_pop(dvdwrap_index_deque_t *dq)
+{
+	char *dir = NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->count) {
+		dq->count--;
+		dir = dq->items[(dq->head + dq->count) % dq->alloc];
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return dir;
+}
+
+/*! Takes the oldest directory, for another worker */
+static char* dvdwrap_index_steal(dvdwrap_index_deque_t *dq)
+{
+	char *dir = NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->count) {
+		dir = dq->items[dq->head];
+		dq->head = (dq->head + 1) % dq->alloc;
+		dq->count--;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return dir;
+}
+
+static char* dvdwrap_index_take(dvdwrap_index_worker_t *worker)
+{
+	dvdwrap_index_t *index = worker->index;
+	unsigned int self = worker - index->workers, n;
+	char *dir = dvdwrap_index_pop(&worker->deque);
+
+	for (n = 1; dir == NULL && n < index->nworkers; n++) {
+		dir = dvdwrap_index_steal(&index->workers[(self + n) % index->nworkers].deque);
+		if (dir) {
+			__sync_fetch_and_add(&index->steals, 1);
+		}
+	}
+	return dir;
+}
+
+/*! Queues a directory to be read, taking ownership of dir */
+static void dvdwrap_index_queue(dvdwrap_index_worker_t *worker, char *dir)
+{
+	dvdwrap_index_t *index = worker->index;
+
+	__sync_fetch_and_add(&index->pending, 1);
+	if (dvdwrap_index_push(&worker->deque, dir) < 0) {
+		free(dir);
+		__sync_fetch_and_sub(&index->pending, 1);
+		return;
+	}
+	if (index->idle) {
+		pthread_mutex_lock(&index->lock);
+		pthread_cond_signal(&index->wake);
+		pthread_mutex_unlock(&index->lock);
+	}
+}
+
+/*! Indexes the subdirectories of one directory and queues those which
+ * aren't DVD images */
+static void dvdwrap_index_read_dir(dvdwrap_index_worker_t *worker, const char *path)
+{
+	dvdwrap_index_t *index = worker->index;
+	dvdwrap_index_info_t info;
+	struct dirent *dir;
+	DIR *d;
+
+	d = opendir(path);
+	if (d == NULL) {
+		return;
+	}
+	__sync_fetch_and_add(&index->dirs, 1);
+	while (!index->stop && (dir = readdir(d)) != NULL) {
+		char thispath[PATH_MAX];
+		struct stat st;
+		uint32_t now;
+
+		/* Only directories show up in the mount, as in readdir */
+		if (dir->d_name[0] == '.') {
+			continue;
+		}
+		snprintf(thispath, PATH_MAX, "%s/%s", path, dir->d_name);
+		if (dir->d_type != DT_DIR) {
+			if (dir->d_type != DT_UNKNOWN) {
+				continue;
+			}
+			if (dvdwrap_stats_lstat(thispath, &st) < 0 || !S_ISDIR(st.st_mode)) {
+				continue;
+			}
+		}
+
+		now = dvdwrap_index_now(index);
+		dvdwrap_index_probe(thispath, &info);
+		dvdwrap_index_store(index, thispath, &info, now);
+		if (info.flags & INDEX_TITLE) {
+			__sync_fetch_and_add(&index->titles, 1);
+		}
+		if (!(info.flags & INDEX_VIDEOTS)) {
+			char *sub = strdup(thispath);
+
+			if (sub) {
+				dvdwrap_index_queue(worker, sub);
+			}
+		}
+	}
+	closedir(d);
+}
+
+static void* dvdwrap_index_thread(void *arg)
+{
+	dvdwrap_index_worker_t *worker = (dvdwrap_index_worker_t*)arg;
+	dvdwrap_index_t *index = worker->index;
+	struct timespec ts;
+	uint64_t now, wait;
+	char *dir;
+
+	for (;;) {
+		dir = dvdwrap_index_take(worker);
+		if (dir) {
+			if (!index->stop) {
+				dvdwrap_index_read_dir(worker, dir);
+			}
+			free(dir);
+			if (__sync_sub_and_fetch(&index->pending, 1) == 0) {
+				/* That was the last directory of the walk */
+				pthread_mutex_lock(&index->lock);
+				index->last_walk = dvdwrap_now_ms() - index->walk_start;
+				index->walks++;
+				LOG("Indexed %llu titles in %llu ms\n", (unsigned long long)index->titles,
+					(unsigned long long)index->last_walk);
+				pthread_mutex_unlock(&index->lock);
+			}
+			continue;
+		}
+
+		pthread_mutex_lock(&index->lock);
+		if (index->stop) {
+			pthread_mutex_unlock(&index->lock);
+			break;
+		}
+		now = dvdwrap_now_ms();
+		if (index->pending == 0 && index->conf->ttl && now >= index->next_walk) {
+			/* Time to walk the library again, before the last walk
+			 * expires */
+			index->walk_start = now;
+			index->next_walk = now + (uint64_t)index->conf->ttl * 1000;
+			index->dirs = 0;
+			index->titles = 0;
+			pthread_mutex_unlock(&index->lock);
+			dir = strdup(index->root);
+			if (dir) {
+				dvdwrap_index_queue(worker, dir);
+			}
+			continue;
+		}
+		if (index->pending) {
+			wait = INDEX_POLL_MS;
+		} else if (index->conf->ttl == 0) {
+			wait = INDEX_IDLE_MS;
+		} else {
+			wait = index->next_walk - now;
+		}
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += wait / 1000;
+		ts.tv_nsec += (wait % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		index->idle++;
+		pthread_cond_timedwait(&index->wake, &index->lock, &ts);
+		index->idle--;
+		pthread_mutex_unlock(&index->lock);
+	}
+	return NULL;
+}
+
+int dvdwrap_index_init(dvdwrap_index_t *index, const dvdwrap_index_conf_t *conf,
+	const char *root)
+{
+	memset(index, 0, sizeof(dvdwrap_index_t));
+	index->conf = conf;
+	index->root = root;
+	pthread_mutex_init(&index->lock, NULL);
+	pthread_cond_init(&index->wake, NULL);
+	pthread_cond_init(&index->spec_wake, NULL);
+	index->rootlen = strcmp(root, "/") == 0 ? 0 : strlen(root);
+	index->base = dvdwrap_now_ms();
+	index->nbuckets = INDEX_BUCKETS;
+	index->hash = (uint32_t*)calloc(index->nbuckets, sizeof(uint32_t));
+	index->bytes = index->nbuckets * sizeof(uint32_t);
+	return index->hash ? 0 : -ENOMEM;
+}
+
+/*! Starts the background walker and speculative scanning, if enabled.
+ * Must be called after fuse has daemonised. */
+int dvdwrap_index_start(dvdwrap_index_t *index)
+{
+	unsigned int n;
+
+	if (index->conf->speculate) {
+		if (pthread_create(&index->spec_thread, NULL, dvdwrap_index_spec_thread, index) != 0) {
+			return -EAGAIN;
+		}
+		index->spec_running = 1;
+	}
+	if (index->conf->threads == 0) {
+		return 0;
+	}
+	index->workers = (dvdwrap_index_worker_t*)calloc(index->conf->threads,
+		sizeof(dvdwrap_index_worker_t));
+	if (index->workers == NULL) {
+		return -ENOMEM;
+	}
+	index->nworkers = index->conf->threads;
+	for (n = 0; n < index->nworkers; n++) {
+		index->workers[n].index = index;
+		pthread_mutex_init(&index->workers[n].deque.lock, NULL);
+	}
+	for (n = 0; n < index->nworkers; n++) {
+		if (pthread_create(&index->workers[n].thread, NULL, dvdwrap_index_thread,
+				&index->workers[n]) != 0) {
+			break;
+		}
+		index->running++;
+	}
+	return index->running ? 0 : -EAGAIN;
+}
+
+void dvdwrap_index_destroy(dvdwrap_index_t *index)
+{
+	unsigned int n;
+	char *dir;
+
+	pthread_mutex_lock(&index->lock);
+	index->stop = 1;
+	pthread_cond_broadcast(&index->wake);
+	pthread_cond_broadcast(&index->spec_wake);
+	pthread_mutex_unlock(&index->lock);
+	for (n = 0; n < index->running; n++) {
+		pthread_join(index->workers[n].thread, NULL);
+	}
+	if (index->spec_running) {
+		pthread_join(index->spec_thread, NULL);
+	}
+	while (index->batches) {
+		dvdwrap_index_batch_t *batch = index->batches;
+
+		index->batches = batch->next;
+		dvdwrap_index_batch_put(batch);
+	}
+	for (n = 0; n < index->nworkers; n++) {
+		while ((dir = dvdwrap_index_pop(&index->workers[n].deque)) != NULL) {
+			free(dir);
+		}
+		free(index->workers[n].deque.items);
+		pthread_mutex_destroy(&index->workers[n].deque.lock);
+	}
+	free(index->workers);
+
+	for (n = 0; n < index->nslabs; n++) {
+		free(index->slabs[n]);
+	}
+	free(index->slabs);
+	while (index->arena) {
+		char *prev = *(char**)index->arena;
+
+		free(index->arena);
+		index->arena = prev;
+	}
+	free(index->hash);
+	pthread_cond_destroy(&index->wake);
+	pthread_cond_destroy(&index->spec_wake);
+	pthread_mutex_destroy(&index->lock);
+}
+
+void dvdwrap_index_report(dvdwrap_index_t *index, dvdwrap_buf_t *buf)
+{
+	pthread_mutex_lock(&index->lock);
+	dvdwrap_buf_printf(buf,
+		"threads %u\n"
+		"ttl %u\n"
+		"state %s\n"
+		"walks %u\n"
+		"last_walk_ms %llu\n"
+		"dirs %llu\n"
+		"titles %llu\n"
+		"steals %llu\n"
+		"entries %u\n"
+		"memory %llu\n"
+		"hits %llu\n"
+		"misses %llu\n"
+		"recheck %u\n"
+		"revalidated %llu\n"
+		"changed %llu\n"
+		"speculated %llu\n"
+		"abandoned %llu\n",
+		index->running, index->conf->ttl,
+		index->running == 0 ? "off" : index->pending ? "walking" : "idle",
+		index->walks, (unsigned long long)index->last_walk,
+		(unsigned long long)index->dirs, (unsigned long long)index->titles,
+		(unsigned long long)index->steals, index->count,
+		(unsigned long long)index->bytes,
+		(unsigned long long)index->hits, (unsigned long long)index->misses,
+		index->conf->recheck, (unsigned long long)index->revalidated,
+		(unsigned long long)index->changed,
+		(unsigned long long)index->speculated, (unsigned long long)index->abandoned);
+	pthread_mutex_unlock(&index->lock);
+}
@@ -0,0 +1,172 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DVDWRAP_INDEX_H
+#define _DVDWRAP_INDEX_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "dvdwrap_buf.h"
+
+/*! Library index tunables */
+typedef struct {
+	unsigned int	threads;		/*!< Background indexing threads, 0 = off */
+	unsigned int	ttl;			/*!< Seconds a result is trusted, 0 = always
+									 *   look again */
+	unsigned int	recheck;		/*!< Seconds before checking cheaply that a
+									 *   DVD image hasn't changed, 0 = never */
+	unsigned int	speculate;		/*!< Most images of a listing to scan ahead,
+									 *   0 = off */
+} dvdwrap_index_conf_t;
+
+#define INDEX_VIDEOTS		(1 << 0)	/*!< Directory holds VIDEO_TS */
+#define INDEX_TITLE			(1 << 1)	/*!< and a titleset that can be played */
+
+/*! What a source directory holds */
+typedef struct {
+	int				flags;
+	int				maj;			/*!< Titleset of the main feature */
+	uint64_t		total_size;		/*!< Of the main feature */
+	struct stat		st;				/*!< Of VIDEO_TS.IFO */
+	time_t			vts_mtime;		/*!< Of VIDEO_TS, which changes as VOBs
+									 *   come and go */
+	time_t			vob_mtime;		/*!< Newest VOB of the main feature */
+} dvdwrap_index_info_t;
+
+/*! An index entry.  Packed, as there is one for every directory of the
+ * library, and only what getattr needs is kept from the stat of
+ * VIDEO_TS.IFO. */
+typedef struct {
+	uint32_t			next;		/*!< Next id in the bucket, 0 = none */
+	uint32_t			hash;
+	uint32_t			checked;	/*!< When probed, in s since init */
+	uint32_t			validated;	/*!< When last found unchanged */
+	const char			*path;		/*!< Relative to the root, in the arena */
+	uint64_t			total_size;
+	int64_t				atime;
+	int64_t				mtime;
+	int64_t				ctime;
+	int64_t				vts_mtime;
+	int64_t				vob_mtime;
+	uint32_t			uid;
+	uint32_t			gid;
+	uint32_t			ifo_size;
+	uint16_t			mode;
+	uint8_t				flags;
+	uint8_t				maj;
+} dvdwrap_index_entry_t;
+
+/*! Directories waiting to be read by one worker.  The worker takes from
+ * the tail, so the walk is depth first, while idle workers steal from
+ * the head, which holds the largest unread subtrees. */
+typedef struct {
+	pthread_mutex_t		lock;
+	char				**items;
+	unsigned int		head;
+	unsigned int		count;
+	unsigned int		alloc;
+} dvdwrap_index_deque_t;
+
+/*! Images found by one readdir, to be scanned before the client stats
+ * them.  Dropped when the directory is released. */
+typedef struct dvdwrap_index_batch {
+	struct dvdwrap_index_batch	*next;
+	unsigned int		refs;
+	int					queued;
+	volatile int		cancelled;
+	char				**paths;
+	unsigned int		count;
+	unsigned int		alloc;
+	unsigned int		done;		/*!< Paths taken by the scanning thread */
+} dvdwrap_index_batch_t;
+
+struct dvdwrap_index;
+
+typedef struct {
+	struct dvdwrap_index	*index;
+	pthread_t				thread;
+	dvdwrap_index_deque_t	deque;
+} dvdwrap_index_worker_t;
+
+/*! Remembers which source directories are DVD images, and what they
+ * hold, so browsing doesn't scan every image again */
+typedef struct dvdwrap_index {
+	const dvdwrap_index_conf_t	*conf;
+	const char			*root;
+	size_t				rootlen;
+	uint64_t			base;		/*!< dvdwrap_now_ms() at init */
+
+	pthread_mutex_t		lock;
+	pthread_cond_t		wake;
+	uint32_t			*hash;		/*!< First entry id of each bucket */
+	unsigned int		nbuckets;
+	unsigned int		count;
+	dvdwrap_index_entry_t	**slabs;	/*!< Entries by id */
+	unsigned int		nslabs;
+	char				*arena;		/*!< Block paths are being added to */
+	size_t				arena_used;
+	uint64_t			bytes;		/*!< Memory held by the index */
+
+	dvdwrap_index_worker_t	*workers;
+	unsigned int		nworkers;
+	unsigned int		running;	/*!< Worker threads started */
+	unsigned int		idle;		/*!< Workers waiting for something to do */
+	unsigned int		pending;	/*!< Directories queued or being read */
+	int					stop;
+	uint64_t			walk_start;
+	uint64_t			next_walk;	/*!< When to walk the library again, in ms */
+
+	dvdwrap_index_batch_t	*batches;	/*!< Waiting, newest listing first */
+	pthread_cond_t		spec_wake;
+	pthread_t			spec_thread;
+	int					spec_running;
+
+	/* Statistics */
+	unsigned int		walks;		/*!< Walks completed */
+	uint64_t			last_walk;	/*!< Duration of the last one, in ms */
+	uint64_t			dirs;		/*!< Read so far by this walk or the last */
+	uint64_t			titles;		/*!< Found so far by this walk or the last */
+	uint64_t			steals;
+	uint64_t			hits;
+	uint64_t			misses;
+	uint64_t			revalidated;	/*!< Found unchanged without a scan */
+	uint64_t			changed;	/*!< Found changed, and scanned again */
+	uint64_t			speculated;	/*!< Images scanned ahead of a stat */
+	uint64_t			abandoned;	/*!< Left unscanned as the listing was closed */
+} dvdwrap_index_t;
+
+int dvdwrap_index_init(dvdwrap_index_t *index, const dvdwrap_index_conf_t *conf,
+	const char *root);
+int dvdwrap_index_start(dvdwrap_index_t *index);
+void dvdwrap_index_destroy(dvdwrap_index_t *index);
+int dvdwrap_index_lookup(dvdwrap_index_t *index, const char *path,
+	dvdwrap_index_info_t *info);
+int dvdwrap_index_is_image(dvdwrap_index_t *index, const char *path,
+	dvdwrap_index_batch_t *batch);
+dvdwrap_index_batch_t* dvdwrap_index_batch_new(dvdwrap_index_t *index);
+void dvdwrap_index_speculate(dvdwrap_index_t *index, dvdwrap_index_batch_t *batch);
+void dvdwrap_index_cancel(dvdwrap_index_t *index, dvdwrap_index_batch_t *batch);
+void dvdwrap_index_report(dvdwrap_index_t *index, dvdwrap_buf_t *buf);
+
+#endif
@@ -0,0 +1,477 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Per-device I/O queues.  Every backing device (by st_dev) gets its own
+ * queue and pool of worker threads, sized by the scheduler's slot count,
+ * which perform the actual reads.  A slow or busy disk therefore only
+ * holds up requests for that disk, and the number of reads outstanding on
+ * any one device is bounded by the queue depth.
+ *
+ * A watchdog looks at the read each worker is doing, and reports any that
+ * has taken longer than the stall time - a failing disk, a network
+ * source that has gone away, or one still spinning up.  Stalls are
+ * counted per device, and the most recent are listed with the file and
+ * how long they finally took in .dvdwrap/stalls.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/sysmacros.h>
+
+#include "dvdwrap_fuse.h"
+#include "dvdwrap_ioq.h"
+#include "dvdwrap_probes.h"
+
+/*! Records how a stalled read ended.  Called with the queue locked. */
+static void dvdwrap_ioq_stall_done(dvdwrap_ioq_t *q, dvdwrap_ioq_worker_t *w,
+	uint64_t us, ssize_t rc)
+{
+	dvdwrap_ioq_set_t *set = q->set;
+	dvdwrap_ioq_stall_t *stall;
+
+	q->stalled--;
+	q->stall_us += us;
+	if (us > q->stall_max_us) {
+		q->stall_max_us = us;
+	}
+	LOG("Stalled read on %u:%u done after %llu ms\n", major(q->dev), minor(q->dev),
+		(unsigned long long)(us / 1000));
+
+	pthread_mutex_lock(&set->stall_lock);
+	stall = &set->stall_log[(w->stall_seq - 1) % IOQ_STALL_LOG];
+	if (stall->seq == w->stall_seq) {
+		stall->us = us;
+		stall->result = rc;
+		stall->done = 1;
+	}
+	pthread_mutex_unlock(&set->stall_lock);
+}
+
+static void* dvdwrap_ioq_worker(void *arg)
+{
+	dvdwrap_ioq_worker_t *w = (dvdwrap_ioq_worker_t*)arg;
+	dvdwrap_ioq_t *q = w->q;
+
+	pthread_mutex_lock(&q->lock);
+	while (!q->stop) {
+		dvdwrap_ioq_job_t *job;
+		uint64_t start, end;
+		ssize_t rc;
+
+		job = (dvdwrap_ioq_job_t*)dvdwrap_sched_next(&q->sched);
+		if (job == NULL) {
+			pthread_cond_wait(&q->work, &q->lock);
+			continue;
+		}
+		start = dvdwrap_now_us();
+		w->job = job;
+		w->start = start;
+		pthread_mutex_unlock(&q->lock);
+
+		DVDWRAP_PROBE4(backend_start, job->fd, (int64_t)job->offset, job->size,
+			start - job->queued);
+		rc = pread(job->fd, job->buf, job->size, job->offset);
+		if (rc < 0) {
+			rc = -errno;
+		}
+		end = start + dvdwrap_stats_record(STATS_PREAD, start, rc);
+		DVDWRAP_PROBE4(backend_done, job->fd, (int64_t)job->offset, rc, end - start);
+
+		pthread_mutex_lock(&q->lock);
+		if (w->stalled) {
+			dvdwrap_ioq_stall_done(q, w, end - start, rc);
+			w->stalled = 0;
+		}
+		w->job = NULL;
+		dvdwrap_sched_complete(&q->sched, job->entry.class);
+		q->depth--;
+		q->completed++;
+		if (rc < 0) {
+			q->errors++;
+		} else {
+			q->bytes += rc;
+		}
+		q->wait_us += start - job->queued;
+		q->service_us += end - start;
+		if (end - job->queued > q->max_us) {
+			q->max_us = end - job->queued;
+		}
+		job->result = rc;
+		job->done = 1;
+		pthread_cond_broadcast(&q->done);
+		pthread_cond_signal(&q->space);
+		/* Completion may have made a bulk read admissible */
+		pthread_cond_broadcast(&q->work);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return NULL;
+}
+
+static dvdwrap_ioq_t* dvdwrap_ioq_new(dvdwrap_ioq_set_t *set, dev_t dev)
+{
+	dvdwrap_ioq_t *q;
+	unsigned int n;
+
+	q = (dvdwrap_ioq_t*)calloc(1, sizeof(dvdwrap_ioq_t));
+	if (q == NULL) {
+		return NULL;
+	}
+	q->set = set;
+	q->dev = dev;
+	q->conf = set->conf;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->work, NULL);
+	pthread_cond_init(&q->done, NULL);
+	pthread_cond_init(&q->space, NULL);
+	dvdwrap_sched_init(&q->sched, set->sched_conf);
+
+	q->workers = (dvdwrap_ioq_worker_t*)calloc(set->sched_conf->slots,
+		sizeof(dvdwrap_ioq_worker_t));
+	if (q->workers == NULL) {
+		free(q);
+		return NULL;
+	}
+	for (n = 0; n < set->sched_conf->slots; n++) {
+		q->workers[n].q = q;
+		if (pthread_create(&q->workers[n].thread, NULL, dvdwrap_ioq_worker,
+				&q->workers[n]) != 0) {
+			break;
+		}
+		q->nworkers++;
+	}
+	if (q->nworkers == 0) {
+		free(q->workers);
+		free(q);
+		return NULL;
+	}
+	LOG("New queue for device %u:%u with %u workers\n",
+		major(dev), minor(dev), q->nworkers);
+	return q;
+}
+
+void dvdwrap_ioq_set_init(dvdwrap_ioq_set_t *set, const dvdwrap_ioq_conf_t *conf,
+	const dvdwrap_sched_conf_t *sched_conf)
+{
+	memset(set, 0, sizeof(dvdwrap_ioq_set_t));
+	pthread_mutex_init(&set->lock, NULL);
+	pthread_cond_init(&set->wake, NULL);
+	pthread_mutex_init(&set->stall_lock, NULL);
+	set->conf = conf;
+	set->sched_conf = sched_conf;
+}
+
+/*! Stops all workers and frees the queues.  No reads may be in progress. */
+void dvdwrap_ioq_set_destroy(dvdwrap_ioq_set_t *set)
+{
+	dvdwrap_ioq_t *q, *next;
+	unsigned int n;
+
+	pthread_mutex_lock(&set->lock);
+	for (q = set->queues; q; q = next) {
+		next = q->next;
+
+		pthread_mutex_lock(&q->lock);
+		q->stop = 1;
+		pthread_cond_broadcast(&q->work);
+		pthread_mutex_unlock(&q->lock);
+		for (n = 0; n < q->nworkers; n++) {
+			pthread_join(q->workers[n].thread, NULL);
+		}
+		free(q->workers);
+		free(q);
+	}
+	set->queues = NULL;
+	pthread_mutex_unlock(&set->lock);
+}
+
+/*! Adds a newly stalled read to the log.  Called with the queue locked.
+ * Returns its sequence number. */
+static uint64_t dvdwrap_ioq_stall_log(dvdwrap_ioq_set_t *set, dvdwrap_ioq_t *q,
+	dvdwrap_ioq_worker_t *w)
+{
+	dvdwrap_ioq_stall_t *stall;
+	char link[32], path[IOQ_STALL_PATH];
+	ssize_t len;
+	uint64_t seq;
+
+	/* The file is still open, as its reader is waiting for it */
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", w->job->fd);
+	len = readlink(link, path, sizeof(path) - 1);
+	path[len < 0 ? 0 : len] = '\0';
+
+	pthread_mutex_lock(&set->stall_lock);
+	seq = ++set->nstalls;
+	stall = &set->stall_log[(seq - 1) % IOQ_STALL_LOG];
+	memset(stall, 0, sizeof(dvdwrap_ioq_stall_t));
+	stall->seq = seq;
+	stall->when = time(NULL);
+	stall->dev = q->dev;
+	memcpy(stall->path, path, sizeof(path));
+	stall->offset = w->job->offset;
+	stall->size = w->job->size;
+	stall->start = w->start;
+	pthread_mutex_unlock(&set->stall_lock);
+	return seq;
+}
+
+/*! Reports reads that have been in progress too long */
+static void dvdwrap_ioq_watch_check(dvdwrap_ioq_set_t *set)
+{
+	uint64_t limit = (uint64_t)set->conf->stall * 1000;
+	uint64_t now = dvdwrap_now_us();
+	dvdwrap_ioq_t *q;
+	unsigned int n;
+
+	for (q = set->queues; q; q = q->next) {
+		pthread_mutex_lock(&q->lock);
+		for (n = 0; n < q->nworkers; n++) {
+			dvdwrap_ioq_worker_t *w = &q->workers[n];
+
+			if (w->job == NULL || w->stalled || now - w->start < limit) {
+				continue;
+			}
+			w->stalled = 1;
+			w->stall_seq = dvdwrap_ioq_stall_log(set, q, w);
+			q->stalls++;
+			q->stalled++;
+			LOG("Read on %u:%u stalled, fd %d offset %llu size %zu\n",
+				major(q->dev), minor(q->dev), w->job->fd,
+				(unsigned long long)w->job->offset, w->job->size);
+			DVDWRAP_PROBE4(backend_stall, w->job->fd, (int64_t)w->job->offset,
+				w->job->size, now - w->start);
+		}
+		pthread_mutex_unlock(&q->lock);
+	}
+}
+
+static void* dvdwrap_ioq_watch_thread(void *arg)
+{
+	dvdwrap_ioq_set_t *set = (dvdwrap_ioq_set_t*)arg;
+	struct timespec ts;
+	unsigned int ms;
+
+	pthread_mutex_lock(&set->lock);
+	while (!set->stop) {
+		/* Look often enough to notice a stall within a quarter of the
+		 * stall time */
+		ms = set->conf->stall / 4;
+		ms = ms < 50 ? 50 : ms > 1000 ? 1000 : ms;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += (long)ms * 1000000;
+		ts.tv_sec += ts.tv_nsec / 1000000000;
+		ts.tv_nsec %= 1000000000;
+		pthread_cond_timedwait(&set->wake, &set->lock, &ts);
+		if (!set->stop && set->conf->stall) {
+			dvdwrap_ioq_watch_check(set);
+		}
+	}
+	pthread_mutex_unlock(&set->lock);
+	return NULL;
+}
+
+/*! Starts the stall watchdog.  Must be called after fuse has daemonised. */
+int dvdwrap_ioq_watch_start(dvdwrap_ioq_set_t *set)
+{
+	if (pthread_create(&set->watch, NULL, dvdwrap_ioq_watch_thread, set) != 0) {
+		return -EAGAIN;
+	}
+	set->running = 1;
+	return 0;
+}
+
+void dvdwrap_ioq_watch_stop(dvdwrap_ioq_set_t *set)
+{
+	if (set->running) {
+		pthread_mutex_lock(&set->lock);
+		set->stop = 1;
+		pthread_cond_broadcast(&set->wake);
+		pthread_mutex_unlock(&set->lock);
+		pthread_join(set->watch, NULL);
+		set->running = 0;
+	}
+}
+
+/*!
+ * Returns the queue for a device, creating it if this is the first file
+ * seen on that device.
+ *
+ * \param set		Queue set
+ * \param dev		Device, as st_dev of a file on it
+ * \return			Queue, or NULL on allocation failure
+ */
+dvdwrap_ioq_t* dvdwrap_ioq_get(dvdwrap_ioq_set_t *set, dev_t dev)
+{
+	dvdwrap_ioq_t *q;
+
+	pthread_mutex_lock(&set->lock);
+	for (q = set->queues; q; q = q->next) {
+		if (q->dev == dev) {
+			break;
+		}
+	}
+	if (q == NULL) {
+		q = dvdwrap_ioq_new(set, dev);
+		if (q) {
+			q->next = set->queues;
+			set->queues = q;
+		}
+	}
+	pthread_mutex_unlock(&set->lock);
+	return q;
+}
+
+/*!
+ * Queues a read without waiting for it.  Blocks only while the device
+ * queue is at its depth limit.
+ *
+ * \param q			Device queue
+ * \param job		Read to perform, with fd, buf, size, offset and
+ *					entry.class filled in
+ */
+void dvdwrap_ioq_submit(dvdwrap_ioq_t *q, dvdwrap_ioq_job_t *job)
+{
+	job->done = 0;
+	job->result = 0;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->depth >= q->conf->depth) {
+		pthread_cond_wait(&q->space, &q->lock);
+	}
+	q->depth++;
+	if (q->depth > q->peak_depth) {
+		q->peak_depth = q->depth;
+	}
+	job->queued = dvdwrap_now_us();
+	dvdwrap_sched_enqueue(&q->sched, &job->entry);
+	pthread_cond_signal(&q->work);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/*!
+ * Waits for a submitted read to complete.
+ *
+ * \return			Bytes read or -errno
+ */
+ssize_t dvdwrap_ioq_wait(dvdwrap_ioq_t *q, dvdwrap_ioq_job_t *job)
+{
+	pthread_mutex_lock(&q->lock);
+	while (!job->done) {
+		pthread_cond_wait(&q->done, &q->lock);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return job->result;
+}
+
+/*! Returns non-zero if a submitted read has completed */
+int dvdwrap_ioq_done(dvdwrap_ioq_t *q, dvdwrap_ioq_job_t *job)
+{
+	int done;
+
+	pthread_mutex_lock(&q->lock);
+	done = job->done;
+	pthread_mutex_unlock(&q->lock);
+	return done;
+}
+
+/*! Synchronous read through a device queue.  Returns bytes read or -errno. */
+ssize_t dvdwrap_ioq_read(dvdwrap_ioq_t *q, int fd, void *buf, size_t size,
+	off_t offset, dvdwrap_sched_class_t class)
+{
+	dvdwrap_ioq_job_t job;
+
+	job.entry.class = class;
+	job.fd = fd;
+	job.buf = buf;
+	job.size = size;
+	job.offset = offset;
+	dvdwrap_ioq_submit(q, &job);
+	return dvdwrap_ioq_wait(q, &job);
+}
+
+/*! Writes per-device queue statistics */
+void dvdwrap_ioq_report(dvdwrap_ioq_set_t *set, dvdwrap_buf_t *buf)
+{
+	dvdwrap_ioq_t *q;
+
+	dvdwrap_buf_printf(buf, "%-10s %7s %5s %5s %10s %7s %12s %9s %9s %9s %7s %7s %9s\n",
+		"device", "workers", "depth", "peak", "reads", "errors", "bytes",
+		"wait_us", "svc_us", "max_us", "stalls", "stalled", "stall_ms");
+	pthread_mutex_lock(&set->lock);
+	for (q = set->queues; q; q = q->next) {
+		char dev[32];
+
+		pthread_mutex_lock(&q->lock);
+		snprintf(dev, sizeof(dev), "%u:%u", major(q->dev), minor(q->dev));
+		dvdwrap_buf_printf(buf,
+			"%-10s %7u %5u %5u %10llu %7llu %12llu %9llu %9llu %9llu %7llu %7u %9llu\n",
+			dev, q->nworkers, q->depth, q->peak_depth,
+			(unsigned long long)q->completed, (unsigned long long)q->errors,
+			(unsigned long long)q->bytes,
+			(unsigned long long)(q->completed ? q->wait_us / q->completed : 0),
+			(unsigned long long)(q->completed ? q->service_us / q->completed : 0),
+			(unsigned long long)q->max_us, (unsigned long long)q->stalls,
+			q->stalled, (unsigned long long)(q->stall_max_us / 1000));
+		pthread_mutex_unlock(&q->lock);
+	}
+	pthread_mutex_unlock(&set->lock);
+}
+
+/*! Lists recent stalls, newest first */
+void dvdwrap_ioq_stall_report(dvdwrap_ioq_set_t *set, dvdwrap_buf_t *buf)
+{
+	uint64_t now = dvdwrap_now_us();
+	uint64_t seq;
+
+	pthread_mutex_lock(&set->stall_lock);
+	dvdwrap_buf_printf(buf, "stall_ms %u\nstalls %llu\n\n", set->conf->stall,
+		(unsigned long long)set->nstalls);
+	dvdwrap_buf_printf(buf, "%-19s %-10s %9s %-9s %12s %8s %s\n",
+		"when", "device", "ms", "result", "offset", "size", "path");
+	for (seq = set->nstalls; seq > 0 && seq + IOQ_STALL_LOG > set->nstalls; seq--) {
+		const dvdwrap_ioq_stall_t *stall = &set->stall_log[(seq - 1) % IOQ_STALL_LOG];
+		char when[32], dev[32], result[24];
+		uint64_t us = stall->us;
+		struct tm tm;
+
+		localtime_r(&stall->when, &tm);
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+		snprintf(dev, sizeof(dev), "%u:%u", major(stall->dev), minor(stall->dev));
+		if (!stall->done) {
+			/* Still waiting - show how long for so far */
+			us = now - stall->start;
+			snprintf(result, sizeof(result), "waiting");
+		} else if (stall->result < 0) {
+			snprintf(result, sizeof(result), "err %d", (int)-stall->result);
+		} else {
+			snprintf(result, sizeof(result), "%zd", stall->result);
+		}
+		dvdwrap_buf_printf(buf, "%-19s %-10s %9llu %-9s %12llu %8zu %s\n",
+			when, dev, (unsigned long long)(us / 1000), result,
+			(unsigned long long)stall->offset, stall->size, stall->path);
+	}
+	pthread_mutex_unlock(&set->stall_lock);
+}
@@ -0,0 +1,146 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DVDWRAP_IOQ_H
+#define _DVDWRAP_IOQ_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "dvdwrap_sched.h"
+#include "dvdwrap_buf.h"
+
+#define IOQ_STALL_LOG		32			/*!< Recent stalls remembered */
+#define IOQ_STALL_PATH		256
+
+/*! Device queue tunables */
+typedef struct {
+	unsigned int	depth;			/*!< Max reads queued or in flight per device */
+	unsigned int	stall;			/*!< Reads slower than this are reported
+									 *   as stalled (ms), 0 = never */
+} dvdwrap_ioq_conf_t;
+
+/*! A backend read.  Owned by the submitter until dvdwrap_ioq_wait returns. */
+typedef struct {
+	dvdwrap_sched_entry_t	entry;		/*!< Must be first */
+	int						fd;
+	void					*buf;
+	size_t					size;
+	off_t					offset;
+	uint64_t				queued;		/*!< Submission time (us) */
+	ssize_t					result;		/*!< Bytes read or -errno */
+	int						done;
+} dvdwrap_ioq_job_t;
+
+struct dvdwrap_ioq;
+struct dvdwrap_ioq_set;
+
+/*! A worker thread, and the read it is doing for the stall watchdog */
+typedef struct {
+	struct dvdwrap_ioq	*q;
+	pthread_t			thread;
+	dvdwrap_ioq_job_t	*job;		/*!< Read in progress, or NULL */
+	uint64_t			start;		/*!< When it was issued (us) */
+	int					stalled;	/*!< Reported as stalled */
+	uint64_t			stall_seq;	/*!< Its entry in the stall log */
+} dvdwrap_ioq_worker_t;
+
+/*! A read reported by the watchdog */
+typedef struct {
+	uint64_t			seq;		/*!< Stalls before this one + 1 */
+	time_t				when;		/*!< Wall clock when noticed */
+	dev_t				dev;
+	char				path[IOQ_STALL_PATH];
+	off_t				offset;
+	size_t				size;
+	uint64_t			start;		/*!< When the read was issued (us) */
+	uint64_t			us;			/*!< Time taken, once done */
+	int					done;
+	ssize_t				result;		/*!< Bytes read or -errno, once done */
+} dvdwrap_ioq_stall_t;
+
+/*! Queue and worker pool serving a single backing device */
+typedef struct dvdwrap_ioq {
+	struct dvdwrap_ioq	*next;
+	struct dvdwrap_ioq_set	*set;
+	dev_t				dev;
+
+	const dvdwrap_ioq_conf_t	*conf;
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;		/*!< Signalled when a job may be startable */
+	pthread_cond_t		done;		/*!< Broadcast when a job completes */
+	pthread_cond_t		space;		/*!< Signalled when depth drops */
+	dvdwrap_sched_t		sched;
+	unsigned int		depth;		/*!< Jobs queued or in flight */
+	unsigned int		nworkers;
+	dvdwrap_ioq_worker_t	*workers;
+	int					stop;
+
+	/* Statistics */
+	unsigned int		peak_depth;
+	uint64_t			completed;
+	uint64_t			errors;
+	uint64_t			bytes;
+	uint64_t			wait_us;	/*!< Total time queued */
+	uint64_t			service_us;	/*!< Total time in read() */
+	uint64_t			max_us;		/*!< Worst submit to completion time */
+	uint64_t			stalls;		/*!< Reads reported as stalled */
+	unsigned int		stalled;	/*!< Of those, still in progress */
+	uint64_t			stall_us;	/*!< Total time taken by them */
+	uint64_t			stall_max_us;
+} dvdwrap_ioq_t;
+
+/*! All device queues */
+typedef struct dvdwrap_ioq_set {
+	pthread_mutex_t				lock;
+	dvdwrap_ioq_t				*queues;
+	const dvdwrap_ioq_conf_t	*conf;
+	const dvdwrap_sched_conf_t	*sched_conf;
+
+	/* Stall watchdog */
+	pthread_t					watch;
+	pthread_cond_t				wake;
+	int							running;
+	int							stop;
+	pthread_mutex_t				stall_lock;		/*!< Taken after a queue's lock */
+	dvdwrap_ioq_stall_t			stall_log[IOQ_STALL_LOG];
+	uint64_t					nstalls;
+} dvdwrap_ioq_set_t;
+
+void dvdwrap_ioq_set_init(dvdwrap_ioq_set_t *set, const dvdwrap_ioq_conf_t *conf,
+	const dvdwrap_sched_conf_t *sched_conf);
+void dvdwrap_ioq_set_destroy(dvdwrap_ioq_set_t *set);
+int dvdwrap_ioq_watch_start(dvdwrap_ioq_set_t *set);
+void dvdwrap_ioq_watch_stop(dvdwrap_ioq_set_t *set);
+dvdwrap_ioq_t* dvdwrap_ioq_get(dvdwrap_ioq_set_t *set, dev_t dev);
+
+void dvdwrap_ioq_submit(dvdwrap_ioq_t *q, dvdwrap_ioq_job_t *job);
+ssize_t dvdwrap_ioq_wait(dvdwrap_ioq_t *q, dvdwrap_ioq_job_t *job);
+int dvdwrap_ioq_done(dvdwrap_ioq_t *q, dvdwrap_ioq_job_t *job);
+ssize_t dvdwrap_ioq_read(dvdwrap_ioq_t *q, int fd, void *buf, size_t size,
+	off_t offset, dvdwrap_sched_class_t class);
+void dvdwrap_ioq_report(dvdwrap_ioq_set_t *set, dvdwrap_buf_t *buf);
+void dvdwrap_ioq_stall_report(dvdwrap_ioq_set_t *set, dvdwrap_buf_t *buf);
+
+#endif
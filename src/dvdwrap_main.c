@@ -0,0 +1,247 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "dvdwrap_fuse.h"
+
+#define DVDWRAP_OPT(t, p, v)	{ t, offsetof(dvdwrap_ctx_t, p), v }
+
+static struct fuse_opt dvdwrap_opts[] = {
+	DVDWRAP_OPT("sched_slots=%u",		sched_conf.slots, 0),
+	DVDWRAP_OPT("sched_share=%u",		sched_conf.share, 0),
+	DVDWRAP_OPT("sched_deadline=%u",	sched_conf.deadline, 0),
+	DVDWRAP_OPT("probe_deadline=%u",	sched_conf.probe_deadline, 0),
+	DVDWRAP_OPT("playback_rate=%u",		sched_conf.playback_rate, 0),
+	DVDWRAP_OPT("ioq_depth=%u",			ioq_conf.depth, 0),
+	DVDWRAP_OPT("ioq_stall=%u",			ioq_conf.stall, 0),
+	DVDWRAP_OPT("chunk_size=%u",		chunk_conf.size, 0),
+	DVDWRAP_OPT("chunk_depth=%u",		chunk_conf.depth, 0),
+	DVDWRAP_OPT("cache_size=%u",		cache_conf.size, 0),
+	DVDWRAP_OPT("ssd_dir=%s",			ssd_conf.dir, 0),
+	DVDWRAP_OPT("ssd_size=%u",			ssd_conf.size, 0),
+	DVDWRAP_OPT("ssd_admit=%u",			ssd_conf.admit, 0),
+	DVDWRAP_OPT("state_dir=%s",			warm_conf.dir, 0),
+	DVDWRAP_OPT("spin_buffer=%u",		spin_conf.size, 0),
+	DVDWRAP_OPT("spin_total=%u",		spin_conf.total, 0),
+	DVDWRAP_OPT("spin_up=%u",			spin_conf.spinup, 0),
+	DVDWRAP_OPT("pin_size=%u",			pin_conf.size, 0),
+	DVDWRAP_OPT("pin_head=%u",			pin_conf.head, 0),
+	DVDWRAP_OPT("pin_tail=%u",			pin_conf.tail, 0),
+	DVDWRAP_OPT("mem_interval=%u",		mem_conf.interval, 0),
+	DVDWRAP_OPT("mem_min=%u",			mem_conf.min, 0),
+	DVDWRAP_OPT("mem_pressure=%u",		mem_conf.pressure, 0),
+	DVDWRAP_OPT("index_threads=%u",		index_conf.threads, 0),
+	DVDWRAP_OPT("index_ttl=%u",			index_conf.ttl, 0),
+	DVDWRAP_OPT("index_recheck=%u",		index_conf.recheck, 0),
+	DVDWRAP_OPT("index_speculate=%u",	index_conf.speculate, 0),
+	DVDWRAP_OPT("client_expire=%u",		client_conf.expire, 0),
+	DVDWRAP_OPT("log_level=%u",			log_level, 0),
+	DVDWRAP_OPT("trace_file=%s",		trace_file, 0),
+	FUSE_OPT_END
+};
+
+static void dvdwrap_usage(const char *progname)
+{
+	fprintf(stderr,"Usage: %s <source> <mount point> [options]\n\n", progname);
+	fprintf(stderr,
+		"dvdwrap options:\n"
+		"    -o sched_slots=N       concurrent backend reads per device (%u)\n"
+		"    -o sched_share=PCT     read slots reserved for playback streams (%u)\n"
+		"    -o sched_deadline=MS   playback read deadline (%u)\n"
+		"    -o probe_deadline=MS   random access read deadline, longer so that\n"
+		"                           scanners don't hold up playback (%u)\n"
+		"    -o playback_rate=KIB   fastest sequential read treated as playback (%u)\n"
+		"    -o ioq_depth=N         reads queued or in flight per device (%u)\n"
+		"    -o ioq_stall=MS        report reads slower than this as stalled in\n"
+		"                           .dvdwrap/stalls (%u, 0 = never)\n"
+		"    -o chunk_size=KIB      split reads into parallel chunks, for network\n"
+		"                           sources (0 = off)\n"
+		"    -o chunk_depth=N       chunks kept in flight ahead of a stream, up\n"
+		"                           to %u (%u)\n"
+		"    -o cache_size=MIB      block cache shared by all handles (%u)\n"
+		"    -o ssd_dir=PATH        cache hot titles in this local directory\n"
+		"    -o ssd_size=MIB        capacity of ssd_dir (%u)\n"
+		"    -o ssd_admit=N         opens before a title is cached in ssd_dir (%u)\n"
+		"    -o state_dir=PATH      save what the block cache holds, and how each\n"
+		"                           title is read, here at unmount and load them\n"
+		"                           again at the next mount\n"
+		"    -o spin_buffer=MIB     read playback streams this far ahead in one go\n"
+		"                           so idle disks can spin down (0 = off)\n"
+		"    -o spin_total=MIB      memory for all spin_buffer buffers (%u)\n"
+		"    -o spin_up=S           disk spin-up time to allow for (%u)\n"
+		"    -o pin_size=MIB        memory for the pinned start and end of each\n"
+		"                           title opened, kept in ssd_dir if set (0 = off)\n"
+		"    -o pin_head=KIB        bytes pinned from the start of a title (%u)\n"
+		"    -o pin_tail=KIB        bytes pinned from the end of a title (%u)\n"
+		"    -o mem_interval=S      how often to check free memory and resize the\n"
+		"                           caches to suit (%u, 0 = never)\n"
+		"    -o mem_min=PCT         smallest the caches shrink to (%u)\n"
+		"    -o mem_pressure=PCT    memory stall time that shrinks the caches (%u)\n"
+		"    -o index_threads=N     threads walking the source tree in the\n"
+		"                           background so browsing is quick (0 = off)\n"
+		"    -o index_ttl=S         how long to trust what is known about a DVD\n"
+		"                           image before looking again (%u)\n"
+		"    -o index_recheck=S     how long before checking a DVD image hasn't\n"
+		"                           changed, for network sources (%u, 0 = never)\n"
+		"    -o index_speculate=N   DVD images of a listing to scan in the\n"
+		"                           background before they are stat'd (%u)\n"
+		"    -o client_expire=S     forget processes idle this long in\n"
+		"                           .dvdwrap/clients (%u)\n"
+		"    -o log_level=N         debug logging to the trace ring, and to stderr\n"
+		"                           in DEBUG builds (%u)\n"
+		"    -o trace_file=PATH     where SIGUSR1 dumps the trace ring, for\n"
+		"                           dvdtrace (state_dir/trace, or\n"
+		"                           /tmp/dvdwrap-<pid>.trace)\n"
+		"\n"
+		"Settings listed in .dvdwrap/control can be changed while mounted by\n"
+		"writing key=value lines to it.  chunk_depth, spin_buffer, pin_head and\n"
+		"pin_tail only affect files opened after the change.\n"
+		"\n",
+		DEFAULT_SCHED_SLOTS, DEFAULT_SCHED_SHARE, DEFAULT_SCHED_DEADLINE,
+		DEFAULT_PROBE_DEADLINE, DEFAULT_PLAYBACK_RATE, DEFAULT_IOQ_DEPTH, DEFAULT_IOQ_STALL,
+		CHUNK_MAX_DEPTH, DEFAULT_CHUNK_DEPTH,
+		DEFAULT_CACHE_SIZE, DEFAULT_SSD_SIZE, DEFAULT_SSD_ADMIT,
+		DEFAULT_SPIN_TOTAL, DEFAULT_SPIN_UP, DEFAULT_PIN_HEAD, DEFAULT_PIN_TAIL,
+		DEFAULT_MEM_INTERVAL, DEFAULT_MEM_MIN, DEFAULT_MEM_PRESSURE,
+		DEFAULT_INDEX_TTL, DEFAULT_INDEX_RECHECK, DEFAULT_INDEX_SPECULATE,
+		DEFAULT_CLIENT_EXPIRE, DEFAULT_LOG_LEVEL);
+}
+
+/*!
+ * Creates a directory named by an option if it doesn't exist, and makes
+ * its path absolute, as fuse changes directory when it daemonises.
+ *
+ * \param dir		Option value, replaced with the absolute path
+ * \return			0, or -1 if the directory can't be used
+ */
+static int dvdwrap_option_dir(char **dir)
+{
+	char *path;
+
+	mkdir(*dir, 0700);
+	path = realpath(*dir, NULL);
+	if (path == NULL) {
+		return -1;
+	}
+	free(*dir);
+	*dir = path;
+	return 0;
+}
+
+/*!
+ * Makes the path of a file named by an option absolute, for the same
+ * reason.
+ *
+ * \param file		Option value, replaced with the absolute path
+ * \return			0, or -1 if the current directory is unknown
+ */
+static int dvdwrap_option_file(char **file)
+{
+	char cwd[PATH_MAX];
+	char *path;
+
+	if (**file == '/') {
+		return 0;
+	}
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		return -1;
+	}
+	path = (char*)malloc(strlen(cwd) + strlen(*file) + 2);
+	if (path == NULL) {
+		return -1;
+	}
+	sprintf(path, "%s/%s", cwd, *file);
+	free(*file);
+	*file = path;
+	return 0;
+}
+
+static int dvdwrap_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+	dvdwrap_ctx_t *ctx = (dvdwrap_ctx_t*)data;
+
+	if (key == FUSE_OPT_KEY_NONOPT && ctx->sourcepath == NULL) {
+		/* First non-option is the source, which fuse doesn't need */
+		ctx->sourcepath = realpath(arg, NULL);
+		if (ctx->sourcepath == NULL) {
+			fprintf(stderr, "Bad source path %s\n", arg);
+			return -1;
+		}
+		return 0;
+	}
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	dvdwrap_ctx_t *ctx;
+
+	if (argc < 3) {
+		dvdwrap_usage(argv[0]);
+		return 1;
+	}
+
+	ctx = dvdwrap_ctx_new();
+	if (ctx == NULL) {
+		fprintf(stderr, "Failed to allocate private data\n");
+		return 1;
+	}
+
+	if (fuse_opt_parse(&args, ctx, dvdwrap_opts, dvdwrap_opt_proc) < 0) {
+		return 1;
+	}
+	if (ctx->sourcepath == NULL) {
+		dvdwrap_usage(argv[0]);
+		return 1;
+	}
+	if (ctx->trace_file && dvdwrap_option_file(&ctx->trace_file) < 0) {
+		fprintf(stderr, "Bad trace file %s\n", ctx->trace_file);
+		return 1;
+	}
+	if (ctx->ssd_conf.dir && dvdwrap_option_dir(&ctx->ssd_conf.dir) < 0) {
+		fprintf(stderr, "Bad SSD cache directory %s\n", ctx->ssd_conf.dir);
+		return 1;
+	}
+	if (ctx->warm_conf.dir && dvdwrap_option_dir(&ctx->warm_conf.dir) < 0) {
+		fprintf(stderr, "Bad state directory %s\n", ctx->warm_conf.dir);
+		return 1;
+	}
+	if (dvdwrap_ctx_setup(ctx) < 0) {
+		return 1;
+	}
+
+	/* SIGUSR1 is blocked here, so every fuse thread inherits the mask */
+	dvdwrap_trace_init();
+	return fuse_main(args.argc, args.argv, &dvdwrap_oper, ctx);
+}
+
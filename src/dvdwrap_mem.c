@@ -0,0 +1,300 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Memory budget.  The caches are sized by options at mount, but the
+ * memory actually free to the mount changes as other programs run,
+ * especially in a container with a memory limit.  A thread watches the
+ * headroom in the mount's cgroup (or the system if it has no limit) and
+ * memory pressure stall information, and scales every registered cache
+ * down while memory is short and back up towards its configured size
+ * once it isn't.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "dvdwrap_fuse.h"
+#include "dvdwrap_mem.h"
+
+#define CGROUP_ROOT		"/sys/fs/cgroup"
+
+/*! Reads a small file into a string */
+static int dvdwrap_mem_read_file(const char *name, char *buf, size_t size)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		return -errno;
+	}
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0) {
+		return -EIO;
+	}
+	buf[len] = '\0';
+	return 0;
+}
+
+/*! Finds the cgroup v2 directory of this process, if it has a memory
+ * controller */
+static void dvdwrap_mem_find_cgroup(dvdwrap_mem_t *mem)
+{
+	char buf[1024], name[PATH_MAX + 32], *line, *save;
+
+	mem->cgroup[0] = '\0';
+	if (dvdwrap_mem_read_file("/proc/self/cgroup", buf, sizeof(buf)) < 0) {
+		return;
+	}
+	for (line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+		if (strncmp(line, "0::", 3) == 0) {
+			snprintf(mem->cgroup, sizeof(mem->cgroup), CGROUP_ROOT "%s", line + 3);
+			break;
+		}
+	}
+	snprintf(name, sizeof(name), "%s/memory.max", mem->cgroup);
+	if (mem->cgroup[0] && access(name, R_OK) < 0) {
+		/* v1, or the root which has no limit */
+		mem->cgroup[0] = '\0';
+	}
+}
+
+/*! Bytes the mount can allocate before hitting a limit */
+static uint64_t dvdwrap_mem_available(dvdwrap_mem_t *mem)
+{
+	char buf[4096], name[PATH_MAX + 32], *p;
+
+	if (mem->cgroup[0]) {
+		uint64_t max, current;
+
+		snprintf(name, sizeof(name), "%s/memory.max", mem->cgroup);
+		if (dvdwrap_mem_read_file(name, buf, sizeof(buf)) == 0 && strncmp(buf, "max", 3) != 0) {
+			max = strtoull(buf, NULL, 10);
+			snprintf(name, sizeof(name), "%s/memory.current", mem->cgroup);
+			if (dvdwrap_mem_read_file(name, buf, sizeof(buf)) == 0) {
+				current = strtoull(buf, NULL, 10);
+				return max > current ? max - current : 0;
+			}
+		}
+	}
+
+	/* No limit on the cgroup - use what the system has */
+	if (dvdwrap_mem_read_file("/proc/meminfo", buf, sizeof(buf)) == 0 &&
+			(p = strstr(buf, "MemAvailable:")) != NULL) {
+		return strtoull(p + 13, NULL, 10) * 1024;
+	}
+	return UINT64_MAX;
+}
+
+/*! Share of the last 10s that tasks stalled waiting for memory (%), or
+ * -1 if the kernel doesn't report it */
+static double dvdwrap_mem_stall(dvdwrap_mem_t *mem)
+{
+	char buf[256], name[PATH_MAX + 32];
+	double avg10;
+
+	snprintf(name, sizeof(name), "%s/memory.pressure", mem->cgroup);
+	if ((mem->cgroup[0] == '\0' || dvdwrap_mem_read_file(name, buf, sizeof(buf)) < 0) &&
+			dvdwrap_mem_read_file("/proc/pressure/memory", buf, sizeof(buf)) < 0) {
+		return -1.0;
+	}
+	if (sscanf(buf, "some avg10=%lf", &avg10) != 1) {
+		return -1.0;
+	}
+	return avg10;
+}
+
+/*! Takes readings and rescales the consumers if needed */
+static void dvdwrap_mem_check(dvdwrap_mem_t *mem)
+{
+	uint64_t available = dvdwrap_mem_available(mem);
+	double stall = dvdwrap_mem_stall(mem);
+	uint64_t ours = 0;
+	unsigned int scale, n;
+
+	pthread_mutex_lock(&mem->lock);
+	for (n = 0; n < mem->nconsumers; n++) {
+		ours += mem->consumers[n].max;
+	}
+	scale = mem->scale;
+	if (stall >= mem->conf->pressure || available < ours / 8) {
+		/* Back off quickly */
+		scale = scale * 3 / 4;
+		if (scale < mem->conf->min) {
+			scale = mem->conf->min;
+		}
+	} else if (stall < mem->conf->pressure / 4.0 && available > ours / 4) {
+		/* Recover slowly */
+		scale += 10;
+		if (scale > 100) {
+			scale = 100;
+		}
+	}
+	mem->available = available;
+	mem->stall = stall;
+
+	if (scale != mem->scale) {
+		LOG("Memory scale %u%% -> %u%%\n", mem->scale, scale);
+		if (scale < mem->scale) {
+			mem->shrinks++;
+		} else {
+			mem->grows++;
+		}
+		mem->scale = scale;
+		for (n = 0; n < mem->nconsumers; n++) {
+			dvdwrap_mem_consumer_t *c = &mem->consumers[n];
+
+			c->limit = c->max * scale / 100;
+			c->set_limit(c->arg, c->limit);
+		}
+	}
+	pthread_mutex_unlock(&mem->lock);
+}
+
+void dvdwrap_mem_init(dvdwrap_mem_t *mem, const dvdwrap_mem_conf_t *conf)
+{
+	memset(mem, 0, sizeof(dvdwrap_mem_t));
+	mem->conf = conf;
+	pthread_mutex_init(&mem->lock, NULL);
+	pthread_cond_init(&mem->wake, NULL);
+	mem->scale = 100;
+	mem->stall = -1.0;
+	dvdwrap_mem_find_cgroup(mem);
+}
+
+/*!
+ * Adds a cache to be scaled.  Must be called before dvdwrap_mem_start.
+ *
+ * \param mem			Memory budget
+ * \param name			Shown in the report
+ * \param max			Configured size (bytes)
+ * \param set_limit		Called with each new limit
+ * \param arg			Passed to set_limit
+ */
+void dvdwrap_mem_register(dvdwrap_mem_t *mem, const char *name, uint64_t max,
+	dvdwrap_mem_limit_t set_limit, void *arg)
+{
+	dvdwrap_mem_consumer_t *c;
+
+	if (mem->nconsumers == MEM_MAX_CONSUMERS) {
+		return;
+	}
+	c = &mem->consumers[mem->nconsumers++];
+	c->name = name;
+	c->max = c->limit = max;
+	c->set_limit = set_limit;
+	c->arg = arg;
+}
+
+/*! Changes the configured size of a registered cache */
+void dvdwrap_mem_set_max(dvdwrap_mem_t *mem, const char *name, uint64_t max)
+{
+	unsigned int n;
+
+	pthread_mutex_lock(&mem->lock);
+	for (n = 0; n < mem->nconsumers; n++) {
+		dvdwrap_mem_consumer_t *c = &mem->consumers[n];
+
+		if (strcmp(c->name, name) == 0) {
+			c->max = max;
+			c->limit = max * mem->scale / 100;
+			c->set_limit(c->arg, c->limit);
+		}
+	}
+	pthread_mutex_unlock(&mem->lock);
+}
+
+static void* dvdwrap_mem_thread(void *arg)
+{
+	dvdwrap_mem_t *mem = (dvdwrap_mem_t*)arg;
+	struct timespec ts;
+
+	pthread_mutex_lock(&mem->lock);
+	while (!mem->stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += mem->conf->interval;
+		pthread_cond_timedwait(&mem->wake, &mem->lock, &ts);
+		if (mem->stop) {
+			break;
+		}
+		pthread_mutex_unlock(&mem->lock);
+		dvdwrap_mem_check(mem);
+		pthread_mutex_lock(&mem->lock);
+	}
+	pthread_mutex_unlock(&mem->lock);
+	return NULL;
+}
+
+/*! Starts watching memory.  Must be called after fuse has daemonised. */
+int dvdwrap_mem_start(dvdwrap_mem_t *mem)
+{
+	if (mem->conf->interval == 0 || mem->nconsumers == 0) {
+		return 0;
+	}
+	if (pthread_create(&mem->thread, NULL, dvdwrap_mem_thread, mem) != 0) {
+		return -EAGAIN;
+	}
+	mem->running = 1;
+	return 0;
+}
+
+void dvdwrap_mem_destroy(dvdwrap_mem_t *mem)
+{
+	if (mem->running) {
+		pthread_mutex_lock(&mem->lock);
+		mem->stop = 1;
+		pthread_cond_broadcast(&mem->wake);
+		pthread_mutex_unlock(&mem->lock);
+		pthread_join(mem->thread, NULL);
+		mem->running = 0;
+	}
+}
+
+void dvdwrap_mem_report(dvdwrap_mem_t *mem, dvdwrap_buf_t *buf)
+{
+	unsigned int n;
+
+	pthread_mutex_lock(&mem->lock);
+	dvdwrap_buf_printf(buf,
+		"cgroup %s\n"
+		"available %llu\n"
+		"stall %.2f\n"
+		"scale %u\n"
+		"shrinks %llu\n"
+		"grows %llu\n\n",
+		mem->cgroup[0] ? mem->cgroup : "none",
+		(unsigned long long)mem->available, mem->stall, mem->scale,
+		(unsigned long long)mem->shrinks, (unsigned long long)mem->grows);
+	dvdwrap_buf_printf(buf, "%-10s %12s %12s\n", "consumer", "max", "limit");
+	for (n = 0; n < mem->nconsumers; n++) {
+		dvdwrap_buf_printf(buf, "%-10s %12llu %12llu\n", mem->consumers[n].name,
+			(unsigned long long)mem->consumers[n].max,
+			(unsigned long long)mem->consumers[n].limit);
+	}
+	pthread_mutex_unlock(&mem->lock);
+}
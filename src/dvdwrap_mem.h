@@ -0,0 +1,84 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DVDWRAP_MEM_H
+#define _DVDWRAP_MEM_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "dvdwrap_buf.h"
+
+#define MEM_MAX_CONSUMERS	8
+
+/*! Memory budget tunables */
+typedef struct {
+	unsigned int	interval;		/*!< Seconds between checks, 0 to disable */
+	unsigned int	min;			/*!< Smallest share of configured sizes (%) */
+	unsigned int	pressure;		/*!< Stall time above which caches shrink (%) */
+} dvdwrap_mem_conf_t;
+
+/*! Applies a new limit to a consumer */
+typedef void (*dvdwrap_mem_limit_t)(void *arg, uint64_t limit);
+
+/*! Something holding memory whose size can be changed at run time */
+typedef struct {
+	const char			*name;
+	uint64_t			max;		/*!< Configured size (bytes) */
+	uint64_t			limit;		/*!< Current limit (bytes) */
+	dvdwrap_mem_limit_t	set_limit;
+	void				*arg;
+} dvdwrap_mem_consumer_t;
+
+/*! Scales caches with the memory available to the mount */
+typedef struct {
+	const dvdwrap_mem_conf_t	*conf;
+	pthread_mutex_t		lock;
+	pthread_cond_t		wake;
+	pthread_t			thread;
+	int					running;
+	int					stop;
+
+	dvdwrap_mem_consumer_t	consumers[MEM_MAX_CONSUMERS];
+	unsigned int		nconsumers;
+	unsigned int		scale;		/*!< Current share of configured sizes (%) */
+	char				cgroup[PATH_MAX];	/*!< cgroup v2 directory, or empty */
+
+	/* Last readings */
+	uint64_t			available;	/*!< Bytes free to the mount */
+	double				stall;		/*!< PSI some avg10 (%), < 0 if unknown */
+
+	/* Statistics */
+	uint64_t			shrinks;
+	uint64_t			grows;
+} dvdwrap_mem_t;
+
+void dvdwrap_mem_init(dvdwrap_mem_t *mem, const dvdwrap_mem_conf_t *conf);
+void dvdwrap_mem_register(dvdwrap_mem_t *mem, const char *name, uint64_t max,
+	dvdwrap_mem_limit_t set_limit, void *arg);
+void dvdwrap_mem_set_max(dvdwrap_mem_t *mem, const char *name, uint64_t max);
+int dvdwrap_mem_start(dvdwrap_mem_t *mem);
+void dvdwrap_mem_destroy(dvdwrap_mem_t *mem);
+void dvdwrap_mem_report(dvdwrap_mem_t *mem, dvdwrap_buf_t *buf);
+
+#endif
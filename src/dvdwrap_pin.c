@@ -0,0 +1,558 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Pinned head and tail blocks.  Players read the start of a file to
+ * begin playback and media scanners probe both ends for headers and
+ * duration, so those reads decide how responsive the mount feels while
+ * the disks behind it may be asleep.  The first and last few hundred KiB
+ * of each title opened are loaded by a background thread and held in
+ * memory, outside the block cache.  When pin_size is full, or the memory
+ * monitor cuts it, titles with no open handles are dropped, the longest
+ * unopened first.  If ssd_dir is set the pinned data is saved there at
+ * unmount and reloaded at the next mount.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include "dvdwrap_fuse.h"
+#include "dvdwrap_pin.h"
+
+#define PIN_BUCKETS			1024
+#define PIN_MAGIC			"DVDWPIN1"
+#define PIN_FILE			"pinned"
+
+/*! Persisted file header */
+typedef struct {
+	char		magic[8];
+	uint32_t	count;
+	uint32_t	reserved;
+} dvdwrap_pin_file_header_t;
+
+/*! Persisted entry, followed by its path, head and tail */
+typedef struct {
+	uint64_t	total_size;
+	int64_t		mtime;
+	uint64_t	tail_offset;
+	uint32_t	pathlen;
+	uint32_t	head_len;
+	uint32_t	tail_len;
+	uint32_t	reserved;
+} dvdwrap_pin_record_t;
+
+/*! Gives back an entry's data.  Called with the set locked. */
+static void dvdwrap_pin_free_data(dvdwrap_pin_t *pin, dvdwrap_pin_entry_t *entry)
+{
+	if (entry->head || entry->tail) {
+		pin->used -= entry->head_len + entry->tail_len;
+	}
+	free(entry->head);
+	free(entry->tail);
+	entry->head = entry->tail = NULL;
+}
+
+static void dvdwrap_pin_free(dvdwrap_pin_t *pin, dvdwrap_pin_entry_t *entry)
+{
+	dvdwrap_pin_free_data(pin, entry);
+	free(entry->path);
+	free(entry);
+}
+
+/*! Adds an entry to the hash.  Called with the set locked. */
+static dvdwrap_pin_entry_t* dvdwrap_pin_new(dvdwrap_pin_t *pin, const char *path,
+	uint64_t total_size, time_t mtime)
+{
+	unsigned int bucket = dvdwrap_hash_string(path) % pin->nbuckets;
+	dvdwrap_pin_entry_t *entry;
+
+	entry = (dvdwrap_pin_entry_t*)calloc(1, sizeof(dvdwrap_pin_entry_t));
+	if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+		free(entry);
+		return NULL;
+	}
+	entry->total_size = total_size;
+	entry->mtime = mtime;
+	entry->next = pin->hash[bucket];
+	pin->hash[bucket] = entry;
+	pin->count++;
+	return entry;
+}
+
+/*! Removes an entry from the hash.  Called with the set locked. */
+static void dvdwrap_pin_unlink(dvdwrap_pin_t *pin, dvdwrap_pin_entry_t *entry)
+{
+	dvdwrap_pin_entry_t **e;
+
+	for (e = &pin->hash[dvdwrap_hash_string(entry->path) % pin->nbuckets]; *e; e = &(*e)->next) {
+		if (*e == entry) {
+			*e = entry->next;
+			pin->count--;
+			break;
+		}
+	}
+}
+
+/*! Drops a reference.  Called with the set locked. */
+static void dvdwrap_pin_put(dvdwrap_pin_t *pin, dvdwrap_pin_entry_t *entry)
+{
+	if (--entry->refs == 0 && entry->dead) {
+		dvdwrap_pin_free(pin, entry);
+	}
+}
+
+/*!
+ * Drops titles with no open handles, least recently opened first, until
+ * need more bytes fit.  Called with the set locked.
+ *
+ * \return			Non-zero if there is room
+ */
+static int dvdwrap_pin_evict(dvdwrap_pin_t *pin, uint64_t need)
+{
+	while (pin->used + need > pin->capacity) {
+		dvdwrap_pin_entry_t *entry, *victim = NULL;
+		unsigned int bucket;
+
+		for (bucket = 0; bucket < pin->nbuckets; bucket++) {
+			for (entry = pin->hash[bucket]; entry; entry = entry->next) {
+				if (entry->state == PIN_READY && entry->refs == 0 &&
+						(victim == NULL || entry->last_used < victim->last_used)) {
+					victim = entry;
+				}
+			}
+		}
+		if (victim == NULL) {
+			return 0;
+		}
+		LOG("Unpinning %s\n", victim->path);
+		dvdwrap_pin_unlink(pin, victim);
+		dvdwrap_pin_free(pin, victim);
+		pin->evictions++;
+	}
+	return 1;
+}
+
+/*!
+ * Reserves memory for and allocates an entry's head and tail, once its
+ * size is known, making room by dropping titles not opened for longest.
+ *
+ * \return			0, or -ENOSPC if the title doesn't fit
+ */
+int dvdwrap_pin_alloc(dvdwrap_pin_t *pin, dvdwrap_pin_entry_t *entry)
+{
+	uint64_t head = (uint64_t)pin->conf->head * 1024;
+	uint64_t tail = (uint64_t)pin->conf->tail * 1024;
+
+	entry->head_len = head < entry->total_size ? head : entry->total_size;
+	entry->tail_offset = tail < entry->total_size ? entry->total_size - tail : 0;
+	if (entry->tail_offset < entry->head_len) {
+		/* Small title - don't hold the middle twice */
+		entry->tail_offset = entry->head_len;
+	}
+	entry->tail_len = entry->total_size - entry->tail_offset;
+
+	pthread_mutex_lock(&pin->lock);
+	if (!dvdwrap_pin_evict(pin, entry->head_len + entry->tail_len)) {
+		pin->rejected++;
+		pthread_mutex_unlock(&pin->lock);
+		return -ENOSPC;
+	}
+	pin->used += entry->head_len + entry->tail_len;
+	pthread_mutex_unlock(&pin->lock);
+
+	entry->head = entry->head_len ? (char*)malloc(entry->head_len) : NULL;
+	entry->tail = entry->tail_len ? (char*)malloc(entry->tail_len) : NULL;
+	if ((entry->head_len && entry->head == NULL) || (entry->tail_len && entry->tail == NULL)) {
+		pthread_mutex_lock(&pin->lock);
+		pin->used -= entry->head_len + entry->tail_len;
+		pthread_mutex_unlock(&pin->lock);
+		free(entry->head);
+		free(entry->tail);
+		entry->head = entry->tail = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/*! Changes the memory for pinned data.  Titles with no open handles are
+ * dropped to fit at once, and the rest as they close. */
+void dvdwrap_pin_set_capacity(dvdwrap_pin_t *pin, uint64_t capacity)
+{
+	pthread_mutex_lock(&pin->lock);
+	pin->capacity = capacity;
+	dvdwrap_pin_evict(pin, 0);
+	pthread_mutex_unlock(&pin->lock);
+}
+
+/*! Loads data pinned at the last unmount */
+static void dvdwrap_pin_restore(dvdwrap_pin_t *pin)
+{
+	dvdwrap_pin_file_header_t hdr;
+	char name[PATH_MAX];
+	unsigned int n;
+	int fd;
+
+	snprintf(name, PATH_MAX, "%s/" PIN_FILE, pin->conf->dir);
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+			memcmp(hdr.magic, PIN_MAGIC, sizeof(hdr.magic)) != 0) {
+		close(fd);
+		return;
+	}
+	for (n = 0; n < hdr.count; n++) {
+		dvdwrap_pin_record_t rec;
+		dvdwrap_pin_entry_t *entry;
+		char path[PATH_MAX];
+
+		if (read(fd, &rec, sizeof(rec)) != sizeof(rec) || rec.pathlen >= PATH_MAX ||
+				read(fd, path, rec.pathlen) != rec.pathlen) {
+			break;
+		}
+		path[rec.pathlen] = '\0';
+		entry = dvdwrap_pin_new(pin, path, rec.total_size, (time_t)rec.mtime);
+		if (entry == NULL) {
+			break;
+		}
+		/* The pinned sizes may have been changed since - skip the data and
+		 * load the title again when it is next opened */
+		if (dvdwrap_pin_alloc(pin, entry) < 0 || entry->head_len != rec.head_len ||
+				entry->tail_offset != rec.tail_offset || entry->tail_len != rec.tail_len) {
+			dvdwrap_pin_unlink(pin, entry);
+			dvdwrap_pin_free(pin, entry);
+			if (lseek(fd, (off_t)rec.head_len + rec.tail_len, SEEK_CUR) < 0) {
+				break;
+			}
+			continue;
+		}
+		if (read(fd, entry->head, entry->head_len) != (ssize_t)entry->head_len ||
+				read(fd, entry->tail, entry->tail_len) != (ssize_t)entry->tail_len) {
+			dvdwrap_pin_unlink(pin, entry);
+			dvdwrap_pin_free(pin, entry);
+			break;
+		}
+		entry->state = PIN_READY;
+	}
+	close(fd);
+	LOG("Restored %u pinned titles\n", pin->count);
+}
+
+/*! Saves pinned data for the next mount */
+static void dvdwrap_pin_save(dvdwrap_pin_t *pin)
+{
+	dvdwrap_pin_file_header_t hdr;
+	dvdwrap_pin_entry_t *entry;
+	char name[PATH_MAX], tmp[PATH_MAX];
+	unsigned int bucket;
+	int fd, ok;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PIN_MAGIC, sizeof(hdr.magic));
+	for (bucket = 0; bucket < pin->nbuckets; bucket++) {
+		for (entry = pin->hash[bucket]; entry; entry = entry->next) {
+			hdr.count += entry->state == PIN_READY;
+		}
+	}
+
+	snprintf(name, PATH_MAX, "%s/" PIN_FILE, pin->conf->dir);
+	snprintf(tmp, PATH_MAX, "%s/" PIN_FILE ".tmp", pin->conf->dir);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		return;
+	}
+	ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr);
+	for (bucket = 0; ok && bucket < pin->nbuckets; bucket++) {
+		for (entry = pin->hash[bucket]; ok && entry; entry = entry->next) {
+			dvdwrap_pin_record_t rec;
+
+			if (entry->state != PIN_READY) {
+				continue;
+			}
+			memset(&rec, 0, sizeof(rec));
+			rec.total_size = entry->total_size;
+			rec.mtime = entry->mtime;
+			rec.tail_offset = entry->tail_offset;
+			rec.pathlen = strlen(entry->path);
+			rec.head_len = entry->head_len;
+			rec.tail_len = entry->tail_len;
+			ok = write(fd, &rec, sizeof(rec)) == sizeof(rec) &&
+				write(fd, entry->path, rec.pathlen) == rec.pathlen &&
+				write(fd, entry->head, rec.head_len) == rec.head_len &&
+				write(fd, entry->tail, rec.tail_len) == rec.tail_len;
+		}
+	}
+	if (fdatasync(fd) < 0) {
+		ok = 0;
+	}
+	close(fd);
+	if (!ok || rename(tmp, name) < 0) {
+		unlink(tmp);
+	}
+}
+
+int dvdwrap_pin_init(dvdwrap_pin_t *pin, const dvdwrap_pin_conf_t *conf)
+{
+	memset(pin, 0, sizeof(dvdwrap_pin_t));
+	pin->conf = conf;
+	pthread_mutex_init(&pin->lock, NULL);
+	pthread_cond_init(&pin->work, NULL);
+	pin->capacity = (uint64_t)conf->size * 1024 * 1024;
+	pin->nbuckets = PIN_BUCKETS;
+	pin->hash = (dvdwrap_pin_entry_t**)calloc(pin->nbuckets, sizeof(dvdwrap_pin_entry_t*));
+	if (pin->hash == NULL) {
+		return -ENOMEM;
+	}
+	if (conf->dir) {
+		dvdwrap_pin_restore(pin);
+	}
+	return 0;
+}
+
+static void* dvdwrap_pin_thread(void *arg)
+{
+	dvdwrap_pin_t *pin = (dvdwrap_pin_t*)arg;
+	dvdwrap_pin_entry_t *entry;
+	int rc;
+
+	pthread_mutex_lock(&pin->lock);
+	while (!pin->stop) {
+		if (pin->queue == NULL) {
+			pthread_cond_wait(&pin->work, &pin->lock);
+			continue;
+		}
+		entry = pin->queue;
+		pin->queue = entry->qnext;
+		if (pin->queue == NULL) {
+			pin->queue_tail = NULL;
+		}
+		if (entry->dead) {
+			dvdwrap_pin_put(pin, entry);
+			continue;
+		}
+		pthread_mutex_unlock(&pin->lock);
+
+		LOG("Pinning %s\n", entry->path);
+		rc = pin->fetch(pin->arg, entry);
+
+		pthread_mutex_lock(&pin->lock);
+		if (rc == 0) {
+			/* Readers check the state without the lock */
+			__sync_synchronize();
+			entry->state = PIN_READY;
+			pin->loads++;
+		} else {
+			dvdwrap_pin_free_data(pin, entry);
+			entry->state = PIN_FAILED;
+			pin->failures++;
+		}
+		dvdwrap_pin_put(pin, entry);
+	}
+	pthread_mutex_unlock(&pin->lock);
+	return NULL;
+}
+
+/*! Starts the loader thread.  Must be called after fuse has daemonised. */
+int dvdwrap_pin_start(dvdwrap_pin_t *pin, dvdwrap_pin_fetch_t fetch, void *arg)
+{
+	pin->fetch = fetch;
+	pin->arg = arg;
+	if (pthread_create(&pin->thread, NULL, dvdwrap_pin_thread, pin) != 0) {
+		return -EAGAIN;
+	}
+	pin->running = 1;
+	return 0;
+}
+
+/*! Stops the loader, saves pinned data and frees it, at unmount */
+void dvdwrap_pin_destroy(dvdwrap_pin_t *pin)
+{
+	dvdwrap_pin_entry_t *entry, *next;
+	unsigned int n;
+
+	if (pin->running) {
+		pthread_mutex_lock(&pin->lock);
+		pin->stop = 1;
+		pthread_cond_broadcast(&pin->work);
+		pthread_mutex_unlock(&pin->lock);
+		pthread_join(pin->thread, NULL);
+		pin->running = 0;
+	}
+	if (pin->conf->dir) {
+		pthread_mutex_lock(&pin->lock);
+		dvdwrap_pin_save(pin);
+		pthread_mutex_unlock(&pin->lock);
+	}
+
+	/* Every handle has been released, so nothing still refers to these */
+	for (n = 0; n < pin->nbuckets; n++) {
+		for (entry = pin->hash[n]; entry; entry = next) {
+			next = entry->next;
+			dvdwrap_pin_free(pin, entry);
+		}
+	}
+	free(pin->hash);
+	pin->hash = NULL;
+	pin->count = 0;
+	pthread_cond_destroy(&pin->work);
+	pthread_mutex_destroy(&pin->lock);
+}
+
+/*! Hands an entry to the loader thread.  Called with the set locked. */
+static void dvdwrap_pin_queue(dvdwrap_pin_t *pin, dvdwrap_pin_entry_t *entry)
+{
+	entry->state = PIN_QUEUED;
+	entry->qnext = NULL;
+	entry->refs++;
+	if (pin->queue_tail) {
+		pin->queue_tail->qnext = entry;
+	} else {
+		pin->queue = entry;
+	}
+	pin->queue_tail = entry;
+	pthread_cond_signal(&pin->work);
+}
+
+/*!
+ * Called when a title is opened.  Queues the title to be pinned if it
+ * isn't already, again if it has changed, or if there was no room for it
+ * last time.
+ *
+ * \return			Entry to pass to dvdwrap_pin_read/close, or NULL
+ */
+dvdwrap_pin_entry_t* dvdwrap_pin_open(dvdwrap_pin_t *pin, const char *path,
+	uint64_t total_size, time_t mtime)
+{
+	unsigned int bucket = dvdwrap_hash_string(path) % pin->nbuckets;
+	dvdwrap_pin_entry_t *entry;
+
+	pthread_mutex_lock(&pin->lock);
+	for (entry = pin->hash[bucket]; entry; entry = entry->next) {
+		if (strcmp(entry->path, path) == 0) {
+			break;
+		}
+	}
+	if (entry && entry->state != PIN_QUEUED &&
+			(entry->total_size != total_size || entry->mtime != mtime)) {
+		/* Title has changed - replace it, leaving the old data to any
+		 * handles still using it */
+		LOG("Pinned %s changed\n", path);
+		dvdwrap_pin_unlink(pin, entry);
+		if (entry->refs == 0) {
+			dvdwrap_pin_free(pin, entry);
+		} else {
+			entry->dead = 1;
+		}
+		entry = NULL;
+	}
+	if (entry == NULL) {
+		entry = dvdwrap_pin_new(pin, path, total_size, mtime);
+		if (entry == NULL) {
+			pthread_mutex_unlock(&pin->lock);
+			return NULL;
+		}
+		dvdwrap_pin_queue(pin, entry);
+	} else if (entry->state == PIN_FAILED) {
+		dvdwrap_pin_queue(pin, entry);
+	}
+	entry->refs++;
+	entry->last_used = dvdwrap_now_ms();
+	pthread_mutex_unlock(&pin->lock);
+	return entry;
+}
+
+/*! Called when a handle on a title is released, giving back memory if
+ * the limit has been lowered since */
+void dvdwrap_pin_close(dvdwrap_pin_t *pin, dvdwrap_pin_entry_t *entry)
+{
+	pthread_mutex_lock(&pin->lock);
+	dvdwrap_pin_put(pin, entry);
+	if (pin->used > pin->capacity) {
+		dvdwrap_pin_evict(pin, 0);
+	}
+	pthread_mutex_unlock(&pin->lock);
+}
+
+/*!
+ * Serves a read from the pinned head or tail of a title.
+ *
+ * \param pin			Pinned data
+ * \param entry			Entry from dvdwrap_pin_open
+ * \param total_size	Size of the title as opened
+ * \param buf			Destination
+ * \param size			Bytes requested
+ * \param offset		Offset within the title, before the end
+ * \return				Bytes read, or 0 if the range isn't pinned
+ */
+ssize_t dvdwrap_pin_read(dvdwrap_pin_t *pin, dvdwrap_pin_entry_t *entry,
+	uint64_t total_size, char *buf, size_t size, uint64_t offset)
+{
+	if (size > total_size - offset) {
+		size = total_size - offset;
+	}
+	if (entry->state != PIN_READY) {
+		if (offset < (uint64_t)pin->conf->head * 1024 ||
+				offset + (uint64_t)pin->conf->tail * 1024 >= total_size) {
+			__sync_fetch_and_add(&pin->misses, 1);
+		}
+		return 0;
+	}
+	__sync_synchronize();
+	if (entry->total_size != total_size) {
+		return 0;
+	}
+	if (offset + size <= entry->head_len) {
+		memcpy(buf, entry->head + offset, size);
+	} else if (offset >= entry->tail_offset) {
+		memcpy(buf, entry->tail + (offset - entry->tail_offset), size);
+	} else {
+		return 0;
+	}
+	__sync_fetch_and_add(&pin->hits, 1);
+	return size;
+}
+
+void dvdwrap_pin_report(dvdwrap_pin_t *pin, dvdwrap_buf_t *buf)
+{
+	pthread_mutex_lock(&pin->lock);
+	dvdwrap_buf_printf(buf,
+		"capacity %llu\n"
+		"used %llu\n"
+		"titles %u\n"
+		"hits %llu\n"
+		"misses %llu\n"
+		"loads %llu\n"
+		"failures %llu\n"
+		"rejected %llu\n"
+		"evictions %llu\n",
+		(unsigned long long)pin->capacity, (unsigned long long)pin->used,
+		pin->count,
+		(unsigned long long)pin->hits, (unsigned long long)pin->misses,
+		(unsigned long long)pin->loads, (unsigned long long)pin->failures,
+		(unsigned long long)pin->rejected, (unsigned long long)pin->evictions);
+	pthread_mutex_unlock(&pin->lock);
+}
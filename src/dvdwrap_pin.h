@@ -0,0 +1,116 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DVDWRAP_PIN_H
+#define _DVDWRAP_PIN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "dvdwrap_buf.h"
+
+/*! Pinned head/tail tunables */
+typedef struct {
+	unsigned int	size;			/*!< Memory for pinned data (MiB), 0 to disable */
+	unsigned int	head;			/*!< Bytes pinned from the start of a title (KiB) */
+	unsigned int	tail;			/*!< Bytes pinned from the end of a title (KiB) */
+	const char		*dir;			/*!< Directory to persist to, or NULL */
+} dvdwrap_pin_conf_t;
+
+typedef enum {
+	PIN_QUEUED = 0,					/*!< Waiting for the loader thread */
+	PIN_READY,						/*!< head and tail are valid */
+	PIN_FAILED,						/*!< Couldn't be read or no room */
+} dvdwrap_pin_state_t;
+
+/*! Pinned head and tail of one title */
+typedef struct dvdwrap_pin_entry {
+	struct dvdwrap_pin_entry	*next;		/*!< Hash chain */
+	struct dvdwrap_pin_entry	*qnext;		/*!< Loader queue */
+	char				*path;
+	uint64_t			total_size;
+	time_t				mtime;
+	dvdwrap_pin_state_t	state;
+	unsigned int		refs;		/*!< Handles and the loader */
+	int					dead;		/*!< Replaced, free on last reference */
+	uint64_t			last_used;	/*!< dvdwrap_now_ms() when last opened */
+
+	char				*head;
+	size_t				head_len;
+	char				*tail;
+	uint64_t			tail_offset;
+	size_t				tail_len;
+} dvdwrap_pin_entry_t;
+
+/*!
+ * Reads the head and tail of a title for the loader thread.  Must set the
+ * entry's size and mtime, check them against any already set, then call
+ * dvdwrap_pin_alloc and fill the buffers.
+ *
+ * \return			0 or -errno
+ */
+typedef int (*dvdwrap_pin_fetch_t)(void *arg, dvdwrap_pin_entry_t *entry);
+
+/*! Pinned data for all titles */
+typedef struct {
+	const dvdwrap_pin_conf_t	*conf;
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;
+	dvdwrap_pin_entry_t	**hash;
+	unsigned int		nbuckets;
+	dvdwrap_pin_entry_t	*queue;
+	dvdwrap_pin_entry_t	*queue_tail;
+	uint64_t			capacity;	/*!< Bytes */
+	uint64_t			used;
+	unsigned int		count;
+
+	dvdwrap_pin_fetch_t	fetch;
+	void				*arg;
+	pthread_t			thread;
+	int					running;
+	int					stop;
+
+	/* Statistics */
+	uint64_t			hits;
+	uint64_t			misses;		/*!< Head/tail reads before the data was ready */
+	uint64_t			loads;
+	uint64_t			failures;
+	uint64_t			rejected;	/*!< Titles not pinned for lack of room */
+	uint64_t			evictions;	/*!< Titles dropped to make room */
+} dvdwrap_pin_t;
+
+int dvdwrap_pin_init(dvdwrap_pin_t *pin, const dvdwrap_pin_conf_t *conf);
+int dvdwrap_pin_start(dvdwrap_pin_t *pin, dvdwrap_pin_fetch_t fetch, void *arg);
+void dvdwrap_pin_destroy(dvdwrap_pin_t *pin);
+dvdwrap_pin_entry_t* dvdwrap_pin_open(dvdwrap_pin_t *pin, const char *path,
+	uint64_t total_size, time_t mtime);
+void dvdwrap_pin_close(dvdwrap_pin_t *pin, dvdwrap_pin_entry_t *entry);
+void dvdwrap_pin_set_capacity(dvdwrap_pin_t *pin, uint64_t capacity);
+int dvdwrap_pin_alloc(dvdwrap_pin_t *pin, dvdwrap_pin_entry_t *entry);
+ssize_t dvdwrap_pin_read(dvdwrap_pin_t *pin, dvdwrap_pin_entry_t *entry,
+	uint64_t total_size, char *buf, size_t size, uint64_t offset);
+void dvdwrap_pin_report(dvdwrap_pin_t *pin, dvdwrap_buf_t *buf);
+
+#endif
@@ -0,0 +1,64 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Static tracepoints (USDT) for bpftrace, perf or SystemTap.  Each costs
+ * a nop until it is traced, and they compile away entirely where
+ * <sys/sdt.h> isn't available.  Provider "dvdwrap":
+ *
+ *   op_start(op, path)                     FUSE operation entered
+ *   op_done(op, path, rc, us)              and returned
+ *   backend_start(fd, offset, size, wait_us)
+ *                                          VOB read issued after waiting
+ *                                          wait_us in its queue
+ *   backend_done(fd, offset, rc, us)       and completed
+ *   backend_stall(fd, offset, size, us)    VOB read still in progress
+ *                                          after the stall time
+ *   ssd_read(fd, offset, size, rc)         SSD tier block read
+ *   ssd_write(fd, offset, size, rc)        SSD tier block written
+ *   index_probe(path, flags)               DVD image scanned
+ *
+ * op numbers follow dvdwrap_stats_op_t, in the order the operations are
+ * listed in .dvdwrap/stats.  path may be NULL for operations on open
+ * directories and files.
+ */
+
+#ifndef _DVDWRAP_PROBES_H
+#define _DVDWRAP_PROBES_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define DVDWRAP_PROBE2(name, a, b)			DTRACE_PROBE2(dvdwrap, name, a, b)
+#define DVDWRAP_PROBE4(name, a, b, c, d)	DTRACE_PROBE4(dvdwrap, name, a, b, c, d)
+#else
+#define DVDWRAP_PROBE2(name, a, b) \
+	do { (void)(a); (void)(b); } while (0)
+#define DVDWRAP_PROBE4(name, a, b, c, d) \
+	do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+#endif
+
+#endif
@@ -0,0 +1,214 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Read scheduler.  Each open file is classified from its observed
+ * behaviour as playback (sequential, no faster than a player would
+ * consume it), bulk (sequential at full speed, e.g. rsync or cp) or probe
+ * (random access).  Each device's backend reads are then admitted through
+ * a fixed number of slots: playback and probes are served earliest
+ * deadline first, and while any playback stream is active, bulk reads may
+ * only occupy the slots not reserved for playback.  Probes get a longer
+ * deadline than playback, so a scanner flooding the queue only goes ahead
+ * of a player's reads once they have waited the difference.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dvdwrap_fuse.h"
+#include "dvdwrap_sched.h"
+
+/*! Sequential reads needed before a stream is treated as playback or bulk */
+#define SCHED_SEQ_THRESHOLD		4
+/*! Maximum forward gap still treated as sequential (kernel readahead may
+ * reorder or skip small ranges) */
+#define SCHED_SEQ_SLACK			(256 * 1024)
+/*! Rate measurement window (ms) */
+#define SCHED_WINDOW			1000
+/*! How long playback is considered active after its last read (ms) */
+#define SCHED_PLAYBACK_HOLD		2000
+
+void dvdwrap_sched_init(dvdwrap_sched_t *sched, const dvdwrap_sched_conf_t *conf)
+{
+	memset(sched, 0, sizeof(dvdwrap_sched_t));
+	sched->conf = conf;
+}
+
+/*!
+ * Updates the classification of a stream given its next read.  Must be
+ * called with the owning file handle locked.
+ *
+ * \param conf		Scheduler tunables
+ * \param stream	Stream state for the file handle
+ * \param offset	Offset of this read
+ * \param size		Size of this read
+ */
+void dvdwrap_sched_classify(const dvdwrap_sched_conf_t *conf,
+	dvdwrap_sched_stream_t *stream, uint64_t offset, size_t size)
+{
+	uint64_t now = dvdwrap_now_ms();
+	uint64_t limit;
+
+	if (offset >= stream->next_offset &&
+			offset <= stream->next_offset + SCHED_SEQ_SLACK) {
+		stream->seq_run++;
+	} else {
+		/* Seek - start measuring again */
+		stream->seq_run = 0;
+		stream->window_start = now;
+		stream->window_bytes = 0;
+	}
+	stream->next_offset = offset + size;
+	stream->window_bytes += size;
+
+	if (stream->seq_run < SCHED_SEQ_THRESHOLD) {
+		stream->class = SCHED_PROBE;
+		return;
+	}
+
+	/* A sequential stream is bulk as soon as it has read more in the
+	 * current window than a player could have consumed in a full one.
+	 * Otherwise it is playback, and is re-evaluated when the window
+	 * closes. */
+	limit = (uint64_t)conf->playback_rate * 1024 * SCHED_WINDOW / 1000;
+	if (stream->window_bytes > limit) {
+		stream->class = SCHED_BULK;
+	} else if (now - stream->window_start >= SCHED_WINDOW) {
+		stream->class = SCHED_PLAYBACK;
+	} else if (stream->class == SCHED_PROBE) {
+		/* Newly sequential - give it the benefit of the doubt */
+		stream->class = SCHED_PLAYBACK;
+	}
+
+	if (now - stream->window_start >= SCHED_WINDOW) {
+		stream->window_start = now;
+		stream->window_bytes = 0;
+	}
+}
+
+/*! Number of slots bulk reads may occupy */
+static unsigned int dvdwrap_sched_bulk_limit(dvdwrap_sched_t *sched, uint64_t now)
+{
+	unsigned int slots = sched->conf->slots;
+	unsigned int reserved;
+
+	if (sched->last_playback == 0 || now - sched->last_playback > SCHED_PLAYBACK_HOLD) {
+		/* No playback to protect */
+		return slots;
+	}
+	reserved = (slots * sched->conf->share + 99) / 100;
+	if (reserved >= slots) {
+		/* Always leave bulk transfers something */
+		reserved = slots - 1;
+	}
+	return slots - reserved;
+}
+
+/*! Whether a read of the given class could start now */
+static int dvdwrap_sched_admissible(dvdwrap_sched_t *sched,
+	dvdwrap_sched_class_t class, uint64_t now)
+{
+	unsigned int busy = 0;
+	int n;
+
+	for (n = 0; n < SCHED_NCLASSES; n++) {
+		busy += sched->busy[n];
+	}
+	if (busy >= sched->conf->slots) {
+		return 0;
+	}
+	if (class == SCHED_BULK && sched->busy[SCHED_BULK] >= dvdwrap_sched_bulk_limit(sched, now)) {
+		return 0;
+	}
+	return 1;
+}
+
+/*!
+ * Queues a backend read.  Its deadline is set from the current time and
+ * its class.
+ *
+ * \param sched		Scheduler
+ * \param entry		Entry embedded in the request, with class set
+ */
+void dvdwrap_sched_enqueue(dvdwrap_sched_t *sched, dvdwrap_sched_entry_t *entry)
+{
+	dvdwrap_sched_entry_t **tail;
+
+	entry->next = NULL;
+	entry->deadline = dvdwrap_now_ms() + (entry->class == SCHED_PROBE ?
+		sched->conf->probe_deadline : sched->conf->deadline);
+	for (tail = &sched->queue; *tail; tail = &(*tail)->next);
+	*tail = entry;
+}
+
+/*!
+ * Selects the next read to start.  Playback and probe reads go earliest
+ * deadline first, then bulk reads in arrival order.  The returned entry is
+ * counted as in flight until passed to dvdwrap_sched_complete.
+ *
+ * \param sched		Scheduler
+ * \return			Entry to start, or NULL if nothing may start now
+ */
+dvdwrap_sched_entry_t* dvdwrap_sched_next(dvdwrap_sched_t *sched)
+{
+	dvdwrap_sched_entry_t **e, **best = NULL, *entry;
+	uint64_t now = dvdwrap_now_ms();
+
+	for (e = &sched->queue; *e; e = &(*e)->next) {
+		if ((*e)->class == SCHED_BULK) {
+			continue;
+		}
+		if (best == NULL || (*e)->deadline < (*best)->deadline) {
+			best = e;
+		}
+	}
+	if (best == NULL) {
+		for (e = &sched->queue; *e; e = &(*e)->next) {
+			if ((*e)->class == SCHED_BULK) {
+				best = e;
+				break;
+			}
+		}
+	}
+	if (best == NULL || !dvdwrap_sched_admissible(sched, (*best)->class, now)) {
+		return NULL;
+	}
+
+	/* Unlink and account */
+	entry = *best;
+	*best = entry->next;
+	if (entry->class != SCHED_BULK && now > entry->deadline) {
+		sched->missed_deadlines++;
+	}
+	sched->busy[entry->class]++;
+	sched->admitted[entry->class]++;
+	if (entry->class == SCHED_PLAYBACK) {
+		sched->last_playback = now;
+	}
+	return entry;
+}
+
+void dvdwrap_sched_complete(dvdwrap_sched_t *sched, dvdwrap_sched_class_t class)
+{
+	sched->busy[class]--;
+}
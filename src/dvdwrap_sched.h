@@ -0,0 +1,82 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DVDWRAP_SCHED_H
+#define _DVDWRAP_SCHED_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*! Read classes, in descending order of priority */
+typedef enum {
+	SCHED_PLAYBACK = 0,		/*!< Rate-limited sequential stream */
+	SCHED_PROBE,			/*!< Random access (seeks, scanners) */
+	SCHED_BULK,				/*!< Full-speed sequential copy */
+	SCHED_NCLASSES,
+} dvdwrap_sched_class_t;
+
+/*! Scheduler tunables */
+typedef struct {
+	unsigned int	slots;			/*!< Concurrent backend reads per device */
+	unsigned int	share;			/*!< Percentage of slots reserved for playback */
+	unsigned int	deadline;		/*!< Playback read deadline (ms) */
+	unsigned int	probe_deadline;	/*!< Probe read deadline (ms) */
+	unsigned int	playback_rate;	/*!< Highest rate treated as playback (KiB/s) */
+} dvdwrap_sched_conf_t;
+
+/*! Observed access pattern of a single file handle */
+typedef struct {
+	dvdwrap_sched_class_t	class;
+	uint64_t		next_offset;	/*!< Offset a sequential read would start at */
+	unsigned int	seq_run;		/*!< Consecutive sequential reads seen */
+	uint64_t		window_start;	/*!< Start of rate measurement window (ms) */
+	uint64_t		window_bytes;	/*!< Bytes read in current window */
+} dvdwrap_sched_stream_t;
+
+/*! A queued backend read.  Embedded in the caller's request structure. */
+typedef struct dvdwrap_sched_entry {
+	struct dvdwrap_sched_entry	*next;
+	dvdwrap_sched_class_t		class;
+	uint64_t					deadline;
+} dvdwrap_sched_entry_t;
+
+/*! Orders backend reads for one device.  Not thread-safe - the owner
+ * must serialise calls. */
+typedef struct {
+	const dvdwrap_sched_conf_t	*conf;
+	unsigned int			busy[SCHED_NCLASSES];	/*!< Reads in flight per class */
+	dvdwrap_sched_entry_t	*queue;					/*!< Queued reads, arrival order */
+	uint64_t				last_playback;			/*!< Last playback admission (ms) */
+
+	/* Statistics */
+	uint64_t				admitted[SCHED_NCLASSES];
+	uint64_t				missed_deadlines;
+} dvdwrap_sched_t;
+
+void dvdwrap_sched_init(dvdwrap_sched_t *sched, const dvdwrap_sched_conf_t *conf);
+void dvdwrap_sched_classify(const dvdwrap_sched_conf_t *conf,
+	dvdwrap_sched_stream_t *stream, uint64_t offset, size_t size);
+void dvdwrap_sched_enqueue(dvdwrap_sched_t *sched, dvdwrap_sched_entry_t *entry);
+dvdwrap_sched_entry_t* dvdwrap_sched_next(dvdwrap_sched_t *sched);
+void dvdwrap_sched_complete(dvdwrap_sched_t *sched, dvdwrap_sched_class_t class);
+
+#endif
@@ -0,0 +1,291 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Spin-down aware buffering.  A playback stream only needs a few hundred
+ * KiB/s, which is enough to keep an idle disk spinning forever if it is
+ * read as it is played.  Instead each playback stream is given a large
+ * double buffer: one half is played from while the other is filled with
+ * what comes next in a single long read, started early enough that the
+ * fill completes even if the disk has to spin up first.  Between fills
+ * the disk sees no I/O from the stream and can go back to sleep.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "dvdwrap_fuse.h"
+#include "dvdwrap_spin.h"
+
+void dvdwrap_spin_init(dvdwrap_spin_t *spin, const dvdwrap_spin_conf_t *conf,
+	unsigned int playback_rate)
+{
+	memset(spin, 0, sizeof(dvdwrap_spin_t));
+	spin->conf = conf;
+	pthread_mutex_init(&spin->lock, NULL);
+	spin->capacity = (uint64_t)conf->total * 1024 * 1024;
+	dvdwrap_spin_tune(spin, playback_rate);
+}
+
+/*! Called once every stream's buffers have been released */
+void dvdwrap_spin_destroy(dvdwrap_spin_t *spin)
+{
+	pthread_mutex_destroy(&spin->lock);
+}
+
+/*! Works out when to refill, after the spin-up time or playback rate
+ * has changed */
+void dvdwrap_spin_tune(dvdwrap_spin_t *spin, unsigned int playback_rate)
+{
+	/* Assume the stream runs at the fastest playback rate, so the refill
+	 * is never late */
+	spin->low_water = (size_t)playback_rate * 1024 * spin->conf->spinup;
+}
+
+/*! Changes the memory for all buffers.  Buffers already allocated are
+ * kept until their handles are released. */
+void dvdwrap_spin_set_capacity(dvdwrap_spin_t *spin, uint64_t capacity)
+{
+	pthread_mutex_lock(&spin->lock);
+	spin->capacity = capacity;
+	pthread_mutex_unlock(&spin->lock);
+}
+
+/*! Sets up the buffer state for a newly opened title.  Memory is not
+ * allocated until the handle is first read as a playback stream. */
+void dvdwrap_spin_open(dvdwrap_spin_t *spin, dvdwrap_spin_state_t *ss,
+	uint64_t total_size, dvdwrap_cache_fill_t fill, void *arg)
+{
+	memset(ss, 0, sizeof(dvdwrap_spin_state_t));
+	ss->spin = spin;
+	pthread_mutex_init(&ss->lock, NULL);
+	ss->total_size = total_size;
+	ss->fill = fill;
+	ss->arg = arg;
+}
+
+void dvdwrap_spin_release(dvdwrap_spin_state_t *ss)
+{
+	if (ss->spin == NULL) {
+		return;
+	}
+	if (ss->joinable) {
+		pthread_join(ss->thread, NULL);
+	}
+	if (ss->buf[0]) {
+		free(ss->buf[0]);
+		free(ss->buf[1]);
+		pthread_mutex_lock(&ss->spin->lock);
+		ss->spin->used -= 2 * ss->alloc;
+		pthread_mutex_unlock(&ss->spin->lock);
+	}
+	pthread_mutex_destroy(&ss->lock);
+}
+
+/*! Allocates both halves if the memory limit allows.  Called with the
+ * state locked. */
+static int dvdwrap_spin_alloc(dvdwrap_spin_state_t *ss)
+{
+	dvdwrap_spin_t *spin = ss->spin;
+	size_t alloc = (size_t)spin->conf->size * 1024 * 1024;
+
+	if (alloc > ss->total_size) {
+		alloc = ss->total_size;
+	}
+	pthread_mutex_lock(&spin->lock);
+	if (spin->used + 2 * alloc > spin->capacity) {
+		spin->refused++;
+		pthread_mutex_unlock(&spin->lock);
+		ss->refused = 1;
+		return 0;
+	}
+	spin->used += 2 * alloc;
+	spin->streams++;
+	pthread_mutex_unlock(&spin->lock);
+
+	ss->buf[0] = (char*)malloc(alloc);
+	ss->buf[1] = (char*)malloc(alloc);
+	if (ss->buf[0] == NULL || ss->buf[1] == NULL) {
+		free(ss->buf[0]);
+		free(ss->buf[1]);
+		ss->buf[0] = ss->buf[1] = NULL;
+		pthread_mutex_lock(&spin->lock);
+		spin->used -= 2 * alloc;
+		pthread_mutex_unlock(&spin->lock);
+		ss->refused = 1;
+		return 0;
+	}
+	ss->alloc = alloc;
+	return 1;
+}
+
+static int dvdwrap_spin_holds(const dvdwrap_spin_state_t *ss, int half, uint64_t offset)
+{
+	return offset >= ss->start[half] && offset < ss->start[half] + ss->len[half];
+}
+
+static void* dvdwrap_spin_thread(void *arg)
+{
+	dvdwrap_spin_state_t *ss = (dvdwrap_spin_state_t*)arg;
+	dvdwrap_spin_t *spin = ss->spin;
+	uint64_t start;
+	char *dst;
+	ssize_t rc;
+
+	pthread_mutex_lock(&ss->lock);
+	dst = ss->buf[!ss->cur];
+	start = ss->start[!ss->cur];
+	pthread_mutex_unlock(&ss->lock);
+
+	LOG("Spin refill %llu\n", (unsigned long long)start);
+	rc = ss->fill(ss->arg, dst, ss->alloc, start);
+
+	pthread_mutex_lock(&spin->lock);
+	spin->fills++;
+	spin->fill_bytes += rc > 0 ? rc : 0;
+	pthread_mutex_unlock(&spin->lock);
+
+	pthread_mutex_lock(&ss->lock);
+	ss->len[!ss->cur] = rc > 0 ? rc : 0;
+	ss->filling = 0;
+	pthread_mutex_unlock(&ss->lock);
+	return NULL;
+}
+
+/*! Starts filling the idle half from offset.  Called with the state
+ * locked and no fill running. */
+static void dvdwrap_spin_refill(dvdwrap_spin_state_t *ss, uint64_t offset)
+{
+	int half = !ss->cur;
+
+	if (ss->joinable) {
+		/* Last fill has finished - just reap it */
+		pthread_join(ss->thread, NULL);
+		ss->joinable = 0;
+	}
+	ss->start[half] = offset;
+	ss->len[half] = 0;
+	ss->filling = 1;
+	if (pthread_create(&ss->thread, NULL, dvdwrap_spin_thread, ss) != 0) {
+		ss->filling = 0;
+		return;
+	}
+	ss->joinable = 1;
+}
+
+/*!
+ * Reads part of a playback stream from its buffer.  Anything not yet
+ * buffered is read directly, and never waits for a refill in progress.
+ *
+ * \param ss		Buffer state of the handle
+ * \param buf		Destination
+ * \param size		Bytes requested
+ * \param offset	Offset within the title
+ * \param fill		Read for data that isn't buffered
+ * \param arg		Passed to fill
+ * \return			Bytes read or -errno
+ */
+ssize_t dvdwrap_spin_read(dvdwrap_spin_state_t *ss, char *buf, size_t size,
+	uint64_t offset, dvdwrap_cache_fill_t fill, void *arg)
+{
+	size_t total = 0;
+	uint64_t pos;
+	ssize_t rc;
+
+	pthread_mutex_lock(&ss->lock);
+	if (ss->buf[0] == NULL && (ss->refused || !dvdwrap_spin_alloc(ss))) {
+		pthread_mutex_unlock(&ss->lock);
+		return fill(arg, buf, size, offset);
+	}
+
+	while (total < size) {
+		int half = ss->cur;
+		size_t n;
+
+		pos = offset + total;
+		if (!dvdwrap_spin_holds(ss, half, pos)) {
+			half = !half;
+			if (ss->filling || !dvdwrap_spin_holds(ss, half, pos)) {
+				break;
+			}
+			/* Played into the refilled half */
+			ss->cur = half;
+		}
+		n = ss->start[half] + ss->len[half] - pos;
+		if (n > size - total) {
+			n = size - total;
+		}
+		memcpy(buf + total, ss->buf[half] + (pos - ss->start[half]), n);
+		total += n;
+	}
+
+	/* Refill ahead of the stream once the current half runs low, or from
+	 * here if the stream has moved outside both halves */
+	pos = offset + size;
+	if (!ss->filling) {
+		uint64_t next = pos;
+
+		if (dvdwrap_spin_holds(ss, ss->cur, pos)) {
+			next = ss->start[ss->cur] + ss->len[ss->cur];
+			if (next - pos > ss->spin->low_water) {
+				next = ss->total_size;
+			}
+		}
+		if (next < ss->total_size && !dvdwrap_spin_holds(ss, !ss->cur, next)) {
+			dvdwrap_spin_refill(ss, next);
+		}
+	}
+	pthread_mutex_unlock(&ss->lock);
+
+	__sync_fetch_and_add(&ss->spin->hit_bytes, total);
+	if (total < size) {
+		rc = fill(arg, buf + total, size - total, offset + total);
+		if (rc < 0) {
+			return total ? (ssize_t)total : rc;
+		}
+		__sync_fetch_and_add(&ss->spin->miss_bytes, rc);
+		total += rc;
+	}
+	return total;
+}
+
+void dvdwrap_spin_report(dvdwrap_spin_t *spin, dvdwrap_buf_t *buf)
+{
+	pthread_mutex_lock(&spin->lock);
+	dvdwrap_buf_printf(buf,
+		"capacity %llu\n"
+		"used %llu\n"
+		"low_water %llu\n"
+		"streams %llu\n"
+		"refused %llu\n"
+		"fills %llu\n"
+		"fill_bytes %llu\n"
+		"hit_bytes %llu\n"
+		"miss_bytes %llu\n",
+		(unsigned long long)spin->capacity, (unsigned long long)spin->used,
+		(unsigned long long)spin->low_water,
+		(unsigned long long)spin->streams, (unsigned long long)spin->refused,
+		(unsigned long long)spin->fills, (unsigned long long)spin->fill_bytes,
+		(unsigned long long)spin->hit_bytes, (unsigned long long)spin->miss_bytes);
+	pthread_mutex_unlock(&spin->lock);
+}
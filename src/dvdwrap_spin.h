@@ -0,0 +1,93 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DVDWRAP_SPIN_H
+#define _DVDWRAP_SPIN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "dvdwrap_buf.h"
+#include "dvdwrap_cache.h"
+
+/*! Spin-down buffering tunables */
+typedef struct {
+	unsigned int	size;			/*!< Buffer per playback stream (MiB), 0 to disable */
+	unsigned int	total;			/*!< Memory for all stream buffers (MiB) */
+	unsigned int	spinup;			/*!< Playback to cover while a disk spins up (s) */
+} dvdwrap_spin_conf_t;
+
+/*! Memory shared by all stream buffers */
+typedef struct {
+	const dvdwrap_spin_conf_t	*conf;
+	pthread_mutex_t		lock;
+	uint64_t			capacity;	/*!< Bytes */
+	uint64_t			used;		/*!< Bytes allocated to streams */
+	size_t				low_water;	/*!< Buffered bytes left when a refill starts */
+
+	/* Statistics */
+	uint64_t			streams;	/*!< Streams given buffers */
+	uint64_t			refused;	/*!< Streams refused for lack of memory */
+	uint64_t			fills;
+	uint64_t			fill_bytes;
+	uint64_t			hit_bytes;	/*!< Bytes served from buffers */
+	uint64_t			miss_bytes;	/*!< Bytes read while a buffer was not ready */
+} dvdwrap_spin_t;
+
+/*!
+ * Double buffer for one playback stream.  One half is read from while a
+ * background thread fills the other with what follows, in a single long
+ * read, so the disk can spin down until the next refill.
+ */
+typedef struct {
+	dvdwrap_spin_t		*spin;
+	pthread_mutex_t		lock;
+	uint64_t			total_size;
+	dvdwrap_cache_fill_t	fill;	/*!< Used by the refill thread */
+	void				*arg;
+	int					refused;	/*!< Don't ask for memory again */
+
+	char				*buf[2];
+	size_t				alloc;		/*!< Size of each half */
+	uint64_t			start[2];	/*!< Title offset held by each half */
+	size_t				len[2];		/*!< Bytes valid in each half */
+	int					cur;		/*!< Half being read from */
+	int					filling;	/*!< Other half is being filled */
+	int					joinable;	/*!< thread needs joining */
+	pthread_t			thread;
+} dvdwrap_spin_state_t;
+
+void dvdwrap_spin_init(dvdwrap_spin_t *spin, const dvdwrap_spin_conf_t *conf,
+	unsigned int playback_rate);
+void dvdwrap_spin_destroy(dvdwrap_spin_t *spin);
+void dvdwrap_spin_tune(dvdwrap_spin_t *spin, unsigned int playback_rate);
+void dvdwrap_spin_set_capacity(dvdwrap_spin_t *spin, uint64_t capacity);
+void dvdwrap_spin_open(dvdwrap_spin_t *spin, dvdwrap_spin_state_t *ss,
+	uint64_t total_size, dvdwrap_cache_fill_t fill, void *arg);
+void dvdwrap_spin_release(dvdwrap_spin_state_t *ss);
+ssize_t dvdwrap_spin_read(dvdwrap_spin_state_t *ss, char *buf, size_t size,
+	uint64_t offset, dvdwrap_cache_fill_t fill, void *arg);
+void dvdwrap_spin_report(dvdwrap_spin_t *spin, dvdwrap_buf_t *buf);
+
+#endif
@@ -0,0 +1,652 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * SSD cache tier.  Blocks of titles read from slow storage are written
+ * through to a sparse file per title in a local directory, and served
+ * from there on later reads.  Each data file has an index holding the
+ * source size and mtime it was filled from, its popularity and a bitmap
+ * of the blocks present, so the cache survives restarts and is dropped
+ * if the title changes.  When the directory is full, the least popular
+ * title not currently open is evicted.
+ *
+ * Reads only mark blocks present in memory.  The index is written when
+ * the last handle on a title closes, and at unmount, so a crash loses the
+ * blocks cached since, rather than claiming blocks that aren't there.
+ *
+ * Files are named after a hash of the title path:
+ *   <key>.dat		block data at the same offsets as the title
+ *   <key>.idx		dvdwrap_ssd_header_t, path, bitmap
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "dvdwrap_fuse.h"
+#include "dvdwrap_ssd.h"
+#include "dvdwrap_probes.h"
+
+#define SSD_MAGIC			"DVDWSSD1"
+/*! Popularity halves for every period this long without use (s) */
+#define SSD_HALF_LIFE		(7 * 24 * 3600)
+
+/*! On-disk index header */
+typedef struct {
+	char		magic[8];
+	uint32_t	block_size;
+	uint32_t	opens;
+	uint64_t	total_size;
+	int64_t		mtime;
+	int64_t		last_used;
+	uint64_t	cached;
+	uint32_t	pathlen;
+	uint32_t	reserved;
+} dvdwrap_ssd_header_t;
+
+static void dvdwrap_ssd_filename(dvdwrap_ssd_t *ssd, uint64_t key, const char *ext,
+	char *out)
+{
+	snprintf(out, PATH_MAX, "%s/%016llx.%s", ssd->conf->dir, (unsigned long long)key, ext);
+}
+
+/*! Popularity, decayed with time since last use */
+static double dvdwrap_ssd_score(const dvdwrap_ssd_entry_t *entry, time_t now)
+{
+	double age = now > entry->last_used ? (double)(now - entry->last_used) : 0.0;
+
+	return entry->opens / (1.0 + age / SSD_HALF_LIFE);
+}
+
+/*!
+ * Writes an entry's index.  Syncing can take a while on a busy disk, so it
+ * is done without any lock held, from a copy of the bitmap.  The caller
+ * must hold a reference, so the entry stays open, and be the only one
+ * writing this entry's index.
+ */
+static int dvdwrap_ssd_write_index(dvdwrap_ssd_t *ssd, dvdwrap_ssd_entry_t *entry)
+{
+	char name[PATH_MAX], tmp[PATH_MAX];
+	size_t len = (entry->nblocks + 7) / 8;
+	dvdwrap_ssd_header_t hdr;
+	uint8_t *bitmap;
+	unsigned int dirty;
+	int fd, ok;
+
+	bitmap = (uint8_t*)malloc(len);
+	if (bitmap == NULL) {
+		return -ENOMEM;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SSD_MAGIC, sizeof(hdr.magic));
+	hdr.block_size = CACHE_BLOCK_SIZE;
+	hdr.pathlen = strlen(entry->path);
+	pthread_mutex_lock(&entry->lock);
+	hdr.opens = entry->opens;
+	hdr.total_size = entry->total_size;
+	hdr.mtime = entry->mtime;
+	hdr.last_used = entry->last_used;
+	hdr.cached = entry->cached;
+	memcpy(bitmap, entry->bitmap, len);
+	dirty = entry->dirty;
+	entry->dirty = 0;
+	pthread_mutex_unlock(&entry->lock);
+
+	/* Write a new copy and rename over the old so a crash can't leave a
+	 * bitmap claiming blocks that were never written */
+	dvdwrap_ssd_filename(ssd, entry->key, "idx", name);
+	dvdwrap_ssd_filename(ssd, entry->key, "idx.tmp", tmp);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		ok = 0;
+	} else {
+		ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+			write(fd, entry->path, hdr.pathlen) == hdr.pathlen &&
+			write(fd, bitmap, len) == (ssize_t)len;
+		/* Blocks the index claims must be on disk before it is */
+		if ((dirty && fdatasync(entry->fd) < 0) || fdatasync(fd) < 0) {
+			ok = 0;
+		}
+		ok = close(fd) == 0 && ok;
+		if (!ok || rename(tmp, name) < 0) {
+			unlink(tmp);
+			ok = 0;
+		}
+	}
+	free(bitmap);
+	if (!ok) {
+		pthread_mutex_lock(&entry->lock);
+		entry->dirty += dirty;
+		pthread_mutex_unlock(&entry->lock);
+		return -EIO;
+	}
+	return 0;
+}
+
+/*!
+ * Reads an index header and path.
+ *
+ * \param fd		Open index file
+ * \param hdr		Returns the header
+ * \return			Path (caller frees), or NULL if the index is unusable
+ */
+static char* dvdwrap_ssd_read_header(int fd, dvdwrap_ssd_header_t *hdr)
+{
+	char *path;
+
+	if (read(fd, hdr, sizeof(*hdr)) != sizeof(*hdr) ||
+			memcmp(hdr->magic, SSD_MAGIC, sizeof(hdr->magic)) != 0 ||
+			hdr->block_size != CACHE_BLOCK_SIZE || hdr->pathlen >= PATH_MAX) {
+		return NULL;
+	}
+	path = (char*)malloc(hdr->pathlen + 1);
+	if (path == NULL) {
+		return NULL;
+	}
+	if (read(fd, path, hdr->pathlen) != hdr->pathlen) {
+		free(path);
+		return NULL;
+	}
+	path[hdr->pathlen] = '\0';
+	return path;
+}
+
+/*! Deletes an entry's files and forgets it.  Called with the set locked
+ * and the entry not open. */
+static void dvdwrap_ssd_evict(dvdwrap_ssd_t *ssd, dvdwrap_ssd_entry_t *entry)
+{
+	dvdwrap_ssd_entry_t **e;
+	char name[PATH_MAX];
+
+	LOG("SSD evict %s\n", entry->path);
+	dvdwrap_ssd_filename(ssd, entry->key, "dat", name);
+	unlink(name);
+	dvdwrap_ssd_filename(ssd, entry->key, "idx", name);
+	unlink(name);
+
+	for (e = &ssd->entries; *e; e = &(*e)->next) {
+		if (*e == entry) {
+			*e = entry->next;
+			break;
+		}
+	}
+	ssd->used -= entry->cached;
+	ssd->evictions++;
+	pthread_mutex_destroy(&entry->lock);
+	free(entry->path);
+	free(entry);
+}
+
+/*!
+ * Makes room for a block, evicting less popular titles if needed.
+ * Called with the set locked.
+ *
+ * \param self		Entry the block is for, which is never evicted
+ * \return			Non-zero if the space was reserved
+ */
+static int dvdwrap_ssd_reserve(dvdwrap_ssd_t *ssd, dvdwrap_ssd_entry_t *self, size_t len)
+{
+	time_t now = time(NULL);
+
+	while (ssd->used + len > ssd->capacity) {
+		dvdwrap_ssd_entry_t *e, *victim = NULL;
+
+		for (e = ssd->entries; e; e = e->next) {
+			if (e == self || e->refs || e->cached == 0) {
+				continue;
+			}
+			if (victim == NULL || dvdwrap_ssd_score(e, now) < dvdwrap_ssd_score(victim, now)) {
+				victim = e;
+			}
+		}
+		if (victim == NULL || dvdwrap_ssd_score(victim, now) > dvdwrap_ssd_score(self, now)) {
+			/* Everything else is in use or more popular than this */
+			return 0;
+		}
+		dvdwrap_ssd_evict(ssd, victim);
+	}
+	ssd->used += len;
+	return 1;
+}
+
+/*!
+ * Prepares the SSD tier, picking up titles cached by earlier runs.  The
+ * directory must exist.
+ *
+ * \return			0 or -errno
+ */
+int dvdwrap_ssd_init(dvdwrap_ssd_t *ssd, const dvdwrap_ssd_conf_t *conf)
+{
+	DIR *d;
+	struct dirent *dir;
+
+	memset(ssd, 0, sizeof(dvdwrap_ssd_t));
+	ssd->conf = conf;
+	ssd->capacity = (uint64_t)conf->size * 1024 * 1024;
+	pthread_mutex_init(&ssd->lock, NULL);
+
+	d = opendir(conf->dir);
+	if (d == NULL) {
+		return -errno;
+	}
+	while ((dir = readdir(d)) != NULL) {
+		dvdwrap_ssd_header_t hdr;
+		dvdwrap_ssd_entry_t *entry;
+		unsigned long long key;
+		char name[PATH_MAX], *path;
+		int fd;
+
+		if (strlen(dir->d_name) != 20 || strcmp(dir->d_name + 16, ".idx") != 0 ||
+				sscanf(dir->d_name, "%16llx", &key) != 1) {
+			continue;
+		}
+		dvdwrap_ssd_filename(ssd, key, "idx", name);
+		fd = open(name, O_RDONLY);
+		if (fd < 0) {
+			continue;
+		}
+		path = dvdwrap_ssd_read_header(fd, &hdr);
+		close(fd);
+		entry = path ? (dvdwrap_ssd_entry_t*)calloc(1, sizeof(dvdwrap_ssd_entry_t)) : NULL;
+		if (entry == NULL) {
+			/* Unusable - remove it so it doesn't hold space */
+			free(path);
+			unlink(name);
+			dvdwrap_ssd_filename(ssd, key, "dat", name);
+			unlink(name);
+			continue;
+		}
+		entry->key = key;
+		entry->path = path;
+		entry->total_size = hdr.total_size;
+		entry->mtime = (time_t)hdr.mtime;
+		entry->cached = hdr.cached;
+		entry->opens = hdr.opens;
+		entry->last_used = (time_t)hdr.last_used;
+		entry->fd = -1;
+		pthread_mutex_init(&entry->lock, NULL);
+		entry->next = ssd->entries;
+		ssd->entries = entry;
+		ssd->used += entry->cached;
+	}
+	closedir(d);
+	LOG("SSD tier %s: %llu bytes cached\n", conf->dir, (unsigned long long)ssd->used);
+
+	/* The capacity may have been reduced since the last run */
+	pthread_mutex_lock(&ssd->lock);
+	while (ssd->used > ssd->capacity && ssd->entries) {
+		dvdwrap_ssd_entry_t *e, *victim = ssd->entries;
+		time_t now = time(NULL);
+
+		for (e = ssd->entries; e; e = e->next) {
+			if (dvdwrap_ssd_score(e, now) < dvdwrap_ssd_score(victim, now)) {
+				victim = e;
+			}
+		}
+		dvdwrap_ssd_evict(ssd, victim);
+	}
+	pthread_mutex_unlock(&ssd->lock);
+	return 0;
+}
+
+/*! Loads or creates the files for an admitted entry.  Called with the
+ * set locked. */
+static int dvdwrap_ssd_load(dvdwrap_ssd_t *ssd, dvdwrap_ssd_entry_t *entry)
+{
+	char name[PATH_MAX];
+	dvdwrap_ssd_header_t hdr;
+	char *path;
+	int fd, valid = 0;
+
+	entry->nblocks = (entry->total_size + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE;
+	entry->bitmap = (uint8_t*)calloc((entry->nblocks + 7) / 8, 1);
+	if (entry->bitmap == NULL) {
+		return -ENOMEM;
+	}
+
+	dvdwrap_ssd_filename(ssd, entry->key, "idx", name);
+	fd = open(name, O_RDONLY);
+	if (fd >= 0) {
+		path = dvdwrap_ssd_read_header(fd, &hdr);
+		if (path && strcmp(path, entry->path) == 0 &&
+				hdr.total_size == entry->total_size && hdr.mtime == entry->mtime &&
+				read(fd, entry->bitmap, (entry->nblocks + 7) / 8) ==
+					(ssize_t)((entry->nblocks + 7) / 8)) {
+			valid = 1;
+		}
+		free(path);
+		close(fd);
+	}
+
+	dvdwrap_ssd_filename(ssd, entry->key, "dat", name);
+	entry->fd = open(name, O_RDWR | O_CREAT, 0600);
+	if (entry->fd < 0) {
+		free(entry->bitmap);
+		entry->bitmap = NULL;
+		return -errno;
+	}
+	if (!valid) {
+		/* New, changed or damaged - start again */
+		LOG("SSD reset %s\n", entry->path);
+		if (ftruncate(entry->fd, 0) < 0) {
+			LOG("SSD truncate failed\n");
+		}
+		memset(entry->bitmap, 0, (entry->nblocks + 7) / 8);
+		ssd->used -= entry->cached;
+		entry->cached = 0;
+	}
+	return 0;
+}
+
+/*!
+ * Called when a title is opened.  Counts the open towards the title's
+ * popularity and, once admitted, opens its cache files.
+ *
+ * \param ssd			SSD tier
+ * \param path			Path of the title within the mount
+ * \param total_size	Current size of the title
+ * \param mtime			Newest modification time of its VOBs
+ * \return				Entry to pass to dvdwrap_ssd_read/close, or NULL
+ *						if the title is not cached
+ */
+dvdwrap_ssd_entry_t* dvdwrap_ssd_open(dvdwrap_ssd_t *ssd, const char *path,
+	uint64_t total_size, time_t mtime)
+{
+	uint64_t key = dvdwrap_hash_string64(path);
+	dvdwrap_ssd_entry_t *entry;
+
+	pthread_mutex_lock(&ssd->lock);
+	for (entry = ssd->entries; entry; entry = entry->next) {
+		if (entry->key == key) {
+			break;
+		}
+	}
+	if (entry == NULL) {
+		entry = (dvdwrap_ssd_entry_t*)calloc(1, sizeof(dvdwrap_ssd_entry_t));
+		if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+			free(entry);
+			pthread_mutex_unlock(&ssd->lock);
+			return NULL;
+		}
+		entry->key = key;
+		entry->fd = -1;
+		pthread_mutex_init(&entry->lock, NULL);
+		entry->next = ssd->entries;
+		ssd->entries = entry;
+	} else if (strcmp(entry->path, path) != 0) {
+		/* Hash collision - leave the other title alone */
+		pthread_mutex_unlock(&ssd->lock);
+		return NULL;
+	}
+	if (entry->refs == 0) {
+		entry->total_size = total_size;
+		entry->mtime = mtime;
+	} else if (entry->total_size != total_size || entry->mtime != mtime) {
+		/* Changed under another open handle - don't mix contents */
+		pthread_mutex_unlock(&ssd->lock);
+		return NULL;
+	}
+	entry->opens++;
+	entry->last_used = time(NULL);
+	entry->refs++;
+
+	if (entry->fd < 0 && entry->opens >= ssd->conf->admit &&
+			dvdwrap_ssd_load(ssd, entry) < 0) {
+		ssd->errors++;
+	}
+	pthread_mutex_unlock(&ssd->lock);
+	return entry;
+}
+
+/*!
+ * Called when a handle on a title is released.  The last close writes the
+ * index, keeping its reference meanwhile so the entry can't be evicted,
+ * but without the set locked, so other titles carry on.
+ */
+void dvdwrap_ssd_close(dvdwrap_ssd_t *ssd, dvdwrap_ssd_entry_t *entry)
+{
+	int rc;
+
+	pthread_mutex_lock(&ssd->lock);
+	if (entry->refs == 1 && entry->fd >= 0) {
+		pthread_mutex_unlock(&ssd->lock);
+		rc = dvdwrap_ssd_write_index(ssd, entry);
+		pthread_mutex_lock(&ssd->lock);
+		if (rc < 0) {
+			ssd->errors++;
+		}
+	}
+	if (--entry->refs == 0 && entry->fd >= 0) {
+		close(entry->fd);
+		entry->fd = -1;
+		free(entry->bitmap);
+		entry->bitmap = NULL;
+	}
+	pthread_mutex_unlock(&ssd->lock);
+}
+
+/*! Writes out indexes of titles still open, at unmount */
+void dvdwrap_ssd_destroy(dvdwrap_ssd_t *ssd)
+{
+	dvdwrap_ssd_entry_t *entry;
+
+	pthread_mutex_lock(&ssd->lock);
+	for (entry = ssd->entries; entry; entry = entry->next) {
+		if (entry->fd >= 0) {
+			dvdwrap_ssd_write_index(ssd, entry);
+		}
+	}
+	pthread_mutex_unlock(&ssd->lock);
+}
+
+static int dvdwrap_ssd_present(dvdwrap_ssd_entry_t *entry, uint64_t index)
+{
+	int present;
+
+	pthread_mutex_lock(&entry->lock);
+	present = (entry->bitmap[index / 8] >> (index % 8)) & 1;
+	pthread_mutex_unlock(&entry->lock);
+	return present;
+}
+
+/*! Stores a block just read from the backend, if there is room */
+static void dvdwrap_ssd_store(dvdwrap_ssd_t *ssd, dvdwrap_ssd_entry_t *entry,
+	uint64_t index, const char *data, size_t len)
+{
+	uint64_t start;
+	ssize_t rc;
+	int ok;
+
+	pthread_mutex_lock(&ssd->lock);
+	ok = dvdwrap_ssd_reserve(ssd, entry, len);
+	if (!ok) {
+		ssd->rejected++;
+	}
+	pthread_mutex_unlock(&ssd->lock);
+	if (!ok) {
+		return;
+	}
+
+	start = dvdwrap_now_us();
+	rc = pwrite(entry->fd, data, len, index * CACHE_BLOCK_SIZE);
+	dvdwrap_stats_record(STATS_SSD_PWRITE, start, rc < 0 ? -errno : rc);
+	DVDWRAP_PROBE4(ssd_write, entry->fd, (int64_t)(index * CACHE_BLOCK_SIZE), len, rc);
+	if (rc != (ssize_t)len) {
+		pthread_mutex_lock(&ssd->lock);
+		ssd->used -= len;
+		ssd->errors++;
+		pthread_mutex_unlock(&ssd->lock);
+		return;
+	}
+
+	pthread_mutex_lock(&entry->lock);
+	if ((entry->bitmap[index / 8] >> (index % 8)) & 1) {
+		/* Raced with another reader - don't count it twice */
+		pthread_mutex_unlock(&entry->lock);
+		pthread_mutex_lock(&ssd->lock);
+		ssd->used -= len;
+		pthread_mutex_unlock(&ssd->lock);
+		return;
+	}
+	entry->bitmap[index / 8] |= 1 << (index % 8);
+	entry->cached += len;
+	entry->dirty++;
+	pthread_mutex_unlock(&entry->lock);
+
+	pthread_mutex_lock(&ssd->lock);
+	ssd->writes++;
+	pthread_mutex_unlock(&ssd->lock);
+}
+
+/*!
+ * Reads part of a title through the SSD tier.  Blocks not yet on the SSD
+ * are read in full from the backend and written through.
+ *
+ * \param ssd			SSD tier
+ * \param entry			Entry from dvdwrap_ssd_open
+ * \param buf			Destination
+ * \param size			Bytes requested
+ * \param offset		Offset within the title
+ * \param fill			Backend read for misses
+ * \param arg			Passed to fill
+ * \return				Bytes read or -errno
+ */
+ssize_t dvdwrap_ssd_read(dvdwrap_ssd_t *ssd, dvdwrap_ssd_entry_t *entry,
+	char *buf, size_t size, uint64_t offset, dvdwrap_cache_fill_t fill, void *arg)
+{
+	size_t total = 0;
+	char *tmp = NULL;
+
+	if (entry->fd < 0) {
+		/* Not admitted */
+		return fill(arg, buf, size, offset);
+	}
+
+	while (total < size && offset < entry->total_size) {
+		uint64_t index = offset / CACHE_BLOCK_SIZE;
+		size_t boff = offset % CACHE_BLOCK_SIZE;
+		size_t len = CACHE_BLOCK_SIZE, n;
+		char *dst;
+		ssize_t rc;
+
+		if (len > entry->total_size - index * CACHE_BLOCK_SIZE) {
+			len = entry->total_size - index * CACHE_BLOCK_SIZE;
+		}
+		n = size - total;
+		if (n > len - boff) {
+			n = len - boff;
+		}
+
+		if (dvdwrap_ssd_present(entry, index)) {
+			uint64_t start = dvdwrap_now_us();
+
+			rc = pread(entry->fd, buf + total, n, offset);
+			dvdwrap_stats_record(STATS_SSD_PREAD, start, rc < 0 ? -errno : rc);
+			DVDWRAP_PROBE4(ssd_read, entry->fd, (int64_t)offset, n, rc);
+			if (rc == (ssize_t)n) {
+				__sync_fetch_and_add(&ssd->hits, 1);
+				total += n;
+				offset += n;
+				continue;
+			}
+			/* Damaged - fall back to the backend */
+			__sync_fetch_and_add(&ssd->errors, 1);
+		}
+		__sync_fetch_and_add(&ssd->misses, 1);
+
+		/* Fetch the whole block, straight into the caller's buffer if it
+		 * wants all of it */
+		if (boff == 0 && n == len) {
+			dst = buf + total;
+		} else {
+			if (tmp == NULL && (tmp = (char*)malloc(CACHE_BLOCK_SIZE)) == NULL) {
+				return total ? (ssize_t)total : -ENOMEM;
+			}
+			dst = tmp;
+		}
+		rc = fill(arg, dst, len, index * CACHE_BLOCK_SIZE);
+		if (rc < 0) {
+			free(tmp);
+			return total ? (ssize_t)total : rc;
+		}
+		if (rc == (ssize_t)len) {
+			dvdwrap_ssd_store(ssd, entry, index, dst, len);
+		}
+		if (dst == tmp) {
+			if (rc < (ssize_t)(boff + n)) {
+				n = rc > (ssize_t)boff ? rc - boff : 0;
+			}
+			memcpy(buf + total, tmp + boff, n);
+		} else if (rc < (ssize_t)n) {
+			n = rc;
+		}
+		total += n;
+		offset += n;
+		if (rc < (ssize_t)len) {
+			/* VOB shorter than when it was opened */
+			break;
+		}
+	}
+	free(tmp);
+	return total;
+}
+
+/*! Writes SSD tier statistics and the titles it knows about */
+void dvdwrap_ssd_report(dvdwrap_ssd_t *ssd, dvdwrap_buf_t *buf)
+{
+	dvdwrap_ssd_entry_t *entry;
+	time_t now = time(NULL);
+	uint64_t lookups;
+
+	pthread_mutex_lock(&ssd->lock);
+	lookups = ssd->hits + ssd->misses;
+	dvdwrap_buf_printf(buf,
+		"dir %s\n"
+		"capacity %llu\n"
+		"used %llu\n"
+		"hits %llu\n"
+		"misses %llu\n"
+		"hit_ratio %.3f\n"
+		"writes %llu\n"
+		"rejected %llu\n"
+		"evictions %llu\n"
+		"errors %llu\n\n",
+		ssd->conf->dir,
+		(unsigned long long)ssd->capacity, (unsigned long long)ssd->used,
+		(unsigned long long)ssd->hits, (unsigned long long)ssd->misses,
+		lookups ? (double)ssd->hits / lookups : 0.0,
+		(unsigned long long)ssd->writes, (unsigned long long)ssd->rejected,
+		(unsigned long long)ssd->evictions, (unsigned long long)ssd->errors);
+	dvdwrap_buf_printf(buf, "%8s %6s %12s %12s %s\n", "score", "opens", "cached", "size", "title");
+	for (entry = ssd->entries; entry; entry = entry->next) {
+		dvdwrap_buf_printf(buf, "%8.2f %6u %12llu %12llu %s\n",
+			dvdwrap_ssd_score(entry, now), entry->opens,
+			(unsigned long long)entry->cached, (unsigned long long)entry->total_size,
+			entry->path);
+	}
+	pthread_mutex_unlock(&ssd->lock);
+}
@@ -0,0 +1,88 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DVDWRAP_SSD_H
+#define _DVDWRAP_SSD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "dvdwrap_buf.h"
+#include "dvdwrap_cache.h"
+
+/*! SSD tier tunables */
+typedef struct {
+	char			*dir;			/*!< Cache directory, NULL to disable */
+	unsigned int	size;			/*!< Capacity (MiB) */
+	unsigned int	admit;			/*!< Opens before a title is cached */
+} dvdwrap_ssd_conf_t;
+
+/*! A title known to the SSD tier */
+typedef struct dvdwrap_ssd_entry {
+	struct dvdwrap_ssd_entry	*next;
+	uint64_t			key;		/*!< Hash of path, names the files */
+	char				*path;
+	uint64_t			total_size;
+	time_t				mtime;
+	uint64_t			cached;		/*!< Bytes present on the SSD */
+	uint32_t			opens;
+	time_t				last_used;
+	unsigned int		refs;		/*!< Open handles */
+
+	/* Valid while refs > 0 and admitted */
+	pthread_mutex_t		lock;
+	int					fd;			/*!< Data file, -1 if not admitted */
+	uint8_t				*bitmap;	/*!< Blocks present */
+	uint64_t			nblocks;
+	unsigned int		dirty;		/*!< Blocks added since index written */
+} dvdwrap_ssd_entry_t;
+
+/*! Local cache of hot titles on fast storage */
+typedef struct {
+	const dvdwrap_ssd_conf_t	*conf;
+	pthread_mutex_t		lock;
+	dvdwrap_ssd_entry_t	*entries;
+	uint64_t			capacity;	/*!< Bytes */
+	uint64_t			used;		/*!< Bytes of block data on disk */
+
+	/* Statistics */
+	uint64_t			hits;
+	uint64_t			misses;
+	uint64_t			writes;
+	uint64_t			errors;
+	uint64_t			evictions;
+	uint64_t			rejected;	/*!< Blocks not written for lack of room */
+} dvdwrap_ssd_t;
+
+int dvdwrap_ssd_init(dvdwrap_ssd_t *ssd, const dvdwrap_ssd_conf_t *conf);
+void dvdwrap_ssd_destroy(dvdwrap_ssd_t *ssd);
+dvdwrap_ssd_entry_t* dvdwrap_ssd_open(dvdwrap_ssd_t *ssd, const char *path,
+	uint64_t total_size, time_t mtime);
+void dvdwrap_ssd_close(dvdwrap_ssd_t *ssd, dvdwrap_ssd_entry_t *entry);
+ssize_t dvdwrap_ssd_read(dvdwrap_ssd_t *ssd, dvdwrap_ssd_entry_t *entry,
+	char *buf, size_t size, uint64_t offset, dvdwrap_cache_fill_t fill, void *arg);
+void dvdwrap_ssd_report(dvdwrap_ssd_t *ssd, dvdwrap_buf_t *buf);
+
+#endif
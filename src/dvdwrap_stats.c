@@ -0,0 +1,215 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Operation statistics.  Every FUSE operation, and the system calls made
+ * for it, is counted with its bytes, errors and a log2 latency histogram,
+ * and reported in .dvdwrap/stats with percentiles.
+ *
+ * Each thread gets a shard of counters on its first operation and is
+ * the only writer to it, so recording is a handful of plain increments.
+ * The report sums all shards, and may be a few operations behind.  When
+ * a thread exits its shard is kept, with its counts, for the next new
+ * thread.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "dvdwrap_fuse.h"
+#include "dvdwrap_stats.h"
+
+static const char *dvdwrap_stats_names[STATS_NUM] = {
+	"getattr",
+	"opendir",
+	"readdir",
+	"releasedir",
+	"open",
+	"read",
+	"write",
+	"truncate",
+	"release",
+	"lstat",
+	"pread",
+	"ssd_pread",
+	"ssd_pwrite",
+};
+
+static pthread_mutex_t dvdwrap_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t dvdwrap_stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t dvdwrap_stats_key;
+static dvdwrap_stats_shard_t *dvdwrap_stats_shards;
+static __thread dvdwrap_stats_shard_t *dvdwrap_stats_mine;
+
+/*! Hands a thread's shard on when it exits */
+static void dvdwrap_stats_release(void *arg)
+{
+	dvdwrap_stats_shard_t *shard = (dvdwrap_stats_shard_t*)arg;
+
+	pthread_mutex_lock(&dvdwrap_stats_lock);
+	shard->in_use = 0;
+	pthread_mutex_unlock(&dvdwrap_stats_lock);
+}
+
+static void dvdwrap_stats_key_init(void)
+{
+	pthread_key_create(&dvdwrap_stats_key, dvdwrap_stats_release);
+}
+
+/*! Finds a shard for the calling thread */
+static dvdwrap_stats_shard_t* dvdwrap_stats_shard(void)
+{
+	dvdwrap_stats_shard_t *shard;
+
+	pthread_once(&dvdwrap_stats_once, dvdwrap_stats_key_init);
+	pthread_mutex_lock(&dvdwrap_stats_lock);
+	for (shard = dvdwrap_stats_shards; shard; shard = shard->next) {
+		if (!shard->in_use) {
+			break;
+		}
+	}
+	if (shard == NULL) {
+		shard = (dvdwrap_stats_shard_t*)calloc(1, sizeof(dvdwrap_stats_shard_t));
+		if (shard == NULL) {
+			pthread_mutex_unlock(&dvdwrap_stats_lock);
+			return NULL;
+		}
+		shard->next = dvdwrap_stats_shards;
+		dvdwrap_stats_shards = shard;
+	}
+	shard->in_use = 1;
+	pthread_mutex_unlock(&dvdwrap_stats_lock);
+	pthread_setspecific(dvdwrap_stats_key, shard);
+	dvdwrap_stats_mine = shard;
+	return shard;
+}
+
+/*!
+ * Counts an operation.
+ *
+ * \param op		Operation
+ * \param start		dvdwrap_now_us() when it started
+ * \param rc		Its result - bytes transferred, or -errno
+ * \return			How long it took, in us
+ */
+uint64_t dvdwrap_stats_record(dvdwrap_stats_op_t op, uint64_t start, ssize_t rc)
+{
+	dvdwrap_stats_shard_t *shard = dvdwrap_stats_mine;
+	dvdwrap_stats_counter_t *c;
+	uint64_t us = dvdwrap_now_us() - start;
+	unsigned int bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+	if (shard == NULL && (shard = dvdwrap_stats_shard()) == NULL) {
+		return us;
+	}
+	c = &shard->ops[op];
+	c->calls++;
+	if (rc < 0) {
+		c->errors++;
+	} else {
+		c->bytes += rc;
+	}
+	c->total_us += us;
+	if (us > c->max_us) {
+		c->max_us = us;
+	}
+	c->hist[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1]++;
+	return us;
+}
+
+/*! lstat, counted */
+int dvdwrap_stats_lstat(const char *path, struct stat *st)
+{
+	uint64_t start = dvdwrap_now_us();
+	int rc = lstat(path, st);
+
+	dvdwrap_stats_record(STATS_LSTAT, start, rc < 0 ? -1 : 0);
+	return rc;
+}
+
+/*! Upper bound of the bucket holding a percentile, in us */
+static uint64_t dvdwrap_stats_percentile(const dvdwrap_stats_counter_t *c, unsigned int permille)
+{
+	uint64_t want = (c->calls * permille + 999) / 1000, seen = 0;
+	unsigned int n;
+
+	for (n = 0; n < STATS_BUCKETS; n++) {
+		seen += c->hist[n];
+		if (seen >= want) {
+			break;
+		}
+	}
+	return n ? (uint64_t)1 << n : 1;
+}
+
+void dvdwrap_stats_report(dvdwrap_buf_t *buf)
+{
+	dvdwrap_stats_counter_t sum[STATS_NUM];
+	dvdwrap_stats_shard_t *shard;
+	uint64_t syscalls = 0;
+	unsigned int op, n, shards = 0;
+
+	memset(sum, 0, sizeof(sum));
+	pthread_mutex_lock(&dvdwrap_stats_lock);
+	for (shard = dvdwrap_stats_shards; shard; shard = shard->next) {
+		for (op = 0; op < STATS_NUM; op++) {
+			const dvdwrap_stats_counter_t *c = &shard->ops[op];
+
+			sum[op].calls += c->calls;
+			sum[op].errors += c->errors;
+			sum[op].bytes += c->bytes;
+			sum[op].total_us += c->total_us;
+			if (c->max_us > sum[op].max_us) {
+				sum[op].max_us = c->max_us;
+			}
+			for (n = 0; n < STATS_BUCKETS; n++) {
+				sum[op].hist[n] += c->hist[n];
+			}
+		}
+		shards++;
+	}
+	pthread_mutex_unlock(&dvdwrap_stats_lock);
+
+	for (op = STATS_FIRST_SYSCALL; op < STATS_NUM; op++) {
+		syscalls += sum[op].calls;
+	}
+	dvdwrap_buf_printf(buf, "threads %u\nsyscalls %llu\n\n", shards,
+		(unsigned long long)syscalls);
+	dvdwrap_buf_printf(buf, "%-10s %10s %8s %14s %9s %9s %9s %9s %9s\n",
+		"op", "calls", "errors", "bytes", "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+	for (op = 0; op < STATS_NUM; op++) {
+		const dvdwrap_stats_counter_t *c = &sum[op];
+
+		if (c->calls == 0) {
+			continue;
+		}
+		dvdwrap_buf_printf(buf, "%-10s %10llu %8llu %14llu %9llu %9llu %9llu %9llu %9llu\n",
+			dvdwrap_stats_names[op], (unsigned long long)c->calls,
+			(unsigned long long)c->errors, (unsigned long long)c->bytes,
+			(unsigned long long)(c->total_us / c->calls),
+			(unsigned long long)dvdwrap_stats_percentile(c, 500),
+			(unsigned long long)dvdwrap_stats_percentile(c, 990),
+			(unsigned long long)dvdwrap_stats_percentile(c, 999),
+			(unsigned long long)c->max_us);
+	}
+}
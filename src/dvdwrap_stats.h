@@ -0,0 +1,80 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DVDWRAP_STATS_H
+#define _DVDWRAP_STATS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "dvdwrap_buf.h"
+
+/*! Operations timed */
+typedef enum {
+	STATS_GETATTR = 0,
+	STATS_OPENDIR,
+	STATS_READDIR,
+	STATS_RELEASEDIR,
+	STATS_OPEN,
+	STATS_READ,
+	STATS_WRITE,
+	STATS_TRUNCATE,
+	STATS_RELEASE,
+
+	/* System calls made on behalf of the above */
+	STATS_LSTAT,
+	STATS_PREAD,		/*!< Of a VOB */
+	STATS_SSD_PREAD,
+	STATS_SSD_PWRITE,
+
+	STATS_NUM
+} dvdwrap_stats_op_t;
+
+/*! First operation counted as a system call */
+#define STATS_FIRST_SYSCALL		STATS_LSTAT
+
+/*! Latency histogram buckets.  Bucket n counts times of less than 2^n us. */
+#define STATS_BUCKETS			32
+
+typedef struct {
+	uint64_t		calls;
+	uint64_t		errors;
+	uint64_t		bytes;
+	uint64_t		total_us;
+	uint64_t		max_us;
+	uint64_t		hist[STATS_BUCKETS];
+} dvdwrap_stats_counter_t;
+
+/*! Counters written by one thread only, so no locks or atomic
+ * operations are needed to update them */
+typedef struct dvdwrap_stats_shard {
+	struct dvdwrap_stats_shard	*next;
+	int							in_use;		/*!< Owned by a live thread */
+	dvdwrap_stats_counter_t		ops[STATS_NUM];
+} dvdwrap_stats_shard_t;
+
+uint64_t dvdwrap_stats_record(dvdwrap_stats_op_t op, uint64_t start, ssize_t rc);
+int dvdwrap_stats_lstat(const char *path, struct stat *st);
+void dvdwrap_stats_report(dvdwrap_buf_t *buf);
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Title registry.  Each distinct output file opened since mount gets an
+ * entry with an id which caches use as part of their keys.  If the VOBs
+ * behind a path change size or modification time the path is given a new
+ * id, so anything cached against the old content is never used again.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "dvdwrap_fuse.h"
+#include "dvdwrap_title.h"
+
+#define TITLE_BUCKETS		1024
+
+/*! FNV-1a hash of a string */
+uint32_t dvdwrap_hash_string(const char *str)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*! 64-bit FNV-1a hash of a string, for names that must not collide */
+uint64_t dvdwrap_hash_string64(const char *str)
+{
+	uint64_t hash = 14695981039346656037ull;
+
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+int dvdwrap_title_set_init(dvdwrap_title_set_t *set)
+{
+	memset(set, 0, sizeof(dvdwrap_title_set_t));
+	pthread_mutex_init(&set->lock, NULL);
+	set->nbuckets = TITLE_BUCKETS;
+	set->next_id = 1;
+	set->hash = (dvdwrap_title_t**)calloc(set->nbuckets, sizeof(dvdwrap_title_t*));
+	return set->hash ? 0 : -ENOMEM;
+}
+
+void dvdwrap_title_set_destroy(dvdwrap_title_set_t *set)
+{
+	dvdwrap_title_t *title, *next;
+	unsigned int n;
+
+	for (n = 0; n < set->nbuckets; n++) {
+		for (title = set->hash[n]; title; title = next) {
+			next = title->next;
+			free(title->path);
+			free(title);
+		}
+	}
+	free(set->hash);
+	set->hash = NULL;
+	set->count = 0;
+	pthread_mutex_destroy(&set->lock);
+}
+
+/*!
+ * Looks up or registers a title.
+ *
+ * \param set			Title registry
+ * \param path			Path of the output file within the mount
+ * \param total_size	Size of the output file
+ * \param mtime			Newest modification time of its VOBs
+ * \param open			Non-zero to record that it was opened
+ * \return				Title, or NULL on allocation failure
+ */
+dvdwrap_title_t* dvdwrap_title_get(dvdwrap_title_set_t *set, const char *path,
+	uint64_t total_size, time_t mtime, int open)
+{
+	dvdwrap_title_t *title;
+	unsigned int bucket = dvdwrap_hash_string(path) % set->nbuckets;
+
+	pthread_mutex_lock(&set->lock);
+	for (title = set->hash[bucket]; title; title = title->next) {
+		if (strcmp(title->path, path) == 0) {
+			break;
+		}
+	}
+	if (title == NULL) {
+		title = (dvdwrap_title_t*)calloc(1, sizeof(dvdwrap_title_t));
+		if (title == NULL || (title->path = strdup(path)) == NULL) {
+			free(title);
+			pthread_mutex_unlock(&set->lock);
+			return NULL;
+		}
+		title->id = set->next_id++;
+		title->total_size = total_size;
+		title->mtime = mtime;
+		title->next = set->hash[bucket];
+		set->hash[bucket] = title;
+		set->count++;
+	} else if (title->total_size != total_size || title->mtime != mtime) {
+		/* Content has changed - invalidate anything keyed on the old id */
+		LOG("Title %s changed\n", path);
+		title->id = set->next_id++;
+		title->total_size = total_size;
+		title->mtime = mtime;
+	}
+	if (open) {
+		title->opens++;
+		title->last_open = dvdwrap_now_ms();
+	}
+	pthread_mutex_unlock(&set->lock);
+	return title;
+}
+
+/*!
+ * Finds the title currently holding an id.
+ *
+ * \return				Title, or NULL if the id is unknown or its
+ *						title has changed since
+ */
+dvdwrap_title_t* dvdwrap_title_find_id(dvdwrap_title_set_t *set, uint32_t id)
+{
+	dvdwrap_title_t *title = NULL;
+	unsigned int bucket;
+
+	pthread_mutex_lock(&set->lock);
+	for (bucket = 0; bucket < set->nbuckets && title == NULL; bucket++) {
+		for (title = set->hash[bucket]; title; title = title->next) {
+			if (title->id == id) {
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&set->lock);
+	return title;
+}
@@ -0,0 +1,58 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DVDWRAP_TITLE_H
+#define _DVDWRAP_TITLE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+/*! A title (output .mpg) that has been opened at least once */
+typedef struct dvdwrap_title {
+	struct dvdwrap_title	*next;		/*!< Hash chain */
+	uint32_t				id;			/*!< Unique per path and content */
+	char					*path;		/*!< Path within the mount */
+	uint64_t				total_size;
+	time_t					mtime;		/*!< Newest VOB modification time */
+	unsigned int			opens;		/*!< Times opened since mount */
+	uint64_t				last_open;	/*!< dvdwrap_now_ms() of last open */
+} dvdwrap_title_t;
+
+/*! Registry of titles seen since mount */
+typedef struct {
+	pthread_mutex_t			lock;
+	dvdwrap_title_t			**hash;
+	unsigned int			nbuckets;
+	unsigned int			count;
+	uint32_t				next_id;
+} dvdwrap_title_set_t;
+
+int dvdwrap_title_set_init(dvdwrap_title_set_t *set);
+void dvdwrap_title_set_destroy(dvdwrap_title_set_t *set);
+dvdwrap_title_t* dvdwrap_title_get(dvdwrap_title_set_t *set, const char *path,
+	uint64_t total_size, time_t mtime, int open);
+dvdwrap_title_t* dvdwrap_title_find_id(dvdwrap_title_set_t *set, uint32_t id);
+uint32_t dvdwrap_hash_string(const char *str);
+uint64_t dvdwrap_hash_string64(const char *str);
+
+#endif
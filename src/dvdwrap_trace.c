@@ -0,0 +1,569 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Trace ring.  LOG() stores the format string pointer and raw arguments
+ * of each message in a ring kept by the calling thread, so logging takes
+ * no locks and does no formatting.  Strings are copied, as they rarely
+ * outlive the call.  Each thread remembers the argument types of the
+ * formats it uses, so they are parsed once rather than every time.  The
+ * rings are dumped in a binary form, by reading .dvdwrap/trace or sending
+ * the process SIGUSR1, and dvdtrace turns a dump into text or a Chrome
+ * trace.
+ *
+ * Each record is guarded like a seqlock: its seq is cleared while it is
+ * written and set to its position afterwards, so a dump taken while the
+ * thread is logging skips any record it sees change.
+ *
+ * A dump is a magic string followed by tagged items in host byte order:
+ *
+ *   'F' u32 id, u16 len, format string (without NUL)
+ *   'E' u32 tid, u32 format id, u64 time, u16 len, arguments
+ *
+ * A format is defined before the first message that uses it.  Arguments
+ * follow the conversions in the format, each as 8 bytes (int64, uint64,
+ * pointer or double) or a NUL terminated string, and end early if they
+ * didn't fit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "dvdwrap_fuse.h"
+#include "dvdwrap_trace.h"
+
+/*! Dump written on SIGUSR1 when there is a state directory */
+#define TRACE_FILE		"trace"
+
+unsigned int dvdwrap_log_level = DEFAULT_LOG_LEVEL;
+
+static pthread_mutex_t dvdwrap_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t dvdwrap_trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t dvdwrap_trace_key;
+static dvdwrap_trace_ring_t *dvdwrap_trace_rings;
+static __thread dvdwrap_trace_ring_t *dvdwrap_trace_mine;
+
+/* Thread writing dumps on SIGUSR1 */
+static pthread_t dvdwrap_trace_thread;
+static int dvdwrap_trace_running;
+static volatile int dvdwrap_trace_stopping;
+static char dvdwrap_trace_path[PATH_MAX];
+
+/*!
+ * Finds the next conversion in a format string.
+ *
+ * \param fmt		Format, or where the last conversion ended
+ * \param spec		Filled in with the conversion
+ * \return			Where the conversion ends, or NULL if there are none left
+ */
+const char* dvdwrap_trace_next(const char *fmt, dvdwrap_trace_spec_t *spec)
+{
+	const char *p = strchr(fmt, '%');
+
+	if (p == NULL) {
+		return NULL;
+	}
+	memset(spec, 0, sizeof(dvdwrap_trace_spec_t));
+	spec->start = p++;
+
+	/* Flags, width and precision */
+	while (*p && strchr("-+ #0'", *p)) {
+		p++;
+	}
+	for (; (*p >= '0' && *p <= '9') || *p == '.' || *p == '*'; p++) {
+		if (*p == '*') {
+			spec->stars++;
+		}
+	}
+
+	/* Length modifier */
+	spec->length = p;
+	switch (*p) {
+	case 'h':
+		spec->size = (p[1] == 'h') ? 'H' : 'h';
+		break;
+	case 'l':
+		spec->size = (p[1] == 'l') ? 'L' : 'l';
+		break;
+	case 'q':
+		spec->size = 'L';
+		break;
+	case 'L':
+		spec->size = 'D';
+		break;
+	case 'j':
+	case 'z':
+	case 't':
+		spec->size = *p;
+		break;
+	}
+	if (spec->size) {
+		p += (spec->size == 'H' || (spec->size == 'L' && *p == 'l')) ? 2 : 1;
+	}
+
+	switch (*p) {
+	case 'd':
+	case 'i':
+		spec->type = TRACE_ARG_INT;
+		break;
+	case 'o':
+	case 'u':
+	case 'x':
+	case 'X':
+	case 'c':
+		spec->type = TRACE_ARG_UINT;
+		break;
+	case 'p':
+		spec->type = TRACE_ARG_PTR;
+		break;
+	case 's':
+		spec->type = TRACE_ARG_STR;
+		break;
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'F':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+		spec->type = TRACE_ARG_DOUBLE;
+		break;
+	case '\0':
+		spec->end = p;
+		return p;
+	}
+	spec->end = p + 1;
+	return spec->end;
+}
+
+/*! Hands a thread's ring on when it exits */
+static void dvdwrap_trace_release(void *arg)
+{
+	dvdwrap_trace_ring_t *ring = (dvdwrap_trace_ring_t*)arg;
+
+	pthread_mutex_lock(&dvdwrap_trace_lock);
+	ring->in_use = 0;
+	pthread_mutex_unlock(&dvdwrap_trace_lock);
+}
+
+static void dvdwrap_trace_key_init(void)
+{
+	pthread_key_create(&dvdwrap_trace_key, dvdwrap_trace_release);
+}
+
+/*! Finds a ring for the calling thread */
+static dvdwrap_trace_ring_t* dvdwrap_trace_ring(void)
+{
+	dvdwrap_trace_ring_t *ring;
+
+	pthread_once(&dvdwrap_trace_once, dvdwrap_trace_key_init);
+	pthread_mutex_lock(&dvdwrap_trace_lock);
+	for (ring = dvdwrap_trace_rings; ring; ring = ring->next) {
+		if (!ring->in_use) {
+			break;
+		}
+	}
+	if (ring == NULL) {
+		ring = (dvdwrap_trace_ring_t*)calloc(1, sizeof(dvdwrap_trace_ring_t));
+		if (ring == NULL) {
+			pthread_mutex_unlock(&dvdwrap_trace_lock);
+			return NULL;
+		}
+		ring->next = dvdwrap_trace_rings;
+		dvdwrap_trace_rings = ring;
+	}
+	ring->in_use = 1;
+	ring->tid = (uint32_t)syscall(SYS_gettid);
+	pthread_mutex_unlock(&dvdwrap_trace_lock);
+	pthread_setspecific(dvdwrap_trace_key, ring);
+	dvdwrap_trace_mine = ring;
+	return ring;
+}
+
+/*! Stores 8 bytes of argument, returning 0 if there was no room */
+static int dvdwrap_trace_put(dvdwrap_trace_record_t *rec, const void *value)
+{
+	if (rec->len + 8 > TRACE_ARGS) {
+		return 0;
+	}
+	memcpy(&rec->args[rec->len], value, 8);
+	rec->len += 8;
+	return 1;
+}
+
+/*! Stores an integer argument of the given size */
+static int dvdwrap_trace_put_int(dvdwrap_trace_record_t *rec, char size, va_list *ap)
+{
+	int64_t value;
+
+	switch (size) {
+	case 'H':	value = (signed char)va_arg(*ap, int); break;
+	case 'h':	value = (short)va_arg(*ap, int); break;
+	case 'l':	value = va_arg(*ap, long); break;
+	case 'L':	value = va_arg(*ap, long long); break;
+	case 'j':	value = va_arg(*ap, intmax_t); break;
+	case 'z':	value = va_arg(*ap, ssize_t); break;
+	case 't':	value = va_arg(*ap, ptrdiff_t); break;
+	default:	value = va_arg(*ap, int); break;
+	}
+	return dvdwrap_trace_put(rec, &value);
+}
+
+static int dvdwrap_trace_put_uint(dvdwrap_trace_record_t *rec, char size, va_list *ap)
+{
+	uint64_t value;
+
+	switch (size) {
+	case 'H':	value = (unsigned char)va_arg(*ap, unsigned int); break;
+	case 'h':	value = (unsigned short)va_arg(*ap, unsigned int); break;
+	case 'l':	value = va_arg(*ap, unsigned long); break;
+	case 'L':	value = va_arg(*ap, unsigned long long); break;
+	case 'j':	value = va_arg(*ap, uintmax_t); break;
+	case 'z':	value = va_arg(*ap, size_t); break;
+	case 't':	value = (uint64_t)va_arg(*ap, ptrdiff_t); break;
+	default:	value = va_arg(*ap, unsigned int); break;
+	}
+	return dvdwrap_trace_put(rec, &value);
+}
+
+/*! Returns the argument types of a format, parsing it if this thread
+ * hasn't used it lately */
+static const dvdwrap_trace_sig_t* dvdwrap_trace_sig(dvdwrap_trace_ring_t *ring,
+	const char *fmt)
+{
+	dvdwrap_trace_sig_t *sig = &ring->sigs[((uintptr_t)fmt >> 3) & (TRACE_SIGS - 1)];
+	dvdwrap_trace_spec_t spec;
+	const char *p = fmt;
+	unsigned int n;
+
+	if (sig->fmt == fmt) {
+		return sig;
+	}
+	sig->fmt = fmt;
+	sig->count = 0;
+	while ((p = dvdwrap_trace_next(p, &spec)) != NULL) {
+		for (n = 0; n < spec.stars && sig->count < TRACE_SIG_ARGS; n++) {
+			sig->type[sig->count] = TRACE_ARG_INT;
+			sig->size[sig->count++] = 0;
+		}
+		if (spec.type == TRACE_ARG_NONE && spec.end[-1] != 'n') {
+			continue;
+		}
+		if (sig->count == TRACE_SIG_ARGS) {
+			break; /* The rest wouldn't fit anyway */
+		}
+		sig->type[sig->count] = spec.type;
+		sig->size[sig->count++] = spec.size;
+	}
+	return sig;
+}
+
+/*! Copies the arguments of a message into its record */
+static void dvdwrap_trace_args(dvdwrap_trace_record_t *rec, const dvdwrap_trace_sig_t *sig,
+	va_list *ap)
+{
+	unsigned int n;
+
+	for (n = 0; n < sig->count; n++) {
+		switch (sig->type[n]) {
+		case TRACE_ARG_NONE:
+			(void)va_arg(*ap, void*);
+			break;
+		case TRACE_ARG_INT:
+			if (!dvdwrap_trace_put_int(rec, sig->size[n], ap)) {
+				return;
+			}
+			break;
+		case TRACE_ARG_UINT:
+			if (!dvdwrap_trace_put_uint(rec, sig->size[n], ap)) {
+				return;
+			}
+			break;
+		case TRACE_ARG_PTR: {
+			uint64_t value = (uintptr_t)va_arg(*ap, void*);
+
+			if (!dvdwrap_trace_put(rec, &value)) {
+				return;
+			}
+			break;
+		}
+		case TRACE_ARG_DOUBLE: {
+			double value = (sig->size[n] == 'D') ?
+				(double)va_arg(*ap, long double) : va_arg(*ap, double);
+
+			if (!dvdwrap_trace_put(rec, &value)) {
+				return;
+			}
+			break;
+		}
+		case TRACE_ARG_STR: {
+			const char *s = va_arg(*ap, const char*);
+			size_t len;
+
+			if (rec->len >= TRACE_ARGS) {
+				return;
+			}
+			if (s == NULL) {
+				s = "(null)";
+			}
+			/* Truncated to fit, which ends the record */
+			len = strnlen(s, TRACE_ARGS - rec->len - 1);
+			memcpy(&rec->args[rec->len], s, len);
+			rec->args[rec->len + len] = '\0';
+			rec->len += len + 1;
+			break;
+		}
+		}
+	}
+}
+
+/*!
+ * Logs a message to the calling thread's ring.  Use LOG() rather than
+ * calling this directly.
+ *
+ * \param fmt		printf format, which must be a string literal
+ */
+void dvdwrap_trace(const char *fmt, ...)
+{
+	dvdwrap_trace_ring_t *ring = dvdwrap_trace_mine;
+	dvdwrap_trace_record_t *rec;
+	uint64_t pos;
+	va_list ap;
+
+	if (ring == NULL && (ring = dvdwrap_trace_ring()) == NULL) {
+		return;
+	}
+	pos = ring->head;
+	rec = &ring->records[pos & (TRACE_RECORDS - 1)];
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	rec->time = dvdwrap_now_us();
+	rec->fmt = fmt;
+	rec->tid = ring->tid;
+	rec->len = 0;
+	va_start(ap, fmt);
+	dvdwrap_trace_args(rec, dvdwrap_trace_sig(ring, fmt), &ap);
+	va_end(ap);
+
+	__atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, pos + 1, __ATOMIC_RELEASE);
+}
+
+/*! Format ids given out during a dump */
+typedef struct {
+	const char	**fmts;
+	uint32_t	count;
+	uint32_t	alloc;
+} dvdwrap_trace_fmts_t;
+
+/*! Returns the id of a format, defining it in the dump the first time */
+static uint32_t dvdwrap_trace_fmt_id(dvdwrap_trace_fmts_t *fmts, dvdwrap_buf_t *buf,
+	const char *fmt)
+{
+	uint32_t id;
+	uint16_t len;
+
+	for (id = 0; id < fmts->count; id++) {
+		if (fmts->fmts[id] == fmt) {
+			return id;
+		}
+	}
+	if (fmts->count == fmts->alloc) {
+		uint32_t alloc = fmts->alloc ? fmts->alloc * 2 : 64;
+		const char **p = (const char**)realloc(fmts->fmts, alloc * sizeof(const char*));
+
+		if (p == NULL) {
+			return UINT32_MAX;
+		}
+		fmts->fmts = p;
+		fmts->alloc = alloc;
+	}
+	fmts->fmts[id] = fmt;
+	fmts->count++;
+
+	len = (uint16_t)strnlen(fmt, UINT16_MAX);
+	dvdwrap_buf_append(buf, "F", 1);
+	dvdwrap_buf_append(buf, &id, sizeof(id));
+	dvdwrap_buf_append(buf, &len, sizeof(len));
+	dvdwrap_buf_append(buf, fmt, len);
+	return id;
+}
+
+/*!
+ * Dumps the messages held by every thread's ring.
+ *
+ * \param buf		Buffer the binary dump is appended to
+ */
+void dvdwrap_trace_dump(dvdwrap_buf_t *buf)
+{
+	dvdwrap_trace_fmts_t fmts = { NULL, 0, 0 };
+	dvdwrap_trace_ring_t *ring;
+	dvdwrap_trace_record_t rec;
+	uint64_t head, pos;
+	uint32_t id;
+
+	dvdwrap_buf_append(buf, TRACE_MAGIC, strlen(TRACE_MAGIC));
+	pthread_mutex_lock(&dvdwrap_trace_lock);
+	for (ring = dvdwrap_trace_rings; ring; ring = ring->next) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		pos = head > TRACE_RECORDS ? head - TRACE_RECORDS : 0;
+		for (; pos < head; pos++) {
+			dvdwrap_trace_record_t *slot = &ring->records[pos & (TRACE_RECORDS - 1)];
+
+			if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+				continue; /* Overwritten since head was read */
+			}
+			memcpy(&rec, slot, sizeof(rec));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != pos + 1 ||
+					rec.len > TRACE_ARGS) {
+				continue;
+			}
+
+			id = dvdwrap_trace_fmt_id(&fmts, buf, rec.fmt);
+			if (id == UINT32_MAX) {
+				continue;
+			}
+			dvdwrap_buf_append(buf, "E", 1);
+			dvdwrap_buf_append(buf, &rec.tid, sizeof(rec.tid));
+			dvdwrap_buf_append(buf, &id, sizeof(id));
+			dvdwrap_buf_append(buf, &rec.time, sizeof(rec.time));
+			dvdwrap_buf_append(buf, &rec.len, sizeof(rec.len));
+			dvdwrap_buf_append(buf, rec.args, rec.len);
+		}
+	}
+	pthread_mutex_unlock(&dvdwrap_trace_lock);
+	free(fmts.fmts);
+}
+
+/*!
+ * Dumps the trace rings to a file.  The dump is written to a new file
+ * beside it and renamed over it, so a symlink planted at the path, which
+ * may be in /tmp, is replaced rather than followed.
+ *
+ * \param path		File to write, replacing it
+ * \return			0, or -1 on error
+ */
+int dvdwrap_trace_write(const char *path)
+{
+	dvdwrap_buf_t buf = { NULL, 0, 0 };
+	char tmp[PATH_MAX];
+	int ok = 0;
+	int fd;
+
+	if (snprintf(tmp, PATH_MAX, "%s.XXXXXX", path) >= PATH_MAX) {
+		return -1;
+	}
+	/* mkstemp creates the file with O_EXCL and mode 0600 */
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		return -1;
+	}
+	dvdwrap_trace_dump(&buf);
+	ok = write(fd, buf.data, buf.len) == (ssize_t)buf.len;
+	ok = close(fd) == 0 && ok;
+	if (!ok || rename(tmp, path) < 0) {
+		unlink(tmp);
+		ok = 0;
+	}
+	dvdwrap_buf_free(&buf);
+	return ok ? 0 : -1;
+}
+
+/*! Waits for SIGUSR1, writing a dump each time it arrives */
+static void* dvdwrap_trace_signal_thread(void *arg)
+{
+	sigset_t set;
+	int sig;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	while (sigwait(&set, &sig) == 0 && !dvdwrap_trace_stopping) {
+		if (dvdwrap_trace_write(dvdwrap_trace_path) < 0) {
+			fprintf(stderr, "Failed to write trace\n");
+		}
+	}
+	return NULL;
+}
+
+/*! Blocks SIGUSR1, so that it is left for the dump thread.  Call before
+ * any other threads are created. */
+void dvdwrap_trace_init(void)
+{
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+/*!
+ * Starts the thread that dumps the trace rings on SIGUSR1.  The pid is
+ * only known once fuse has daemonised, so the default is chosen here.
+ *
+ * \param path		Dump file, or NULL for the default
+ * \param dir		State directory for the default, or NULL for /tmp
+ * \return			0, or -1 if the thread couldn't be started
+ */
+int dvdwrap_trace_start(const char *path, const char *dir)
+{
+	int len;
+
+	if (path) {
+		len = snprintf(dvdwrap_trace_path, PATH_MAX, "%s", path);
+	} else if (dir) {
+		len = snprintf(dvdwrap_trace_path, PATH_MAX, "%s/" TRACE_FILE, dir);
+	} else {
+		len = snprintf(dvdwrap_trace_path, PATH_MAX, "/tmp/dvdwrap-%d.trace", (int)getpid());
+	}
+	if (len >= PATH_MAX) {
+		return -1;
+	}
+	dvdwrap_trace_stopping = 0;
+	if (pthread_create(&dvdwrap_trace_thread, NULL, dvdwrap_trace_signal_thread, NULL) != 0) {
+		return -1;
+	}
+	dvdwrap_trace_running = 1;
+	return 0;
+}
+
+void dvdwrap_trace_stop(void)
+{
+	if (!dvdwrap_trace_running) {
+		return;
+	}
+	dvdwrap_trace_stopping = 1;
+	pthread_kill(dvdwrap_trace_thread, SIGUSR1);
+	pthread_join(dvdwrap_trace_thread, NULL);
+	dvdwrap_trace_running = 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DVDWRAP_TRACE_H
+#define _DVDWRAP_TRACE_H
+
+#include <stdint.h>
+
+#include "dvdwrap_buf.h"
+
+#define TRACE_RECORDS		4096		/*!< Per thread, a power of 2 */
+#define TRACE_ARGS			98			/*!< Bytes of arguments per record */
+#define TRACE_MAGIC			"DVDTRC1\n"
+
+/*! One logged message, kept with its arguments unformatted */
+typedef struct {
+	uint64_t	seq;			/*!< Ring position + 1, or 0 while being written */
+	uint64_t	time;			/*!< dvdwrap_now_us() */
+	const char	*fmt;			/*!< printf format, which must be a literal */
+	uint32_t	tid;
+	uint16_t	len;			/*!< Bytes of args used */
+	uint8_t		args[TRACE_ARGS];
+} dvdwrap_trace_record_t;
+
+#define TRACE_SIGS			64			/*!< Formats remembered per thread */
+#define TRACE_SIG_ARGS		14			/*!< More than can fit in a record */
+
+/*! The argument types of a format, so it needn't be parsed every time */
+typedef struct {
+	const char	*fmt;
+	uint8_t		count;
+	uint8_t		type[TRACE_SIG_ARGS];		/*!< dvdwrap_trace_arg_t */
+	char		size[TRACE_SIG_ARGS];		/*!< As dvdwrap_trace_spec_t */
+} dvdwrap_trace_sig_t;
+
+/*! Ring of the last TRACE_RECORDS messages from one thread, which is the
+ * only writer */
+typedef struct dvdwrap_trace_ring {
+	struct dvdwrap_trace_ring	*next;
+	int							in_use;
+	uint32_t					tid;
+	uint64_t					head;		/*!< Records ever written */
+	dvdwrap_trace_sig_t			sigs[TRACE_SIGS];
+	dvdwrap_trace_record_t		records[TRACE_RECORDS];
+} dvdwrap_trace_ring_t;
+
+/*! How an argument is stored, as 8 bytes or a NUL terminated string */
+typedef enum {
+	TRACE_ARG_NONE = 0,			/*!< %%, or %n which takes a pointer */
+	TRACE_ARG_INT,
+	TRACE_ARG_UINT,
+	TRACE_ARG_PTR,
+	TRACE_ARG_DOUBLE,
+	TRACE_ARG_STR,
+} dvdwrap_trace_arg_t;
+
+/*! A conversion in a format string */
+typedef struct {
+	const char				*start;		/*!< The % */
+	const char				*length;	/*!< Length modifier, or conversion */
+	const char				*end;		/*!< Just after the conversion */
+	unsigned int			stars;		/*!< int arguments for '*' width and precision */
+	char					size;		/*!< H (hh), h, l, L (ll), j, z, t, D (long double), or 0 */
+	dvdwrap_trace_arg_t		type;
+} dvdwrap_trace_spec_t;
+
+const char* dvdwrap_trace_next(const char *fmt, dvdwrap_trace_spec_t *spec);
+
+void dvdwrap_trace(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+void dvdwrap_trace_dump(dvdwrap_buf_t *buf);
+int dvdwrap_trace_write(const char *path);
+void dvdwrap_trace_init(void);
+int dvdwrap_trace_start(const char *path, const char *dir);
+void dvdwrap_trace_stop(void);
+
+#endif
@@ -0,0 +1,335 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Virtual files exposing run-time state.  These live in a directory
+ * which is not returned by readdir of the root, so normal browsing never
+ * sees them.  Contents are generated when the file is opened and served
+ * from that snapshot until it is released.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "dvdwrap_fuse.h"
+#include "dvdwrap_vfile.h"
+#include "dvdwrap_control.h"
+
+typedef struct {
+	const char	*name;
+	void		(*generate)(dvdwrap_ctx_t *ctx, dvdwrap_buf_t *buf);
+	/*! Handles data written, or NULL if read-only */
+	int			(*write)(dvdwrap_ctx_t *ctx, const char *data, size_t len);
+} dvdwrap_vfile_def_t;
+
+/*! Private data held per open virtual file */
+typedef struct {
+	dvdwrap_fh_type_t			type;	/*!< Must be first */
+	const dvdwrap_vfile_def_t	*def;
+	dvdwrap_buf_t				buf;
+	dvdwrap_buf_t				input;	/*!< Written since the last flush */
+	off_t						base;	/*!< File offset of input */
+} dvdwrap_vfile_fh_t;
+
+static void dvdwrap_vfile_devices(dvdwrap_ctx_t *ctx, dvdwrap_buf_t *buf)
+{
+	dvdwrap_ioq_report(&ctx->ioqs, buf);
+}
+
+static void dvdwrap_vfile_stalls(dvdwrap_ctx_t *ctx, dvdwrap_buf_t *buf)
+{
+	dvdwrap_ioq_stall_report(&ctx->ioqs, buf);
+}
+
+static void dvdwrap_vfile_cache(dvdwrap_ctx_t *ctx, dvdwrap_buf_t *buf)
+{
+	if (ctx->cache_conf.size) {
+		dvdwrap_cache_report(&ctx->cache, buf);
+	} else {
+		dvdwrap_buf_printf(buf, "disabled\n");
+	}
+}
+
+static void dvdwrap_vfile_ssd(dvdwrap_ctx_t *ctx, dvdwrap_buf_t *buf)
+{
+	if (ctx->ssd_conf.dir) {
+		dvdwrap_ssd_report(&ctx->ssd, buf);
+	} else {
+		dvdwrap_buf_printf(buf, "disabled\n");
+	}
+}
+
+static void dvdwrap_vfile_spindown(dvdwrap_ctx_t *ctx, dvdwrap_buf_t *buf)
+{
+	if (ctx->spin_conf.size) {
+		dvdwrap_spin_report(&ctx->spin, buf);
+	} else {
+		dvdwrap_buf_printf(buf, "disabled\n");
+	}
+}
+
+static void dvdwrap_vfile_pinned(dvdwrap_ctx_t *ctx, dvdwrap_buf_t *buf)
+{
+	if (ctx->pin_conf.size) {
+		dvdwrap_pin_report(&ctx->pin, buf);
+	} else {
+		dvdwrap_buf_printf(buf, "disabled\n");
+	}
+}
+
+static void dvdwrap_vfile_memory(dvdwrap_ctx_t *ctx, dvdwrap_buf_t *buf)
+{
+	dvdwrap_mem_report(&ctx->mem, buf);
+}
+
+static void dvdwrap_vfile_warm(dvdwrap_ctx_t *ctx, dvdwrap_buf_t *buf)
+{
+	if (ctx->warm_conf.dir && ctx->cache_conf.size) {
+		dvdwrap_warm_report(&ctx->warm, buf);
+	} else {
+		dvdwrap_buf_printf(buf, "disabled\n");
+	}
+}
+
+static void dvdwrap_vfile_index(dvdwrap_ctx_t *ctx, dvdwrap_buf_t *buf)
+{
+	dvdwrap_index_report(&ctx->index, buf);
+}
+
+static void dvdwrap_vfile_stats(dvdwrap_ctx_t *ctx, dvdwrap_buf_t *buf)
+{
+	dvdwrap_stats_report(buf);
+}
+
+static void dvdwrap_vfile_clients(dvdwrap_ctx_t *ctx, dvdwrap_buf_t *buf)
+{
+	dvdwrap_client_report(&ctx->clients, buf);
+}
+
+static void dvdwrap_vfile_heat(dvdwrap_ctx_t *ctx, dvdwrap_buf_t *buf)
+{
+	dvdwrap_heat_report(&ctx->heat, buf);
+}
+
+/*! Binary, to be read by dvdtrace */
+static void dvdwrap_vfile_trace(dvdwrap_ctx_t *ctx, dvdwrap_buf_t *buf)
+{
+	dvdwrap_trace_dump(buf);
+}
+
+static const dvdwrap_vfile_def_t dvdwrap_vfiles[] = {
+	{ "devices",	dvdwrap_vfile_devices,	NULL },
+	{ "stalls",		dvdwrap_vfile_stalls,	NULL },
+	{ "cache",		dvdwrap_vfile_cache,	NULL },
+	{ "ssd",		dvdwrap_vfile_ssd,		NULL },
+	{ "spindown",	dvdwrap_vfile_spindown,	NULL },
+	{ "pinned",		dvdwrap_vfile_pinned,	NULL },
+	{ "memory",		dvdwrap_vfile_memory,	NULL },
+	{ "warm",		dvdwrap_vfile_warm,		NULL },
+	{ "index",		dvdwrap_vfile_index,	NULL },
+	{ "stats",		dvdwrap_vfile_stats,	NULL },
+	{ "clients",	dvdwrap_vfile_clients,	NULL },
+	{ "heat",		dvdwrap_vfile_heat,		NULL },
+	{ "trace",		dvdwrap_vfile_trace,	NULL },
+	{ "control",	dvdwrap_control_report,	dvdwrap_control_write },
+	{ NULL, NULL, NULL }
+};
+
+/*! Finds the virtual file for a path, or NULL for the directory itself
+ * or an unknown name */
+static const dvdwrap_vfile_def_t* dvdwrap_vfile_lookup(const char *path)
+{
+	const dvdwrap_vfile_def_t *def;
+
+	path += strlen(VFILE_DIR);
+	if (*path++ != '/') {
+		return NULL;
+	}
+	for (def = dvdwrap_vfiles; def->name; def++) {
+		if (strcmp(path, def->name) == 0) {
+			return def;
+		}
+	}
+	return NULL;
+}
+
+/*! Returns non-zero if path is the virtual directory or something in it */
+int dvdwrap_vfile_match(const char *path)
+{
+	size_t len = strlen(VFILE_DIR);
+
+	return path && strncmp(path, VFILE_DIR, len) == 0 &&
+		(path[len] == '\0' || path[len] == '/');
+}
+
+int dvdwrap_vfile_getattr(const char *path, struct stat *stbuf)
+{
+	const dvdwrap_vfile_def_t *def;
+
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_uid = geteuid();
+	stbuf->st_gid = getegid();
+	if (strcmp(path, VFILE_DIR) == 0) {
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+		return 0;
+	}
+	def = dvdwrap_vfile_lookup(path);
+	if (def == NULL) {
+		return -ENOENT;
+	}
+
+	/* Size isn't known until the contents are generated, so these are
+	 * opened with direct_io and read until EOF */
+	stbuf->st_mode = S_IFREG | (def->write ? 0644 : 0444);
+	stbuf->st_nlink = 1;
+	return 0;
+}
+
+int dvdwrap_vfile_readdir(const char *path, void *buf, fuse_fill_dir_t filler)
+{
+	const dvdwrap_vfile_def_t *def;
+
+	if (strcmp(path, VFILE_DIR) != 0) {
+		return -ENOTDIR;
+	}
+	filler(buf, ".", NULL, 0);
+	filler(buf, "..", NULL, 0);
+	for (def = dvdwrap_vfiles; def->name; def++) {
+		filler(buf, def->name, NULL, 0);
+	}
+	return 0;
+}
+
+int dvdwrap_vfile_open(dvdwrap_ctx_t *ctx, const char *path, struct fuse_file_info *fi)
+{
+	const dvdwrap_vfile_def_t *def;
+	dvdwrap_vfile_fh_t *private;
+
+	def = dvdwrap_vfile_lookup(path);
+	if (def == NULL) {
+		return -ENOENT;
+	}
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		/* The mode shown is only enforced with default_permissions, so
+		 * other users of an allow_other mount are turned away here */
+		uid_t uid = fuse_get_context()->uid;
+
+		if (def->write == NULL || (uid != 0 && uid != geteuid())) {
+			return -EACCES;
+		}
+	}
+
+	private = (dvdwrap_vfile_fh_t*)calloc(1, sizeof(dvdwrap_vfile_fh_t));
+	if (private == NULL) {
+		return -ENOMEM;
+	}
+	private->type = DVDWRAP_FH_VFILE;
+	private->def = def;
+	def->generate(ctx, &private->buf);
+
+	fi->fh = (uint64_t)private;
+	fi->direct_io = 1;
+	return 0;
+}
+
+int dvdwrap_vfile_read(struct fuse_file_info *fi, char *buf, size_t size, off_t offset)
+{
+	dvdwrap_vfile_fh_t *private = (dvdwrap_vfile_fh_t*)fi->fh;
+
+	if (offset >= private->buf.len) {
+		return 0;
+	}
+	if (size > private->buf.len - offset) {
+		size = private->buf.len - offset;
+	}
+	memcpy(buf, private->buf.data + offset, size);
+	return size;
+}
+
+/*!
+ * Collects what is written, to be handled as a whole on flush.  Writes
+ * must follow on from each other, as they do from a shell or a single
+ * write call split by the kernel.
+ */
+int dvdwrap_vfile_write(dvdwrap_ctx_t *ctx, struct fuse_file_info *fi, const char *buf,
+	size_t size, off_t offset)
+{
+	dvdwrap_vfile_fh_t *private = (dvdwrap_vfile_fh_t*)fi->fh;
+	size_t len = private->input.len;
+
+	if (private->def->write == NULL) {
+		return -EBADF;
+	}
+	if (offset != private->base + (off_t)len) {
+		return -EINVAL;
+	}
+	if (len + size > VFILE_MAX_INPUT) {
+		return -EFBIG;
+	}
+	dvdwrap_buf_append(&private->input, buf, size);
+	if (private->input.len != len + size) {
+		return -ENOMEM;
+	}
+	return (int)size;
+}
+
+/*!
+ * Hands what has been written since the last flush to the file's writer,
+ * so close() reports whether it was accepted.
+ */
+int dvdwrap_vfile_flush(dvdwrap_ctx_t *ctx, struct fuse_file_info *fi)
+{
+	dvdwrap_vfile_fh_t *private = (dvdwrap_vfile_fh_t*)fi->fh;
+	int rc;
+
+	if (private->input.len == 0) {
+		return 0;
+	}
+	rc = private->def->write(ctx, private->input.data, private->input.len);
+	private->base += private->input.len;
+	dvdwrap_buf_free(&private->input);
+	return rc < 0 ? rc : 0;
+}
+
+/*! Truncating is allowed, so shells can redirect into writable files */
+int dvdwrap_vfile_truncate(const char *path)
+{
+	const dvdwrap_vfile_def_t *def = dvdwrap_vfile_lookup(path);
+
+	if (def == NULL) {
+		return -ENOENT;
+	}
+	return def->write ? 0 : -EACCES;
+}
+
+void dvdwrap_vfile_release(struct fuse_file_info *fi)
+{
+	dvdwrap_vfile_fh_t *private = (dvdwrap_vfile_fh_t*)fi->fh;
+
+	dvdwrap_buf_free(&private->buf);
+	dvdwrap_buf_free(&private->input);
+	free(private);
+	fi->fh = 0;
+}
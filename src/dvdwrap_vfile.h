@@ -0,0 +1,45 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DVDWRAP_VFILE_H
+#define _DVDWRAP_VFILE_H
+
+#include "dvdwrap_fuse.h"
+
+/*! Directory holding the virtual files.  Not listed in the root. */
+#define VFILE_DIR		"/.dvdwrap"
+
+/*! Most that can be written to a virtual file between flushes */
+#define VFILE_MAX_INPUT	65536
+
+int dvdwrap_vfile_match(const char *path);
+int dvdwrap_vfile_getattr(const char *path, struct stat *stbuf);
+int dvdwrap_vfile_readdir(const char *path, void *buf, fuse_fill_dir_t filler);
+int dvdwrap_vfile_open(dvdwrap_ctx_t *ctx, const char *path, struct fuse_file_info *fi);
+int dvdwrap_vfile_read(struct fuse_file_info *fi, char *buf, size_t size, off_t offset);
+int dvdwrap_vfile_write(dvdwrap_ctx_t *ctx, struct fuse_file_info *fi, const char *buf,
+	size_t size, off_t offset);
+int dvdwrap_vfile_flush(dvdwrap_ctx_t *ctx, struct fuse_file_info *fi);
+int dvdwrap_vfile_truncate(const char *path);
+void dvdwrap_vfile_release(struct fuse_file_info *fi);
+
+#endif
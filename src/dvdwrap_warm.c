@@ -0,0 +1,296 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Cache warming across remounts.  At unmount the blocks held by the
+ * block cache are written to a hot set file in the state directory,
+ * grouped into runs per title with the most recently used titles first.
+ * At the next mount a thread asks the kernel to read those ranges ahead
+ * and loads them back into the cache, until the first real read arrives.
+ *
+ * The file is text:
+ *   DVDWHOT1
+ *   T <size> <mtime> <path>
+ *   R <first block> <count>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "dvdwrap_fuse.h"
+#include "dvdwrap_warm.h"
+
+#define WARM_MAGIC		"DVDWHOT1"
+#define WARM_FILE		"hotset"
+
+/*! A cached block, in the order listed by the cache */
+typedef struct {
+	uint32_t		title;
+	uint32_t		order;
+	uint64_t		index;
+} dvdwrap_warm_block_t;
+
+/*! Blocks of one title in the sorted list */
+typedef struct {
+	uint32_t		order;			/*!< Best recency of any block */
+	size_t			first;
+	size_t			end;
+} dvdwrap_warm_group_t;
+
+typedef struct {
+	dvdwrap_warm_block_t	*blocks;
+	size_t			count;
+	size_t			alloc;
+} dvdwrap_warm_list_t;
+
+static void dvdwrap_warm_visit(void *arg, uint32_t title, uint64_t index)
+{
+	dvdwrap_warm_list_t *list = (dvdwrap_warm_list_t*)arg;
+
+	if (list->count == list->alloc) {
+		size_t alloc = list->alloc ? list->alloc * 2 : 1024;
+		dvdwrap_warm_block_t *blocks = (dvdwrap_warm_block_t*)realloc(list->blocks,
+			alloc * sizeof(dvdwrap_warm_block_t));
+
+		if (blocks == NULL) {
+			return;
+		}
+		list->blocks = blocks;
+		list->alloc = alloc;
+	}
+	list->blocks[list->count].title = title;
+	list->blocks[list->count].order = list->count;
+	list->blocks[list->count].index = index;
+	list->count++;
+}
+
+static int dvdwrap_warm_cmp_block(const void *a, const void *b)
+{
+	const dvdwrap_warm_block_t *x = (const dvdwrap_warm_block_t*)a;
+	const dvdwrap_warm_block_t *y = (const dvdwrap_warm_block_t*)b;
+
+	if (x->title != y->title) {
+		return x->title < y->title ? -1 : 1;
+	}
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static int dvdwrap_warm_cmp_group(const void *a, const void *b)
+{
+	const dvdwrap_warm_group_t *x = (const dvdwrap_warm_group_t*)a;
+	const dvdwrap_warm_group_t *y = (const dvdwrap_warm_group_t*)b;
+
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/*!
+ * Writes the hot set of the block cache, at unmount.
+ *
+ * \param warm		Cache warming state
+ * \param cache		Block cache
+ * \param titles	Title registry, to find the paths behind cache keys
+ * \return			0 or -errno
+ */
+int dvdwrap_warm_save(dvdwrap_warm_t *warm, dvdwrap_cache_t *cache,
+	dvdwrap_title_set_t *titles)
+{
+	dvdwrap_warm_list_t list;
+	dvdwrap_warm_group_t *groups;
+	size_t ngroups = 0, n, g;
+	char name[PATH_MAX], tmp[PATH_MAX];
+	FILE *f;
+	int ok;
+
+	memset(&list, 0, sizeof(list));
+	dvdwrap_cache_foreach(cache, dvdwrap_warm_visit, &list);
+
+	/* Group by title, in block order, then put the hottest titles first */
+	qsort(list.blocks, list.count, sizeof(dvdwrap_warm_block_t), dvdwrap_warm_cmp_block);
+	groups = (dvdwrap_warm_group_t*)malloc((list.count + 1) * sizeof(dvdwrap_warm_group_t));
+	if (groups == NULL) {
+		free(list.blocks);
+		return -ENOMEM;
+	}
+	for (n = 0; n < list.count; n++) {
+		if (n == 0 || list.blocks[n].title != list.blocks[n - 1].title) {
+			groups[ngroups].order = list.blocks[n].order;
+			groups[ngroups].first = n;
+			ngroups++;
+		}
+		if (list.blocks[n].order < groups[ngroups - 1].order) {
+			groups[ngroups - 1].order = list.blocks[n].order;
+		}
+		groups[ngroups - 1].end = n + 1;
+	}
+	qsort(groups, ngroups, sizeof(dvdwrap_warm_group_t), dvdwrap_warm_cmp_group);
+
+	snprintf(name, PATH_MAX, "%s/" WARM_FILE, warm->conf->dir);
+	snprintf(tmp, PATH_MAX, "%s/" WARM_FILE ".tmp", warm->conf->dir);
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		free(groups);
+		free(list.blocks);
+		return -errno;
+	}
+	fprintf(f, WARM_MAGIC "\n");
+	for (g = 0; g < ngroups; g++) {
+		dvdwrap_title_t *title = dvdwrap_title_find_id(titles, list.blocks[groups[g].first].title);
+
+		if (title == NULL) {
+			/* Blocks of content that has since changed */
+			continue;
+		}
+		fprintf(f, "T %llu %lld %s\n", (unsigned long long)title->total_size,
+			(long long)title->mtime, title->path);
+		for (n = groups[g].first; n < groups[g].end; ) {
+			size_t start = n;
+
+			while (++n < groups[g].end && list.blocks[n].index == list.blocks[n - 1].index + 1);
+			fprintf(f, "R %llu %u\n", (unsigned long long)list.blocks[start].index,
+				(unsigned int)(n - start));
+		}
+		warm->saved_titles++;
+		warm->saved_blocks += groups[g].end - groups[g].first;
+	}
+	ok = fflush(f) == 0 && fdatasync(fileno(f)) == 0;
+	ok = fclose(f) == 0 && ok;
+	if (!ok || rename(tmp, name) < 0) {
+		unlink(tmp);
+		ok = 0;
+	}
+	LOG("Saved hot set of %u titles\n", warm->saved_titles);
+	free(groups);
+	free(list.blocks);
+	return ok ? 0 : -EIO;
+}
+
+static void* dvdwrap_warm_thread(void *arg)
+{
+	dvdwrap_warm_t *warm = (dvdwrap_warm_t*)arg;
+	dvdwrap_warm_run_t *runs = NULL;
+	unsigned int nruns = 0, alloc = 0;
+	char name[PATH_MAX], line[PATH_MAX + 64], path[PATH_MAX];
+	unsigned long long total_size = 0;
+	long long mtime = 0;
+	FILE *f;
+	int eof;
+
+	snprintf(name, PATH_MAX, "%s/" WARM_FILE, warm->conf->dir);
+	f = fopen(name, "r");
+	if (f == NULL || fgets(line, sizeof(line), f) == NULL ||
+			strcmp(line, WARM_MAGIC "\n") != 0) {
+		goto done;
+	}
+	path[0] = '\0';
+	do {
+		unsigned long long start;
+		unsigned int count;
+		int pos;
+
+		eof = fgets(line, sizeof(line), f) == NULL;
+		if (!eof && sscanf(line, "R %llu %u", &start, &count) == 2) {
+			if (nruns == alloc) {
+				dvdwrap_warm_run_t *r;
+
+				alloc = alloc ? alloc * 2 : 64;
+				r = (dvdwrap_warm_run_t*)realloc(runs, alloc * sizeof(dvdwrap_warm_run_t));
+				if (r == NULL) {
+					break;
+				}
+				runs = r;
+			}
+			runs[nruns].start = start;
+			runs[nruns].count = count;
+			nruns++;
+			continue;
+		}
+
+		/* New title or end of file - warm the last one */
+		if (path[0] && nruns) {
+			warm->blocks += warm->fn(warm->arg, warm, path, total_size, (time_t)mtime,
+				runs, nruns);
+			warm->titles++;
+		}
+		nruns = 0;
+		path[0] = '\0';
+		if (!eof && sscanf(line, "T %llu %lld %n", &total_size, &mtime, &pos) == 2) {
+			snprintf(path, PATH_MAX, "%s", line + pos);
+			path[strcspn(path, "\n")] = '\0';
+		}
+	} while (!eof && !warm->abort);
+
+done:
+	if (f) {
+		fclose(f);
+	}
+	free(runs);
+	warm->aborted = warm->abort;
+	LOG("Warmed %u titles%s\n", warm->titles, warm->aborted ? " (aborted)" : "");
+	warm->active = 0;
+	return NULL;
+}
+
+void dvdwrap_warm_init(dvdwrap_warm_t *warm, const dvdwrap_warm_conf_t *conf)
+{
+	memset(warm, 0, sizeof(dvdwrap_warm_t));
+	warm->conf = conf;
+}
+
+/*! Starts warming the cache from the last hot set.  Must be called after
+ * fuse has daemonised. */
+int dvdwrap_warm_start(dvdwrap_warm_t *warm, dvdwrap_warm_fn_t fn, void *arg)
+{
+	warm->fn = fn;
+	warm->arg = arg;
+	warm->active = 1;
+	if (pthread_create(&warm->thread, NULL, dvdwrap_warm_thread, warm) != 0) {
+		warm->active = 0;
+		return -EAGAIN;
+	}
+	warm->running = 1;
+	return 0;
+}
+
+void dvdwrap_warm_stop(dvdwrap_warm_t *warm)
+{
+	if (warm->running) {
+		warm->abort = 1;
+		pthread_join(warm->thread, NULL);
+		warm->running = 0;
+	}
+}
+
+void dvdwrap_warm_report(dvdwrap_warm_t *warm, dvdwrap_buf_t *buf)
+{
+	dvdwrap_buf_printf(buf,
+		"dir %s\n"
+		"state %s\n"
+		"titles %u\n"
+		"blocks %llu\n",
+		warm->conf->dir,
+		warm->active ? "warming" : warm->aborted ? "aborted" : "done",
+		warm->titles, (unsigned long long)warm->blocks);
+}
@@ -0,0 +1,93 @@
+/*
+ * dvdwrap, a fuse filesystem for easy access to DVD image directories
+ * Copyright (C) 2013 Mike Stirling
+ *
+ * This file is part of dvdwrap (http://mikestirling.co.uk/dvdwrap)
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DVDWRAP_WARM_H
+#define _DVDWRAP_WARM_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "dvdwrap_buf.h"
+#include "dvdwrap_cache.h"
+#include "dvdwrap_title.h"
+
+/*! Cache warming tunables */
+typedef struct {
+	char			*dir;			/*!< State directory, NULL to disable */
+} dvdwrap_warm_conf_t;
+
+/*! A run of consecutive cache blocks */
+typedef struct {
+	uint64_t		start;			/*!< First block index */
+	uint32_t		count;
+} dvdwrap_warm_run_t;
+
+struct dvdwrap_warm;
+
+/*!
+ * Warms the cache with some blocks of a title.  Should give up early
+ * once warm->abort is set.
+ *
+ * \return			Number of blocks loaded
+ */
+typedef unsigned int (*dvdwrap_warm_fn_t)(void *arg, struct dvdwrap_warm *warm,
+	const char *path, uint64_t total_size, time_t mtime,
+	const dvdwrap_warm_run_t *runs, unsigned int nruns);
+
+/*! Saves the hot set of the block cache at unmount and reloads it at
+ * the next mount */
+typedef struct dvdwrap_warm {
+	const dvdwrap_warm_conf_t	*conf;
+	pthread_t			thread;
+	int					running;	/*!< Thread needs joining */
+	volatile int		active;		/*!< Still warming */
+	volatile int		abort;		/*!< Stop - the mount is in use */
+
+	dvdwrap_warm_fn_t	fn;
+	void				*arg;
+
+	/* Statistics */
+	unsigned int		titles;		/*!< Titles warmed */
+	uint64_t			blocks;		/*!< Blocks warmed */
+	int					aborted;
+	unsigned int		saved_titles;
+	uint64_t			saved_blocks;
+} dvdwrap_warm_t;
+
+void dvdwrap_warm_init(dvdwrap_warm_t *warm, const dvdwrap_warm_conf_t *conf);
+int dvdwrap_warm_start(dvdwrap_warm_t *warm, dvdwrap_warm_fn_t fn, void *arg);
+void dvdwrap_warm_stop(dvdwrap_warm_t *warm);
+int dvdwrap_warm_save(dvdwrap_warm_t *warm, dvdwrap_cache_t *cache,
+	dvdwrap_title_set_t *titles);
+void dvdwrap_warm_report(dvdwrap_warm_t *warm, dvdwrap_buf_t *buf);
+
+/*! Called on every foreground read - warming stops once the mount is
+ * in use, so it never competes with real requests */
+static inline void dvdwrap_warm_foreground(dvdwrap_warm_t *warm)
+{
+	if (warm->active) {
+		warm->abort = 1;
+	}
+}
+
+#endif